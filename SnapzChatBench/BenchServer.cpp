@@ -0,0 +1,931 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "BenchServer.hpp"
+
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const char * const STREAM_OPEN = "<stream:stream";
+static const char * const STREAM_CLOSE = "</stream:stream>";
+static const string MULTICAST_XMLNS = "http://jabber.org/protocol/address";
+
+struct BenchServer::Connection
+{
+    explicit Connection(int fd_)
+        : fd(fd_), is_authenticated(false), is_available(false), is_closing(false) {
+    }
+
+    int fd;
+    string input;
+    string output;
+
+    bool is_authenticated;
+    bool is_available;   // sent initial presence
+    bool is_closing;
+
+    string user;         // SASL authentication identity
+    string jid;          // full JID once bound
+};
+
+/// XML helpers, good enough for the stanzas gloox produces
+static size_t g_tag_end(const string& data, size_t pos)
+{
+    char quote = 0;
+
+    for(; pos < data.size(); ++pos) {
+        char c = data[pos];
+        if(quote) {
+            if(c == quote) {
+                quote = 0;
+            }
+        }
+        else if(c == '\'' || c == '"') {
+            quote = c;
+        }
+        else if(c == '>') {
+            return pos;
+        }
+    }
+    return string::npos;
+}
+
+// size of the complete element at the beginning of data, 0 if incomplete
+static size_t g_element_size(const string& data)
+{
+    int depth = 0;
+    size_t pos = 0;
+
+    while(pos < data.size()) {
+        if(data[pos] != '<') {
+            pos = data.find('<', pos);
+            if(pos == string::npos) {
+                return 0;
+            }
+            continue;
+        }
+
+        size_t end = g_tag_end(data, pos);
+        if(end == string::npos) {
+            return 0;
+        }
+
+        if(data[pos + 1] == '/') {
+            --depth;
+        }
+        else if(data[pos + 1] != '?' && data[pos + 1] != '!' && data[end - 1] != '/') {
+            ++depth;
+        }
+
+        pos = end + 1;
+        if(depth <= 0) {
+            return pos;
+        }
+    }
+    return 0;
+}
+
+static string g_element_name(const string& stanza)
+{
+    size_t end = stanza.find_first_of(" \t\r\n/>", 1);
+    return stanza.substr(1, (end == string::npos) ? string::npos : (end - 1));
+}
+
+// attribute value of the outermost element, empty string if missing
+static string g_attribute(const string& stanza, const string& name)
+{
+    size_t tag_end = g_tag_end(stanza, 0);
+    size_t pos = 0;
+
+    for(;;) {
+        pos = stanza.find(name + "=", pos + 1);
+        if(pos == string::npos || pos >= tag_end) {
+            return "";
+        }
+        if(::isspace((unsigned char)stanza[pos - 1])) {
+            break;
+        }
+    }
+
+    size_t begin = pos + name.size() + 1;
+    char quote = stanza[begin];
+    size_t end = stanza.find(quote, begin + 1);
+    if(end == string::npos) {
+        return "";
+    }
+    return stanza.substr(begin + 1, end - begin - 1);
+}
+
+// sets or replaces an attribute of the outermost element
+static string g_set_attribute(const string& stanza, const string& name, const string& value)
+{
+    size_t tag_end = g_tag_end(stanza, 0);
+    size_t pos = 0;
+
+    for(;;) {
+        pos = stanza.find(name + "=", pos + 1);
+        if(pos == string::npos || pos >= tag_end) {
+            size_t name_end = stanza.find_first_of(" \t\r\n/>", 1);
+            return stanza.substr(0, name_end) + " " + name + "='" + value + "'" + stanza.substr(name_end);
+        }
+        if(::isspace((unsigned char)stanza[pos - 1])) {
+            break;
+        }
+    }
+
+    size_t begin = pos + name.size() + 1;
+    size_t end = stanza.find(stanza[begin], begin + 1);
+    return stanza.substr(0, begin) + "'" + value + "'" + stanza.substr(end + 1);
+}
+
+// text content of the outermost element
+static string g_text(const string& stanza)
+{
+    size_t begin = g_tag_end(stanza, 0);
+    size_t end = stanza.rfind("</");
+    if(begin == string::npos || end == string::npos || end <= begin) {
+        return "";
+    }
+    return stanza.substr(begin + 1, end - begin - 1);
+}
+
+// text content of the first child element with the given name
+static string g_child_text(const string& stanza, const string& name)
+{
+    size_t pos = stanza.find("<" + name, 1);
+    if(pos == string::npos) {
+        return "";
+    }
+
+    size_t begin = g_tag_end(stanza, pos);
+    if(begin == string::npos || stanza[begin - 1] == '/') {
+        return "";
+    }
+
+    size_t end = stanza.find("</" + name, begin);
+    if(end == string::npos) {
+        return "";
+    }
+    return stanza.substr(begin + 1, end - begin - 1);
+}
+
+static string g_base64_decode(const string& data)
+{
+    string result;
+    unsigned int bits = 0;
+    int count = 0;
+
+    for(size_t i = 0; i < data.size(); ++i) {
+        char c = data[i];
+        int value;
+
+        if(c >= 'A' && c <= 'Z') value = c - 'A';
+        else if(c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') value = c - '0' + 52;
+        else if(c == '+') value = 62;
+        else if(c == '/') value = 63;
+        else continue;
+
+        bits = (bits << 6) | value;
+        count += 6;
+        if(count >= 8) {
+            count -= 8;
+            result += (char)((bits >> count) & 0xff);
+        }
+    }
+    return result;
+}
+
+// "user@domain/resource" parts
+static string g_jid_user(const string& jid)
+{
+    size_t pos = jid.find('@');
+    return (pos == string::npos) ? "" : jid.substr(0, pos);
+}
+
+static string g_jid_domain(const string& jid)
+{
+    size_t begin = jid.find('@');
+    begin = (begin == string::npos) ? 0 : (begin + 1);
+
+    size_t end = jid.find('/', begin);
+    return jid.substr(begin, (end == string::npos) ? string::npos : (end - begin));
+}
+
+static string g_jid_resource(const string& jid)
+{
+    size_t pos = jid.find('/');
+    return (pos == string::npos) ? "" : jid.substr(pos + 1);
+}
+
+static string g_error_reply(const string& name, const string& stanza, const string& condition)
+{
+    string reply = "<" + name + " type='error'";
+
+    string id = g_attribute(stanza, "id");
+    if(!id.empty()) {
+        reply += " id='" + id + "'";
+    }
+
+    string to = g_attribute(stanza, "to");
+    if(!to.empty()) {
+        reply += " from='" + to + "'";
+    }
+
+    return reply + "><error type='cancel'><" + condition +
+        " xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></" + name + ">";
+}
+
+static string g_occupant_presence(const string& from, const string& to, bool available, bool self)
+{
+    string presence = "<presence from='" + from + "' to='" + to + "'";
+    if(!available) {
+        presence += " type='unavailable'";
+    }
+
+    presence += "><x xmlns='http://jabber.org/protocol/muc#user'>";
+    presence += available ?
+        "<item affiliation='member' role='participant'/>" :
+        "<item affiliation='member' role='none'/>";
+    if(self) {
+        presence += "<status code='110'/>";
+    }
+    return presence + "</x></presence>";
+}
+
+/// BenchServer
+BenchServer::BenchServer(const string& domain_)
+    : domain(domain_), groupchat_domain("conference." + domain_),
+      listen_fd(-1), port(0),
+      stream_ids(0),
+      routed_stanzas(0), offline_messages(0),
+      is_running(false)
+{
+}
+
+BenchServer::~BenchServer()
+{
+    stop();
+}
+
+bool BenchServer::start()
+{
+    if(is_running) {
+        return true;
+    }
+
+    listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        return false;
+    }
+
+    int on = 1;
+    ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t addr_size = sizeof(addr);
+    if(::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+       ::listen(listen_fd, 1024) != 0 ||
+       ::getsockname(listen_fd, (struct sockaddr*)&addr, &addr_size) != 0) {
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    port = ntohs(addr.sin_port);
+    ::fcntl(listen_fd, F_SETFL, ::fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    is_running = true;
+    if(::pthread_create(&server_thread, 0, BenchServer::server_loop, this) != 0) {
+        is_running = false;
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void BenchServer::stop()
+{
+    if(!is_running) {
+        return;
+    }
+
+    is_running = false;
+    ::pthread_join(server_thread, 0);
+
+    Connections::const_iterator it;
+    for(it = connections.begin(); it != connections.end(); ++it) {
+        ::close((*it)->fd);
+        delete *it;
+    }
+    connections.clear();
+    sessions.clear();
+    rooms.clear();
+    offline.clear();
+
+    ::close(listen_fd);
+    listen_fd = -1;
+}
+
+void* BenchServer::server_loop(void *data)
+{
+    static_cast<BenchServer*>(data)->run();
+    return 0;
+}
+
+void BenchServer::run()
+{
+    vector<struct pollfd> fds;
+
+    while(is_running) {
+        fds.resize(connections.size() + 1);
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        for(size_t i = 0; i < connections.size(); ++i) {
+            fds[i + 1].fd = connections[i]->fd;
+            fds[i + 1].events = POLLIN | (connections[i]->output.empty() ? 0 : POLLOUT);
+            fds[i + 1].revents = 0;
+        }
+
+        if(::poll(&fds[0], fds.size(), 10) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // NOTE: connections accepted now are polled on the next iteration
+        size_t polled = connections.size();
+
+        if(fds[0].revents & POLLIN) {
+            acceptConnections();
+        }
+
+        for(size_t i = 0; i < polled; ++i) {
+            Connection *conn = connections[i];
+            if(!conn->is_closing && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                bool is_alive = readConnection(conn);
+                handleInput(conn);
+                if(!is_alive) {
+                    conn->is_closing = true;
+                }
+            }
+        }
+
+        // routing fills the output of any connection, flush them all
+        for(size_t i = 0; i < connections.size(); ++i) {
+            Connection *conn = connections[i];
+            if(!writeConnection(conn)) {
+                conn->is_closing = true;
+                conn->output.clear();
+            }
+        }
+
+        for(size_t i = 0; i < connections.size();) {
+            Connection *conn = connections[i];
+            if(conn->is_closing && conn->output.empty()) {
+                closeConnection(conn);
+                connections.erase(connections.begin() + i);
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+}
+
+void BenchServer::acceptConnections()
+{
+    for(;;) {
+        int fd = ::accept(listen_fd, 0, 0);
+        if(fd < 0) {
+            break;
+        }
+
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        connections.push_back(new Connection(fd));
+    }
+}
+
+bool BenchServer::readConnection(Connection *conn)
+{
+    char buffer[16384];
+
+    for(;;) {
+        ssize_t size = ::read(conn->fd, buffer, sizeof(buffer));
+        if(size > 0) {
+            conn->input.append(buffer, size);
+            continue;
+        }
+
+        if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if(size < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // closed by peer or failed
+        return false;
+    }
+}
+
+bool BenchServer::writeConnection(Connection *conn)
+{
+    while(!conn->output.empty()) {
+        ssize_t size = ::send(conn->fd, conn->output.data(), conn->output.size(), MSG_NOSIGNAL);
+        if(size > 0) {
+            conn->output.erase(0, size);
+            continue;
+        }
+
+        if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if(size < 0 && errno == EINTR) {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+void BenchServer::closeConnection(Connection *conn)
+{
+    vector<string> joined;
+
+    Rooms::iterator it_room;
+    for(it_room = rooms.begin(); it_room != rooms.end(); ++it_room) {
+        map<string, Connection*>::const_iterator it;
+        for(it = it_room->second.occupants.begin(); it != it_room->second.occupants.end(); ++it) {
+            if(it->second == conn) {
+                joined.push_back(it_room->first);
+                break;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < joined.size(); ++i) {
+        leaveRoom(conn, joined[i]);
+    }
+
+    Sessions::iterator it_session = sessions.find(conn->user);
+    if(it_session != sessions.end() && it_session->second == conn) {
+        sessions.erase(it_session);
+    }
+
+    ::close(conn->fd);
+    delete conn;
+}
+
+void BenchServer::handleInput(Connection *conn)
+{
+    string& input = conn->input;
+
+    while(!conn->is_closing) {
+        size_t pos = input.find_first_not_of(" \t\r\n");
+        if(pos == string::npos) {
+            input.clear();
+            return;
+        }
+        input.erase(0, pos);
+
+        // wait for the stream tokens to be complete before matching them
+        if(input.size() < ::strlen(STREAM_CLOSE) &&
+           (::strncmp(input.c_str(), STREAM_OPEN, input.size()) == 0 ||
+            ::strncmp(input.c_str(), STREAM_CLOSE, input.size()) == 0)) {
+            return;
+        }
+
+        if(input.compare(0, 2, "<?") == 0) {
+            size_t end = input.find("?>");
+            if(end == string::npos) {
+                return;
+            }
+            input.erase(0, end + 2);
+        }
+        else if(input.compare(0, ::strlen(STREAM_OPEN), STREAM_OPEN) == 0) {
+            size_t end = g_tag_end(input, 0);
+            if(end == string::npos) {
+                return;
+            }
+            input.erase(0, end + 1);
+            handleStreamOpen(conn);
+        }
+        else if(input.compare(0, ::strlen(STREAM_CLOSE), STREAM_CLOSE) == 0) {
+            conn->output += STREAM_CLOSE;
+            conn->is_closing = true;
+            input.clear();
+        }
+        else {
+            size_t size = g_element_size(input);
+            if(size == 0) {
+                return;
+            }
+
+            string stanza = input.substr(0, size);
+            input.erase(0, size);
+            handleStanza(conn, stanza);
+        }
+    }
+}
+
+void BenchServer::handleStreamOpen(Connection *conn)
+{
+    char id[16];
+    ::snprintf(id, sizeof(id), "%u", ++stream_ids);
+
+    conn->output += "<?xml version='1.0'?>"
+        "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+        "id='" + string(id) + "' from='" + domain + "' version='1.0' xml:lang='en'>";
+
+    if(!conn->is_authenticated) {
+        conn->output += "<stream:features>"
+            "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><mechanism>PLAIN</mechanism></mechanisms>"
+            "</stream:features>";
+    }
+    else {
+        conn->output += "<stream:features>"
+            "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+            "<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+            "</stream:features>";
+    }
+}
+
+void BenchServer::handleStanza(Connection *conn, const string& stanza)
+{
+    const string name = g_element_name(stanza);
+
+    if(!conn->is_authenticated) {
+        if(name == "auth") {
+            handleAuth(conn, stanza);
+        }
+        return;
+    }
+
+    if(name == "iq") {
+        handleIq(conn, stanza);
+    }
+    else if(conn->jid.empty()) {
+        // not bound yet, drop
+    }
+    else if(name == "message") {
+        handleMessage(conn, stanza);
+    }
+    else if(name == "presence") {
+        handlePresence(conn, stanza);
+    }
+}
+
+void BenchServer::handleAuth(Connection *conn, const string& stanza)
+{
+    // PLAIN: [authzid] NUL authcid NUL passwd
+    string plain = g_base64_decode(g_text(stanza));
+
+    size_t begin = plain.find('\0');
+    size_t end = (begin == string::npos) ? string::npos : plain.find('\0', begin + 1);
+
+    if(g_attribute(stanza, "mechanism") != "PLAIN" || end == string::npos || end == begin + 1) {
+        conn->output += "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><not-authorized/></failure>";
+        return;
+    }
+
+    conn->user = plain.substr(begin + 1, end - begin - 1);
+    conn->is_authenticated = true;
+
+    conn->output += "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>";
+}
+
+void BenchServer::handleIq(Connection *conn, const string& stanza)
+{
+    const string to = g_attribute(stanza, "to");
+    const string type = g_attribute(stanza, "type");
+    const string id = g_attribute(stanza, "id");
+
+    if(!to.empty() && to != domain) {
+        if(conn->jid.empty()) {
+            return;
+        }
+
+        if(g_jid_domain(to) == groupchat_domain) {
+            handleRoomStanza(conn, "iq", stanza, to);
+        }
+        else {
+            route(conn, "iq", stanza, to);
+        }
+        return;
+    }
+
+    if(type != "get" && type != "set") {
+        // results and errors for the server itself
+        return;
+    }
+
+    if(stanza.find("urn:ietf:params:xml:ns:xmpp-bind") != string::npos) {
+        string resource = g_child_text(stanza, "resource");
+        if(resource.empty()) {
+            char generated[32];
+            ::snprintf(generated, sizeof(generated), "bench%u", stream_ids);
+            resource = generated;
+        }
+
+        conn->jid = conn->user + "@" + domain + "/" + resource;
+        sessions[conn->user] = conn;
+
+        conn->output += "<iq type='result' id='" + id + "'>"
+            "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>" + conn->jid + "</jid></bind></iq>";
+    }
+    else if(stanza.find("http://jabber.org/protocol/disco#info") != string::npos) {
+        // XEP-0033 multicast is offered by the server itself
+        conn->output += "<iq type='result' id='" + id + "' from='" + domain + "'>"
+            "<query xmlns='http://jabber.org/protocol/disco#info'>"
+            "<identity category='server' type='im' name='BenchServer'/>"
+            "<feature var='http://jabber.org/protocol/disco#info'/>"
+            "<feature var='" + MULTICAST_XMLNS + "'/>"
+            "</query></iq>";
+    }
+    else if(stanza.find("urn:ietf:params:xml:ns:xmpp-session") != string::npos ||
+            stanza.find("urn:xmpp:ping") != string::npos) {
+        conn->output += "<iq type='result' id='" + id + "' from='" + domain + "'/>";
+    }
+    else {
+        conn->output += g_error_reply("iq", stanza, "service-unavailable");
+    }
+}
+
+void BenchServer::handleMessage(Connection *conn, const string& stanza)
+{
+    const string to = g_attribute(stanza, "to");
+
+    if(to.empty()) {
+        return;
+    }
+
+    if(to == domain && stanza.find(MULTICAST_XMLNS) != string::npos) {
+        handleMulticast(conn, stanza);
+    }
+    else if(g_jid_domain(to) == groupchat_domain) {
+        handleRoomStanza(conn, "message", stanza, to);
+    }
+    else {
+        route(conn, "message", stanza, to);
+    }
+}
+
+// XEP-0033: one copy per address, without the addresses
+void BenchServer::handleMulticast(Connection *conn, const string& stanza)
+{
+    size_t begin = stanza.find("<addresses");
+    size_t end = stanza.find("</addresses>", begin);
+    if(begin == string::npos || end == string::npos) {
+        return;
+    }
+    end += ::strlen("</addresses>");
+
+    const string addresses = stanza.substr(begin, end - begin);
+    const string message = stanza.substr(0, begin) + stanza.substr(end);
+
+    for(size_t pos = addresses.find("<address "); pos != string::npos; pos = addresses.find("<address ", pos + 1)) {
+        const string jid = g_attribute(addresses.substr(pos), "jid");
+        if(!jid.empty()) {
+            route(conn, "message", g_set_attribute(message, "to", jid), jid);
+        }
+    }
+}
+
+void BenchServer::handlePresence(Connection *conn, const string& stanza)
+{
+    const string to = g_attribute(stanza, "to");
+    const string type = g_attribute(stanza, "type");
+
+    if(!to.empty()) {
+        if(g_jid_domain(to) == groupchat_domain) {
+            handleRoomStanza(conn, "presence", stanza, to);
+        }
+        else {
+            route(conn, "presence", stanza, to);
+        }
+        return;
+    }
+
+    // no roster: broadcast presence only toggles offline delivery
+    if(type.empty()) {
+        bool is_initial = !conn->is_available;
+        conn->is_available = true;
+
+        Offline::iterator it = offline.find(conn->user);
+        if(is_initial && it != offline.end()) {
+            for(size_t i = 0; i < it->second.size(); ++i) {
+                deliver(conn, g_set_attribute(it->second[i], "to", conn->jid));
+            }
+            __sync_fetch_and_sub(&offline_messages, it->second.size());
+            offline.erase(it);
+        }
+    }
+    else if(type == "unavailable") {
+        conn->is_available = false;
+    }
+}
+
+void BenchServer::handleRoomStanza(Connection *conn, const string& name, const string& stanza, const string& to)
+{
+    const string room_name = g_jid_user(to);
+    const string nick = g_jid_resource(to);
+    const string type = g_attribute(stanza, "type");
+
+    if(name == "presence") {
+        if(type.empty() && !nick.empty()) {
+            joinRoom(conn, room_name, nick);
+        }
+        else if(type == "unavailable") {
+            leaveRoom(conn, room_name);
+        }
+        return;
+    }
+
+    if(name == "iq") {
+        if(type == "get" || type == "set") {
+            conn->output += g_error_reply("iq", stanza, "service-unavailable");
+        }
+        return;
+    }
+
+    // find the sender's nick
+    Rooms::iterator it_room = rooms.find(room_name);
+    string sender;
+    if(it_room != rooms.end()) {
+        map<string, Connection*>::const_iterator it;
+        for(it = it_room->second.occupants.begin(); it != it_room->second.occupants.end(); ++it) {
+            if(it->second == conn) {
+                sender = it->first;
+                break;
+            }
+        }
+    }
+
+    if(sender.empty()) {
+        if(type != "error") {
+            conn->output += g_error_reply("message", stanza, "not-acceptable");
+        }
+        return;
+    }
+
+    const string from = room_name + "@" + groupchat_domain + "/" + sender;
+    const map<string, Connection*>& occupants = it_room->second.occupants;
+
+    if(type == "groupchat") {
+        string message = g_set_attribute(stanza, "from", from);
+
+        map<string, Connection*>::const_iterator it;
+        for(it = occupants.begin(); it != occupants.end(); ++it) {
+            deliver(it->second, g_set_attribute(message, "to", it->second->jid));
+        }
+    }
+    else {
+        // private message to an occupant
+        map<string, Connection*>::const_iterator it = occupants.find(nick);
+        if(it != occupants.end()) {
+            deliver(it->second, g_set_attribute(g_set_attribute(stanza, "from", from), "to", it->second->jid));
+        }
+        else if(type != "error") {
+            conn->output += g_error_reply("message", stanza, "item-not-found");
+        }
+    }
+}
+
+void BenchServer::route(Connection *conn, const string& name, const string& stanza, const string& to)
+{
+    string message = g_set_attribute(stanza, "from", conn->jid);
+
+    Sessions::const_iterator it = sessions.find(g_jid_user(to));
+    if(g_jid_domain(to) == domain && it != sessions.end()) {
+        const string resource = g_jid_resource(to);
+        if(resource.empty() || resource == g_jid_resource(it->second->jid)) {
+            deliver(it->second, message);
+            return;
+        }
+    }
+
+    const string type = g_attribute(stanza, "type");
+
+    if(name == "message") {
+        if(g_jid_domain(to) != domain || type == "error" || type == "groupchat" ||
+           stanza.find("<body") == string::npos) {
+            return;
+        }
+
+        // store with a delay stamp, delivered on the next initial presence
+        char stamp[32];
+        time_t now = ::time(0);
+        struct tm tm;
+        ::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", ::gmtime_r(&now, &tm));
+
+        size_t end = message.rfind("</message>");
+        if(end == string::npos) {
+            return;
+        }
+        message.insert(end, "<delay xmlns='urn:xmpp:delay' from='" + domain +
+                       "' stamp='" + stamp + "'>Offline Storage</delay>");
+
+        offline[g_jid_user(to)].push_back(message);
+        __sync_fetch_and_add(&offline_messages, 1);
+    }
+    else if(name == "iq") {
+        if(type == "get" || type == "set") {
+            conn->output += g_error_reply("iq", stanza, "service-unavailable");
+        }
+    }
+}
+
+void BenchServer::deliver(Connection *conn, const string& stanza)
+{
+    conn->output += stanza;
+    __sync_fetch_and_add(&routed_stanzas, 1);
+}
+
+void BenchServer::joinRoom(Connection *conn, const string& room_name, const string& nick)
+{
+    // NOTE: rooms are created unlocked, no owner configuration round-trip
+    Room& room = rooms[room_name];
+    const string room_jid = room_name + "@" + groupchat_domain;
+
+    map<string, Connection*>::iterator it = room.occupants.find(nick);
+    if(it != room.occupants.end() && it->second != conn) {
+        string reply = "<presence type='error' from='" + room_jid + "/" + nick + "'>"
+            "<error type='cancel'><conflict xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></presence>";
+        conn->output += reply;
+        return;
+    }
+
+    // existing occupants to the new one, the new one to the others
+    for(it = room.occupants.begin(); it != room.occupants.end(); ++it) {
+        if(it->second != conn) {
+            deliver(conn, g_occupant_presence(room_jid + "/" + it->first, conn->jid, true, false));
+            deliver(it->second, g_occupant_presence(room_jid + "/" + nick, it->second->jid, true, false));
+        }
+    }
+
+    room.occupants[nick] = conn;
+
+    conn->output += g_occupant_presence(room_jid + "/" + nick, conn->jid, true, true);
+    conn->output += "<message type='groupchat' from='" + room_jid + "' to='" + conn->jid + "'><subject/></message>";
+}
+
+void BenchServer::leaveRoom(Connection *conn, const string& room_name)
+{
+    Rooms::iterator it_room = rooms.find(room_name);
+    if(it_room == rooms.end()) {
+        return;
+    }
+
+    map<string, Connection*>& occupants = it_room->second.occupants;
+    const string room_jid = room_name + "@" + groupchat_domain;
+
+    map<string, Connection*>::iterator it;
+    for(it = occupants.begin(); it != occupants.end(); ++it) {
+        if(it->second == conn) {
+            break;
+        }
+    }
+    if(it == occupants.end()) {
+        return;
+    }
+
+    const string nick = it->first;
+    occupants.erase(it);
+
+    for(it = occupants.begin(); it != occupants.end(); ++it) {
+        deliver(it->second, g_occupant_presence(room_jid + "/" + nick, it->second->jid, false, false));
+    }
+
+    if(!conn->is_closing) {
+        conn->output += g_occupant_presence(room_jid + "/" + nick, conn->jid, false, true);
+    }
+
+    if(occupants.empty()) {
+        rooms.erase(it_room);
+    }
+}
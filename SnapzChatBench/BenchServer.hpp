@@ -0,0 +1,114 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef BENCH_SERVER_INCLUDED
+#define BENCH_SERVER_INCLUDED
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include <pthread.h>
+
+using namespace std;
+
+// Minimal in-process XMPP server stand-in for benchmarks, listening on 127.0.0.1:
+// plain-text streams, SASL PLAIN (any password accepted), resource binding,
+// 1:1 routing with offline storage and MUC rooms created unlocked on first join.
+// NOTE: it only implements what XMPPClient needs, it is not a conforming server
+class BenchServer
+{
+public:
+    explicit BenchServer(const string& domain);
+
+    ~BenchServer();
+
+    /// listens on an ephemeral loopback port and starts the server thread
+    bool start();
+    void stop();
+
+    int getPort() const {
+        return port;
+    }
+
+    const string& getDomain() const {
+        return domain;
+    }
+
+    const string& getGroupChatDomain() const {
+        return groupchat_domain;
+    }
+
+    /// stanzas delivered to a connection other than the sender's
+    uint64_t getRoutedStanzas() const {
+        return __sync_fetch_and_add(const_cast<uint64_t*>(&routed_stanzas), 0);
+    }
+
+    /// messages stored for offline users and not delivered yet
+    uint64_t getOfflineMessages() const {
+        return __sync_fetch_and_add(const_cast<uint64_t*>(&offline_messages), 0);
+    }
+
+private:
+    struct Connection;
+
+    struct Room
+    {
+        map<string, Connection*> occupants;  // nick -> connection
+    };
+
+    typedef vector<Connection*> Connections;
+    typedef map<string, Connection*> Sessions;       // username -> connection
+    typedef map<string, Room> Rooms;                  // room name -> room
+    typedef map<string, vector<string> > Offline;     // username -> messages
+
+    void run();
+    void acceptConnections();
+    bool readConnection(Connection *conn);
+    bool writeConnection(Connection *conn);
+    void closeConnection(Connection *conn);
+
+    void handleInput(Connection *conn);
+    void handleStreamOpen(Connection *conn);
+    void handleStanza(Connection *conn, const string& stanza);
+    void handleAuth(Connection *conn, const string& stanza);
+    void handleIq(Connection *conn, const string& stanza);
+    void handleMessage(Connection *conn, const string& stanza);
+    void handleMulticast(Connection *conn, const string& stanza);
+    void handlePresence(Connection *conn, const string& stanza);
+    void handleRoomStanza(Connection *conn, const string& name, const string& stanza, const string& to);
+
+    void route(Connection *conn, const string& name, const string& stanza, const string& to);
+    void deliver(Connection *conn, const string& stanza);
+    void joinRoom(Connection *conn, const string& room_name, const string& nick);
+    void leaveRoom(Connection *conn, const string& room_name);
+
+    static void* server_loop(void *data);
+
+private:
+    string domain;
+    string groupchat_domain;
+
+    int listen_fd;
+    int port;
+
+    Connections connections;
+    Sessions sessions;
+    Rooms rooms;
+    Offline offline;
+
+    unsigned int stream_ids;
+
+    uint64_t routed_stanzas;
+    uint64_t offline_messages;
+
+    pthread_t server_thread;
+    volatile bool is_running;
+
+private:
+    BenchServer();
+    BenchServer(const BenchServer&);
+    const BenchServer& operator=(const BenchServer&);
+};
+
+#endif // BENCH_SERVER_INCLUDED
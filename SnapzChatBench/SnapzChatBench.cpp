@@ -0,0 +1,1192 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+// Drives XMPPClient against the in-process BenchServer over loopback and
+// writes one JSON document with the results of every scenario.
+//
+// Linux build (needs the gloox 1.0 headers and library), from the top directory:
+//   make bench
+// add IO_URING=1 for the io_uring side of the chat_transport scenario
+//
+// Usage: snapzchatbench [-n messages] [-r rooms] [-t timeout] [-o output.json] [-c capture] [scenario ...]
+
+#include "BenchServer.hpp"
+#include "XMPPClient.hpp"
+#include "XMPPClock.hpp"
+#include "XMPPStanzaWriter.hpp"
+#include "XMPPStanzaReader.hpp"
+#include "XMPPArena.hpp"
+#include "XMPPCapture.hpp"
+#include "XMPPPool.hpp"
+
+#include <gloox/message.h>
+#include <gloox/messageevent.h>
+#include <gloox/tag.h>
+#include <gloox/parser.h>
+#include <gloox/taghandler.h>
+
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <sched.h>
+
+// counts heap allocations, for the stanza_writer and stanza_reader scenarios
+static volatile uint64_t g_allocations = 0;
+
+void* operator new(size_t size)
+{
+    __sync_fetch_and_add(&g_allocations, 1);
+
+    void *data = ::malloc(size ? size : 1);
+    if(!data) {
+        throw std::bad_alloc();
+    }
+    return data;
+}
+
+void operator delete(void *data) throw()
+{
+    ::free(data);
+}
+
+class BenchClient : public XMPPClient
+{
+public:
+    explicit BenchClient(const Config& config);
+
+    virtual ~BenchClient();
+
+    bool start();
+
+    /// called from the owner thread while the client is idle
+    void reset();
+
+    bool waitOnline(int timeout) const;
+    static bool waitFor(const volatile uint64_t *counter, uint64_t value, int timeout);
+
+public:
+    // NOTE: updated by the event loop thread, read by the owner thread
+    volatile bool is_online;
+    volatile uint64_t connect_time;       // XMPPClock::now() at onConnect()
+    volatile uint64_t chat_messages;
+    volatile uint64_t composing_events;
+    volatile uint64_t delivered_events;
+    volatile uint64_t joined_groups;
+
+    vector<uint64_t> latencies;           // send to onChatMessage(), nanoseconds
+    vector<uint64_t> event_latencies;     // send to onChatMessageDelivered(), nanoseconds
+    vector<uint64_t> join_latencies;      // beginGroupChat() to own presence, nanoseconds
+
+    // NOTE: written by the owner thread before the matching request
+    bool reply_events;                    // answer messages with 'composing' and 'delivered'
+    volatile uint64_t send_time;          // last message sent, for event_latencies
+    vector<uint64_t> join_times;          // per room index, for join_latencies
+
+protected:
+    /// connection callbacks
+    virtual void onConnect();
+    virtual void onDisconnect(ConnectionError error);
+
+    /// simple chat callbacks
+    virtual void onChatMessage(const string& user, const string& resource,
+                               const string& message, const string& subject, const char *timestamp);
+    virtual void onChatMessageComposing(const string& user, const string& resource);
+    virtual void onChatMessageDelivered(const string& user, const string& resource);
+
+    /// group chat callbacks
+    virtual void onGroupChatUserPresence(const string& group, const string& user,
+                                         bool online, const string& reason, int flags);
+
+private:
+    bool is_started;
+
+private:
+    BenchClient();
+    BenchClient(const BenchClient&);
+    const BenchClient& operator=(const BenchClient&);
+};
+
+/// BenchClient
+BenchClient::BenchClient(const Config& config)
+    : XMPPClient(config),
+      is_online(false), connect_time(0),
+      chat_messages(0), composing_events(0), delivered_events(0), joined_groups(0),
+      reply_events(false), send_time(0),
+      is_started(false)
+{
+}
+
+BenchClient::~BenchClient()
+{
+    // NOTE: XMPPClient::disconnect() joins the event loop thread unconditionally
+    if(is_started) {
+        XMPPClient::disconnect();
+    }
+}
+
+bool BenchClient::start()
+{
+    is_started = XMPPClient::connect();
+    return is_started;
+}
+
+void BenchClient::reset()
+{
+    chat_messages = 0;
+    composing_events = 0;
+    delivered_events = 0;
+    joined_groups = 0;
+
+    latencies.clear();
+    event_latencies.clear();
+    join_latencies.clear();
+
+    reply_events = false;
+    send_time = 0;
+    join_times.clear();
+
+    __sync_synchronize();
+}
+
+bool BenchClient::waitOnline(int timeout /* milliseconds */) const
+{
+    uint64_t deadline = XMPPClock::nowMilliseconds() + timeout;
+
+    while(!is_online) {
+        if(XMPPClock::nowMilliseconds() > deadline) {
+            return false;
+        }
+        ::usleep(1000);
+    }
+    return true;
+}
+
+bool BenchClient::waitFor(const volatile uint64_t *counter, uint64_t value, int timeout /* milliseconds */)
+{
+    uint64_t deadline = XMPPClock::nowMilliseconds() + timeout;
+
+    while(__sync_fetch_and_add(const_cast<uint64_t*>(counter), 0) < value) {
+        if(XMPPClock::nowMilliseconds() > deadline) {
+            return false;
+        }
+        sched_yield();
+    }
+
+    __sync_synchronize();
+    return true;
+}
+
+void BenchClient::onConnect()
+{
+    connect_time = XMPPClock::now();
+    is_online = true;
+}
+
+void BenchClient::onDisconnect(ConnectionError error)
+{
+    (void)error;
+
+    is_online = false;
+}
+
+void BenchClient::onChatMessage(const string& user, const string& resource,
+                                const string& message, const string& subject, const char *timestamp)
+{
+    (void)subject, (void)timestamp;
+
+    // body: "<sequence> <XMPPClock::now() at send>"
+    const char *stamp = ::strchr(message.c_str(), ' ');
+    if(stamp) {
+        latencies.push_back(XMPPClock::now() - ::strtoull(stamp + 1, 0, 10));
+    }
+
+    if(reply_events) {
+        sendChatMessageComposing(user, resource);
+        sendChatMessageDelivered(user, resource);
+    }
+
+    __sync_fetch_and_add(&chat_messages, 1);
+}
+
+void BenchClient::onChatMessageComposing(const string& user, const string& resource)
+{
+    (void)user, (void)resource;
+
+    __sync_fetch_and_add(&composing_events, 1);
+}
+
+void BenchClient::onChatMessageDelivered(const string& user, const string& resource)
+{
+    (void)user, (void)resource;
+
+    event_latencies.push_back(XMPPClock::now() - send_time);
+    __sync_fetch_and_add(&delivered_events, 1);
+}
+
+void BenchClient::onGroupChatUserPresence(const string& group, const string& user,
+                                          bool online, const string& reason, int flags)
+{
+    (void)user, (void)reason;
+
+    if(!online || !(flags & UserSelf)) {
+        return;
+    }
+
+    // group: "room<index>"
+    size_t index = ::strtoul(group.c_str() + 4, 0, 10);
+    if(index < join_times.size()) {
+        join_latencies.push_back(XMPPClock::now() - join_times[index]);
+    }
+
+    __sync_fetch_and_add(&joined_groups, 1);
+}
+
+/// scenarios
+struct BenchContext
+{
+    BenchServer *server;
+    BenchClient *alice;
+    BenchClient *bob;
+
+    int messages;
+    int rooms;
+    int timeout;  // per scenario, milliseconds
+
+    const char *capture;  // recorded stream for stanza_reader, 0 for a synthetic one
+};
+
+struct BenchResult
+{
+    explicit BenchResult(const string& scenario_)
+        : scenario(scenario_), success(false) {
+    }
+
+    void add(const string& name, double value) {
+        values.push_back(make_pair(name, value));
+    }
+
+    // p50/p90/p99/max in microseconds
+    void addPercentiles(const string& prefix, vector<uint64_t>& samples);
+
+    string scenario;
+    bool success;
+    vector<pair<string, double> > values;
+};
+
+void BenchResult::addPercentiles(const string& prefix, vector<uint64_t>& samples)
+{
+    if(samples.empty()) {
+        return;
+    }
+
+    sort(samples.begin(), samples.end());
+
+    static const struct {
+        const char *name;
+        double quantile;
+    } PERCENTILES[] = {
+        {"_p50_us", 0.50},
+        {"_p90_us", 0.90},
+        {"_p99_us", 0.99},
+        {"_max_us", 1.00}
+    };
+
+    for(size_t i = 0; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++i) {
+        size_t index = (size_t)(PERCENTILES[i].quantile * (samples.size() - 1));
+        add(prefix + PERCENTILES[i].name, samples[index] / 1000.0);
+    }
+}
+
+static string g_message_body(uint64_t sequence)
+{
+    char body[64];
+    ::snprintf(body, sizeof(body), "%llu %llu",
+               (unsigned long long)sequence, (unsigned long long)XMPPClock::now());
+    return body;
+}
+
+static double g_seconds(uint64_t start, uint64_t end)
+{
+    return (end - start) / 1e9;
+}
+
+static BenchClient* g_connect_client(const BenchServer& server, const string& user, bool io_uring = false)
+{
+    XMPPClient::Config config(user + "@" + server.getDomain(), "bench");
+    config.server = "127.0.0.1";
+    config.port = server.getPort();
+    config.tls_policy = TLSDisabled;
+    config.groupchat_server = server.getGroupChatDomain();
+    config.recv_timeout = 100;
+    config.fanout_rate = 0;  // measure serialization, not pacing
+    config.io_uring = io_uring;
+
+    BenchClient *client = new BenchClient(config);
+    if(!client->start() || !client->waitOnline(5000)) {
+        delete client;
+        return 0;
+    }
+    return client;
+}
+
+// open loop: alice sends all messages, bob counts them
+static void g_chat_throughput(BenchContext& context, BenchResult& result)
+{
+    context.alice->reset();
+    context.bob->reset();
+
+    uint64_t start = XMPPClock::now();
+
+    for(int i = 0; i < context.messages; ++i) {
+        context.alice->sendChatMessage("bob", g_message_body(i));
+    }
+    uint64_t sent = XMPPClock::now();
+
+    result.success = BenchClient::waitFor(&context.bob->chat_messages, context.messages, context.timeout);
+    uint64_t end = XMPPClock::now();
+
+    result.add("messages", context.bob->chat_messages);
+    result.add("seconds", g_seconds(start, end));
+    result.add("send_per_second", context.messages / g_seconds(start, sent));
+    result.add("messages_per_second", context.bob->chat_messages / g_seconds(start, end));
+    result.addPercentiles("latency", context.bob->latencies);
+}
+
+// closed loop: one message in flight
+static void g_chat_latency(BenchContext& context, BenchResult& result)
+{
+    context.alice->reset();
+    context.bob->reset();
+
+    result.success = true;
+    for(int i = 0; i < context.messages && result.success; ++i) {
+        context.alice->sendChatMessage("bob", g_message_body(i));
+        result.success = BenchClient::waitFor(&context.bob->chat_messages, i + 1, context.timeout);
+    }
+
+    result.add("messages", context.bob->chat_messages);
+    result.addPercentiles("latency", context.bob->latencies);
+}
+
+// closed loop: bob answers every message with 'composing' and 'delivered'
+static void g_chat_events(BenchContext& context, BenchResult& result)
+{
+    context.alice->reset();
+    context.bob->reset();
+    context.bob->reply_events = true;
+
+    uint64_t start = XMPPClock::now();
+
+    result.success = true;
+    for(int i = 0; i < context.messages && result.success; ++i) {
+        context.alice->send_time = XMPPClock::now();
+        context.alice->sendChatMessage("bob", g_message_body(i));
+        result.success = BenchClient::waitFor(&context.alice->delivered_events, i + 1, context.timeout);
+    }
+    uint64_t end = XMPPClock::now();
+
+    result.add("messages", context.bob->chat_messages);
+    result.add("composing_events", context.alice->composing_events);
+    result.add("delivered_events", context.alice->delivered_events);
+    result.add("composing_per_second", context.alice->composing_events / g_seconds(start, end));
+    result.add("delivered_per_second", context.alice->delivered_events / g_seconds(start, end));
+    result.addPercentiles("delivered_rtt", context.alice->event_latencies);
+
+    context.bob->reply_events = false;
+}
+
+// alice joins all rooms at once, then leaves them
+static void g_room_join(BenchContext& context, BenchResult& result)
+{
+    context.alice->reset();
+    context.alice->join_times.resize(context.rooms);
+
+    uint64_t start = XMPPClock::now();
+
+    char group[32];
+    for(int i = 0; i < context.rooms; ++i) {
+        ::snprintf(group, sizeof(group), "room%d", i);
+        context.alice->join_times[i] = XMPPClock::now();
+        context.alice->beginGroupChat(group);
+    }
+
+    result.success = BenchClient::waitFor(&context.alice->joined_groups, context.rooms, context.timeout);
+    uint64_t end = XMPPClock::now();
+
+    result.add("rooms", context.alice->joined_groups);
+    result.add("seconds", g_seconds(start, end));
+    result.add("joins_per_second", context.alice->joined_groups / g_seconds(start, end));
+    result.addPercentiles("join", context.alice->join_latencies);
+
+    for(int i = 0; i < context.rooms; ++i) {
+        ::snprintf(group, sizeof(group), "room%d", i);
+        context.alice->endGroupChat(group);
+    }
+}
+
+static bool g_wait_offline(const BenchServer& server, uint64_t messages, int timeout /* milliseconds */)
+{
+    uint64_t deadline = XMPPClock::nowMilliseconds() + timeout;
+
+    while(server.getOfflineMessages() < messages) {
+        if(XMPPClock::nowMilliseconds() > deadline) {
+            return false;
+        }
+        ::usleep(1000);
+    }
+    return true;
+}
+
+// messages stored while carol is offline, flushed at her login
+static void g_offline_burst(BenchContext& context, BenchResult& result)
+{
+    context.alice->reset();
+
+    for(int i = 0; i < context.messages; ++i) {
+        context.alice->sendChatMessage("carol", g_message_body(i));
+    }
+
+    if(!g_wait_offline(*context.server, context.messages, context.timeout)) {
+        return;
+    }
+
+    uint64_t start = XMPPClock::now();
+
+    BenchClient *carol = g_connect_client(*context.server, "carol");
+    if(!carol) {
+        return;
+    }
+
+    result.success = BenchClient::waitFor(&carol->chat_messages, context.messages, context.timeout);
+    uint64_t end = XMPPClock::now();
+
+    result.add("messages", carol->chat_messages);
+    result.add("login_seconds", g_seconds(start, carol->connect_time));
+    result.add("seconds", g_seconds(start, end));
+    result.add("messages_per_second", carol->chat_messages / g_seconds(start, end));
+
+    delete carol;
+}
+
+// CPU time of the whole process (server included), seconds
+static double g_cpu_seconds()
+{
+    struct timespec now;
+    if(::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now) != 0) {
+        return 0;
+    }
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// one side of chat_transport, waiting without spinning so that the CPU time is the stream's
+static bool g_chat_transport_run(BenchContext& context, BenchResult& result, const string& prefix, bool io_uring)
+{
+    BenchClient *sender = g_connect_client(*context.server, prefix + "_sender", io_uring);
+    BenchClient *receiver = g_connect_client(*context.server, prefix + "_receiver", io_uring);
+    if(!sender || !receiver) {
+        delete sender;
+        delete receiver;
+        return false;
+    }
+
+    double cpu = g_cpu_seconds();
+    uint64_t start = XMPPClock::now();
+    uint64_t deadline = XMPPClock::nowMilliseconds() + context.timeout;
+
+    for(int i = 0; i < context.messages; ++i) {
+        sender->sendChatMessage(prefix + "_receiver", g_message_body(i));
+    }
+
+    while(receiver->chat_messages < (uint64_t)context.messages && XMPPClock::nowMilliseconds() <= deadline) {
+        ::usleep(1000);
+    }
+    __sync_synchronize();
+
+    uint64_t end = XMPPClock::now();
+    double cpu_seconds = g_cpu_seconds() - cpu;
+    uint64_t messages = receiver->chat_messages;
+
+    result.add(prefix + "_messages", messages);
+    result.add(prefix + "_messages_per_second", messages / g_seconds(start, end));
+    result.add(prefix + "_cpu_us_per_message", messages ? cpu_seconds * 1e6 / messages : 0);
+    result.addPercentiles(prefix + "_latency", receiver->latencies);
+
+    delete sender;
+    delete receiver;
+
+    return messages == (uint64_t)context.messages;
+}
+
+// the stream between a fresh pair of clients with the plain TCP calls, then
+// through io_uring (Config::io_uring) when built with XMPP_CLIENT_IO_URING_ENABLE
+static void g_chat_transport(BenchContext& context, BenchResult& result)
+{
+    result.success = g_chat_transport_run(context, result, "tcp", false);
+
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+    result.success = g_chat_transport_run(context, result, "io_uring", true) && result.success;
+#endif // XMPP_CLIENT_IO_URING_ENABLE
+}
+
+// the same message to many offline users: one sendChatMessage() per user,
+// then a single sendChatMessageToMany() (XEP-0033 multicast, offered by BenchServer)
+static void g_chat_fanout(BenchContext& context, BenchResult& result)
+{
+    vector<string> users;
+    char user[32];
+    for(int i = 0; i < context.messages; ++i) {
+        ::snprintf(user, sizeof(user), "fanout%d", i);
+        users.push_back(user);
+    }
+
+    const string body = g_message_body(0);
+
+    uint64_t stored = context.server->getOfflineMessages();
+    uint64_t start = XMPPClock::now();
+
+    for(size_t i = 0; i < users.size(); ++i) {
+        context.alice->sendChatMessage(users[i], body);
+    }
+    uint64_t sent = XMPPClock::now();
+
+    if(!g_wait_offline(*context.server, stored + users.size(), context.timeout)) {
+        return;
+    }
+    uint64_t end = XMPPClock::now();
+
+    result.add("recipients", users.size());
+    result.add("loop_send_seconds", g_seconds(start, sent));
+    result.add("loop_seconds", g_seconds(start, end));
+    result.add("loop_messages_per_second", users.size() / g_seconds(start, end));
+
+    double loop_seconds = g_seconds(start, end);
+
+    stored = context.server->getOfflineMessages();
+    start = XMPPClock::now();
+
+    const XMPPMetrics& metrics = context.alice->getMetrics();
+    uint64_t multicast_stanzas = metrics.get(XMPPMetrics::COUNTER_MULTICAST_STANZAS);
+    uint64_t multicast_bytes_saved = metrics.get(XMPPMetrics::COUNTER_MULTICAST_BYTES_SAVED);
+
+    context.alice->sendChatMessageToMany(users, body);
+    sent = XMPPClock::now();
+
+    result.success = g_wait_offline(*context.server, stored + users.size(), context.timeout);
+    end = XMPPClock::now();
+
+    result.add("many_send_seconds", g_seconds(start, sent));
+    result.add("many_seconds", g_seconds(start, end));
+    result.add("many_messages_per_second", users.size() / g_seconds(start, end));
+    result.add("speedup", loop_seconds / g_seconds(start, end));
+    result.add("multicast_stanzas", metrics.get(XMPPMetrics::COUNTER_MULTICAST_STANZAS) - multicast_stanzas);
+    result.add("multicast_bytes_saved", metrics.get(XMPPMetrics::COUNTER_MULTICAST_BYTES_SAVED) - multicast_bytes_saved);
+}
+
+// one stanza kind serialized by gloox or by XMPPStanzaWriter, returns its size
+typedef size_t (*SerializeFunction)(string& out, const JID& to, const string& id, const string& body);
+
+static size_t g_serialize_tag(const Message& message)
+{
+    Tag *tag = message.tag();
+    size_t size = tag->xml().size();
+    delete tag;
+    return size;
+}
+
+static size_t g_gloox_message(string&, const JID& to, const string& id, const string& body)
+{
+    Message message(Message::Chat, to, body);
+    message.setID(id);
+    message.addExtension(new MessageEvent(MessageEventOffline | MessageEventDelivered |
+                                          MessageEventDisplayed | MessageEventComposing));
+    return g_serialize_tag(message);
+}
+
+static size_t g_gloox_composing(string&, const JID& to, const string& id, const string&)
+{
+    Message message(Message::Normal, to);
+    message.addExtension(new MessageEvent(MessageEventComposing, id));
+    return g_serialize_tag(message);
+}
+
+static size_t g_gloox_delivered(string&, const JID& to, const string& id, const string&)
+{
+    Message message(Message::Normal, to);
+    message.addExtension(new MessageEvent(MessageEventDelivered, id));
+    return g_serialize_tag(message);
+}
+
+static size_t g_writer_message(string& out, const JID& to, const string& id, const string& body)
+{
+    out.clear();
+    XMPPStanzaWriter::appendChatMessage(out, to.full(), id, body, "", "",
+                                        MessageEventOffline | MessageEventDelivered |
+                                        MessageEventDisplayed | MessageEventComposing);
+    return out.size();
+}
+
+static size_t g_writer_composing(string& out, const JID& to, const string& id, const string&)
+{
+    out.clear();
+    XMPPStanzaWriter::appendMessageEvent(out, to.full(), id, MessageEventComposing, id);
+    return out.size();
+}
+
+static size_t g_writer_delivered(string& out, const JID& to, const string& id, const string&)
+{
+    out.clear();
+    XMPPStanzaWriter::appendMessageEvent(out, to.full(), id, MessageEventDelivered, id);
+    return out.size();
+}
+
+// no server involved: ns and heap allocations per stanza, gloox Tag tree vs XMPPStanzaWriter
+static void g_stanza_writer(BenchContext& context, BenchResult& result)
+{
+    static const struct {
+        const char *name;
+        SerializeFunction serialize;
+    } SERIALIZERS[] = {
+        {"gloox_message",     g_gloox_message},
+        {"writer_message",    g_writer_message},
+        {"gloox_composing",   g_gloox_composing},
+        {"writer_composing",  g_writer_composing},
+        {"gloox_delivered",   g_gloox_delivered},
+        {"writer_delivered",  g_writer_delivered}
+    };
+
+    const JID to("bob@" + context.server->getDomain() + "/bench");
+    const string id = "uid:4f3a2b1c:00001234";
+    const string body = g_message_body(0) + " Let's meet at <noon> & \"bring\" the notes, it's a plain text body.";
+
+    string out;
+    out.reserve(1024);
+
+    for(size_t i = 0; i < sizeof(SERIALIZERS) / sizeof(SERIALIZERS[0]); ++i) {
+        size_t bytes = 0;
+
+        uint64_t allocations = g_allocations;
+        uint64_t start = XMPPClock::now();
+
+        for(int n = 0; n < context.messages; ++n) {
+            bytes += SERIALIZERS[i].serialize(out, to, id, body);
+        }
+
+        uint64_t end = XMPPClock::now();
+        allocations = g_allocations - allocations;
+
+        const string name = SERIALIZERS[i].name;
+        result.add(name + "_ns", (double)(end - start) / context.messages);
+        result.add(name + "_allocations", (double)allocations / context.messages);
+        result.add(name + "_bytes", (double)bytes / context.messages);
+    }
+
+    result.success = true;
+}
+
+// resident set size in KiB, 0 where /proc is not available
+static double g_rss_kb()
+{
+    FILE *file = ::fopen("/proc/self/statm", "r");
+    if(!file) {
+        return 0;
+    }
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if(::fscanf(file, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    ::fclose(file);
+
+    return resident * (::sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+// session create/delete: alice switches the resource of a chat peer on every
+// composing event (a new ChatSession, MessageSession and MessageEventFilter),
+// then joins and leaves rooms (GroupChatSession and MUCRoom)
+static void g_session_churn(BenchContext& context, BenchResult& result)
+{
+    static const int PEERS = 100;
+
+    context.alice->reset();
+
+    vector<uint64_t> chat_latencies;
+    vector<uint64_t> room_latencies;
+    chat_latencies.reserve(context.messages);
+    room_latencies.reserve(context.messages);
+
+    double rss = g_rss_kb();
+    char user[32];
+
+    uint64_t start = XMPPClock::now();
+
+    for(int i = 0; i < context.messages; ++i) {
+        ::snprintf(user, sizeof(user), "churn%d", i % PEERS);
+
+        uint64_t begin = XMPPClock::now();
+        context.alice->sendChatMessageComposing(user, ((i / PEERS) & 1) ? "a" : "b");
+        chat_latencies.push_back(XMPPClock::now() - begin);
+    }
+
+    uint64_t chat_end = XMPPClock::now();
+
+    for(int i = 0; i < context.messages; ++i) {
+        ::snprintf(user, sizeof(user), "churnroom%d", i % PEERS);
+
+        uint64_t begin = XMPPClock::now();
+        context.alice->beginGroupChat(user);
+        context.alice->endGroupChat(user);
+        room_latencies.push_back(XMPPClock::now() - begin);
+    }
+
+    uint64_t end = XMPPClock::now();
+
+    result.add("chat_sessions_per_second", context.messages / g_seconds(start, chat_end));
+    result.addPercentiles("chat_session", chat_latencies);
+    result.add("rooms_per_second", context.messages / g_seconds(chat_end, end));
+    result.addPercentiles("room", room_latencies);
+    result.add("rss_growth_kb", g_rss_kb() - rss);
+    result.add("pool_in_use", (double)XMPPPool::getTotalInUse());
+    result.add("pool_capacity", (double)XMPPPool::getTotalCapacity());
+
+    result.success = true;
+}
+
+// runs update() of a client without event loop thread until its is_online
+// equals online, false if it does not within timeout milliseconds
+static bool g_update_until(BenchClient& client, bool online, int timeout /* milliseconds */)
+{
+    uint64_t deadline = XMPPClock::nowMilliseconds() + timeout;
+
+    while(client.is_online != online) {
+        if(XMPPClock::nowMilliseconds() > deadline || !client.update(10)) {
+            return client.is_online == online;
+        }
+    }
+    return true;
+}
+
+// Config::endpoint_standby: a client connected to a server of its own keeps a
+// standby connection to the shared one, the first server stops and the next
+// connect() negotiates the stream over the standby connection
+static void g_standby_takeover(BenchContext& context, BenchResult& result)
+{
+    BenchServer primary(context.server->getDomain());
+    if(!primary.start()) {
+        return;
+    }
+
+    char endpoint[64];
+    XMPPClient::Config config("dave@" + context.server->getDomain(), "bench");
+    config.server = "127.0.0.1";
+    config.tls_policy = TLSDisabled;
+    config.recv_timeout = 100;
+    config.endpoint_standby = true;
+
+    // NOTE: endpoints never measured rank first, the standby goes to the shared server
+    ::snprintf(endpoint, sizeof(endpoint), "127.0.0.1:%d", primary.getPort());
+    config.endpoints.push_back(endpoint);
+    ::snprintf(endpoint, sizeof(endpoint), "127.0.0.1:%d", context.server->getPort());
+    config.endpoints.push_back(endpoint);
+
+    BenchClient client(config);
+    if(!client.connect(false) || !g_update_until(client, true, 5000)) {
+        primary.stop();
+        return;
+    }
+
+    // NOTE: the standby connection is opened by the first update(), established well within this
+    uint64_t deadline = XMPPClock::nowMilliseconds() + 200;
+    while(XMPPClock::nowMilliseconds() < deadline) {
+        client.update(10);
+    }
+
+    uint64_t start = XMPPClock::now();
+    primary.stop();
+
+    bool is_failed_over = g_update_until(client, false, context.timeout);
+    uint64_t disconnected = XMPPClock::now();
+
+    is_failed_over = is_failed_over && client.connect(false) && g_update_until(client, true, 5000);
+    uint64_t end = XMPPClock::now();
+
+    uint64_t takeovers = client.getMetrics().get(XMPPMetrics::COUNTER_STANDBY_TAKEOVERS);
+
+    result.add("standby_takeovers", (double)takeovers);
+    result.add("detect_ms", g_seconds(start, disconnected) * 1000);
+    result.add("reconnect_ms", g_seconds(disconnected, end) * 1000);
+
+    client.disconnect();
+
+    // NOTE: a takeover without stream header would never get online
+    result.success = is_failed_over && takeovers == 1;
+}
+
+// gloox side of stanza_reader: Tag tree per stanza, as ClientBase gets it
+class BenchTagHandler : public TagHandler
+{
+public:
+    explicit BenchTagHandler()
+        : stanzas(0), bytes(0) {
+    }
+
+    virtual void handleTag(Tag *tag) {
+        ++stanzas;
+
+        const Tag *body = (tag->name() == "message") ? tag->findChild("body") : 0;
+        if(body) {
+            bytes += body->cdata().size();
+        }
+    }
+
+    uint64_t stanzas;
+    uint64_t bytes;
+};
+
+// XMPPStanzaReader side of stanza_reader, what it passes on goes to the gloox parser
+class BenchStanzaReader :
+    public XMPPStanzaReader::DataHandler,
+    public XMPPStanzaReader::MessageHandler
+{
+public:
+    explicit BenchStanzaReader()
+        : parser(&tags), messages(0), bytes(0) {
+    }
+
+    virtual void handleStreamData(const string& data) {
+        stream = data;
+        parser.feed(stream);
+    }
+
+    virtual bool handleMessage(const XMPPStanzaReader::Message& message) {
+        ++messages;
+        bytes += message.body.size;
+        return true;
+    }
+
+    BenchTagHandler tags;
+    Parser parser;
+    string stream;  // NOTE: gloox::Parser::feed() takes a non-const string, reused
+
+    uint64_t messages;
+    uint64_t bytes;
+};
+
+// the chunks of a capture file (XMPPClient::Config::capture_file)
+static bool g_load_capture(const char *path, vector<XMPPCapture::Chunk>& chunks)
+{
+    XMPPCapture capture;
+    if(!capture.open(path)) {
+        ::fprintf(stderr, "cannot open the capture %s\n", path);
+        return false;
+    }
+
+    XMPPCapture::Chunk chunk;
+    while(capture.read(chunk)) {
+        chunks.push_back(chunk);
+    }
+    return !chunks.empty();
+}
+
+// a recorded stream when there is none: one connection, BATCH_MESSAGES chat messages per chunk
+static void g_synthetic_capture(const BenchContext& context, vector<XMPPCapture::Chunk>& chunks)
+{
+    static const int BATCH_MESSAGES = 16;
+
+    const string domain = context.server->getDomain();
+
+    string body;
+    XMPPStanzaWriter::appendEscaped(body, g_message_body(0) +
+                                    " Let's meet at <noon> & \"bring\" the notes, it's a plain text body.");
+
+    XMPPCapture::Chunk chunk;
+    chunk.timestamp = 0;
+    chunk.flags = XMPPCapture::FLAG_CONNECT;
+    chunks.push_back(chunk);
+
+    chunk.flags = 0;
+    chunk.data = "<?xml version='1.0' ?><stream:stream xmlns='jabber:client' "
+        "xmlns:stream='http://etherx.jabber.org/streams' id='bench' from='" + domain + "' version='1.0'>";
+    chunks.push_back(chunk);
+
+    chunk.data.clear();
+    for(int i = 0; i < BATCH_MESSAGES; ++i) {
+        chunk.data += "<message from='alice@" + domain + "/bench' to='bob@" + domain + "/bench' "
+            "type='chat' id='uid:4f3a2b1c:00001234'><body>" + body + "</body>"
+            "<x xmlns='jabber:x:event'><offline/><delivered/><displayed/><composing/></x></message>";
+    }
+
+    for(int n = 0; n < context.messages; n += BATCH_MESSAGES) {
+        chunks.push_back(chunk);
+    }
+}
+
+// false for a chunk without data; a new connection or a stream restart
+// (after STARTTLS or SASL) starts over with a clean parser
+static bool g_restart_parser(Parser& parser, const XMPPCapture::Chunk& chunk)
+{
+    if(chunk.flags & XMPPCapture::FLAG_CONNECT) {
+        parser.cleanup();
+        return false;
+    }
+
+    if(chunk.data.find("<stream:stream") != string::npos) {
+        parser.cleanup();
+    }
+    return true;
+}
+
+// XMPPStanzaReader side of stanza_reader: passes over chunks, true if every stanza was read
+static bool g_read_chunks(const vector<XMPPCapture::Chunk>& chunks, int passes, uint64_t stanzas,
+                          XMPPArena *arena, size_t chunk_size, const string& prefix, BenchResult& result)
+{
+    BenchStanzaReader handler;
+    XMPPStanzaReader reader(&handler, &handler, arena);
+    handler.stream.reserve(chunk_size);
+
+    uint64_t allocations = g_allocations;
+    uint64_t start = XMPPClock::now();
+
+    for(int n = 0; n < passes; ++n) {
+        for(size_t i = 0; i < chunks.size(); ++i) {
+            if(!g_restart_parser(handler.parser, chunks[i])) {
+                reader.reset();
+                continue;
+            }
+            reader.feed(chunks[i].data);
+            if(arena) {
+                arena->reset();
+            }
+        }
+    }
+
+    uint64_t end = XMPPClock::now();
+    allocations = g_allocations - allocations;
+
+    result.add(prefix + "_ns", (end - start) / (double)stanzas);
+    result.add(prefix + "_allocations", allocations / (double)stanzas);
+    result.add(prefix + "_messages", (double)handler.messages);
+    return handler.tags.stanzas + handler.messages == stanzas;
+}
+
+// gloox parser (Tag tree) vs XMPPStanzaReader in front of it, without and with
+// an XMPPArena reset per chunk, on a capture file (-c) or a synthetic stream of chat messages;
+// ns and heap allocations per inbound stanza, the recording is repeated up to -n stanzas
+static void g_stanza_reader(BenchContext& context, BenchResult& result)
+{
+    vector<XMPPCapture::Chunk> chunks;
+    if(context.capture) {
+        if(!g_load_capture(context.capture, chunks)) {
+            return;
+        }
+    }
+    else {
+        g_synthetic_capture(context, chunks);
+    }
+
+    size_t chunk_size = 0;
+    for(size_t i = 0; i < chunks.size(); ++i) {
+        chunk_size = max(chunk_size, chunks[i].data.size());
+    }
+
+    // NOTE: gloox::Parser::feed() takes a non-const string, reuse one
+    string data;
+    data.reserve(chunk_size);
+
+    uint64_t stanzas = 0;
+    int passes = 0;
+
+    {
+        BenchTagHandler handler;
+        Parser parser(&handler);
+
+        uint64_t allocations = g_allocations;
+        uint64_t start = XMPPClock::now();
+
+        do {
+            for(size_t i = 0; i < chunks.size(); ++i) {
+                if(g_restart_parser(parser, chunks[i])) {
+                    data = chunks[i].data;
+                    parser.feed(data);
+                }
+            }
+            ++passes;
+        }
+        while(handler.stanzas > 0 && handler.stanzas < (uint64_t)context.messages);
+
+        uint64_t end = XMPPClock::now();
+        allocations = g_allocations - allocations;
+        stanzas = handler.stanzas;
+
+        if(stanzas == 0) {
+            return;
+        }
+
+        result.add("stanzas", (double)stanzas);
+        result.add("gloox_parser_ns", (end - start) / (double)stanzas);
+        result.add("gloox_parser_allocations", allocations / (double)stanzas);
+    }
+
+    // before and after the arena: unescaped text from the heap, then from an arena reset per chunk
+    bool is_read = g_read_chunks(chunks, passes, stanzas, 0, chunk_size, "reader_heap", result);
+
+    XMPPArena arena;
+    is_read = g_read_chunks(chunks, passes, stanzas, &arena, chunk_size, "reader_arena", result) && is_read;
+
+    result.add("reader_arena_blocks", (double)arena.getBlockAllocations());
+    result.success = is_read;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(BenchContext& context, BenchResult& result);
+} g_scenarios[] = {
+    {"chat_throughput", g_chat_throughput},
+    {"chat_latency",    g_chat_latency},
+    {"chat_events",     g_chat_events},
+    {"room_join",       g_room_join},
+    {"offline_burst",   g_offline_burst},
+    {"chat_fanout",     g_chat_fanout},
+    {"chat_transport",  g_chat_transport},
+    {"stanza_writer",   g_stanza_writer},
+    {"stanza_reader",   g_stanza_reader},
+    {"session_churn",   g_session_churn},
+    {"standby_takeover", g_standby_takeover}
+};
+
+static const size_t SCENARIOS = sizeof(g_scenarios) / sizeof(g_scenarios[0]);
+
+static void g_write_json(FILE *stream, const BenchContext& context, const vector<BenchResult>& results)
+{
+    ::fprintf(stream, "{\n  \"benchmark\": \"SnapzChatBench\",\n  \"timestamp\": %ld,\n"
+              "  \"messages\": %d,\n  \"rooms\": %d,\n  \"results\": [\n",
+              (long)::time(0), context.messages, context.rooms);
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+
+        ::fprintf(stream, "    {\"scenario\": \"%s\", \"success\": %s",
+                  result.scenario.c_str(), result.success ? "true" : "false");
+
+        vector<pair<string, double> >::const_iterator it;
+        for(it = result.values.begin(); it != result.values.end(); ++it) {
+            ::fprintf(stream, ", \"%s\": %.3f", it->first.c_str(), it->second);
+        }
+
+        ::fprintf(stream, "}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+
+    ::fprintf(stream, "  ]\n}\n");
+}
+
+static void g_usage(const char *name)
+{
+    ::fprintf(stderr, "usage: %s [-n messages] [-r rooms] [-t timeout seconds] [-o output.json] [-c capture]\n"
+              "       [scenario ...]\n"
+              "scenarios:", name);
+    for(size_t i = 0; i < SCENARIOS; ++i) {
+        ::fprintf(stderr, " %s", g_scenarios[i].name);
+    }
+    ::fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchContext context;
+    context.messages = 10000;
+    context.rooms = 100;
+    context.timeout = 60000;
+    context.capture = 0;
+
+    const char *output = 0;
+
+    int option;
+    while((option = ::getopt(argc, argv, "n:r:t:o:c:h")) != -1) {
+        switch(option) {
+        case 'n':
+            context.messages = ::atoi(optarg);
+            break;
+        case 'r':
+            context.rooms = ::atoi(optarg);
+            break;
+        case 't':
+            context.timeout = ::atoi(optarg) * 1000;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            context.capture = optarg;
+            break;
+        default:
+            g_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    vector<size_t> selected;
+    for(int i = optind; i < argc; ++i) {
+        size_t index = 0;
+        while(index < SCENARIOS && ::strcmp(argv[i], g_scenarios[index].name) != 0) {
+            ++index;
+        }
+        if(index == SCENARIOS) {
+            g_usage(argv[0]);
+            return 2;
+        }
+        selected.push_back(index);
+    }
+    if(selected.empty()) {
+        for(size_t i = 0; i < SCENARIOS; ++i) {
+            selected.push_back(i);
+        }
+    }
+
+    BenchServer server("bench.local");
+    if(!server.start()) {
+        ::fprintf(stderr, "cannot start the server\n");
+        return 1;
+    }
+    context.server = &server;
+
+    context.alice = g_connect_client(server, "alice");
+    context.bob = g_connect_client(server, "bob");
+    if(!context.alice || !context.bob) {
+        ::fprintf(stderr, "cannot connect the clients to 127.0.0.1:%d\n", server.getPort());
+        delete context.alice;
+        delete context.bob;
+        return 1;
+    }
+
+    vector<BenchResult> results;
+    bool success = true;
+
+    for(size_t i = 0; i < selected.size(); ++i) {
+        results.push_back(BenchResult(g_scenarios[selected[i]].name));
+        g_scenarios[selected[i]].run(context, results.back());
+        success = success && results.back().success;
+    }
+
+    delete context.alice;
+    delete context.bob;
+    server.stop();
+
+    FILE *stream = output ? ::fopen(output, "w") : stdout;
+    if(!stream) {
+        ::perror(output);
+        return 1;
+    }
+
+    g_write_json(stream, context, results);
+
+    if(stream != stdout) {
+        ::fclose(stream);
+    }
+
+    return success ? 0 : 1;
+}
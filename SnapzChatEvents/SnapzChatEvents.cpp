@@ -0,0 +1,144 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+// Prints the events a client publishes with XMPPClient::Config::event_bridge,
+// one line per event, until the client closes the bridge.
+//
+// Linux build (gloox is not needed), from the top directory:
+//   make events
+//
+// Usage: snapzchatevents [-q] [-w wait] <shared memory name>
+//   -q  quiet, counts the events instead of printing them
+//   -w  seconds to wait for the client to create the bridge (default 10)
+
+#include "XMPPEventBridge.hpp"
+#include "XMPPClock.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+static const char* g_type_string(XMPPEventBridge::Type type)
+{
+    switch(type) {
+    case XMPPEventBridge::TYPE_CONNECT:
+        return "connect";
+    case XMPPEventBridge::TYPE_DISCONNECT:
+        return "disconnect";
+    case XMPPEventBridge::TYPE_CHAT_MESSAGE:
+        return "chat_message";
+    case XMPPEventBridge::TYPE_CHAT_COMPOSING:
+        return "chat_composing";
+    case XMPPEventBridge::TYPE_CHAT_DELIVERED:
+        return "chat_delivered";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_MESSAGE:
+        return "group_chat_message";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_SUBJECT:
+        return "group_chat_subject";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_USER_PRESENCE:
+        return "group_chat_user_presence";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_INVITE:
+        return "group_chat_invite";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_INVITE_DECLINE:
+        return "group_chat_invite_decline";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_CREATE:
+        return "group_chat_create";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_DESTROY:
+        return "group_chat_destroy";
+    case XMPPEventBridge::TYPE_GROUP_CHAT_ERROR:
+        return "group_chat_error";
+    default:
+        return "unknown";
+    }
+}
+
+static void g_print(const XMPPEventBridge::Event& event)
+{
+    uint64_t delay = XMPPClock::now() - event.timestamp;
+
+    ::printf("%s value=%d flags=%d delay_us=%.1f", g_type_string(event.type),
+             event.value, event.flags, delay / 1000.0);
+
+    for(size_t i = 0; i < event.fields; ++i) {
+        ::printf(" '%.*s'", (int)event.size[i], event.data[i]);
+    }
+    ::printf("\n");
+}
+
+static void g_usage(const char *name)
+{
+    ::fprintf(stderr, "usage: %s [-q] [-w wait seconds] <shared memory name>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    bool quiet = false;
+    int wait = 10;
+
+    int option;
+    while((option = ::getopt(argc, argv, "qw:h")) != -1) {
+        switch(option) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'w':
+            wait = ::atoi(optarg);
+            break;
+        default:
+            g_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if(optind + 1 != argc) {
+        g_usage(argv[0]);
+        return 2;
+    }
+    const char *name = argv[optind];
+
+    XMPPEventBridge bridge;
+
+    uint64_t deadline = XMPPClock::nowMilliseconds() + wait * 1000ULL;
+    while(!bridge.open(name)) {
+        if(XMPPClock::nowMilliseconds() > deadline) {
+            ::perror(name);
+            return 1;
+        }
+        ::usleep(100000);
+    }
+
+    uint64_t events = 0;
+    uint64_t start = XMPPClock::now();
+
+    XMPPEventBridge::Event event;
+    for(;;) {
+        while(bridge.read(event)) {
+            ++events;
+            if(!quiet) {
+                g_print(event);
+            }
+        }
+
+        if(bridge.isClosed()) {
+            break;
+        }
+
+        // NOTE: stdout may be a pipe, flushed while idle only
+        ::fflush(stdout);
+        bridge.wait(1000);
+    }
+
+    // NOTE: closed between the last read() and isClosed()
+    while(bridge.read(event)) {
+        ++events;
+        if(!quiet) {
+            g_print(event);
+        }
+    }
+
+    ::fprintf(stderr, "%llu events in %.3f seconds, %llu dropped by the client\n",
+              (unsigned long long)events, (XMPPClock::now() - start) / 1e9,
+              (unsigned long long)bridge.getDropped());
+
+    return 0;
+}
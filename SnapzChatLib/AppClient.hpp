@@ -27,8 +27,9 @@ public:
 
     // NOTE: ALL METHODS MUST BE CALLED FROM THE SAME OWNER THREAD THAT CREATES/CONNECTS THIS CLIENT
 public:
+    /// server: "hostname[:port][,hostname[:port]...]", standby: Config::endpoint_standby with several of them
     static bool Connect(const string& jid, const string& passwd,
-                        const string& server = DEFAULT_SERVER_NAME);
+                        const string& server = DEFAULT_SERVER_NAME, bool standby = false);
     static bool Disconnect();
 
     static AppClient* GetInstance() {
@@ -1,6 +1,7 @@
 //// -*- mode: C++; coding: utf-8; -*-
 
 #include "AppClient.hpp"
+#include "XMPPTrace.hpp"
 
 #include <gloox/client.h>
 
@@ -15,6 +16,12 @@ const string AppClient::DEFAULT_JID          = "user1@jabber.snapz.mobi";
 const string AppClient::DEFAULT_SERVER_NAME  = "jabber.snapz.mobi";
 const int    AppClient::DEFAULT_SERVER_PORT  = 5222;
 
+// NSString of str, owned by the caller (no autoreleased temporary)
+static NSString* g_string(const string& str)
+{
+    return [[NSString alloc] initWithBytes:str.data() length:str.size() encoding:NSUTF8StringEncoding];
+}
+
 //// !!!WARNING!!! NEVER BLOCK IN ANY OF THE HANDLERS BELOW
 
 #ifdef _DEBUG
@@ -138,43 +145,35 @@ void AppClient::onDisconnect(ConnectionError error)
 void AppClient::onChatMessage(const string& user, const string& resource,
                               const string& message, const string& subject, const char *timestamp)
 {
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_APP_CHAT_MESSAGE,
+               user.c_str(), resource.c_str(), message.size(), (timestamp != 0));
 
-//#ifdef _DEBUG
-    ::fprintf(stderr, "##### AppClient::onChatMessage(): "
-            "user='%s' resource='%s' timestamp='%s' subject='%s' body='%s'\n",
-            user.c_str(), resource.c_str(),
-            (timestamp ? timestamp : "n/a"),
-            subject.c_str(), message.c_str());
-    
     // send 'DELIVERED' notification
-    if(XMPPClient::sendChatMessageDelivered(user)) {
-        ::fprintf(stderr, "##### AppClient::onChatMessage(): "
-                  "send 'DELIVERED' notification to user='%s'\n", user.c_str());
-    }
-    else {
-        ::fprintf(stderr, "##### AppClient::onChatMessage(): "
-                "FAILED to send 'DELIVERED' notification to user='%s'\n", user.c_str());
+    bool delivered = XMPPClient::sendChatMessageDelivered(user);
+    XMPP_TRACE(delivered ? XMPPTrace::LEVEL_INFO : XMPPTrace::LEVEL_ERROR,
+               XMPPTrace::EVENT_APP_DELIVERED, user.c_str(), 0, delivered);
+
+    // NOTE: one copy per string, and the event loop thread has no pool of its own
+    @autoreleasepool {
+        NSString *fromUser        = g_string(user);
+        NSString *strResource     = g_string(resource);
+        NSString *msg             = g_string(message);
+        NSString *strSubject      = g_string(subject);
+        NSString *strTimestamp    = (timestamp ? [[NSString alloc] initWithUTF8String:timestamp] : @"n/a");
+        NSDictionary* itemDetails = [[NSDictionary alloc]
+                                     initWithObjectsAndKeys:
+                                     XMPPEventChatMessageReceived, XMPPClientEventKey,
+                                     fromUser,     @"User",
+                                     strResource,  @"Resource",
+                                     strSubject,   @"Subject",
+                                     msg,          @"Message",
+                                     strTimestamp, @"Timestamp",
+                                     nil];
+
+        [[NSNotificationCenter defaultCenter]
+         postNotificationName: XMPPClientNotification
+         object: nil userInfo:itemDetails];
     }
-
-//#endif // _DEBUG
-    NSString *fromUser        = [NSString stringWithUTF8String:user.c_str()];
-    NSString *strResource     = [NSString stringWithUTF8String:resource.c_str()];
-    NSString *msg             = [NSString stringWithUTF8String:message.c_str()];
-    NSString *strSubject      = [NSString stringWithUTF8String:subject.c_str()];
-    NSString *strTimestamp    = [NSString stringWithUTF8String:(timestamp ? timestamp : "n/a")];
-    NSDictionary* itemDetails = [[NSDictionary alloc]
-                                 initWithObjectsAndKeys:
-                                 [NSString stringWithFormat:@"%@", XMPPEventChatMessageReceived], XMPPClientEventKey,
-                                 [NSString stringWithFormat:@"%@", fromUser],     @"User",
-                                 [NSString stringWithFormat:@"%@", strResource],  @"Resource",
-                                 [NSString stringWithFormat:@"%@", strSubject],   @"Subject",
-                                 [NSString stringWithFormat:@"%@", msg],          @"Message",
-                                 [NSString stringWithFormat:@"%@", strTimestamp], @"Timestamp",
-                                 nil];
-    
-    [[NSNotificationCenter defaultCenter]
-     postNotificationName: XMPPClientNotification
-     object: nil userInfo:itemDetails];
 }
 
 //// called when 'COMPOSING' event is received
@@ -185,19 +184,21 @@ void AppClient::onChatMessageComposing(const string& user, const string& resourc
               "user='%s' resource='%s'\n", user.c_str(), resource.c_str());
 #endif // _DEBUG
     
-    NSString *msg  = [NSString stringWithUTF8String:resource.c_str()];
-    NSString *fromUser  = [NSString stringWithUTF8String:user.c_str()];
-    // NSString *receivedTime      = [NSString stringWithUTF8String:timestamp];
-    NSDictionary* itemDetails = [[NSDictionary alloc]
-                                 initWithObjectsAndKeys:
-                                 [NSString stringWithFormat:@"%@", XMPPEventChatMessageComposing], XMPPClientEventKey,
-                                 [NSString stringWithFormat:@"%@", fromUser], @"User",
-                                 [NSString stringWithFormat:@"%@", msg],      @"Resource",
-                                 nil];
-    
-    [[NSNotificationCenter defaultCenter]
-     postNotificationName: XMPPClientNotification
-     object: nil userInfo:itemDetails];
+    @autoreleasepool {
+        NSString *msg  = g_string(resource);
+        NSString *fromUser  = g_string(user);
+        // NSString *receivedTime      = [NSString stringWithUTF8String:timestamp];
+        NSDictionary* itemDetails = [[NSDictionary alloc]
+                                     initWithObjectsAndKeys:
+                                     XMPPEventChatMessageComposing, XMPPClientEventKey,
+                                     fromUser, @"User",
+                                     msg,      @"Resource",
+                                     nil];
+
+        [[NSNotificationCenter defaultCenter]
+         postNotificationName: XMPPClientNotification
+         object: nil userInfo:itemDetails];
+    }
 }
 
 //// called when 'DELIVERED' event is received
@@ -208,19 +209,21 @@ void AppClient::onChatMessageDelivered(const string& user, const string& resourc
               "user='%s' resource='%s'\n", user.c_str(), resource.c_str());
 #endif // _DEBUG
     
-    NSString *msg  = [NSString stringWithUTF8String:resource.c_str()];
-    NSString *fromUser  = [NSString stringWithUTF8String:user.c_str()];
-    // NSString *receivedTime      = [NSString stringWithUTF8String:timestamp];
-    NSDictionary* itemDetails = [[NSDictionary alloc]
-                                 initWithObjectsAndKeys:
-                                 [NSString stringWithFormat:@"%@", XMPPEventChatMessageDelivered], XMPPClientEventKey,
-                                 [NSString stringWithFormat:@"%@", fromUser], @"User",
-                                 [NSString stringWithFormat:@"%@", msg],      @"Resource",
-                                 nil];
-    
-    [[NSNotificationCenter defaultCenter]
-     postNotificationName: XMPPClientNotification
-     object: nil userInfo:itemDetails];
+    @autoreleasepool {
+        NSString *msg  = g_string(resource);
+        NSString *fromUser  = g_string(user);
+        // NSString *receivedTime      = [NSString stringWithUTF8String:timestamp];
+        NSDictionary* itemDetails = [[NSDictionary alloc]
+                                     initWithObjectsAndKeys:
+                                     XMPPEventChatMessageDelivered, XMPPClientEventKey,
+                                     fromUser, @"User",
+                                     msg,      @"Resource",
+                                     nil];
+
+        [[NSNotificationCenter defaultCenter]
+         postNotificationName: XMPPClientNotification
+         object: nil userInfo:itemDetails];
+    }
 }
 
 //// called when a new group is being created
@@ -462,7 +465,7 @@ static vector<string> g_string_split(const string& str_, char delimiter)
     return result;
 }
 
-static bool g_update_configuration(XMPPClient::Config *config, const string& server)
+static bool g_update_configuration(XMPPClient::Config *config, const string& server, bool standby)
 {
     // setup root CA certificate
     config->ca_certs.push_back(ROOT_CA_CERTIFICATE_NAME);
@@ -473,14 +476,22 @@ static bool g_update_configuration(XMPPClient::Config *config, const string& ser
         config->server = AppClient::DEFAULT_SERVER_NAME;
         config->port = AppClient::DEFAULT_SERVER_PORT;
 
-        // parse 'hostname[:port]' form
-        vector<string> hostname_port = g_string_split(server, ':');
+        // parse 'hostname[:port][,hostname[:port]...]' form, the first one names the server
+        vector<string> endpoints = g_string_split(server, ',');
+
+        vector<string> hostname_port = g_string_split(endpoints[0], ':');
         if(!hostname_port.empty()) {
             config->server = hostname_port[0];
             if(hostname_port.size() > 1) {
                 config->port = ::atoi(hostname_port[1].c_str());
             }
         }
+
+        // NOTE: the fastest healthy one is connected to, a standby makes failover quicker at some battery cost
+        if(endpoints.size() > 1) {
+            config->endpoints.assign(endpoints.begin(), endpoints.end());
+            config->endpoint_standby = standby;
+        }
     }
 
     return true;
@@ -504,7 +515,7 @@ XMPPClient::Config AppClient::config;
 
 bool AppClient::is_suspended = false;
 
-bool AppClient::Connect(const string& jid, const string& passwd, const string& server)
+bool AppClient::Connect(const string& jid, const string& passwd, const string& server, bool standby)
 {
     NSLog(@"AppClient::Connect");
     
@@ -513,7 +524,7 @@ bool AppClient::Connect(const string& jid, const string& passwd, const string& s
             config = Config(jid, passwd);
             is_suspended = false;
 
-            if(g_update_configuration(&config, server)) {
+            if(g_update_configuration(&config, server, standby)) {
                 app_client = new AppClient(config);
 
                 if(!app_client->connect()) {
@@ -548,8 +559,8 @@ bool AppClient::Suspend()
 {
     if(!is_suspended) {
         if(app_client != 0) {
-            delete app_client;
-            app_client = 0;
+            // NOTE: stays connected, the server holds back what is not urgent (XEP-0352)
+            app_client->setInactive(true);
 
             is_suspended = true;
             return true;
@@ -562,9 +573,19 @@ bool AppClient::Suspend()
 bool AppClient::Resume()
 {
     if(is_suspended) {
-        assert(app_client == 0);
         is_suspended = false;
 
+        if(app_client != 0) {
+            if(app_client->isConnected()) {
+                app_client->setInactive(false);
+                return true;
+            }
+
+            // the connection was lost in the background
+            delete app_client;
+            app_client = 0;
+        }
+
         try {
             app_client = new AppClient(config);
 
@@ -130,7 +130,7 @@ static SnapzChatLib *chatClient;
 }
 
 +(void) resume {
-    AppClient::Suspend();
+    AppClient::Resume();
 }
 
 -(BOOL) sendChatMessage:(NSString*)user
@@ -0,0 +1,106 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPArena.hpp"
+
+#include <new>
+#include <cstdlib>
+#include <cstring>
+
+// alignment of every allocation, enough for any scalar type
+static const size_t ALIGNMENT = 16;
+
+static inline size_t g_align(size_t size)
+{
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+XMPPArena::XMPPArena()
+    : blocks(0), current(0), offset(0), large(0),
+      used(0), block_allocations(0)
+{
+}
+
+XMPPArena::~XMPPArena()
+{
+    reset();
+
+    while(blocks) {
+        Block *next = blocks->next;
+        ::free(blocks);
+        blocks = next;
+    }
+}
+
+char* XMPPArena::getData(Block *block)
+{
+    return reinterpret_cast<char*>(block) + g_align(sizeof(Block));
+}
+
+XMPPArena::Block* XMPPArena::newBlock(size_t size)
+{
+    Block *block = static_cast<Block*>(::malloc(g_align(sizeof(Block)) + size));
+    if(!block) {
+        throw std::bad_alloc();
+    }
+
+    block->next = 0;
+    block->size = size;
+    ++block_allocations;
+
+    return block;
+}
+
+void* XMPPArena::allocate(size_t size)
+{
+    size = g_align(size ? size : 1);
+    used += size;
+
+    // NOTE: big ones would waste most of a shared block
+    if(size > BLOCK_SIZE / 4) {
+        Block *block = newBlock(size);
+        block->next = large;
+        large = block;
+        return getData(block);
+    }
+
+    if(!current) {
+        if(!blocks) {
+            blocks = newBlock(BLOCK_SIZE);
+        }
+        current = blocks;
+        offset = 0;
+    }
+
+    if(offset + size > current->size) {
+        if(!current->next) {
+            current->next = newBlock(BLOCK_SIZE);
+        }
+        current = current->next;
+        offset = 0;
+    }
+
+    void *data = getData(current) + offset;
+    offset += size;
+    return data;
+}
+
+char* XMPPArena::copy(const char *data, size_t size)
+{
+    char *result = static_cast<char*>(allocate(size + 1));
+    ::memcpy(result, data, size);
+    result[size] = '\0';
+    return result;
+}
+
+void XMPPArena::reset()
+{
+    while(large) {
+        Block *next = large->next;
+        ::free(large);
+        large = next;
+    }
+
+    current = blocks;
+    offset = 0;
+    used = 0;
+}
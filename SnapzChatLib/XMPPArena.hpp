@@ -0,0 +1,69 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_ARENA_INCLUDED
+#define XMPP_ARENA_INCLUDED
+
+#include <cstddef>
+#include <stdint.h>
+
+// Monotonic allocator for the temporaries of one recv() batch: allocate()
+// bumps a pointer, nothing is freed until reset() releases everything at once.
+// The blocks are kept across reset(), so a steady stream of batches does not
+// touch the heap at all.
+// NOTE: not thread safe, owned by the thread dispatching the batch
+class XMPPArena
+{
+public:
+    static const size_t BLOCK_SIZE = 16384;  // bytes, larger allocations get their own block
+
+public:
+    explicit XMPPArena();
+
+    ~XMPPArena();
+
+    /// uninitialized memory aligned for any type, valid until reset()
+    void* allocate(size_t size);
+
+    /// NUL-terminated copy of data, valid until reset()
+    char* copy(const char *data, size_t size);
+
+    /// releases everything allocated since the last reset()
+    void reset();
+
+    /// bytes handed out since the last reset()
+    size_t getUsed() const {
+        return used;
+    }
+
+    /// blocks allocated from the heap since construction
+    uint64_t getBlockAllocations() const {
+        return block_allocations;
+    }
+
+private:
+    struct Block
+    {
+        Block *next;
+        size_t size;  // usable bytes after the header
+    };
+
+    Block* newBlock(size_t size);
+
+    /// usable memory of block
+    static char* getData(Block *block);
+
+private:
+    Block *blocks;     // kept across reset(), BLOCK_SIZE each
+    Block *current;    // block being filled, 0 before the first allocate()
+    size_t offset;     // next free byte in current
+    Block *large;      // oversized allocations, freed by reset()
+
+    size_t used;
+    uint64_t block_allocations;
+
+private:
+    XMPPArena(const XMPPArena&);
+    const XMPPArena& operator=(const XMPPArena&);
+};
+
+#endif // XMPP_ARENA_INCLUDED
@@ -0,0 +1,105 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPCapture.hpp"
+#include "XMPPClock.hpp"
+
+#include <cstring>
+
+static const char MAGIC[] = "XMPPCAP1";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+XMPPCapture::XMPPCapture()
+    : file(0), start(0)
+{
+}
+
+XMPPCapture::~XMPPCapture()
+{
+    close();
+}
+
+bool XMPPCapture::create(const string& path)
+{
+    close();
+
+    file = ::fopen(path.c_str(), "wb");
+    if(!file) {
+        return false;
+    }
+
+    if(::fwrite(MAGIC, 1, MAGIC_SIZE, file) != MAGIC_SIZE) {
+        close();
+        return false;
+    }
+
+    start = XMPPClock::now();
+    return true;
+}
+
+bool XMPPCapture::open(const string& path)
+{
+    close();
+
+    file = ::fopen(path.c_str(), "rb");
+    if(!file) {
+        return false;
+    }
+
+    char magic[MAGIC_SIZE];
+    if(::fread(magic, 1, MAGIC_SIZE, file) != MAGIC_SIZE || ::memcmp(magic, MAGIC, MAGIC_SIZE) != 0) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void XMPPCapture::close()
+{
+    if(file) {
+        ::fclose(file);
+        file = 0;
+    }
+}
+
+bool XMPPCapture::write(uint32_t flags, const string& data)
+{
+    if(!file) {
+        return false;
+    }
+
+    uint64_t timestamp = XMPPClock::now() - start;
+    uint32_t size = (uint32_t)data.size();
+
+    bool success =
+        ::fwrite(&timestamp, sizeof(timestamp), 1, file) == 1 &&
+        ::fwrite(&flags, sizeof(flags), 1, file) == 1 &&
+        ::fwrite(&size, sizeof(size), 1, file) == 1 &&
+        (size == 0 || ::fwrite(data.data(), size, 1, file) == 1);
+
+    // NOTE: keep the file readable if the process dies
+    ::fflush(file);
+
+    return success;
+}
+
+bool XMPPCapture::read(Chunk& chunk)
+{
+    if(!file) {
+        return false;
+    }
+
+    uint32_t size;
+    if(::fread(&chunk.timestamp, sizeof(chunk.timestamp), 1, file) != 1 ||
+       ::fread(&chunk.flags, sizeof(chunk.flags), 1, file) != 1 ||
+       ::fread(&size, sizeof(size), 1, file) != 1) {
+        return false;
+    }
+
+    chunk.data.resize(size);
+    if(size > 0 && ::fread(&chunk.data[0], size, 1, file) != 1) {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,59 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_CAPTURE_INCLUDED
+#define XMPP_CAPTURE_INCLUDED
+
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+
+using namespace std;
+
+// Recording of the inbound XML stream as handed to the parser (after TLS),
+// a sequence of timestamped chunks:
+//   "XMPPCAP1" then per chunk: uint64 timestamp, uint32 flags, uint32 size, data
+// NOTE: integers are written in host byte order
+class XMPPCapture
+{
+public:
+    enum Flags {
+        FLAG_CONNECT   = 0x01,  // a new connection starts, no data
+        FLAG_ENCRYPTED = 0x02,  // received over TLS
+        FLAG_COMPRESSED = 0x04  // received compressed
+    };
+
+    struct Chunk
+    {
+        uint64_t timestamp;  // nanoseconds since the capture was created
+        uint32_t flags;
+        string data;
+    };
+
+public:
+    explicit XMPPCapture();
+
+    ~XMPPCapture();
+
+    /// creates (truncates) a capture file for write()
+    bool create(const string& path);
+
+    /// opens a capture file for read()
+    bool open(const string& path);
+
+    void close();
+
+    bool write(uint32_t flags, const string& data);
+
+    /// false at the end of the file or on a truncated chunk
+    bool read(Chunk& chunk);
+
+private:
+    FILE *file;
+    uint64_t start;
+
+private:
+    XMPPCapture(const XMPPCapture&);
+    const XMPPCapture& operator=(const XMPPCapture&);
+};
+
+#endif // XMPP_CAPTURE_INCLUDED
@@ -1,6 +1,16 @@
 //// -*- mode: C++; coding: utf-8; -*-
 
 #include "XMPPClient.hpp"
+#include "XMPPTrace.hpp"
+#include "XMPPCapture.hpp"
+#include "XMPPStanzaWriter.hpp"
+#include "XMPPStanzaReader.hpp"
+#include "XMPPArena.hpp"
+#include "XMPPPool.hpp"
+#include "XMPPDiscoCache.hpp"
+#include "XMPPEndpoints.hpp"
+#include "XMPPUringConnection.hpp"
+#include "XMPPEventBridge.hpp"
 
 #include <gloox/error.h>
 #include <gloox/client.h>
@@ -17,1423 +27,4990 @@
 #include <gloox/mucroomhandler.h>
 #include <gloox/mucroomconfighandler.h>
 #include <gloox/mucinvitationhandler.h>
+#include <gloox/dataform.h>
 #include <gloox/dataformitem.h>
 #include <gloox/mutex.h>
 #include <gloox/mutexguard.h>
+#include <gloox/statisticshandler.h>
+#include <gloox/util.h>
+#include <gloox/event.h>
+#include <gloox/eventhandler.h>
+#include <gloox/iq.h>
+#include <gloox/iqhandler.h>
+#include <gloox/stanzaextension.h>
+#include <gloox/tag.h>
+#include <gloox/connectiontcpbase.h>
+#include <gloox/connectiontcpclient.h>
 
 #include <iostream>
+#include <deque>
+#include <set>
 #include <cassert>
 #include <cstdio>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 
 #include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 using namespace gloox::util;
 
-class XMPPClient::ClientImpl :
-    public ConnectionListener
-#ifdef _DEBUG
-   ,public LogHandler
-#endif // _DEBUG
-{
-public:
-    explicit ClientImpl(XMPPClient *client, const Config& config);
+// sendChatMessageToMany() queue is checked at least this often (microseconds)
+static const int FANOUT_INTERVAL = 10000;
 
-    virtual ~ClientImpl();
+// busy socket is checked at least this often while the outbound scheduler has a backlog (microseconds)
+static const int SCHEDULER_INTERVAL = 10000;
 
-    XMPPClient* getClient() const {
-        return client;
-    }
+// a write taking longer waited for the socket, the next ones poll it first (microseconds)
+static const int SCHEDULER_WRITE_STALL = 1000;
 
-    gloox::Client* getXmpp() const {
-        return xmpp;
-    }
+// an io_uring connection holding more unsent data is busy, as a full socket would be (bytes)
+static const size_t SCHEDULER_URING_BACKLOG = 65536;
 
-    ChatImpl* getChatImpl() const {
-        return chat_impl;
-    }
+// standby connection (Config::endpoint_standby) is checked and reopened this often (microseconds)
+static const int STANDBY_INTERVAL = 5000000;
 
-    GroupChatImpl* getGroupChatImpl() const {
-        return group_chat_impl;
-    }
+// jabber:x:event request added to sent messages, as MessageEventFilter::decorate() does
+static const int REQUESTED_MESSAGE_EVENTS =
+    MessageEventOffline | MessageEventDelivered | MessageEventDisplayed | MessageEventComposing;
 
-public:
-    // ConnectionListener
-    virtual void onConnect();
-    virtual void onDisconnect(ConnectionError error);
-    virtual bool onTLSConnect(const CertInfo& info);
+// XEP-0033 extended stanza addressing
+static const string MULTICAST_XMLNS = "http://jabber.org/protocol/address";
 
-#ifdef _DEBUG
-    // LogHandler
-    virtual void handleLog(LogLevel level, LogArea area, const string& message);
-#endif // _DEBUG
+// XEP-0352 client state indication, stream feature and nonzas
+static const string CSI_XMLNS = "urn:xmpp:csi:0";
+static const string CSI_ACTIVE = "<active xmlns='" + CSI_XMLNS + "'/>";
+static const string CSI_INACTIVE = "<inactive xmlns='" + CSI_XMLNS + "'/>";
 
-private:
-    XMPPClient *client;
-    gloox::Client *xmpp;
+// XEP-0115 entity capabilities, in the stream features for the server
+static const string CAPS_XMLNS = "http://jabber.org/protocol/caps";
 
-    ChatImpl *chat_impl;
-    GroupChatImpl *group_chat_impl;
+// XEP-0237 roster versioning stream feature
+static const string ROSTER_VERSIONING_XMLNS = "urn:xmpp:features:rosterver";
 
-private:
-    ClientImpl();
-    ClientImpl(const ClientImpl&);
-    const ClientImpl& operator=(const ClientImpl&);
-};
+// group chat presence reported at once while inactive, it changes what the application can do
+static const int UNHELD_PRESENCE_FLAGS = UserSelf | UserKicked | UserBanned | UserRoomDestroyed | UserRoomShutdown;
 
-struct XMPPClient::ChatSession
+// same as MutexGuard, but reports the time spent waiting for the lock
+class MetricsMutexGuard
 {
-    explicit ChatSession(ClientImpl *impl, MessageSession *message_session);
-    explicit ChatSession(ClientImpl *impl, const string& user, const string& resource = "");
-
-    virtual ~ChatSession();
+public:
+    explicit MetricsMutexGuard(Mutex& mutex_, XMPPMetrics& metrics, XMPPMetrics::Histogram histogram)
+        : mutex(mutex_)
+    {
+        if(mutex.trylock()) {
+            metrics.record(histogram, 0);
+        }
+        else {
+            uint64_t start = XMPPClock::now();
+            mutex.lock();
+            metrics.record(histogram, XMPPClock::now() - start);
+        }
+    }
 
-    string session_id;  // JID's username part
-    string resource;    // JID's resource part
-    MessageSession *session;
-    MessageEventFilter *message_event_filter;
+    ~MetricsMutexGuard() {
+        mutex.unlock();
+    }
 
 private:
-    ClientImpl *impl;
+    Mutex& mutex;
 
 private:
-    ChatSession();
-    ChatSession(const ChatSession&);
-    const ChatSession& operator=(const ChatSession&);
+    MetricsMutexGuard();
+    MetricsMutexGuard(const MetricsMutexGuard&);
+    const MetricsMutexGuard& operator=(const MetricsMutexGuard&);
 };
 
-class XMPPClient::ChatImpl :
-    public MessageSessionHandler,
-    public MessageHandler,
-    public MessageEventHandler
+// connection whose connect() goes on over a socket connected beforehand, the
+// standby connection of EndpointImpl: setSocket() would mark it connected, then
+// connect() returns at once and no stream header is ever sent
+template <class Connection>
+class AdoptedConnection : public Connection
 {
 public:
-    explicit ChatImpl(XMPPClient *client, ClientImpl *impl);
+    explicit AdoptedConnection(ConnectionDataHandler *handler, const LogSink& log_instance,
+                               const string& server, int port, int socket)
+        : Connection(handler, log_instance, server, port)
+    {
+        // NOTE: still disconnected, connect() skips the DNS and the TCP connect only
+        this->m_socket = socket;
+    }
 
-    virtual ~ChatImpl();
+private:
+    AdoptedConnection();
+    AdoptedConnection(const AdoptedConnection&);
+    const AdoptedConnection& operator=(const AdoptedConnection&);
+};
 
+// gloox::Client with hooks on the inbound stream
+class GlooxClient :
+    public gloox::Client,
+    public XMPPStanzaReader::DataHandler
+{
 public:
-    // MessageSessionHandler
-    virtual void handleMessageSession(MessageSession *session);
-
-    // MessageHandler
-    virtual void handleMessage(const Message& message, MessageSession *session);
-
-    // MessageEventHandler
-    virtual void handleMessageEvent(const JID& from, MessageEventType event);
+    explicit GlooxClient(const JID& jid, const string& password, int port)
+        : gloox::Client(jid, password, port),
+          reader(0), stage(STAGE_RECEIVED), connection(0), tls(0),
+          has_client_state(false), has_roster_versioning(false), is_io_uring(false)
+    {
+    }
 
-public:
-    bool sendChatMessage(const string& user, const string& message, const string& subject, const string& resource);
-    bool sendChatMessageComposing(const string& user, const string& resource);
-    bool sendChatMessageDelivered(const string& user, const string& resource);
+    virtual ~GlooxClient() {
+        delete reader;
+    }
 
-    void handlePrivateChatMessage(const string& user, const string& room, const Message& message);
+    /// records the inbound stream as seen by the parser (see XMPPCapture)
+    bool startCapture(const string& path) {
+        return capture.create(path);
+    }
 
-    void disposeChatSessions();
+    /// hands plain messages to handler before the gloox parser (see XMPPStanzaReader)
+    void setFastParser(XMPPStanzaReader::MessageHandler *handler, XMPPArena *arena) {
+        delete reader;
+        reader = new XMPPStanzaReader(this, handler, arena);
+    }
 
-private:
-    void handleChatSession(MessageSession *session);
-    void handleChatMessageEvent(const JID& from, MessageEventType event);
-    ChatSession* findChatSession(const string& id);
+    /// connections made by newConnection() go through io_uring (Config::io_uring)
+    void setIoUring(bool io_uring) {
+        is_io_uring = io_uring;
+    }
 
-private:
-    typedef map<string, ChatSession*> ChatSessions;
-    ChatSessions chat_sessions;
-    gloox::util::Mutex chat_sessions_lock;
+    /// TCP connection to server, for setConnectionImpl(); over socket, connected
+    /// already and in blocking mode, unless -1
+    ConnectionTCPClient* newConnection(const string& server, int port, int socket = -1) {
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+        if(is_io_uring) {
+            if(socket >= 0) {
+                return new AdoptedConnection<XMPPUringConnection>(this, logInstance(), server, port, socket);
+            }
+            return new XMPPUringConnection(this, logInstance(), server, port);
+        }
+#endif // XMPP_CLIENT_IO_URING_ENABLE
+        if(socket >= 0) {
+            return new AdoptedConnection<ConnectionTCPClient>(this, logInstance(), server, port, socket);
+        }
+        return new ConnectionTCPClient(this, logInstance(), server, port);
+    }
 
-private:
-    XMPPClient *client;
-    ClientImpl *impl;
+    /// sends already serialized XML, bypassing the Tag tree
+    void sendXml(const string& xml) {
+        send(xml);
+    }
 
-private:
-    ChatImpl();
-    ChatImpl(const ChatImpl&);
-    const ChatImpl& operator=(const ChatImpl&);
-};
+    /// closes the stream, onDisconnect() gets the reason instead of ConnUserDisconnected
+    void abortConnection(ConnectionError reason) {
+        gloox::ClientBase::disconnect(reason);
+    }
 
-struct XMPPClient::GroupChatSession
-{
-    explicit GroupChatSession(XMPPClient::ClientImpl *impl, const string& group);
+    /// true when the last stream features offered XEP-0352
+    bool hasClientState() const {
+        return has_client_state;
+    }
 
-    virtual ~GroupChatSession();
+    /// true when the last stream features offered XEP-0237
+    bool hasRosterVersioning() const {
+        return has_roster_versioning;
+    }
 
-    string session_id;  // group name
-    bool is_joined;
-    MUCRoom *room;
+    /// XEP-0115 "<node>#<ver>" of the server from the stream features, empty string if none
+    const string& getServerCaps() const {
+        return server_caps;
+    }
 
-    enum CreationState {CREATION_STATE_NONE, CREATION_STATE_PENDING, CREATION_STATE_COMPLETE};
-    CreationState creation_state;
+    /// descriptor of the TCP connection, -1 if there is none
+    int getSocket() const {
+        const ConnectionTCPBase *tcp = dynamic_cast<const ConnectionTCPBase*>(connectionImpl());
+        return tcp ? tcp->socket() : -1;
+    }
 
-private:
-    ClientImpl *impl;
+    /// bytes written to an XMPPUringConnection and not sent yet, 0 for other connections
+    size_t getQueuedBytes() const {
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+        if(is_io_uring) {
+            XMPPUringConnection *uring = dynamic_cast<XMPPUringConnection*>(connectionImpl());
+            if(uring) {
+                return uring->getQueuedBytes();
+            }
+        }
+#endif // XMPP_CLIENT_IO_URING_ENABLE
+        return 0;
+    }
 
-private:
-    GroupChatSession();
-    GroupChatSession(const GroupChatSession&);
-    const GroupChatSession& operator=(const GroupChatSession&);
-};
+    /// descriptor readable when the connection has something to receive, the
+    /// io_uring instance of an XMPPUringConnection, otherwise the TCP connection
+    int getPollSocket() const {
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+        const XMPPUringConnection *uring = dynamic_cast<const XMPPUringConnection*>(connectionImpl());
+        if(uring) {
+            return uring->getPollDescriptor();
+        }
+#endif // XMPP_CLIENT_IO_URING_ENABLE
+        return getSocket();
+    }
 
-class XMPPClient::GroupChatImpl :
-    public MUCRoomHandler,
-    public MUCInvitationHandler,
-    public MUCRoomConfigHandler
-{
 public:
-    explicit GroupChatImpl(XMPPClient *client, ClientImpl *impl);
-
-    virtual ~GroupChatImpl();
+    // ConnectionDataHandler
+    virtual void handleConnect(const ConnectionBase* connection) {
+        capture.write(XMPPCapture::FLAG_CONNECT, "");
+        if(reader) {
+            reader->reset();
+        }
+        has_client_state = false;
+        has_roster_versioning = false;
+        server_caps.clear();
+        gloox::Client::handleConnect(connection);
+    }
 
-public:
-    // MUCRoomHandler
-    virtual void handleMUCParticipantPresence(MUCRoom *room, const MUCRoomParticipant participant, const Presence& presence);
-    virtual void handleMUCMessage(MUCRoom *room, const Message& msg, bool priv);
-    virtual bool handleMUCRoomCreation(MUCRoom *room);
-    virtual void handleMUCSubject(MUCRoom *room, const string& nick, const string& subject);
-    virtual void handleMUCInviteDecline(MUCRoom *room, const JID& invitee, const string& reason);
-    virtual void handleMUCError(MUCRoom *room, StanzaError error);
-    virtual void handleMUCInfo(MUCRoom *room, int features, const string& name, const DataForm *infoForm);
-    virtual void handleMUCItems(MUCRoom *room, const Disco::ItemList& items);
+    virtual void handleReceivedData(const ConnectionBase* connection_, const string& data) {
+        if(!m_encryptionActive && !m_compressionActive) {
+            capture.write(0, data);
 
-    // MUCInvitationHandler
-    virtual void handleMUCInvitation(const JID& room, const JID& from, const string& reason,
-                                     const string& body, const string& password, bool cont, const string& thread);
+            if(reader) {
+                stage = STAGE_RECEIVED;
+                connection = connection_;
+                reader->feed(data);
+                return;
+            }
+        }
+        gloox::Client::handleReceivedData(connection_, data);
+    }
 
-    // MUCRoomConfigHandler
-    virtual void handleMUCConfigList(MUCRoom* room, const MUCListItemList& items, MUCOperation operation);
-    virtual void handleMUCConfigForm(MUCRoom* room, const DataForm& form);
-    virtual void handleMUCConfigResult(MUCRoom* room, bool success, MUCOperation operation);
-    virtual void handleMUCRequest(MUCRoom* room, const DataForm& form);
+    // TLSHandler
+    virtual void handleDecryptedData(const TLSBase* base, const string& data) {
+        if(!m_compressionActive) {
+            capture.write(XMPPCapture::FLAG_ENCRYPTED, data);
 
-public:
-#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
-    bool declineGroupChatInvitation(const string& group, const string& user, const string& reason);
-#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
+            if(reader) {
+                stage = STAGE_DECRYPTED;
+                tls = base;
+                reader->feed(data);
+                return;
+            }
+        }
+        gloox::Client::handleDecryptedData(base, data);
+    }
 
-    bool configureGroupChat(const string& group, const GroupChatConfig *config);
-    bool cancelGroupChatCreation(const string& group);
-    bool beginGroupChat(const string& group, const string& passwd,
-                       int history_messages, const string& history_since);
-    bool endGroupChat(const string& group, const string& reason);
-    bool destroyGroupChat(const string& group, const string& reason);
-    bool setGroupChatSubject(const string& group, const string& subject);
-    bool sendGroupChatMessage(const string& group, const string& message);
-    bool inviteToGroupChat(const string& group, const string& user, const string& reason);
-    bool kickFromGroupChat(const string& group, const string& user, const string& reason);
+    // CompressionDataHandler
+    virtual void handleDecompressedData(const string& data) {
+        uint32_t flags = XMPPCapture::FLAG_COMPRESSED;
+        if(m_encryptionActive) {
+            flags |= XMPPCapture::FLAG_ENCRYPTED;
+        }
+        capture.write(flags, data);
 
-#ifdef XMPP_CLIENT_BAN_ENABLE
-    bool banFromGroupChat(const string& group, const string& user, const string& reason);
-    bool unbanFromGroupChat(const string& group, const string& user);
-#endif // XMPP_CLIENT_BAN_ENABLE
+        if(reader) {
+            stage = STAGE_DECOMPRESSED;
+            reader->feed(data);
+            return;
+        }
+        gloox::Client::handleDecompressedData(data);
+    }
 
-    bool listGroupChatUsers(const string& group);
+    // TagHandler
+    virtual bool handleNormalNode(Tag *tag) {
+        // NOTE: gloox ignores the stream features it does not know
+        if(tag->name() == "features") {
+            has_client_state = tag->hasChild("csi", "xmlns", CSI_XMLNS);
+            has_roster_versioning = tag->hasChild("ver", "xmlns", ROSTER_VERSIONING_XMLNS);
+
+            // NOTE: kept from the first features when the next ones leave it out
+            const Tag *caps = tag->findChild("c", "xmlns", CAPS_XMLNS);
+            if(caps && !caps->findAttribute("ver").empty()) {
+                server_caps = caps->findAttribute("node") + "#" + caps->findAttribute("ver");
+            }
+        }
+        return gloox::Client::handleNormalNode(tag);
+    }
 
-    void disposeGroupChatSessions();
+    // XMPPStanzaReader::DataHandler
+    virtual void handleStreamData(const string& data) {
+        // NOTE: back to where the data came from, gloox only parses at the last stage
+        switch(stage) {
+        case STAGE_RECEIVED:
+            gloox::Client::handleReceivedData(connection, data);
+            break;
+        case STAGE_DECRYPTED:
+            gloox::Client::handleDecryptedData(tls, data);
+            break;
+        case STAGE_DECOMPRESSED:
+            gloox::Client::handleDecompressedData(data);
+            break;
+        }
+    }
 
 private:
-    GroupChatSession* findGroupChatSession(const string& id);
+    XMPPCapture capture;       // write() does nothing until startCapture()
+    XMPPStanzaReader *reader;  // 0 unless setFastParser()
 
-private:
-    typedef map<string, GroupChatSession*> GroupChatSessions;
-    GroupChatSessions chat_sessions;
-    gloox::util::Mutex chat_sessions_lock;
+    enum Stage {STAGE_RECEIVED, STAGE_DECRYPTED, STAGE_DECOMPRESSED};
+    Stage stage;               // handler feeding the reader
+    const ConnectionBase *connection;
+    const TLSBase *tls;
 
-    GroupChatConfig config;
+    bool has_client_state;     // reset for each stream
+    bool has_roster_versioning;
+    string server_caps;
 
-private:
-    XMPPClient *client;
-    ClientImpl *impl;
+    bool is_io_uring;
 
 private:
-    GroupChatImpl();
-    GroupChatImpl(const GroupChatImpl&);
-    const GroupChatImpl& operator=(const GroupChatImpl&);
+    GlooxClient();
+    GlooxClient(const GlooxClient&);
+    const GlooxClient& operator=(const GlooxClient&);
 };
 
-/// XMPPClient::ClientImpl
-XMPPClient::ClientImpl::ClientImpl(XMPPClient *client_, const Config& config)
-    : client(client_), xmpp(0),
-      chat_impl(0), group_chat_impl(0)
+// gloox helpers of the sessions taken from pools, gloox itself deletes
+// them through their virtual destructors, which returns them to the pools
+class PooledMessageSession :
+    public MessageSession,
+    public XMPPPooled<PooledMessageSession>
 {
-    xmpp = new gloox::Client(config.jid, config.passwd, config.port);
+public:
+    explicit PooledMessageSession(ClientBase *parent, const JID& jid, bool want_upgrade)
+        : MessageSession(parent, jid, want_upgrade)
+    {
+    }
+};
 
-    if(!config.server.empty()) {
-        xmpp->setServer(config.server);
+class PooledMessageEventFilter :
+    public MessageEventFilter,
+    public XMPPPooled<PooledMessageEventFilter>
+{
+public:
+    explicit PooledMessageEventFilter(MessageSession *parent)
+        : MessageEventFilter(parent)
+    {
     }
+};
 
-    xmpp->registerConnectionListener(this);
+class PooledMUCRoom :
+    public MUCRoom,
+    public XMPPPooled<PooledMUCRoom>
+{
+public:
+    explicit PooledMUCRoom(ClientBase *parent, const JID& nick, MUCRoomHandler *handler, MUCRoomConfigHandler *config_handler)
+        : MUCRoom(parent, nick, handler, config_handler)
+    {
+    }
 
-    int message_events = gloox::MessageEventDelivered | gloox::MessageEventComposing;
-    xmpp->registerStanzaExtension(new gloox::MessageEvent(message_events));
+    /// the room is left without writing anything, neither by leave() nor by the
+    /// destructor, returns the presence leave() would have sent, for SchedulerImpl
+    /// NOTE: the handlers are removed by the destructor, delete the room right after
+    Presence detach(const string& reason) {
+        m_joined = false;
+        return Presence(Presence::Unavailable, m_nick.full(), reason);
+    }
+};
 
-    xmpp->registerStanzaExtension(new gloox::DelayedDelivery());
+// jabber:iq:roster query, replaces the one gloox unregisters with its RosterManager:
+// the request carries the cached version, results and pushes carry items
+class RosterQuery : public StanzaExtension
+{
+public:
+    explicit RosterQuery(const Tag *tag = 0)
+        : StanzaExtension(ExtRoster), has_version(false)
+    {
+        if(!tag) {
+            return;
+        }
 
-    xmpp->disableRoster();
+        has_version = tag->hasAttribute("ver");
+        version = tag->findAttribute("ver");
 
-    // register single chat handler
-    try {
-        chat_impl = new ChatImpl(client, this);
-        xmpp->registerMessageSessionHandler(chat_impl, 0);
-    }
-    catch(...) {
-        delete xmpp;
-        throw;
-    }
+        const TagList& children = tag->children();
+        items.reserve(children.size());
 
-    // register group chat handler
-    try {
-        group_chat_impl = new GroupChatImpl(client, this);
-        xmpp->registerMUCInvitationHandler(group_chat_impl);
+        for(TagList::const_iterator it = children.begin(); it != children.end(); ++it) {
+            if((*it)->name() != "item") {
+                continue;
+            }
+
+            items.push_back(XMPPRoster::Item());
+            XMPPRoster::Item& item = items.back();
+
+            item.jid = JID((*it)->findAttribute("jid")).bare();
+            item.name = (*it)->findAttribute("name");
+            item.subscription = (*it)->findAttribute("subscription");
+            item.is_pending = (*it)->hasAttribute("ask", "subscribe");
+
+            const TagList& groups = (*it)->children();
+            for(TagList::const_iterator group = groups.begin(); group != groups.end(); ++group) {
+                if((*group)->name() == "group") {
+                    item.groups.push_back((*group)->cdata());
+                }
+            }
+        }
     }
-    catch(...) {
-        delete chat_impl;
-        delete xmpp;
-        throw;
+
+    /// request, the version is left out if the server does not support versioning
+    explicit RosterQuery(const string& version_, bool has_version_)
+        : StanzaExtension(ExtRoster), version(version_), has_version(has_version_)
+    {
     }
 
-    // set TLS policy for connection
-    xmpp->setTls(config.tls_policy);
+    virtual const string& filterString() const {
+        static const string filter = "/iq/query[@xmlns='" + XMLNS_ROSTER + "']";
+        return filter;
+    }
 
-    // set CA certs if provided
-    if(!config.ca_certs.empty()) {
-        xmpp->setCACerts(config.ca_certs);
+    virtual StanzaExtension* newInstance(const Tag *tag) const {
+        return new RosterQuery(tag);
     }
 
+    // NOTE: requests only, gloox drops empty attributes so an empty version is left out too
+    virtual Tag* tag() const {
+        Tag *query = new Tag("query", "xmlns", XMLNS_ROSTER);
+        if(has_version) {
+            query->addAttribute("ver", version);
+        }
+        return query;
+    }
+
+    virtual StanzaExtension* clone() const {
+        return new RosterQuery(*this);
+    }
+
+    string version;
+    bool has_version;
+    vector<XMPPRoster::Item> items;
+};
+
+// muc#admin or muc#owner query, sent by GroupChatImpl instead of MUCRoom which
+// keeps its iq ids to itself; a muc#owner result carries the room configuration form
+// NOTE: registered next to MUCRoom's own extensions, under the first user type
+class MUCQuery : public StanzaExtension
+{
+public:
+    explicit MUCQuery(const Tag *tag = 0)
+        : StanzaExtension(ExtUser), query(tag ? tag->clone() : 0)
+    {
+    }
+
+    /// request, the children are added to getQuery()
+    explicit MUCQuery(const string& xmlns)
+        : StanzaExtension(ExtUser), query(new Tag("query", "xmlns", xmlns))
+    {
+    }
+
+    MUCQuery(const MUCQuery& other)
+        : StanzaExtension(ExtUser), query(other.query ? other.query->clone() : 0)
+    {
+    }
+
+    virtual ~MUCQuery() {
+        delete query;
+    }
+
+    virtual const string& filterString() const {
+        static const string filter = "/iq/query[@xmlns='" + XMLNS_MUC_OWNER + "']";
+        return filter;
+    }
+
+    virtual StanzaExtension* newInstance(const Tag *tag) const {
+        return new MUCQuery(tag);
+    }
+
+    virtual Tag* tag() const {
+        return query ? query->clone() : 0;
+    }
+
+    virtual StanzaExtension* clone() const {
+        return new MUCQuery(*this);
+    }
+
+    Tag* getQuery() const {
+        return query;
+    }
+
+private:
+    Tag *query;
+
+private:
+    const MUCQuery& operator=(const MUCQuery&);
+};
+
+// session pools are shared by all clients of the process
+static void g_set_pool_gauges(XMPPMetrics& metrics)
+{
+    metrics.setGauge(XMPPMetrics::GAUGE_POOL_IN_USE, XMPPPool::getTotalInUse());
+    metrics.setGauge(XMPPMetrics::GAUGE_POOL_CAPACITY, XMPPPool::getTotalCapacity());
+}
+
+// muc#admin role or affiliation change of an occupant, by nick like MUCRoom does
+static MUCQuery* g_muc_item_query(const string& nick, const char *attribute, const char *value,
+                                  const string& reason)
+{
+    MUCQuery *query = new MUCQuery(XMLNS_MUC_ADMIN);
+
+    Tag *item = new Tag(query->getQuery(), "item", "nick", nick);
+    item->addAttribute(attribute, value);
+    if(!reason.empty()) {
+        new Tag(item, "reason", reason);
+    }
+
+    return query;
+}
+
+// muc#owner empty submitted form, accepts the default configuration of a new room
+static MUCQuery* g_instant_room_query()
+{
+    MUCQuery *query = new MUCQuery(XMLNS_MUC_OWNER);
+
+    Tag *form = new Tag(query->getQuery(), "x", "xmlns", XMLNS_X_DATA);
+    form->addAttribute("type", "submit");
+
+    return query;
+}
+
+// muc#owner query cancelling the creation of a room, as MUCRoom::cancelRoomCreation() sends it
+static MUCQuery* g_cancel_room_query()
+{
+    MUCQuery *query = new MUCQuery(XMLNS_MUC_OWNER);
+
+    Tag *form = new Tag(query->getQuery(), "x", "xmlns", XMLNS_X_DATA);
+    form->addAttribute("type", "cancel");
+
+    return query;
+}
+
+// serialized stanza, for SchedulerImpl
+static string g_stanza_xml(const Stanza& stanza)
+{
+    Tag *tag = stanza.tag();
+    const string xml = tag->xml();
+    delete tag;
+
+    return xml;
+}
+
+// Tracked messages waiting for a room reflection, an offline or delivered
+// event, or an error reply. jabber:x:event notifications read by gloox carry
+// no id, they are paired with the messages of the user in send order.
+// NOTE: thread safe, messages are sent from the owner thread and completed from the event loop
+class XMPPClient::DeliveryImpl
+{
+public:
+    explicit DeliveryImpl(XMPPClient *client);
+
+    /// starts tracking the message about to be sent with the stanza id,
+    /// to user for chat messages, empty string for group chat messages
+    MessageId track(const string& id, const string& user);
+
+    /// completes the message with the stanza id, false if it is not pending
+    bool complete(const string& id, MessageStatus status);
+
+    /// completes the oldest pending message sent to user, for events without an id
+    bool completeOldest(const string& user, MessageStatus status);
+
+    /// times out expired messages, returns microseconds until the next deadline, -1 if none
+    int expire();
+
+    /// completes all pending messages with MESSAGE_FAILED
+    void fail();
+
+private:
+    struct Pending
+    {
+        MessageId id;
+        string user;
+        uint64_t sent;         // XMPPClock::now()
+        uint64_t deadline;
+        bool is_acknowledged;  // chat message stored offline, kept until its receipt or deadline
+    };
+
+    typedef map<string, Pending> PendingMessages;
+
+    struct Completion
+    {
+        MessageId id;
+        MessageStatus status;
+        uint64_t latency;
+    };
+
+    // called with pending_lock held, false if there is nothing to notify
+    bool update(PendingMessages::iterator it, MessageStatus status, uint64_t now, Completion *completion);
+    void remove(PendingMessages::iterator it);
+
+    void notify(const Completion& completion);
+
+private:
+    PendingMessages pending_messages;
+
+    // stanza ids of the chat messages to each user in send order, the first
+    // one is always pending, the others may have completed already
+    typedef map<string, deque<string> > UserQueues;
+    UserQueues user_queues;
+
+    // stanza ids in send order, i.e. deadline order, may have completed already
+    deque<string> deadlines;
+
+    MessageId last_id;
+    gloox::util::Mutex pending_lock;
+
+    XMPPClient *client;
+
+private:
+    DeliveryImpl();
+    DeliveryImpl(const DeliveryImpl&);
+    const DeliveryImpl& operator=(const DeliveryImpl&);
+};
+
+// XEP-0199 pings sent after Config::ping_interval without inbound data. The
+// interval doubles after each ping answered in time, up to ping_interval_max,
+// and is reset when a ping goes unanswered for ping_timeout, the ping is then
+// sent again until dead_peer_timeout when the stream is closed with ConnIoError.
+// NOTE: not thread safe, only used by the event loop
+class XMPPClient::KeepaliveImpl :
+    public EventHandler
+{
+public:
+    explicit KeepaliveImpl(XMPPClient *client);
+
+    /// starts pinging the server of a new stream, sets the TCP keepalive options
+    void start(GlooxClient *xmpp);
+
+    /// no more pings until the next start()
+    void stop();
+
+    /// inbound data, the peer is alive
+    void received(uint64_t now);
+
+    /// sends the ping due, returns microseconds until the next check, -1 if none,
+    /// sets is_dead when the stream should be closed
+    int update(uint64_t now, bool *is_dead);
+
+public:
+    // EventHandler
+    virtual void handleEvent(const Event& event);
+
+private:
+    void ping(uint64_t now);
+
+    void setSocketOptions(int socket);
+
+private:
+    XMPPClient *client;
+    GlooxClient *xmpp;  // 0 when stopped
+
+    uint64_t interval;       // nanoseconds, between ping_interval and ping_interval_max
+    uint64_t last_received;  // XMPPClock::now() of the last inbound data
+    uint64_t last_ping;      // 0 once answered
+    uint64_t probe_start;    // first ping sent since last_received, 0 if none
+    int unanswered;          // pings timed out since last_received
+
+private:
+    KeepaliveImpl();
+    KeepaliveImpl(const KeepaliveImpl&);
+    const KeepaliveImpl& operator=(const KeepaliveImpl&);
+};
+
+// Config::endpoints: each connect() goes to the best endpoint that accepts it,
+// ranked by XMPPEndpoints from the round trip times of the connects of all
+// clients. With Config::endpoint_standby, a TCP connection to the next
+// best endpoint is kept open, a connect() picking that endpoint takes it over
+// and only negotiates the stream. receive() waits on its TCP handshake along
+// with the stream, for its connect time.
+// NOTE: event loop thread only
+class XMPPClient::EndpointImpl
+{
+public:
+    explicit EndpointImpl(XMPPClient *client, const Config& config);
+
+    /// closes the standby connection
+    ~EndpointImpl();
+
+    /// connects the stream as configured, to each endpoint in turn until one accepts it
+    bool connect(GlooxClient *xmpp);
+
+    /// ping answered on the current stream, nanoseconds
+    void pinged(uint64_t rtt);
+
+    /// the current stream is gone, an I/O error counts against its endpoint
+    void disconnected(ConnectionError error);
+
+    /// opens or checks the standby connection, returns microseconds until the next check, -1 if none
+    int update(uint64_t now);
+
+    /// standby connection while its TCP handshake is in progress, to wait on for
+    /// writing along with the stream; -1 if none
+    int getConnectingSocket() const {
+        return (standby_socket >= 0 && !is_standby_ready) ? standby_socket : -1;
+    }
+
+    /// the wait saw getConnectingSocket() writable, records the connect time
+    void connected(uint64_t now);
+
+private:
+    void openStandby();
+    void closeStandby();
+
+    /// true once the TCP connection is established and still open
+    bool isStandbyReady();
+
+private:
+    XMPPClient *client;
+
+    vector<XMPPEndpoints::Endpoint> endpoints;
+    int current;  // index in endpoints of the stream, -1 if none
+
+    int standby;             // index in endpoints of standby_socket
+    int standby_socket;      // non-blocking, -1 if none
+    bool is_standby_ready;   // the TCP handshake completed
+    uint64_t standby_start;  // XMPPClock::now() of the connect() of standby_socket
+    uint64_t standby_check;  // XMPPClock::now() of the next check
+
+private:
+    EndpointImpl();
+    EndpointImpl(const EndpointImpl&);
+    const EndpointImpl& operator=(const EndpointImpl&);
+};
+
+// Roster kept in memory, indexed by bare JID, and in Config::roster_cache. On
+// each stream the cached version is sent (XEP-0237), the server then answers
+// with an empty result and pushes the changes since that version, or with the
+// full roster if it does not know it. gloox's own RosterManager is disabled.
+// NOTE: thread safe, looked up from any thread and updated by the event loop
+class XMPPClient::RosterImpl :
+    public IqHandler
+{
+public:
+    explicit RosterImpl(XMPPClient *client);
+
+    /// loads the cache and takes roster queries over from gloox
+    void enable(GlooxClient *xmpp);
+
+    /// asks for the roster of a new stream, does nothing unless enabled
+    void request();
+
+    /// writes the cache if the roster changed since the last call
+    void save();
+
+    bool find(const string& jid, RosterItem *item);
+    size_t size();
+
+public:
+    // IqHandler
+    virtual bool handleIq(const IQ& iq);
+    virtual void handleIqID(const IQ& iq, int context);
+
+private:
+    // called with roster_lock held, the changes are reported by notify()
+    void update(const RosterItem& item);
+    void remove(const string& jid);
+
+    void notify();
+
+private:
+    XMPPClient *client;
+    GlooxClient *xmpp;  // 0 unless enabled
+
+    XMPPRoster roster;
+    bool is_dirty;      // changed since the last save()
+    gloox::util::Mutex roster_lock;
+
+    struct Change
+    {
+        RosterItem item;
+        bool removed;
+    };
+
+    typedef vector<Change> Changes;
+    Changes changes;    // event loop only
+
+private:
+    RosterImpl();
+    RosterImpl(const RosterImpl&);
+    const RosterImpl& operator=(const RosterImpl&);
+};
+
+// Stanzas serialized by the library, by priority class. A stanza is written at
+// once when nothing is queued, the socket takes it (only polled after a write
+// stalled or an io_uring connection fell behind), Config::send_rate_bytes and
+// send_rate_stanzas allow it and no other thread is writing, otherwise it waits
+// in its queue and the queues are drained by weighted fair queueing on stanza
+// sizes, so a chat message overtakes a backlog of receipts, chat states and
+// presence. A queued chat state is dropped when a newer stanza to the same user
+// is queued, a queued presence for a newer one with its key.
+// NOTE: thread safe, gloox writes its own stanzas (MUC presence, pings, iq results)
+// NOTE: directly, those that must not overtake the backlog go through callInOrder()
+class XMPPClient::SchedulerImpl
+{
+public:
+    enum Priority {
+        PRIORITY_CONTENT,     // chat and group chat messages
+        PRIORITY_RECEIPT,     // jabber:x:event other than composing
+        PRIORITY_CHAT_STATE,  // composing events
+        PRIORITY_PRESENCE,    // presence, client state and administration
+        PRIORITY_MAX
+    };
+
+    static const uint64_t WEIGHTS[PRIORITY_MAX];  // share of a congested link, content first
+    static const XMPPMetrics::Histogram HISTOGRAMS[PRIORITY_MAX];
+
+    explicit SchedulerImpl(XMPPClient *client, ClientImpl *impl);
+
+    /// writes or queues the stanza, key is the user or presence it supersedes, may be empty
+    void send(Priority priority, const string& key, const string& xml);
+
+    /// as send(), queued behind all the stanzas queued so far whatever their priority:
+    /// leaving or administering a room, its subject, after the messages sent to it
+    void sendInOrder(Priority priority, const string& xml);
+
+    /// as sendInOrder() for a stanza of about size bytes written by gloox, an iq
+    /// it tracks the result of: function(data) writes it when its turn comes;
+    /// NOTE: it runs for a lost stream too, gloox then writes nothing
+    void callInOrder(Priority priority, size_t size, PostedFunction function, void *data);
+
+    /// writes what the socket and the rates allow, returns microseconds until
+    /// it should be called again, -1 if nothing is queued
+    int flush();
+
+    /// drops the stanzas queued for a lost stream
+    void discard();
+
+    /// see XMPPClient::getSendQueueDelay()
+    uint64_t getQueueDelay();
+
+private:
+    struct Item
+    {
+        string key;
+        string xml;
+        size_t size;                // of xml, or of what function writes
+        PostedFunction function;    // writes the stanza instead of xml if not 0
+        void *data;
+        uint64_t queued;  // XMPPClock::now()
+        uint64_t finish;  // virtual finish time
+    };
+
+    typedef deque<Item> Queue;
+
+    void submit(Priority priority, const string& key, const string& xml, size_t size,
+                PostedFunction function, void *data, bool is_ordered);
+
+    // called with queue_lock held, an ordered item goes after all those queued
+    Item& push(Priority priority, const string& key, const string& xml, size_t size, bool is_ordered);
+    int next() const;  // queue written from next, -1 if all are empty
+    void pop(int priority, Item *item);
+    void supersede(Priority priority, const string& key);
+
+    // token buckets, called with queue_lock held
+    void refill(uint64_t now);
+    bool take(size_t size);
+    int getTokenWait(size_t size) const;  // microseconds until take() succeeds
+
+    // called with drain_lock held
+    void drain();
+    void write(const string& xml, PostedFunction function = 0, void *data = 0);
+
+    bool hasQueued();
+    bool isWritable();  // clears is_congested
+
+private:
+    Queue queues[PRIORITY_MAX];
+    uint64_t last_finish[PRIORITY_MAX];
+    uint64_t virtual_time;  // finish time of the last stanza written
+    size_t queued;
+    size_t queued_bytes;
+
+    double byte_tokens;     // may be negative after a stanza larger than the bucket
+    double stanza_tokens;
+    uint64_t refill_time;
+
+    gloox::util::Mutex queue_lock;
+
+    gloox::util::Mutex drain_lock;  // held by the thread writing
+
+    volatile bool is_congested;     // a write stalled, until a poll sees the socket writable
+
+    XMPPClient *client;
+    ClientImpl *impl;
+
+private:
+    SchedulerImpl();
+    SchedulerImpl(const SchedulerImpl&);
+    const SchedulerImpl& operator=(const SchedulerImpl&);
+};
+
+class XMPPClient::ClientImpl :
+    public ConnectionListener,
+    public StatisticsHandler,
+    public XMPPStanzaReader::MessageHandler
+#ifdef _DEBUG
+   ,public LogHandler
+#endif // _DEBUG
+{
+public:
+    explicit ClientImpl(XMPPClient *client, const Config& config);
+
+    virtual ~ClientImpl();
+
+    XMPPClient* getClient() const {
+        return client;
+    }
+
+    GlooxClient* getXmpp() const {
+        return xmpp;
+    }
+
+    ChatImpl* getChatImpl() const {
+        return chat_impl;
+    }
+
+    GroupChatImpl* getGroupChatImpl() const {
+        return group_chat_impl;
+    }
+
+    DeliveryImpl& getDeliveryImpl() {
+        return delivery_impl;
+    }
+
+    KeepaliveImpl& getKeepaliveImpl() {
+        return keepalive_impl;
+    }
+
+    SchedulerImpl& getSchedulerImpl() {
+        return scheduler_impl;
+    }
+
+    RosterImpl& getRosterImpl() {
+        return roster_impl;
+    }
+
+    EndpointImpl& getEndpointImpl() {
+        return endpoint_impl;
+    }
+
+    /// temporaries of the current recv() batch, reset by XMPPClient::internalUpdate()
+    XMPPArena& getArena() {
+        return arena;
+    }
+
+    /// XMPPClient::post() queue
+    void post(PostedFunction function, void *data);
+    bool hasPosted();
+
+    void setPostHook(PostedFunction function, void *data);
+
+    /// runs what was posted so far, called by XMPPClient::internalUpdate()
+    void runPosted();
+
+    /// XEP-0352 nonza, false if the server does not support it
+    bool sendClientState(bool inactive);
+
+    /// to Config::event_bridge if set, fields as XMPPEventBridge::Type lists them
+    void publishEvent(XMPPEventBridge::Type type, int value = 0, int flags = 0,
+                      const string& field0 = string(), const string& field1 = string(),
+                      const string& field2 = string(), const string& field3 = string(),
+                      const string& field4 = string());
+
+public:
+    // ConnectionListener
+    virtual void onConnect();
+    virtual void onDisconnect(ConnectionError error);
+    virtual bool onTLSConnect(const CertInfo& info);
+
+    // StatisticsHandler
+    virtual void handleStatistics(const StatisticsStruct stats);
+
+    // XMPPStanzaReader::MessageHandler
+    virtual bool handleMessage(const XMPPStanzaReader::Message& message);
+
+#ifdef _DEBUG
+    // LogHandler
+    virtual void handleLog(LogLevel level, LogArea area, const string& message);
+#endif // _DEBUG
+
+private:
+    XMPPClient *client;
+    GlooxClient *xmpp;
+
+    ChatImpl *chat_impl;
+    GroupChatImpl *group_chat_impl;
+
+    DeliveryImpl delivery_impl;
+    KeepaliveImpl keepalive_impl;
+    SchedulerImpl scheduler_impl;
+    RosterImpl roster_impl;
+    EndpointImpl endpoint_impl;
+
+    StatisticsStruct statistics;
+
+    XMPPArena arena;
+    string user_buffer;      // reused by handleMessage()
+    string resource_buffer;
+
+    // NOTE: onDisconnect() publishes from the thread calling disconnect() too
+    XMPPEventBridge events;  // published to under events_lock, a single producer
+    gloox::util::Mutex events_lock;
+
+    struct Posted
+    {
+        PostedFunction function;
+        void *data;
+    };
+
+    typedef vector<Posted> PostedQueue;
+    PostedQueue posted;
+    PostedQueue posted_running;  // swapped with posted by runPosted()
+    gloox::util::Mutex posted_lock;
+
+    Posted post_hook;            // called by post() after the queuing
+
+private:
+    ClientImpl();
+    ClientImpl(const ClientImpl&);
+    const ClientImpl& operator=(const ClientImpl&);
+};
+
+struct XMPPClient::ChatSession : public XMPPPooled<XMPPClient::ChatSession>
+{
+    explicit ChatSession(ClientImpl *impl, MessageSession *message_session);
+    explicit ChatSession(ClientImpl *impl, const string& user, const string& resource = "");
+
+    virtual ~ChatSession();
+
+    string session_id;  // JID's username part
+    string resource;    // JID's resource part
+    MessageSession *session;
+    MessageEventFilter *message_event_filter;  // incoming events only
+
+    // jabber:x:event state for outgoing events, as MessageEventFilter keeps it
+    int requested_events;  // MessageEventType bits asked for by the peer's last message
+    string last_id;        // id of the peer's last message
+    int last_event;        // last event sent, MessageEventCancel after a message
+
+private:
+    ClientImpl *impl;
+
+private:
+    ChatSession();
+    ChatSession(const ChatSession&);
+    const ChatSession& operator=(const ChatSession&);
+};
+
+class XMPPClient::ChatImpl :
+    public MessageSessionHandler,
+    public MessageHandler,
+    public MessageEventHandler,
+    public DiscoHandler
+{
+public:
+    explicit ChatImpl(XMPPClient *client, ClientImpl *impl);
+
+    virtual ~ChatImpl();
+
+public:
+    // MessageSessionHandler
+    virtual void handleMessageSession(MessageSession *session);
+
+    // MessageHandler
+    virtual void handleMessage(const Message& message, MessageSession *session);
+
+    // MessageEventHandler
+    virtual void handleMessageEvent(const JID& from, MessageEventType event);
+
+    // DiscoHandler
+    virtual void handleDiscoInfo(const JID& from, const Disco::Info& info, int context);
+    virtual void handleDiscoItems(const JID& from, const Disco::Items& items, int context);
+    virtual void handleDiscoError(const JID& from, const gloox::Error* error, int context);
+
+public:
+    /// id receives the DeliveryImpl handle when given, left unchanged if nothing was sent
+    bool sendChatMessage(const string& user, const string& message, const string& subject, const string& resource,
+                         MessageId *id = 0);
+    bool sendChatMessageComposing(const string& user, const string& resource);
+    bool sendChatMessageDelivered(const string& user, const string& resource);
+
+    bool sendChatMessageToMany(const vector<string>& users, const string& message, const string& subject);
+
+    /// sends the queued fan-out messages allowed by Config::fanout_rate,
+    /// returns true if some are left
+    bool flushFanout();
+    void disposeFanout();
+
+    /// looks for a XEP-0033 service on the server, used by flushFanout() once found,
+    /// from XMPPDiscoCache where it can
+    void discoverMulticast();
+    void resetMulticast();
+
+    /// writes the discovery results stored so far, called by XMPPClient::internalUpdate()
+    void saveDiscoCache();
+
+    void handlePrivateChatMessage(const string& user, const string& room, const Message& message);
+
+    /// handleMessage() for a message read by XMPPStanzaReader, false to leave it to gloox
+    bool handleFastMessage(const XMPPStanzaReader::Message& message, const string& user, const string& resource);
+
+    void disposeChatSessions();
+
+private:
+    void handleChatSession(MessageSession *session);
+    void handleChatMessageEvent(const string& user, const string& resource, MessageEventType event,
+                                const string& event_id);
+    ChatSession* findChatSession(const string& id);
+
+    // called with chat_sessions_lock held
+    void sendMessage(ChatSession *chat_session, const string& id, const string& message, const string& subject);
+    void raiseMessageEvent(ChatSession *chat_session, MessageEventType event);
+
+    // multicast discovery steps, with a result from the cache or the server
+    void discoverInfo(const JID& jid, int context);
+    void handleMulticastInfo(const JID& jid, const XMPPDiscoCache::Info& info, int context);
+    void handleMulticastItems(const XMPPDiscoCache::Info& items);
+    string getDiscoKey(const JID& jid, int context) const;
+
+private:
+    typedef map<string, ChatSession*> ChatSessions;
+    ChatSessions chat_sessions;
+    gloox::util::Mutex chat_sessions_lock;
+
+    string stanza_buffer;  // reused by sendMessage() and raiseMessageEvent()
+
+    string body_buffer;    // reused by handleFastMessage()
+    string subject_buffer;
+    string stamp_buffer;
+    string id_buffer;
+
+    // one serialized message and its recipients
+    struct Fanout
+    {
+        string stanza;       // serialized <message/> without 'to' and 'id'
+        size_t head_size;    // end of the start tag in stanza
+        string id_prefix;
+        vector<string> users;
+        size_t next;         // next recipient to send to
+    };
+
+    typedef deque<Fanout*> FanoutQueue;
+    FanoutQueue fanout_queue;
+    size_t fanout_pending;   // recipients left in fanout_queue
+    double fanout_credit;    // messages allowed to be sent now
+    uint64_t fanout_time;    // XMPPClock::now() at the last flushFanout()
+    gloox::util::Mutex fanout_lock;
+
+    enum DiscoContext {DISCO_SERVER_INFO, DISCO_SERVER_ITEMS, DISCO_ITEM_INFO};
+    string multicast_service;  // empty string until discovered, guarded by fanout_lock
+    int multicast_limit;       // addresses per stanza
+    XMPPDiscoCache& disco_cache;
+
+private:
+    XMPPClient *client;
+    ClientImpl *impl;
+
+private:
+    ChatImpl();
+    ChatImpl(const ChatImpl&);
+    const ChatImpl& operator=(const ChatImpl&);
+};
+
+struct XMPPClient::GroupChatSession : public XMPPPooled<XMPPClient::GroupChatSession>
+{
+    explicit GroupChatSession(XMPPClient::ClientImpl *impl, const string& group);
+
+    virtual ~GroupChatSession();
+
+    string session_id;  // group name
+    bool is_joined;
+    PooledMUCRoom *room;
+
+    enum CreationState {CREATION_STATE_NONE, CREATION_STATE_PENDING, CREATION_STATE_COMPLETE};
+    CreationState creation_state;
+
+private:
+    ClientImpl *impl;
+
+private:
+    GroupChatSession();
+    GroupChatSession(const GroupChatSession&);
+    const GroupChatSession& operator=(const GroupChatSession&);
+};
+
+class XMPPClient::GroupChatImpl :
+    public MUCRoomHandler,
+    public MUCInvitationHandler,
+    public MUCRoomConfigHandler,
+    public IqHandler
+{
+public:
+    explicit GroupChatImpl(XMPPClient *client, ClientImpl *impl);
+
+    virtual ~GroupChatImpl();
+
+public:
+    // MUCRoomHandler
+    virtual void handleMUCParticipantPresence(MUCRoom *room, const MUCRoomParticipant participant, const Presence& presence);
+    virtual void handleMUCMessage(MUCRoom *room, const Message& msg, bool priv);
+    virtual bool handleMUCRoomCreation(MUCRoom *room);
+    virtual void handleMUCSubject(MUCRoom *room, const string& nick, const string& subject);
+    virtual void handleMUCInviteDecline(MUCRoom *room, const JID& invitee, const string& reason);
+    virtual void handleMUCError(MUCRoom *room, StanzaError error);
+    virtual void handleMUCInfo(MUCRoom *room, int features, const string& name, const DataForm *infoForm);
+    virtual void handleMUCItems(MUCRoom *room, const Disco::ItemList& items);
+
+    // MUCInvitationHandler
+    virtual void handleMUCInvitation(const JID& room, const JID& from, const string& reason,
+                                     const string& body, const string& password, bool cont, const string& thread);
+
+    // MUCRoomConfigHandler
+    virtual void handleMUCConfigList(MUCRoom* room, const MUCListItemList& items, MUCOperation operation);
+    virtual void handleMUCConfigForm(MUCRoom* room, const DataForm& form);
+    virtual void handleMUCConfigResult(MUCRoom* room, bool success, MUCOperation operation);
+    virtual void handleMUCRequest(MUCRoom* room, const DataForm& form);
+
+    // IqHandler, results of the requests
+    virtual bool handleIq(const IQ& iq);
+    virtual void handleIqID(const IQ& iq, int context);
+
+public:
+#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
+    bool declineGroupChatInvitation(const string& group, const string& user, const string& reason);
+#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
+
+    // NOTE: the administration methods take an optional id receiving the
+    // request handle, left unchanged if nothing was sent
+    bool configureGroupChat(const string& group, const GroupChatConfig *config, RequestId *id = 0);
+    bool cancelGroupChatCreation(const string& group);
+    bool beginGroupChat(const string& group, const string& passwd,
+                       int history_messages, const string& history_since);
+    bool endGroupChat(const string& group, const string& reason);
+    bool destroyGroupChat(const string& group, const string& reason, RequestId *id = 0);
+    bool setGroupChatSubject(const string& group, const string& subject);
+    /// id receives the DeliveryImpl handle when given, left unchanged if nothing was sent
+    bool sendGroupChatMessage(const string& group, const string& message, MessageId *id = 0);
+    bool inviteToGroupChat(const string& group, const string& user, const string& reason);
+    bool kickFromGroupChat(const string& group, const string& user, const string& reason, RequestId *id = 0);
+
+#ifdef XMPP_CLIENT_BAN_ENABLE
+    bool banFromGroupChat(const string& group, const string& user, const string& reason, RequestId *id = 0);
+    bool unbanFromGroupChat(const string& group, const string& user, RequestId *id = 0);
+#endif // XMPP_CLIENT_BAN_ENABLE
+
+    bool listGroupChatUsers(const string& group);
+
+    /// completes all pending requests as failed
+    void failRequests();
+
+    /// reports the group chat presence held while inactive, from the event loop
+    void releasePresences();
+    static void releasePresences(void *data);  // PostedFunction
+
+    /// forgets the held presence of the group, or of all groups
+    void discardPresences(const string& group = "");
+
+    /// handleMUCMessage() for a message read by XMPPStanzaReader, false to leave it to gloox
+    bool handleFastMessage(const XMPPStanzaReader::Message& message, const string& group, const string& user);
+
+    void disposeGroupChatSessions();
+
+private:
+    // muc#admin and muc#owner request waiting for its iq result
+    struct Request
+    {
+        string group;
+        RequestId id;            // 0 if not tracked
+        MUCOperation operation;  // RequestRoomConfig until the form is sent back as SendRoomConfig
+        GroupChatConfig config;  // RequestRoomConfig only
+    };
+
+    GroupChatSession* findGroupChatSession(const string& id);
+
+    // called with chat_sessions_lock held, sends the query (taken over) to the room,
+    // id receives the request handle when given
+    void addRequest(const string& group, MUCOperation operation, IQ::IqType type, MUCQuery *query,
+                    RequestId *id, const GroupChatConfig *config = 0);
+    void sendRequest(const Request& request, IQ::IqType type, MUCQuery *query);
+
+    // iq of a request queued by sendRequest(), written through gloox for its result
+    struct PostedRequest
+    {
+        GroupChatImpl *group_chat;
+        IQ *iq;
+    };
+
+    static void sendPostedRequest(void *data);
+
+    // called with chat_sessions_lock held, takes the requests of the group (all
+    // groups if empty) out, only those creating the room if told so
+    void removeRequests(const string& group, bool is_creation_only, vector<Request> *removed);
+
+    void notifyRequest(RequestId id, const string& group, MUCOperation operation, bool success);
+
+    // the per operation callbacks, for the requests and for what MUCRoom sends itself
+    void notifyOperation(const string& group, MUCOperation operation, bool success);
+
+    // keeps the last presence of a user while inactive, false if it must be reported now
+    bool holdPresence(const string& group, const string& user, bool online, const string& reason, int flags);
+
+private:
+    typedef map<string, GroupChatSession*> GroupChatSessions;
+    GroupChatSessions chat_sessions;
+    gloox::util::Mutex chat_sessions_lock;
+
+    // by iq id, guarded by chat_sessions_lock
+    typedef map<string, Request> Requests;
+    Requests requests;
+    RequestId last_request_id;
+
+    struct HeldPresence
+    {
+        bool online;
+        string reason;
+        int flags;
+    };
+
+    // by group and user, only the last presence is reported by releasePresences()
+    typedef map<pair<string, string>, HeldPresence> HeldPresences;
+    HeldPresences held_presences;
+    gloox::util::Mutex held_presences_lock;
+
+    string stanza_buffer;  // reused by sendGroupChatMessage() and inviteToGroupChat()
+
+    string body_buffer;    // reused by handleFastMessage()
+    string stamp_buffer;
+    string id_buffer;
+
+private:
+    XMPPClient *client;
+    ClientImpl *impl;
+
+private:
+    GroupChatImpl();
+    GroupChatImpl(const GroupChatImpl&);
+    const GroupChatImpl& operator=(const GroupChatImpl&);
+};
+
+/// XMPPClient::ClientImpl
+XMPPClient::ClientImpl::ClientImpl(XMPPClient *client_, const Config& config)
+    : client(client_), xmpp(0),
+      chat_impl(0), group_chat_impl(0),
+      delivery_impl(client_), keepalive_impl(client_), scheduler_impl(client_, this),
+      roster_impl(client_), endpoint_impl(client_, config)
+{
+    post_hook.function = 0;
+    post_hook.data = 0;
+
+    if(!config.event_bridge.empty() && !events.create(config.event_bridge, config.event_bridge_size)) {
+        throw Error(errno);
+    }
+
+    xmpp = new GlooxClient(config.jid, config.passwd, config.port);
+
+    if(!config.capture_file.empty()) {
+        if(!xmpp->startCapture(config.capture_file)) {
+            int errnum = errno;
+            delete xmpp;
+            throw Error(errnum);
+        }
+
+        // NOTE: a replay cannot negotiate stream compression, keep the recorded stream plain
+        xmpp->setCompression(false);
+    }
+
+    if(config.fast_parser) {
+        xmpp->setFastParser(this, &arena);
+    }
+
+    if(!config.server.empty()) {
+        xmpp->setServer(config.server);
+    }
+
+    xmpp->setIoUring(config.io_uring);
+
+    // NOTE: after setServer(), which also renames the server of the connection
+    if(!config.server_address.empty()) {
+        xmpp->setConnectionImpl(xmpp->newConnection(config.server_address, config.port));
+    }
+    else if(config.io_uring) {
+        xmpp->setConnectionImpl(xmpp->newConnection(xmpp->server(), config.port));
+    }
+
+    xmpp->registerConnectionListener(this);
+    xmpp->registerStatisticsHandler(this);
+
+    ::memset(&statistics, 0, sizeof(statistics));
+
+    int message_events = gloox::MessageEventDelivered | gloox::MessageEventComposing;
+    xmpp->registerStanzaExtension(new gloox::MessageEvent(message_events));
+
+    xmpp->registerStanzaExtension(new gloox::DelayedDelivery());
+
+    xmpp->disableRoster();
+
+    // NOTE: after disableRoster(), which unregisters the roster query of gloox
+    if(config.roster) {
+        roster_impl.enable(xmpp);
+    }
+
+    // register single chat handler
+    try {
+        chat_impl = new ChatImpl(client, this);
+        xmpp->registerMessageSessionHandler(chat_impl, 0);
+    }
+    catch(...) {
+        delete xmpp;
+        throw;
+    }
+
+    // register group chat handler
+    try {
+        group_chat_impl = new GroupChatImpl(client, this);
+        xmpp->registerMUCInvitationHandler(group_chat_impl);
+    }
+    catch(...) {
+        delete chat_impl;
+        delete xmpp;
+        throw;
+    }
+
+    // set TLS policy for connection
+    xmpp->setTls(config.tls_policy);
+
+    // set CA certs if provided
+    if(!config.ca_certs.empty()) {
+        xmpp->setCACerts(config.ca_certs);
+    }
+
+#ifdef _DEBUG
+    xmpp->logInstance().registerLogHandler(LogLevelDebug, LogAreaAll, this);
+#endif // _DEBUG
+}
+
+XMPPClient::ClientImpl::~ClientImpl()
+{
+    delete group_chat_impl;
+    delete chat_impl;
+    delete xmpp;
+}
+
+// ConnectionListener
+void XMPPClient::ClientImpl::onConnect()
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CONNECT);
+
+    client->metrics.increment(XMPPMetrics::COUNTER_CONNECTS);
+    if(client->has_connected) {
+        client->metrics.increment(XMPPMetrics::COUNTER_RECONNECTS);
+    }
+    client->has_connected = true;
+
+    chat_impl->discoverMulticast();
+    keepalive_impl.start(xmpp);
+    roster_impl.request();
+
+    // NOTE: a new stream starts active
+    if(client->is_inactive) {
+        sendClientState(true);
+    }
+
+    publishEvent(XMPPEventBridge::TYPE_CONNECT);
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CONNECT);
+    client->onConnect();
+}
+
+void XMPPClient::ClientImpl::onDisconnect(ConnectionError error)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_DISCONNECT, 0, 0, (int)error);
+
+    client->metrics.increment(XMPPMetrics::COUNTER_DISCONNECTS);
+
+    chat_impl->resetMulticast();
+    keepalive_impl.stop();
+    endpoint_impl.disconnected(error);
+    scheduler_impl.discard();
+    group_chat_impl->discardPresences();
+
+    // NOTE: replies to the messages and requests in flight are lost with the stream
+    delivery_impl.fail();
+    group_chat_impl->failRequests();
+
+    publishEvent(XMPPEventBridge::TYPE_DISCONNECT, error);
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_DISCONNECT);
+    client->onDisconnect(error);
+}
+
+bool XMPPClient::ClientImpl::onTLSConnect(const CertInfo& info)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_TLS_CONNECT, info.cipher.c_str());
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_TLS_CONNECT);
+    return client->onTlsConnect(info);
+}
+
+void XMPPClient::ClientImpl::post(PostedFunction function, void *data)
+{
+    Posted entry = {function, data};
+
+    {
+        MutexGuard guard(posted_lock);
+        posted.push_back(entry);
+    }
+
+    if(post_hook.function) {
+        post_hook.function(post_hook.data);
+    }
+}
+
+void XMPPClient::ClientImpl::setPostHook(PostedFunction function, void *data)
+{
+    post_hook.function = function;
+    post_hook.data = data;
+}
+
+bool XMPPClient::ClientImpl::hasPosted()
+{
+    MutexGuard guard(posted_lock);
+    return !posted.empty();
+}
+
+void XMPPClient::ClientImpl::runPosted()
+{
+    {
+        MutexGuard guard(posted_lock);
+        posted.swap(posted_running);
+    }
+
+    // NOTE: what these post goes to the next round
+    for(PostedQueue::const_iterator it = posted_running.begin(); it != posted_running.end(); ++it) {
+        it->function(it->data);
+    }
+    posted_running.clear();
+}
+
+bool XMPPClient::ClientImpl::sendClientState(bool inactive)
+{
+    if(!xmpp->hasClientState()) {
+        return false;
+    }
+
+    // NOTE: the last state queued supersedes the others
+    scheduler_impl.send(SchedulerImpl::PRIORITY_PRESENCE, CSI_XMLNS, inactive ? CSI_INACTIVE : CSI_ACTIVE);
+    return true;
+}
+
+void XMPPClient::ClientImpl::publishEvent(XMPPEventBridge::Type type, int value, int flags,
+                                          const string& field0, const string& field1,
+                                          const string& field2, const string& field3,
+                                          const string& field4)
+{
+    if(!events.isOpen()) {
+        return;
+    }
+
+    MutexGuard guard(events_lock);
+    if(!events.publish(type, value, flags, field0, field1, field2, field3, field4)) {
+        client->metrics.increment(XMPPMetrics::COUNTER_EVENTS_DROPPED);
+    }
+}
+
+// gloox statistics are cumulative per connection
+static inline uint64_t g_statistics_delta(long int current, long int last)
+{
+    return (uint64_t)((current >= last) ? (current - last) : current);
+}
+
+// StatisticsHandler
+void XMPPClient::ClientImpl::handleStatistics(const StatisticsStruct stats)
+{
+    XMPPMetrics& metrics = client->metrics;
+
+    metrics.increment(XMPPMetrics::COUNTER_BYTES_IN,
+                      g_statistics_delta(stats.totalBytesReceived, statistics.totalBytesReceived));
+    metrics.increment(XMPPMetrics::COUNTER_BYTES_OUT,
+                      g_statistics_delta(stats.totalBytesSent, statistics.totalBytesSent));
+
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_IN_MESSAGE,
+                      g_statistics_delta(stats.messageStanzasReceived, statistics.messageStanzasReceived));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_IN_PRESENCE,
+                      g_statistics_delta(stats.presenceStanzasReceived, statistics.presenceStanzasReceived));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_IN_IQ,
+                      g_statistics_delta(stats.iqStanzasReceived, statistics.iqStanzasReceived));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_IN_SUBSCRIPTION,
+                      g_statistics_delta(stats.s10nStanzasReceived, statistics.s10nStanzasReceived));
+
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE,
+                      g_statistics_delta(stats.messageStanzasSent, statistics.messageStanzasSent));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_PRESENCE,
+                      g_statistics_delta(stats.presenceStanzasSent, statistics.presenceStanzasSent));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_IQ,
+                      g_statistics_delta(stats.iqStanzasSent, statistics.iqStanzasSent));
+    metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_SUBSCRIPTION,
+                      g_statistics_delta(stats.s10nStanzasSent, statistics.s10nStanzasSent));
+
+    statistics = stats;
+}
+
+// XMPPStanzaReader::MessageHandler
+bool XMPPClient::ClientImpl::handleMessage(const XMPPStanzaReader::Message& message)
+{
+    // user@domain/resource
+    const char *from = message.from.data;
+    const char *from_end = from + message.from.size;
+    const char *at = static_cast<const char*>(::memchr(from, '@', message.from.size));
+    const char *slash = static_cast<const char*>(::memchr(from, '/', message.from.size));
+
+    if(!at || !slash || at > slash || slash + 1 == from_end) {
+        return false;
+    }
+
+    // NOTE: reused, the callbacks take strings
+    user_buffer.assign(from, at - from);
+    resource_buffer.assign(slash + 1, from_end - slash - 1);
+
+    const string& groupchat_server = client->getConfig().groupchat_server;
+    bool is_handled = false;
+
+    if(message.type.empty() || message.type.equals("chat") || message.type.equals("normal")) {
+        is_handled = chat_impl->handleFastMessage(message, user_buffer, resource_buffer);
+    }
+    else if(message.type.equals("groupchat") &&
+            groupchat_server.compare(0, string::npos, at + 1, slash - at - 1) == 0) {
+        is_handled = group_chat_impl->handleFastMessage(message, user_buffer, resource_buffer);
+    }
+
+    if(is_handled) {
+        // NOTE: not in gloox statistics
+        client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_IN_MESSAGE);
+    }
+    return is_handled;
+}
+
+#ifdef _DEBUG
+static const char* g_log_level_string(LogLevel level)
+{
+    switch(level) {
+    case LogLevelDebug:
+        return "DEBUG";
+    case LogLevelWarning:
+        return "WARN";
+    case LogLevelError:
+    default:
+        break;
+    }
+    return "ERROR";
+}
+
+static const char* g_log_area_string(LogArea area)
+{
+    switch(area) {
+    case LogAreaClassParser:
+        return "CLASS_PARSER";
+    case LogAreaClassConnectionTCPBase:
+        return "CLASS_CONNECTION_TCP_BASE";
+    case LogAreaClassClient:
+        return "CLASS_CLIENT";
+    case LogAreaClassClientbase:
+        return "CLASS_CLIENT_BASE";
+    case LogAreaClassComponent:
+        return "CLASS_COMPONENT";
+    case LogAreaClassDns:
+        return "CLASS_DNS";
+    case LogAreaClassConnectionHTTPProxy:
+        return "CLASS_CONNECTION_HTTP_PROXY";
+    case LogAreaClassConnectionSOCKS5Proxy:
+        return "CLASS_CONNECTION_SOCKS5_PROXY";
+    case LogAreaClassConnectionTCPClient:
+        return "CLASS_CONNECTION_TCP_CLIENT";
+    case LogAreaClassConnectionTCPServer:
+        return "CLASS_CONNECTION_TCP_SERVER";
+    case LogAreaClassS5BManager:
+        return "CLASS_S5B_MANAGER";
+    case LogAreaClassSOCKS5Bytestream:
+        return "CLASS_SOCKS5_BYTE_STREAM";
+    case LogAreaClassConnectionBOSH:
+        return "CLASS_CONNECTION_BOSH";
+    case LogAreaClassConnectionTLS:
+        return "CLASS_CONNECTION_TLS";
+    case LogAreaAllClasses:
+        return "ALL_CLASSES";
+    case LogAreaXmlIncoming:
+        return "XML_INCOMING";
+    case LogAreaXmlOutgoing:
+        return "XML_OUTGOING";
+    case LogAreaUser:
+        return "USER";
+    default:
+        break;
+    }
+    return "UNKNOWN";
+}
+
+void XMPPClient::ClientImpl::handleLog(LogLevel level, LogArea area, const string& message)
+{
+    ::fprintf(stderr, ">>> %s >>> %s >>> %s\n",
+              g_log_level_string(level), g_log_area_string(area), message.c_str());
+}
+#endif // _DEBUG
+
+/// XMPPClient::ChatSession
+XMPPClient::ChatSession::ChatSession(ClientImpl *impl_, MessageSession *session_)
+    : session_id(session_->target().username()),
+      resource(session_->target().resource()),
+      session(session_),
+      message_event_filter(0),
+      requested_events(0), last_id(""), last_event(MessageEventCancel),
+      impl(impl_)
+{
+    assert(!resource.empty());
+
+    session->registerMessageHandler(impl->getChatImpl());
+
+    try {
+        message_event_filter = new PooledMessageEventFilter(session);
+        message_event_filter->registerMessageEventHandler(impl->getChatImpl());
+    }
+    catch(...) {
+        impl->getXmpp()->disposeMessageSession(session);
+
+        throw;
+    }
+}
+
+XMPPClient::ChatSession::ChatSession(ClientImpl *impl_, const string& user, const string& resource_)
+    : session_id(user),
+      resource(resource_),
+      session(0),
+      message_event_filter(0),
+      requested_events(0), last_id(""), last_event(MessageEventCancel),
+      impl(impl_)
+{
+    JID jid(impl->getXmpp()->jid());
+    jid.setUsername(user);
+    jid.setResource((resource == "*") ? "" : resource);
+
+    session = new PooledMessageSession(impl->getXmpp(), jid, (resource != "*"));
+    session->registerMessageHandler(impl->getChatImpl());
+
+    try {
+        message_event_filter = new PooledMessageEventFilter(session);
+        message_event_filter->registerMessageEventHandler(impl->getChatImpl());
+    }
+    catch(...) {
+        impl->getXmpp()->disposeMessageSession(session);
+
+        throw;
+    }
+}
+
+XMPPClient::ChatSession::~ChatSession()
+{
+    session->disposeMessageFilter(message_event_filter);
+
+    impl->getXmpp()->disposeMessageSession(session);
+}
+
+/// XMPPClient::ChatImpl
+XMPPClient::ChatImpl::ChatImpl(XMPPClient *client_, ClientImpl *impl_)
+    : fanout_pending(0), fanout_credit(0), fanout_time(0),
+      multicast_service(""), multicast_limit(0),
+      disco_cache(XMPPDiscoCache::getShared(client_->getConfig().disco_cache)),
+      client(client_), impl(impl_)
+{
+}
+
+XMPPClient::ChatImpl::~ChatImpl()
+{
+    impl->getXmpp()->disco()->removeDiscoHandler(this);
+
+    disposeFanout();
+    disposeChatSessions();
+}
+
+bool XMPPClient::ChatImpl::sendChatMessage(const string& user, const string& message, const string& subject, const string& resource,
+                                           MessageId *id)
+{
+    if(message.empty()) {
+        // do not let sending empty messages
+        return true;
+    }
+
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+    ChatSession *chat_session = findChatSession(user);
+    if(!resource.empty()) {
+        if(chat_session) {
+            if(chat_session->resource != resource) {
+                delete chat_session;
+                chat_session = 0;
+            }
+        }
+    }
+
+    if(!chat_session) {
+        chat_session = new ChatSession(impl, user, resource);
+        assert(chat_session->session_id == user);
+        chat_sessions[chat_session->session_id] = chat_session;
+        client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, chat_sessions.size());
+        g_set_pool_gauges(client->metrics);
+    }
+
+    const string stanza_id = impl->getXmpp()->getID();
+    if(id) {
+        // NOTE: before sending, the reply may be read by the event loop first
+        *id = impl->getDeliveryImpl().track(stanza_id, user);
+    }
+
+    sendMessage(chat_session, stanza_id, message, subject);
+    return true;
+}
+
+bool XMPPClient::ChatImpl::sendChatMessageComposing(const string& user, const string& resource)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+    ChatSession *chat_session = findChatSession(user);
+    if(resource.empty()) {
+        if(chat_session) {
+            raiseMessageEvent(chat_session, MessageEventComposing);
+            return true;
+        }
+    }
+    else  {
+        if(chat_session) {
+            if(chat_session->resource != resource) {
+                delete chat_session;
+                chat_session = 0;
+            }
+        }
+
+        if(!chat_session) {
+            chat_session = new ChatSession(impl, user, resource);
+            assert(chat_session->session_id == user);
+            chat_sessions[chat_session->session_id] = chat_session;
+            client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, chat_sessions.size());
+            g_set_pool_gauges(client->metrics);
+        }
+
+        raiseMessageEvent(chat_session, MessageEventComposing);
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::ChatImpl::sendChatMessageDelivered(const string& user, const string& resource)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+    ChatSession *chat_session = findChatSession(user);
+    if(resource.empty()) {
+        if(chat_session) {
+            raiseMessageEvent(chat_session, MessageEventDelivered);
+            return true;
+        }
+    }
+    else  {
+        if(chat_session) {
+            if(chat_session->resource != resource) {
+                delete chat_session;
+                chat_session = 0;
+            }
+        }
+
+        if(!chat_session) {
+            chat_session = new ChatSession(impl, user, resource);
+            assert(chat_session->session_id == user);
+            chat_sessions[chat_session->session_id] = chat_session;
+            client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, chat_sessions.size());
+            g_set_pool_gauges(client->metrics);
+        }
+
+        raiseMessageEvent(chat_session, MessageEventDelivered);
+        return true;
+    }
+
+    return false;
+}
+
+void XMPPClient::ChatImpl::sendMessage(ChatSession *chat_session, const string& id,
+                                       const string& message, const string& subject)
+{
+    stanza_buffer.clear();
+    XMPPStanzaWriter::appendChatMessage(stanza_buffer, chat_session->session->target().full(),
+                                        id, message, subject,
+                                        chat_session->session->threadID(), REQUESTED_MESSAGE_EVENTS);
+
+    chat_session->last_event = MessageEventCancel;
+
+    impl->getSchedulerImpl().send(SchedulerImpl::PRIORITY_CONTENT, chat_session->session_id, stanza_buffer);
+    client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE);
+}
+
+// same rules as MessageEventFilter::raiseMessageEvent()
+void XMPPClient::ChatImpl::raiseMessageEvent(ChatSession *chat_session, MessageEventType event)
+{
+    if(!(chat_session->requested_events & event)) {
+        return;
+    }
+
+    if(event == MessageEventComposing) {
+        if(chat_session->last_event == MessageEventComposing) {
+            return;
+        }
+    }
+    else {
+        // other events are sent once per message
+        chat_session->requested_events &= ~event;
+    }
+
+    chat_session->last_event = event;
+
+    stanza_buffer.clear();
+    XMPPStanzaWriter::appendMessageEvent(stanza_buffer, chat_session->session->target().full(),
+                                         impl->getXmpp()->getID(), event, chat_session->last_id);
+
+    SchedulerImpl::Priority priority = (event == MessageEventComposing) ?
+        SchedulerImpl::PRIORITY_CHAT_STATE : SchedulerImpl::PRIORITY_RECEIPT;
+    impl->getSchedulerImpl().send(priority, chat_session->session_id, stanza_buffer);
+    client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE);
+}
+
+bool XMPPClient::ChatImpl::sendChatMessageToMany(const vector<string>& users, const string& message, const string& subject)
+{
+    if(message.empty() || users.empty()) {
+        // do not let sending empty messages
+        return true;
+    }
+
+    Message stanza(Message::Chat, JID(), message, subject);
+
+    // same request as the messages of a chat session
+    stanza.addExtension(new MessageEvent(REQUESTED_MESSAGE_EVENTS));
+
+    Tag *tag = stanza.tag();
+    const string xml = tag->xml();
+    delete tag;
+
+    static const string MESSAGE_TAG = "<message";
+    if(xml.compare(0, MESSAGE_TAG.size(), MESSAGE_TAG) != 0) {
+        return false;
+    }
+
+    Fanout *fanout = new Fanout;
+    fanout->stanza = xml.substr(MESSAGE_TAG.size());
+    fanout->head_size = fanout->stanza.find('>') + 1;
+    fanout->id_prefix = impl->getXmpp()->getID();
+    fanout->users = users;
+    fanout->next = 0;
+
+    {
+        MutexGuard guard(fanout_lock);
+
+        fanout_queue.push_back(fanout);
+        fanout_pending += users.size();
+        client->metrics.setGauge(XMPPMetrics::GAUGE_FANOUT_QUEUE, fanout_pending);
+    }
+
+    // NOTE: the first burst goes out right away, the event loop may be waiting in recv()
+    flushFanout();
+    return true;
+}
+
+bool XMPPClient::ChatImpl::flushFanout()
+{
+    MutexGuard guard(fanout_lock);
+
+    if(fanout_queue.empty()) {
+        return false;
+    }
+
+    uint64_t now = XMPPClock::now();
+    size_t allowed = fanout_pending;
+
+    int rate = client->config.fanout_rate;
+    if(rate > 0) {
+        // NOTE: at most 100 milliseconds worth of messages at once
+        double burst = (rate < 10) ? 1.0 : (rate / 10.0);
+
+        fanout_credit += (now - fanout_time) * (rate / 1e9);
+        if(fanout_credit > burst) {
+            fanout_credit = burst;
+        }
+
+        allowed = (size_t)fanout_credit;
+    }
+    fanout_time = now;
+
+    // NOTE: kept here rather than copied to the scheduler while it has a backlog, the credit waits too
+    if(impl->getSchedulerImpl().getQueueDelay() > 0) {
+        return true;
+    }
+
+    const string& domain = impl->getXmpp()->jid().server();
+    uint64_t sent = 0;
+    uint64_t recipients = 0;
+    string xml;
+    char id[24];
+
+    while(allowed > 0 && !fanout_queue.empty()) {
+        Fanout *fanout = fanout_queue.front();
+
+        while(allowed > 0 && fanout->next < fanout->users.size()) {
+            ::snprintf(id, sizeof(id), "-%lu", (unsigned long)fanout->next);
+
+            // size of the stanza sent to one recipient, without the JID
+            size_t unicast_size = 13 + 1 + domain.size() + 6 + fanout->id_prefix.size() + ::strlen(id) + 1 + fanout->stanza.size();
+
+            // NOTE: Config::fanout_rate counts recipients, those of a multicast stanza too
+            size_t count = fanout->users.size() - fanout->next;
+            if(count > (size_t)multicast_limit) {
+                count = multicast_limit;
+            }
+            if(count > allowed) {
+                count = allowed;
+            }
+
+            if(!multicast_service.empty() && count > 1) {
+                // XEP-0033: one stanza to the service, the recipients as 'bcc' addresses
+                xml.assign("<message to='");
+                xml += multicast_service;
+                xml += "' id='";
+                xml += fanout->id_prefix;
+                xml += id;
+                xml += '\'';
+                xml.append(fanout->stanza, 0, fanout->head_size);
+                xml += "<addresses xmlns='" + MULTICAST_XMLNS + "'>";
+
+                size_t unicast_bytes = 0;
+                for(size_t i = 0; i < count; ++i) {
+                    const string user = gloox::util::escape(fanout->users[fanout->next + i]);
+
+                    xml += "<address type='bcc' jid='";
+                    xml += user;
+                    xml += '@';
+                    xml += domain;
+                    xml += "'/>";
+
+                    unicast_bytes += unicast_size + user.size();
+                }
+
+                xml += "</addresses>";
+                xml.append(fanout->stanza, fanout->head_size, string::npos);
+
+                impl->getSchedulerImpl().send(SchedulerImpl::PRIORITY_CONTENT, EmptyString, xml);
+
+                client->metrics.increment(XMPPMetrics::COUNTER_MULTICAST_STANZAS);
+                if(unicast_bytes > xml.size()) {
+                    client->metrics.increment(XMPPMetrics::COUNTER_MULTICAST_BYTES_SAVED, unicast_bytes - xml.size());
+                }
+
+                fanout->next += count;
+                allowed -= count;
+                recipients += count;
+                ++sent;
+                continue;
+            }
+
+            // only 'to' and 'id' differ between the recipients
+            xml.assign("<message to='");
+            xml += gloox::util::escape(fanout->users[fanout->next]);
+            xml += '@';
+            xml += domain;
+            xml += "' id='";
+            xml += fanout->id_prefix;
+            xml += id;
+            xml += '\'';
+            xml += fanout->stanza;
+
+            impl->getSchedulerImpl().send(SchedulerImpl::PRIORITY_CONTENT, EmptyString, xml);
+
+            ++fanout->next;
+            --allowed;
+            ++recipients;
+            ++sent;
+        }
+
+        if(fanout->next == fanout->users.size()) {
+            fanout_queue.pop_front();
+            delete fanout;
+        }
+    }
+
+    if(rate > 0) {
+        fanout_credit -= recipients;
+    }
+
+    fanout_pending -= recipients;
+    client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE, sent);
+    client->metrics.setGauge(XMPPMetrics::GAUGE_FANOUT_QUEUE, fanout_pending);
+
+    return !fanout_queue.empty();
+}
+
+void XMPPClient::ChatImpl::disposeFanout()
+{
+    MutexGuard guard(fanout_lock);
+
+    for(FanoutQueue::iterator it = fanout_queue.begin(); it != fanout_queue.end(); ++it) {
+        delete *it;
+    }
+    fanout_queue.clear();
+
+    fanout_pending = 0;
+    client->metrics.setGauge(XMPPMetrics::GAUGE_FANOUT_QUEUE, 0);
+}
+
+void XMPPClient::ChatImpl::discoverMulticast()
+{
+    resetMulticast();
+
+    if(!client->config.multicast) {
+        return;
+    }
+
+    // XEP-0033: the server itself first, then its items
+    discoverInfo(JID(impl->getXmpp()->jid().server()), DISCO_SERVER_INFO);
+}
+
+void XMPPClient::ChatImpl::resetMulticast()
+{
+    MutexGuard guard(fanout_lock);
+
+    multicast_service = "";
+    multicast_limit = 0;
+}
+
+void XMPPClient::ChatImpl::saveDiscoCache()
+{
+    disco_cache.save();
+}
+
+void XMPPClient::ChatImpl::discoverInfo(const JID& jid, int context)
+{
+    XMPPDiscoCache::Info info;
+
+    if(client->config.disco_cache_ttl > 0 && disco_cache.find(getDiscoKey(jid, context), &info)) {
+        client->metrics.increment(XMPPMetrics::COUNTER_DISCO_CACHE_HITS);
+
+        if(context == DISCO_SERVER_ITEMS) {
+            handleMulticastItems(info);
+        }
+        else {
+            handleMulticastInfo(jid, info, context);
+        }
+        return;
+    }
+
+    client->metrics.increment(XMPPMetrics::COUNTER_DISCO_CACHE_MISSES);
+
+    if(context == DISCO_SERVER_ITEMS) {
+        impl->getXmpp()->disco()->getDiscoItems(jid, "", this, context);
+    }
+    else {
+        impl->getXmpp()->disco()->getDiscoInfo(jid, "", this, context);
+    }
+}
+
+void XMPPClient::ChatImpl::handleMulticastInfo(const JID& jid, const XMPPDiscoCache::Info& info, int context)
+{
+    if(!info.hasFeature(MULTICAST_XMLNS)) {
+        if(context == DISCO_SERVER_INFO) {
+            discoverInfo(jid, DISCO_SERVER_ITEMS);
+        }
+        return;
+    }
+
+    int limit = client->config.multicast_limit;
+
+    // NOTE: a service may advertise its limit in a form with the XEP-0033 FORM_TYPE
+    if(info.getField("FORM_TYPE") == MULTICAST_XMLNS) {
+        int advertised_limit = ::atoi(info.getField("message").c_str());
+        if(advertised_limit > 0 && advertised_limit < limit) {
+            limit = advertised_limit;
+        }
+    }
+
+    MutexGuard guard(fanout_lock);
+
+    // the first service found is kept
+    if(multicast_service.empty()) {
+        multicast_service = jid.full();
+        multicast_limit = limit;
+    }
+}
+
+void XMPPClient::ChatImpl::handleMulticastItems(const XMPPDiscoCache::Info& items)
+{
+    for(vector<string>::const_iterator it = items.items.begin(); it != items.items.end(); ++it) {
+        discoverInfo(JID(*it), DISCO_ITEM_INFO);
+    }
+}
+
+// NOTE: the server's features are shared by all accounts on it, keyed by its XEP-0115 hash if it has one
+string XMPPClient::ChatImpl::getDiscoKey(const JID& jid, int context) const
+{
+    switch(context) {
+    case DISCO_SERVER_INFO:
+        if(!impl->getXmpp()->getServerCaps().empty()) {
+            return "caps " + impl->getXmpp()->getServerCaps();
+        }
+        return "info " + jid.full();
+
+    case DISCO_SERVER_ITEMS:
+        return "items " + jid.full();
+
+    case DISCO_ITEM_INFO:
+    default:
+        return "info " + jid.full();
+    }
+}
+
+// DiscoHandler
+void XMPPClient::ChatImpl::handleDiscoInfo(const JID& from, const Disco::Info& info, int context)
+{
+    XMPPDiscoCache::Info result;
+    result.features.assign(info.features().begin(), info.features().end());
+
+    const DataForm *form = info.form();
+    if(form) {
+        const DataForm::FieldList& fields = form->fields();
+        for(DataForm::FieldList::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+            result.fields.push_back(make_pair((*it)->name(), (*it)->value()));
+        }
+    }
+
+    if(client->config.disco_cache_ttl > 0) {
+        disco_cache.store(getDiscoKey(from, context), result, client->config.disco_cache_ttl);
+    }
+
+    handleMulticastInfo(from, result, context);
+}
+
+void XMPPClient::ChatImpl::handleDiscoItems(const JID& from, const Disco::Items& items, int context)
+{
+    XMPPDiscoCache::Info result;
+
+    const Disco::ItemList& list = items.items();
+    for(Disco::ItemList::const_iterator it = list.begin(); it != list.end(); ++it) {
+        result.items.push_back((*it)->jid().full());
+    }
+
+    if(client->config.disco_cache_ttl > 0) {
+        disco_cache.store(getDiscoKey(from, context), result, client->config.disco_cache_ttl);
+    }
+
+    handleMulticastItems(result);
+}
+
+void XMPPClient::ChatImpl::handleDiscoError(const JID& from, const gloox::Error* error, int context)
+{
+    (void)from, (void)error, (void)context;
+
+    // no multicast, sendChatMessageToMany() keeps sending one message per user
+}
+
+void XMPPClient::ChatImpl::handlePrivateChatMessage(const string& user, const string& room, const Message& message)
+{
+    const string& body = message.body();
+
+    if(body.empty()) {
+        // do not raise XMPPClient::onChatMessage() on empty messages
+        // NOTE: this behavior was removed from the latest version (1.0.9)
+        // when triggered after MessageEventHandler::handleMessageEvent()
+        return;
+    }
+
+    const DelayedDelivery *dd = message.when();
+    // FIXME: should create sessions for delayed messages?
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_PRIVATE_CHAT_MESSAGE,
+               user.c_str(), room.c_str(), body.size(), (dd != 0));
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+        ChatSession *chat_session = findChatSession(user);
+        if(!chat_session) {
+            chat_session = new ChatSession(impl, user);
+            chat_sessions[chat_session->session_id] = chat_session;
+            client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, chat_sessions.size());
+            g_set_pool_gauges(client->metrics);
+        }
+        assert(chat_session->session_id == user);
+    }
+
+    impl->publishEvent(XMPPEventBridge::TYPE_CHAT_MESSAGE, 0, 0, user, room,
+                       body, message.subject(), (dd ? dd->stamp() : EmptyString));
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CHAT_MESSAGE);
+    client->onChatMessage(user, room,
+                          body, message.subject(),
+                          (dd ? dd->stamp().c_str() : 0));
+}
+
+void XMPPClient::ChatImpl::handleChatSession(MessageSession *session)
+{
+    // WARN: can only dispose an old MessageSession with ClientBase::disposeMessageSession()
+    // WARN: cannot dispose the current MessageSession here
+
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+    const string& session_id = session->target().username();
+    ChatSession *chat_session = findChatSession(session_id);
+    if(chat_session) {
+        delete chat_session;
+    }
+
+    chat_sessions[session_id] = new ChatSession(impl, session);
+    client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, chat_sessions.size());
+    g_set_pool_gauges(client->metrics);
+}
+
+void XMPPClient::ChatImpl::handleChatMessageEvent(const string& user, const string& resource, MessageEventType event,
+                                                  const string& event_id)
+{
+    // NOTE: the event about a tracked message, paired in send order when it has no id
+    if(MessageEventDelivered & event) {
+        if(!event_id.empty()) {
+            impl->getDeliveryImpl().complete(event_id, MESSAGE_DELIVERED);
+        }
+        else {
+            impl->getDeliveryImpl().completeOldest(user, MESSAGE_DELIVERED);
+        }
+    }
+    else if(MessageEventOffline & event) {
+        if(!event_id.empty()) {
+            impl->getDeliveryImpl().complete(event_id, MESSAGE_ACKNOWLEDGED);
+        }
+        else {
+            impl->getDeliveryImpl().completeOldest(user, MESSAGE_ACKNOWLEDGED);
+        }
+    }
+
+    if(MessageEventDelivered & event) {
+        impl->publishEvent(XMPPEventBridge::TYPE_CHAT_DELIVERED, 0, 0, user, resource);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CHAT_MESSAGE_DELIVERED);
+        client->onChatMessageDelivered(user, resource);
+    }
+    else if(MessageEventComposing & event) {
+        // NOTE: stale by the time the application is active again
+        if(client->is_inactive) {
+            client->metrics.increment(XMPPMetrics::COUNTER_INACTIVE_COMPOSING);
+            return;
+        }
+
+        impl->publishEvent(XMPPEventBridge::TYPE_CHAT_COMPOSING, 0, 0, user, resource);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CHAT_MESSAGE_COMPOSING);
+        client->onChatMessageComposing(user, resource);
+    }
+
+#if 0
+    MutexGuard guard(chat_sessions_lock);
+
+    const string& session_id = user;
+    ChatSession *chat_session = findChatSession(session_id);
+    if(chat_session) {
+        if(MessageEventDelivered & event) {
+            client->onChatMessageDelivered(session_id, resource);
+        }
+        else if(MessageEventComposing & event) {
+            client->onChatMessageComposing(session_id, resource);
+        }
+    }
+#endif
+
+    // MessageEventOffline
+    // MessageEventDisplayed
+    // MessageEventInvalid
+    // MessageEventCancel
+}
+
+void XMPPClient::ChatImpl::disposeChatSessions()
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+    ChatSessions::const_iterator it = chat_sessions.begin();
+
+    for(; it != chat_sessions.end(); ++it) {
+        delete it->second;
+    }
+    chat_sessions.clear();
+    client->metrics.setGauge(XMPPMetrics::GAUGE_CHAT_SESSIONS, 0);
+    g_set_pool_gauges(client->metrics);
+}
+
+XMPPClient::ChatSession* XMPPClient::ChatImpl::findChatSession(const string& id)
+{
+    ChatSessions::const_iterator it = chat_sessions.find(id);
+
+    if(it != chat_sessions.end()) {
+        assert(it->second->session_id == id);
+        return it->second;
+    }
+    return 0;
+}
+
+// MessageSessionHandler
+void XMPPClient::ChatImpl::handleMessageSession(MessageSession *session)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_MESSAGE_SESSION,
+               session->target().username().c_str(), session->target().resource().c_str());
+
+    // WARN: can only dispose an old MessageSession with ClientBase::disposeMessageSession()
+    // WARN: cannot dispose the current MessageSession here
+
+    handleChatSession(session);
+}
+
+// MessageHandler
+void XMPPClient::ChatImpl::handleMessage(const Message& message, MessageSession *session)
+{
+    const string& body = message.body();
+
+    if(message.subtype() != Message::Error) {
+        // keep what the peer asked for, for raiseMessageEvent()
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+        ChatSession *chat_session = findChatSession(session->target().username());
+        if(chat_session && chat_session->session == session) {
+            const MessageEvent *event = message.findExtension<MessageEvent>(ExtMessageEvent);
+            if(!event) {
+                chat_session->requested_events = 0;
+                chat_session->last_id = "";
+            }
+            else if(!body.empty()) {
+                chat_session->requested_events = event->event();
+                chat_session->last_id = message.id();
+            }
+        }
+    }
+    else {
+        // the error reply carries the id of the message that failed
+        impl->getDeliveryImpl().complete(message.id(), MESSAGE_FAILED);
+    }
+
+    if(body.empty()) {
+        // do not raise XMPPClient::onChatMessage() on empty messages
+        // NOTE: this behavior was removed from the latest version (1.0.9)
+        // when triggered after MessageEventHandler::handleMessageEvent()
+        return;
+    }
+
+    const JID& target = session->target();
+    const DelayedDelivery *dd = message.when();
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CHAT_MESSAGE,
+               target.username().c_str(), target.resource().c_str(), body.size(), (dd != 0));
+
+    impl->publishEvent(XMPPEventBridge::TYPE_CHAT_MESSAGE, 0, 0, target.username(), target.resource(),
+                       body, message.subject(), (dd ? dd->stamp() : EmptyString));
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CHAT_MESSAGE);
+    client->onChatMessage(target.username(), target.resource(),
+                          body, message.subject(),
+                          (dd ? dd->stamp().c_str() : 0));
+}
+
+// MessageEventHandler
+void XMPPClient::ChatImpl::handleMessageEvent(const JID& from, MessageEventType event)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CHAT_MESSAGE_EVENT,
+               from.username().c_str(), from.resource().c_str(), (int)event);
+
+    // NOTE: gloox::MessageEvent does not read the id
+    handleChatMessageEvent(from.username(), from.resource(), event, EmptyString);
+}
+
+bool XMPPClient::ChatImpl::handleFastMessage(const XMPPStanzaReader::Message& message,
+                                             const string& user, const string& resource)
+{
+    // as gloox::MessageEvent reads it
+    int event = message.events ? message.events : MessageEventCancel;
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT);
+
+        // NOTE: only where gloox would pick the session by its full JID,
+        // new sessions and thread changes go through MessageSessionHandler
+        ChatSession *chat_session = findChatSession(user);
+        if(!chat_session || !message.from.equals(chat_session->session->target().full())) {
+            return false;
+        }
+        if(!message.thread.empty() && !message.thread.equals(chat_session->session->threadID())) {
+            return false;
+        }
+
+        // same as handleMessage()
+        if(!message.has_event) {
+            chat_session->requested_events = 0;
+            chat_session->last_id = "";
+        }
+        else if(!message.body.empty()) {
+            chat_session->requested_events = event;
+            message.id.copyTo(chat_session->last_id);
+        }
+    }
+
+    if(message.body.empty()) {
+        if(message.has_event) {
+            // same as MessageEventFilter
+            XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CHAT_MESSAGE_EVENT,
+                       user.c_str(), resource.c_str(), event);
+
+            message.event_id.copyTo(id_buffer);
+            handleChatMessageEvent(user, resource, (MessageEventType)event, id_buffer);
+        }
+        return true;
+    }
+
+    bool is_delayed = !message.stamp.empty();
+
+    message.body.copyTo(body_buffer);
+    message.subject.copyTo(subject_buffer);
+    message.stamp.copyTo(stamp_buffer);
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CHAT_MESSAGE,
+               user.c_str(), resource.c_str(), body_buffer.size(), is_delayed);
+
+    impl->publishEvent(XMPPEventBridge::TYPE_CHAT_MESSAGE, 0, 0, user, resource,
+                       body_buffer, subject_buffer, (is_delayed ? stamp_buffer : EmptyString));
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_CHAT_MESSAGE);
+    client->onChatMessage(user, resource,
+                          body_buffer, subject_buffer,
+                          (is_delayed ? stamp_buffer.c_str() : 0));
+    return true;
+}
+
+/// XMPPClient::GroupChatSession
+XMPPClient::GroupChatSession::GroupChatSession(ClientImpl *impl_, const string& group)
+    : session_id(group),
+      is_joined(false), room(0),
+      creation_state(CREATION_STATE_NONE),
+      impl(impl_)
+{
+    JID nick(group + "@" + impl->getClient()->getConfig().groupchat_server
+             + "/" + impl->getXmpp()->jid().username());
+
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_SESSION, group.c_str());
+
+    room = new PooledMUCRoom(impl->getXmpp(), nick,
+                             impl->getGroupChatImpl(), impl->getGroupChatImpl());
+}
+
+XMPPClient::GroupChatSession::~GroupChatSession()
+{
+    if(is_joined) {
+        is_joined = false;
+        room->leave();
+    }
+
+    delete room;
+}
+
+/// XMPPClient::GroupChatImpl
+XMPPClient::GroupChatImpl::GroupChatImpl(XMPPClient *client_, ClientImpl *impl_)
+    : MUCInvitationHandler(impl_->getXmpp()),
+      last_request_id(0),
+      client(client_), impl(impl_)
+{
+    impl->getXmpp()->registerStanzaExtension(new MUCQuery());
+}
+
+XMPPClient::GroupChatImpl::~GroupChatImpl()
+{
+    disposeGroupChatSessions();
+}
+
+#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
+bool XMPPClient::GroupChatImpl::declineGroupChatInvitation(const string& group, const string& user, const string& reason)
+{
+    string room = group + "@" + impl->getClient()->getConfig().groupchat_server;
+
+    JID jid(impl->getXmpp()->jid());
+    jid.setUsername(user);
+
+    // FIXME: TODO: is something wrong with jid.bareJID()?
+    Message *message = MUCRoom::declineInvitation(room, jid.bareJID(), reason);
+    impl->getXmpp()->send(*message);
+    delete message;
+
+    return true;
+}
+#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
+
+bool XMPPClient::GroupChatImpl::beginGroupChat(const string& group, const string& passwd,
+                                               int history_messages, const string& history_since)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session) {
+        return chat_session->is_joined;
+    }
+
+    chat_session = new GroupChatSession(impl, group);
+    assert(chat_session->session_id == group);
+    chat_sessions[chat_session->session_id] = chat_session;
+    client->metrics.setGauge(XMPPMetrics::GAUGE_GROUP_CHAT_SESSIONS, chat_sessions.size());
+    g_set_pool_gauges(client->metrics);
+
+    if(!passwd.empty()) {
+        chat_session->room->setPassword(passwd);
+    }
+
+    if(history_messages >= 0) {
+        chat_session->room->setRequestHistory(history_messages, MUCRoom::HistoryMaxStanzas);
+    }
+    else if(!history_since.empty()) {
+        chat_session->room->setRequestHistory(history_since);
+    }
+
+    chat_session->room->join();
+    chat_session->is_joined = true;
+
+    return true;
+}
+
+bool XMPPClient::GroupChatImpl::endGroupChat(const string& group, const string& reason)
+{
+    vector<Request> removed;
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+        GroupChatSession *chat_session = findGroupChatSession(group);
+        if(!chat_session) {
+            return false;
+        }
+
+        if(chat_session->is_joined) {
+            chat_session->is_joined = false;
+
+            // NOTE: after the messages queued for the room
+            const string xml = g_stanza_xml(chat_session->room->detach(reason));
+            impl->getSchedulerImpl().sendInOrder(SchedulerImpl::PRIORITY_PRESENCE, xml);
+            client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_PRESENCE);
+        }
+
+        // NOTE: failed now, their results are ignored
+        removeRequests(group, false, &removed);
+
+        delete chat_session;
+        chat_sessions.erase(group);
+        client->metrics.setGauge(XMPPMetrics::GAUGE_GROUP_CHAT_SESSIONS, chat_sessions.size());
+        g_set_pool_gauges(client->metrics);
+    }
+
+    for(vector<Request>::const_iterator it = removed.begin(); it != removed.end(); ++it) {
+        notifyRequest(it->id, group, it->operation, false);
+    }
+
+    discardPresences(group);
+    return true;
+}
+
+bool XMPPClient::GroupChatImpl::destroyGroupChat(const string& group, const string& reason, RequestId *id)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        MUCQuery *query = new MUCQuery(XMLNS_MUC_OWNER);
+        Tag *destroy = new Tag(query->getQuery(), "destroy");
+        if(!reason.empty()) {
+            new Tag(destroy, "reason", reason);
+        }
+        addRequest(group, DestroyRoom, IQ::Set, query, id);
+
+        chat_session->is_joined = false;
+
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::configureGroupChat(const string& group, const GroupChatConfig *config, RequestId *id)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        if(!config) {
+            if(chat_session->creation_state == GroupChatSession::CREATION_STATE_PENDING) {
+                addRequest(group, CreateInstantRoom, IQ::Set, g_instant_room_query(), id);
+                return true;
+            }
+        }
+        else {
+            // NOTE: kept with the request, handleIqID() fills the form from it
+            addRequest(group, RequestRoomConfig, IQ::Get, new MUCQuery(XMLNS_MUC_OWNER), id, config);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::cancelGroupChatCreation(const string& group)
+{
+    vector<Request> removed;
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+        GroupChatSession *chat_session = findGroupChatSession(group);
+        if(!chat_session || !chat_session->is_joined) {
+            return false;
+        }
+
+        // NOTE: as MUCRoom::cancelRoomCreation(), only while the room waits for its configuration
+        if(chat_session->creation_state == GroupChatSession::CREATION_STATE_PENDING) {
+            chat_session->creation_state = GroupChatSession::CREATION_STATE_NONE;
+            addRequest(group, CancelRoomCreation, IQ::Set, g_cancel_room_query(), 0);
+        }
+
+        // NOTE: the room is gone, the configuration results still to come are ignored
+        removeRequests(group, true, &removed);
+    }
+
+    for(vector<Request>::const_iterator it = removed.begin(); it != removed.end(); ++it) {
+        notifyRequest(it->id, group, it->operation, false);
+    }
+
+    return true;
+}
+
+bool XMPPClient::GroupChatImpl::setGroupChatSubject(const string& group, const string& subject)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        // NOTE: as MUCRoom::setSubject() writes it, after the messages queued for the room
+        Message message(Message::Groupchat, JID(group + "@" + client->getConfig().groupchat_server),
+                        EmptyString, subject);
+
+        impl->getSchedulerImpl().sendInOrder(SchedulerImpl::PRIORITY_CONTENT, g_stanza_xml(message));
+        client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE);
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::sendGroupChatMessage(const string& group, const string& message, MessageId *id)
+{
+    if(message.empty()) {
+        // do not let sending empty messages
+        return true;
+    }
+
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        // NOTE: MUCRoom::send() sets no id, the room reflection is matched on it
+        const string stanza_id = impl->getXmpp()->getID();
+        if(id) {
+            *id = impl->getDeliveryImpl().track(stanza_id, EmptyString);
+        }
+
+        stanza_buffer.clear();
+        XMPPStanzaWriter::appendGroupChatMessage(stanza_buffer, group + "@" + client->getConfig().groupchat_server,
+                                                 stanza_id, message);
+
+        impl->getSchedulerImpl().send(SchedulerImpl::PRIORITY_CONTENT, EmptyString, stanza_buffer);
+        client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE);
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::inviteToGroupChat(const string& group, const string& user, const string& reason)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        JID jid(impl->getXmpp()->jid());
+        jid.setUsername(user);
+
+        // NOTE: paced with the other stanzas, rooms are often filled with many invitations
+        stanza_buffer.clear();
+        XMPPStanzaWriter::appendGroupChatInvitation(stanza_buffer, group + "@" + client->getConfig().groupchat_server,
+                                                    impl->getXmpp()->getID(), jid.bare(), reason);
+
+        impl->getSchedulerImpl().send(SchedulerImpl::PRIORITY_PRESENCE, EmptyString, stanza_buffer);
+        client->metrics.increment(XMPPMetrics::COUNTER_STANZAS_OUT_MESSAGE);
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::kickFromGroupChat(const string& group, const string& user, const string& reason,
+                                                  RequestId *id)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        addRequest(group, SetRNone, IQ::Set, g_muc_item_query(user, "role", "none", reason), id);
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef XMPP_CLIENT_BAN_ENABLE
+bool XMPPClient::GroupChatImpl::banFromGroupChat(const string& group, const string& user, const string& reason,
+                                                 RequestId *id)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        addRequest(group, SetOutcast, IQ::Set, g_muc_item_query(user, "affiliation", "outcast", reason), id);
+        return true;
+    }
+
+    return false;
+}
+
+bool XMPPClient::GroupChatImpl::unbanFromGroupChat(const string& group, const string& user, RequestId *id)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        addRequest(group, SetANone, IQ::Set, g_muc_item_query(user, "affiliation", "none", ""), id);
+        return true;
+    }
+
+    return false;
+}
+#endif // XMPP_CLIENT_BAN_ENABLE
+
+bool XMPPClient::GroupChatImpl::listGroupChatUsers(const string& group)
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(group);
+    if(chat_session && chat_session->is_joined) {
+        chat_session->room->getRoomItems();
+        return true;
+    }
+
+    return false;
+}
+
+XMPPClient::GroupChatSession* XMPPClient::GroupChatImpl::findGroupChatSession(const string& id)
+{
+    GroupChatSessions::const_iterator it = chat_sessions.find(id);
+
+    if(it != chat_sessions.end()) {
+        assert(it->second->session_id == id);
+        return it->second;
+    }
+    return 0;
+}
+
+void XMPPClient::GroupChatImpl::disposeGroupChatSessions()
+{
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSessions::const_iterator it = chat_sessions.begin();
+
+    for(; it != chat_sessions.end(); ++it) {
+        delete it->second;
+    }
+    chat_sessions.clear();
+    client->metrics.setGauge(XMPPMetrics::GAUGE_GROUP_CHAT_SESSIONS, 0);
+    g_set_pool_gauges(client->metrics);
+
+    discardPresences();
+}
+
+void XMPPClient::GroupChatImpl::failRequests()
+{
+    vector<Request> removed;
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+        removeRequests("", false, &removed);
+    }
+
+    for(vector<Request>::const_iterator it = removed.begin(); it != removed.end(); ++it) {
+        notifyRequest(it->id, it->group, it->operation, false);
+    }
+}
+
+bool XMPPClient::GroupChatImpl::holdPresence(const string& group, const string& user,
+                                             bool online, const string& reason, int flags)
+{
+    if(!client->is_inactive || (flags & UNHELD_PRESENCE_FLAGS)) {
+        return false;
+    }
+
+    MutexGuard guard(held_presences_lock);
+
+    pair<HeldPresences::iterator, bool> result =
+        held_presences.insert(make_pair(make_pair(group, user), HeldPresence()));
+    if(!result.second) {
+        client->metrics.increment(XMPPMetrics::COUNTER_INACTIVE_PRESENCE);
+    }
+
+    HeldPresence& held = result.first->second;
+    held.online = online;
+    held.reason = reason;
+    held.flags = flags;
+
+    return true;
+}
+
+void XMPPClient::GroupChatImpl::releasePresences()
+{
+    HeldPresences presences;
+
+    {
+        MutexGuard guard(held_presences_lock);
+        presences.swap(held_presences);
+    }
+
+    for(HeldPresences::const_iterator it = presences.begin(); it != presences.end(); ++it) {
+        impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_USER_PRESENCE, it->second.online, it->second.flags,
+                           it->first.first, it->first.second, it->second.reason);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_USER_PRESENCE);
+        client->onGroupChatUserPresence(it->first.first, it->first.second,
+                                        it->second.online, it->second.reason, it->second.flags);
+    }
+}
+
+void XMPPClient::GroupChatImpl::releasePresences(void *data)
+{
+    static_cast<GroupChatImpl*>(data)->releasePresences();
+}
+
+void XMPPClient::GroupChatImpl::discardPresences(const string& group)
+{
+    MutexGuard guard(held_presences_lock);
+
+    if(group.empty()) {
+        held_presences.clear();
+        return;
+    }
+
+    HeldPresences::iterator it = held_presences.lower_bound(make_pair(group, string()));
+    while(it != held_presences.end() && it->first.first == group) {
+        held_presences.erase(it++);
+    }
+}
+
+void XMPPClient::GroupChatImpl::addRequest(const string& group, MUCOperation operation, IQ::IqType type,
+                                           MUCQuery *query, RequestId *id, const GroupChatConfig *config)
+{
+    Request request;
+    request.group = group;
+    request.id = id ? ++last_request_id : 0;
+    request.operation = operation;
+    if(config) {
+        request.config = *config;
+    }
+
+    if(id) {
+        *id = request.id;
+    }
+
+    sendRequest(request, type, query);
+}
+
+void XMPPClient::GroupChatImpl::sendRequest(const Request& request, IQ::IqType type, MUCQuery *query)
+{
+    // NOTE: kept before sending, the event loop may read the result at once
+    const string iq_id = impl->getXmpp()->getID();
+    requests[iq_id] = request;
+
+    PostedRequest *posted = new PostedRequest;
+    posted->group_chat = this;
+    posted->iq = new IQ(type, JID(request.group + "@" + client->getConfig().groupchat_server), iq_id);
+    posted->iq->addExtension(query);
+
+    // NOTE: a kick or destroy must not overtake the messages queued for the room
+    impl->getSchedulerImpl().callInOrder(SchedulerImpl::PRIORITY_PRESENCE, g_stanza_xml(*posted->iq).size(),
+                                         sendPostedRequest, posted);
+}
+
+void XMPPClient::GroupChatImpl::sendPostedRequest(void *data)
+{
+    PostedRequest *posted = static_cast<PostedRequest*>(data);
+
+    posted->group_chat->impl->getXmpp()->send(*posted->iq, posted->group_chat, 0);
+
+    delete posted->iq;
+    delete posted;
+}
+
+void XMPPClient::GroupChatImpl::removeRequests(const string& group, bool is_creation_only, vector<Request> *removed)
+{
+    Requests::iterator it = requests.begin();
+    while(it != requests.end()) {
+        const Request& request = it->second;
+
+        bool is_creation = (request.operation == CreateInstantRoom
+                            || request.operation == RequestRoomConfig
+                            || request.operation == SendRoomConfig);
+
+        if((group.empty() || request.group == group) && (!is_creation_only || is_creation)) {
+            removed->push_back(request);
+            requests.erase(it++);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+static XMPPClient::GroupChatOperation g_group_chat_operation(MUCOperation operation)
+{
+    switch(operation) {
+    case SetRNone:
+        return XMPPClient::GROUP_CHAT_KICK;
+    case SetOutcast:
+        return XMPPClient::GROUP_CHAT_BAN;
+    case SetANone:
+        return XMPPClient::GROUP_CHAT_UNBAN;
+    case DestroyRoom:
+        return XMPPClient::GROUP_CHAT_DESTROY;
+    default:
+        break;
+    }
+    return XMPPClient::GROUP_CHAT_CONFIGURE;
+}
+
+void XMPPClient::GroupChatImpl::notifyRequest(RequestId id, const string& group, MUCOperation operation, bool success)
+{
+    if(!id) {
+        return;
+    }
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_REQUEST_RESULT);
+    client->onGroupChatRequestResult(id, group, g_group_chat_operation(operation), success);
+}
+
+// MUCRoomHandler
+void XMPPClient::GroupChatImpl::handleMUCParticipantPresence(MUCRoom *room, const MUCRoomParticipant participant, const Presence& presence)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_PRESENCE,
+               room->name().c_str(), (participant.nick ? participant.nick->resource().c_str() : "n/a"),
+               (int)presence.presence(), participant.flags);
+
+    const string& reason =
+        participant.reason.empty() ?
+        participant.status : participant.reason;
+
+    bool online;
+
+    switch(presence.presence()) {
+    case Presence::Available:
+    case Presence::Chat:
+        online = true;
+        break;
+
+    case Presence::Away:
+    case Presence::DND:
+    case Presence::XA:
+    case Presence::Unavailable:
+        online = false;
+        break;
+
+    case Presence::Probe:
+    case Presence::Error:
+    case Presence::Invalid:
+    default:
+        return;
+    }
+
+    if(holdPresence(room->name(), participant.nick->resource(), online, reason, participant.flags)) {
+        return;
+    }
+
+    impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_USER_PRESENCE, online, participant.flags,
+                       room->name(), participant.nick->resource(), reason);
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_USER_PRESENCE);
+    client->onGroupChatUserPresence(room->name(), participant.nick->resource(),
+                                    online, reason.c_str(), participant.flags);
+}
+
+void XMPPClient::GroupChatImpl::handleMUCMessage(MUCRoom *room, const Message& message, bool priv)
+{
+    const string& user = message.from().resource();
+    const DelayedDelivery *dd = message.when();
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_MESSAGE,
+               room->name().c_str(), user.c_str(), priv, (dd != 0));
+
+    if(priv) {
+        impl->getChatImpl()->handlePrivateChatMessage(user, room->name(), message);
+    }
+    else {
+        if(user == room->nick() && !message.id().empty()) {
+            // the room reflects our own messages
+            impl->getDeliveryImpl().complete(message.id(), MESSAGE_ACKNOWLEDGED);
+        }
+
+        impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_MESSAGE, 0, 0, room->name(), user,
+                           message.body(), (dd ? dd->stamp() : EmptyString));
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_MESSAGE);
+        client->onGroupChatMessage(room->name(), user, message.body(),
+                                   (dd ? dd->stamp().c_str() : 0));
+    }
+}
+
+bool XMPPClient::GroupChatImpl::handleFastMessage(const XMPPStanzaReader::Message& message,
+                                                  const string& group, const string& user)
+{
+    // NOTE: subjects, status codes and invitations go through MUCRoom
+    if(message.body.empty() || !message.subject.empty()) {
+        return false;
+    }
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+        GroupChatSession *chat_session = findGroupChatSession(group);
+        if(!chat_session || !chat_session->is_joined) {
+            return false;
+        }
+    }
+
+    bool is_delayed = !message.stamp.empty();
+
+    if(!message.id.empty() && user == impl->getXmpp()->jid().username()) {
+        // same as handleMUCMessage()
+        message.id.copyTo(id_buffer);
+        impl->getDeliveryImpl().complete(id_buffer, MESSAGE_ACKNOWLEDGED);
+    }
+
+    message.body.copyTo(body_buffer);
+    message.stamp.copyTo(stamp_buffer);
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_MESSAGE,
+               group.c_str(), user.c_str(), false, is_delayed);
+
+    impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_MESSAGE, 0, 0, group, user,
+                       body_buffer, (is_delayed ? stamp_buffer : EmptyString));
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_MESSAGE);
+    client->onGroupChatMessage(group, user, body_buffer,
+                               (is_delayed ? stamp_buffer.c_str() : 0));
+    return true;
+}
+
+bool XMPPClient::GroupChatImpl::handleMUCRoomCreation(MUCRoom *room)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_CREATION, room->name().c_str());
+
+    MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+    GroupChatSession *chat_session = findGroupChatSession(room->name());
+    if(chat_session) {
+        assert(chat_session->room == room);
+
+        bool accept_default_config;
+        {
+            XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_CREATION);
+            accept_default_config = client->onGroupChatCreation(room->name());
+        }
+
+        if(accept_default_config == true) {
+            chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
+            return true;
+        }
+        else {
+            chat_session->creation_state = GroupChatSession::CREATION_STATE_PENDING;
+        }
+    }
+
+    return false;
+}
+
+void XMPPClient::GroupChatImpl::handleMUCSubject(MUCRoom *room, const string& nick, const string& subject)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_SUBJECT,
+               room->name().c_str(), nick.c_str(), subject.size());
+
+    if(!nick.empty()) {
+        impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_SUBJECT, 0, 0, room->name(), nick, subject);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_SUBJECT);
+        client->onGroupChatSubject(room->name(), nick, subject);
+    }
+}
+
+void XMPPClient::GroupChatImpl::handleMUCInviteDecline(MUCRoom *room, const JID& invitee, const string& reason)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_INVITE_DECLINE,
+               room->name().c_str(), invitee.username().c_str());
+
+    impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_INVITE_DECLINE, 0, 0,
+                       room->name(), invitee.username(), reason);
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_INVITE_DECLINE);
+    client->onGroupChatInviteDecline(room->name(), invitee.username(), reason);
+}
+
+void XMPPClient::GroupChatImpl::handleMUCError(MUCRoom *room, StanzaError error)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_ERROR, XMPPTrace::EVENT_GROUP_CHAT_ERROR,
+               room->name().c_str(), 0, (int)error);
+
+    impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_ERROR, error, 0, room->name());
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_ERROR);
+    client->onGroupChatError(room->name(), error);
+}
+
 #ifdef _DEBUG
-    xmpp->logInstance().registerLogHandler(LogLevelDebug, LogAreaAll, this);
+static void g_show_room_data_form_fields(const DataFormFieldContainer::FieldList& fields)
+{
+    DataFormFieldContainer::FieldList::const_iterator it;
+    const DataFormField *field;
+
+    for(it = fields.begin(); it != fields.end(); ++it) {
+        field = *it;
+        ::fprintf(stderr, "[name='%s' required=%s label='%s' description='%s' type=%d ",
+                  field->name().c_str(), (field->required() ? "yes" : "no"),
+                  field->label().c_str(), field->description().c_str(), (int)field->type());
+
+        if(field->type() == DataFormField::TypeTextMulti) {
+            ::fprintf(stderr, "values=[");
+
+            const StringList& values = field->values();
+            StringList::const_iterator it;
+
+            for(it = values.begin(); it != values.end(); ++it) {
+                ::fprintf(stderr, "'%s' ", it->c_str());
+            }
+
+            ::fprintf(stderr, "]] ");
+        }
+        else {
+            ::fprintf(stderr, "value='%s'] ", field->value().c_str());
+        }
+    }
+}
+
+static void g_show_room_data_form(const DataForm& form)
+{
+    ::fprintf(stderr, "title='%s' type=%d instructions=[",
+              form.title().c_str(), (int)form.type());
+
+    StringList::const_iterator it;
+    for(it = form.instructions().begin(); it != form.instructions().end(); ++it) {
+        ::fprintf(stderr, "'%s' ", it->c_str());
+    }
+
+    ::fprintf(stderr, "] items=[");
+
+    const DataForm::ItemList& items = form.items();
+    DataForm::ItemList::const_iterator it_item;
+
+    for(it_item = items.begin(); it_item != items.end(); ++it_item) {
+        g_show_room_data_form_fields((*it_item)->fields());
+    }
+
+    ::fprintf(stderr, "] fields=[");
+
+    g_show_room_data_form_fields(form.fields());
+
+    ::fprintf(stderr, "]");
+}
+#endif // _DEBUG
+
+void XMPPClient::GroupChatImpl::handleMUCInfo(MUCRoom *room, int features, const string& name, const DataForm *form)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_INFO,
+               room->name().c_str(), name.c_str(), features);
+
+#ifdef _DEBUG
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCInfo(): "
+              "group='%s' features=%d name='%s' form=[",
+              room->name().c_str(), features, name.c_str());
+
+    if(form) {
+        g_show_room_data_form(*form);
+    }
+    else {
+        ::fprintf(stderr, "n/a");
+    }
+
+    ::fprintf(stderr, "]\n");
+#endif // _DEBUG
+}
+
+#ifdef _DEBUG
+static void g_show_room_items(const Disco::ItemList& items)
+{
+    Disco::ItemList::const_iterator it;
+    gloox::Disco::Item *item;
+
+    for(it = items.begin(); it != items.end(); ++it) {
+        item = *it;
+        ::fprintf(stderr, "[JID='%s' name='%s' node='%s'] ",
+                  item->jid().full().c_str(), item->name().c_str(), item->node().c_str());
+    }
+}
+#endif // _DEBUG
+
+void XMPPClient::GroupChatImpl::handleMUCItems(MUCRoom *room, const Disco::ItemList& items)
+{
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_ITEMS,
+               room->name().c_str(), 0, items.size());
+
+#ifdef _DEBUG
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCItems(): "
+              "group='%s' items=[", room->name().c_str());
+
+    g_show_room_items(items);
+
+    ::fprintf(stderr, "]\n");
 #endif // _DEBUG
+
+    StringList users;
+    Disco::ItemList::const_iterator it;
+
+    for(it = items.begin(); it != items.end(); ++it) {
+        users.push_back((*it)->name());
+    }
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_USERS_LIST);
+    client->onGroupChatUsersList(room->name(), users);
 }
 
-XMPPClient::ClientImpl::~ClientImpl()
+// MUCInvitationHandler
+void XMPPClient::GroupChatImpl::handleMUCInvitation(const JID& room, const JID& from, const string& reason,
+                                                    const string& body, const string& password, bool cont, const string& thread)
 {
-    delete group_chat_impl;
-    delete chat_impl;
-    delete xmpp;
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_INVITATION,
+               room.username().c_str(), from.username().c_str(), cont);
+
+    // NOTE: without the password, the consumer only learns of the invitation
+    impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_INVITE, 0, 0, room.username(), from.username(), reason);
+
+    bool accept_invitation;
+    {
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_INVITE);
+        accept_invitation = client->onGroupChatInvite(room.username(), from.username(), reason, password);
+    }
+
+    if(!accept_invitation) {
+#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
+        // decline invitation
+        Message *message = MUCRoom::declineInvitation(room, from);
+        impl->getXmpp()->send(*message);
+        delete message;
+#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
+    }
 }
 
-// ConnectionListener
-void XMPPClient::ClientImpl::onConnect()
-{
 #ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ClientImpl::onConnect()\n");
-#endif // _DEBUG
-
-    client->onConnect();
+static void g_show_config_room_items(const MUCListItemList& items)
+{
+    MUCListItemList::const_iterator it;
+    for(it = items.begin(); it != items.end(); ++it) {
+        ::fprintf(stderr, "[JID='%s' nick='%s' affiliation=%d role=%d reason='%s'] ",
+                  it->jid().full().c_str(), it->nick().c_str(),
+                  (int)it->affiliation(), (int)it->role(), it->reason().c_str());
+    }
 }
+#endif // _DEBUG
 
-void XMPPClient::ClientImpl::onDisconnect(ConnectionError error)
+// MUCRoomConfigHandler
+void XMPPClient::GroupChatImpl::handleMUCConfigList(MUCRoom* room, const MUCListItemList& items, MUCOperation operation)
 {
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_CONFIG_LIST,
+               room->name().c_str(), 0, (int)operation, items.size());
+
 #ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ClientImpl::onDisconnect(): "
-              "error=%d\n", (int)error);
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCConfigList(): "
+              "group='%s' operation=%d items=[\n",
+              room->name().c_str(), (int)operation);
+
+    g_show_config_room_items(items);
+
+    ::fprintf(stderr, "]\n");
 #endif // _DEBUG
+}
 
-    client->onDisconnect(error);
+static DataForm* g_configure_room_dataform(const XMPPClient::GroupChatConfig& config, const DataForm& form)
+{
+    DataForm *new_form = new DataForm(TypeSubmit, form.instructions(), form.title());
+    bool status = false;
+
+    do {
+        if(!form.hasField("muc#roomconfig_roomname")) break;
+        new_form->addField(DataFormField::TypeTextSingle, "muc#roomconfig_roomname",
+                           config.title);
+
+        if(!form.hasField("muc#roomconfig_roomdesc")) break;
+        new_form->addField(DataFormField::TypeTextSingle, "muc#roomconfig_roomdesc",
+                           config.description);
+
+        if(!form.hasField("muc#roomconfig_persistentroom")) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_persistentroom",
+                           config.is_persistent ? "1" : "0");
+
+        if(!(form.hasField("muc#roomconfig_passwordprotectedroom")
+             && form.hasField("muc#roomconfig_roomsecret"))) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_passwordprotectedroom",
+                           config.passwd.empty() ? "0" : "1");
+        new_form->addField(DataFormField::TypeTextPrivate, "muc#roomconfig_roomsecret",
+                           config.passwd);
+
+        if(!form.hasField("muc#roomconfig_maxusers")) break;
+        new_form->addField(DataFormField::TypeListSingle, "muc#roomconfig_maxusers",
+                           config.max_number_users);
+
+        if(!form.hasField("muc#roomconfig_membersonly")) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_membersonly",
+                           config.is_members_only ? "1" : "0");
+
+        if(!form.hasField("muc#roomconfig_changesubject")) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_changesubject",
+                           config.is_user_subject_change_allowed ? "1" : "0");
+
+        if(!form.hasField("muc#roomconfig_allowinvites")) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_allowinvites",
+                           config.is_user_invite_send_allowed ? "1" : "0");
+
+        if(!form.hasField("muc#roomconfig_allowvoicerequests")) break;
+        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_allowvoicerequests",
+                           config.is_user_send_voice_request_allowed ? "1" : "0");
+
+        status = true;
+    }
+    while(0);
+
+    if(!status) {
+        delete new_form;
+        new_form = 0;
+    }
+    return new_form;
 }
 
-bool XMPPClient::ClientImpl::onTLSConnect(const CertInfo& info)
+void XMPPClient::GroupChatImpl::handleMUCConfigForm(MUCRoom* room, const DataForm& form)
 {
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_CONFIG_FORM, room->name().c_str());
+
+    // NOTE: configureGroupChat() asks for the form itself, see handleIqID()
 #ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ClientImpl::onTLSConnect()\n");
-#endif // _DEBUG
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCConfigForm(): "
+              "group='%s' form=[", room->name().c_str());
 
-    return client->onTlsConnect(info);
+    g_show_room_data_form(form);
+
+    ::fprintf(stderr, "]\n");
+#endif // _DEBUG
 }
 
-#ifdef _DEBUG
-static const char* g_log_level_string(LogLevel level)
+void XMPPClient::GroupChatImpl::handleMUCConfigResult(MUCRoom* room, bool success, MUCOperation operation)
 {
-    switch(level) {
-    case LogLevelDebug:
-        return "DEBUG";
-    case LogLevelWarning:
-        return "WARN";
-    case LogLevelError:
-    default:
-        break;
-    }
-    return "ERROR";
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_CONFIG_RESULT,
+               room->name().c_str(), 0, success, (int)operation);
+
+    // NOTE: what MUCRoom sends itself only, the instant room accepted by
+    // handleMUCRoomCreation()
+    notifyOperation(room->name(), operation, success);
 }
 
-static const char* g_log_area_string(LogArea area)
+void XMPPClient::GroupChatImpl::notifyOperation(const string& group, MUCOperation operation, bool success)
 {
-    switch(area) {
-    case LogAreaClassParser:
-        return "CLASS_PARSER";
-    case LogAreaClassConnectionTCPBase:
-        return "CLASS_CONNECTION_TCP_BASE";
-    case LogAreaClassClient:
-        return "CLASS_CLIENT";
-    case LogAreaClassClientbase:
-        return "CLASS_CLIENT_BASE";
-    case LogAreaClassComponent:
-        return "CLASS_COMPONENT";
-    case LogAreaClassDns:
-        return "CLASS_DNS";
-    case LogAreaClassConnectionHTTPProxy:
-        return "CLASS_CONNECTION_HTTP_PROXY";
-    case LogAreaClassConnectionSOCKS5Proxy:
-        return "CLASS_CONNECTION_SOCKS5_PROXY";
-    case LogAreaClassConnectionTCPClient:
-        return "CLASS_CONNECTION_TCP_CLIENT";
-    case LogAreaClassConnectionTCPServer:
-        return "CLASS_CONNECTION_TCP_SERVER";
-    case LogAreaClassS5BManager:
-        return "CLASS_S5B_MANAGER";
-    case LogAreaClassSOCKS5Bytestream:
-        return "CLASS_SOCKS5_BYTE_STREAM";
-    case LogAreaClassConnectionBOSH:
-        return "CLASS_CONNECTION_BOSH";
-    case LogAreaClassConnectionTLS:
-        return "CLASS_CONNECTION_TLS";
-    case LogAreaAllClasses:
-        return "ALL_CLASSES";
-    case LogAreaXmlIncoming:
-        return "XML_INCOMING";
-    case LogAreaXmlOutgoing:
-        return "XML_OUTGOING";
-    case LogAreaUser:
-        return "USER";
+    switch(operation) {
+    case SetRNone:
+    {
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_KICK_RESULT);
+        client->onGroupChatKickResult(group, success);
+    }
+    break;
+#ifdef XMPP_CLIENT_BAN_ENABLE
+    case SetOutcast:
+    {
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_BAN_RESULT);
+        client->onGroupChatBanResult(group, success);
+    }
+    break;
+    case SetANone:
+    {
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_UNBAN_RESULT);
+        client->onGroupChatUnbanResult(group, success);
+    }
+    break;
+#endif // XMPP_CLIENT_BAN_ENABLE
+    case CreateInstantRoom:
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
+
+        GroupChatSession *chat_session = findGroupChatSession(group);
+        if(chat_session) {
+            chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
+
+            impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_CREATE, success, 0, group);
+
+            XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_CREATE);
+            client->onGroupChatCreate(group, success);
+        }
+    }
+    break;
+    case DestroyRoom:
+    {
+        impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_DESTROY, success, 0, group);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_DESTROY);
+        client->onGroupChatDestroy(group, success);
+    }
+    break;
+
+    case CancelRoomCreation:
+    case RequestRoomConfig:
+    case SendRoomConfig:
+        // FIXME: do we need signal error cases? (sometimes it doesn't event happen)
+        //if(!success) {
+        //    client->onGroupChatOperationError(group, operation);
+        //}
+#ifndef XMPP_CLIENT_BAN_ENABLE
+    case SetOutcast:
+    case SetANone:
+#endif // XMPP_CLIENT_BAN_ENABLE
     default:
         break;
     }
-    return "UNKNOWN";
 }
 
-void XMPPClient::ClientImpl::handleLog(LogLevel level, LogArea area, const string& message)
+// the configuration form of a muc#owner result filled from config, 0 if it has none or misses a field
+static DataForm* g_configure_room_dataform(const XMPPClient::GroupChatConfig& config, const IQ& iq)
 {
-    ::fprintf(stderr, ">>> %s >>> %s >>> %s\n",
-              g_log_level_string(level), g_log_area_string(area), message.c_str());
-}
-#endif // _DEBUG
+    const MUCQuery *query = iq.findExtension<MUCQuery>(ExtUser);
+    const Tag *x = query ? query->getQuery()->findChild("x", "xmlns", XMLNS_X_DATA) : 0;
+    if(!x) {
+        return 0;
+    }
 
-/// XMPPClient::ChatSession
-XMPPClient::ChatSession::ChatSession(ClientImpl *impl_, MessageSession *session_)
-    : session_id(session_->target().username()),
-      resource(session_->target().resource()),
-      session(session_),
-      message_event_filter(0),
-      impl(impl_)
-{
-    assert(!resource.empty());
+    DataForm form(x);
 
-    session->registerMessageHandler(impl->getChatImpl());
+#ifdef _DEBUG
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleIqID(): form=[");
 
-    try {
-        message_event_filter = new MessageEventFilter(session);
-        message_event_filter->registerMessageEventHandler(impl->getChatImpl());
-    }
-    catch(...) {
-        impl->getXmpp()->disposeMessageSession(session);
+    g_show_room_data_form(form);
 
-        throw;
-    }
+    ::fprintf(stderr, "]\n");
+#endif // _DEBUG
+
+    return g_configure_room_dataform(config, form);
 }
 
-XMPPClient::ChatSession::ChatSession(ClientImpl *impl_, const string& user, const string& resource_)
-    : session_id(user),
-      resource(resource_),
-      session(0),
-      message_event_filter(0),
-      impl(impl_)
+// IqHandler
+bool XMPPClient::GroupChatImpl::handleIq(const IQ& iq)
 {
-    JID jid(impl->getXmpp()->jid());
-    jid.setUsername(user);
-    jid.setResource((resource == "*") ? "" : resource);
+    (void)iq;
+    return false;
+}
+
+void XMPPClient::GroupChatImpl::handleIqID(const IQ& iq, int context)
+{
+    (void)context;
+
+    bool success = (iq.subtype() == IQ::Result);
+    bool is_form_sent = false;  // completed by the result of the form instead
+    bool is_created = false;    // the form of a room being created was answered
+    Request request;
+
+    {
+        MetricsMutexGuard guard(chat_sessions_lock, client->metrics, XMPPMetrics::HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT);
 
-    session = new MessageSession(impl->getXmpp(), jid, (resource != "*"));
-    session->registerMessageHandler(impl->getChatImpl());
+        Requests::iterator it = requests.find(iq.id());
+        if(it == requests.end()) {
+            // NOTE: failed already, the group was left or its creation cancelled
+            return;
+        }
+        request = it->second;
+        requests.erase(it);
+
+        XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_GROUP_CHAT_REQUEST_RESULT,
+                   request.group.c_str(), 0, success, (int)request.operation);
+
+        if(request.operation == RequestRoomConfig) {
+            DataForm *new_form = success ? g_configure_room_dataform(request.config, iq) : 0;
+            if(new_form) {
+                MUCQuery *query = new MUCQuery(XMLNS_MUC_OWNER);
+                query->getQuery()->addChild(new_form->tag());
+                delete new_form;
+
+                // NOTE: same handle, under a new iq id
+                request.operation = SendRoomConfig;
+                sendRequest(request, IQ::Set, query);
+                is_form_sent = true;
+            }
+            else {
+                success = false;
+            }
 
-    try {
-        message_event_filter = new MessageEventFilter(session);
-        message_event_filter->registerMessageEventHandler(impl->getChatImpl());
+            GroupChatSession *chat_session = findGroupChatSession(request.group);
+            if(chat_session && chat_session->creation_state == GroupChatSession::CREATION_STATE_PENDING) {
+                chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
+                is_created = true;
+            }
+        }
     }
-    catch(...) {
-        impl->getXmpp()->disposeMessageSession(session);
 
-        throw;
+    if(is_created) {
+        impl->publishEvent(XMPPEventBridge::TYPE_GROUP_CHAT_CREATE, success, 0, request.group);
+
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_GROUP_CHAT_CREATE);
+        client->onGroupChatCreate(request.group, success);
     }
+
+    if(is_form_sent) {
+        return;
+    }
+
+    notifyRequest(request.id, request.group, request.operation, success);
+    notifyOperation(request.group, request.operation, success);
 }
 
-XMPPClient::ChatSession::~ChatSession()
+void XMPPClient::GroupChatImpl::handleMUCRequest(MUCRoom* room, const DataForm& form)
 {
-    session->disposeMessageFilter(message_event_filter);
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_GROUP_CHAT_REQUEST, room->name().c_str());
 
-    impl->getXmpp()->disposeMessageSession(session);
+#ifdef _DEBUG
+    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCRequest(): "
+              "group='%s' form=[", room->name().c_str());
+
+    g_show_room_data_form(form);
+
+    ::fprintf(stderr, "]\n");
+#endif // _DEBUG
 }
 
-/// XMPPClient::ChatImpl
-XMPPClient::ChatImpl::ChatImpl(XMPPClient *client_, ClientImpl *impl_)
-    : client(client_), impl(impl_)
+/// XMPPClient::DeliveryImpl
+XMPPClient::DeliveryImpl::DeliveryImpl(XMPPClient *client_)
+    : last_id(0), client(client_)
 {
 }
 
-XMPPClient::ChatImpl::~ChatImpl()
+XMPPClient::MessageId XMPPClient::DeliveryImpl::track(const string& id, const string& user)
 {
-    disposeChatSessions();
+    uint64_t now = XMPPClock::now();
+
+    MutexGuard guard(pending_lock);
+
+    Pending& pending = pending_messages[id];
+    pending.id = ++last_id;
+    pending.user = user;
+    pending.sent = now;
+    pending.deadline = now + (uint64_t)client->getConfig().message_timeout * 1000000ULL;
+    pending.is_acknowledged = false;
+
+    deadlines.push_back(id);
+    if(!user.empty()) {
+        user_queues[user].push_back(id);
+    }
+
+    client->metrics.setGauge(XMPPMetrics::GAUGE_PENDING_MESSAGES, pending_messages.size());
+    return pending.id;
 }
 
-bool XMPPClient::ChatImpl::sendChatMessage(const string& user, const string& message, const string& subject, const string& resource)
+bool XMPPClient::DeliveryImpl::complete(const string& id, MessageStatus status)
 {
-    if(message.empty()) {
-        // do not let sending empty messages
-        return true;
-    }
+    Completion completion;
 
-    MutexGuard guard(chat_sessions_lock);
+    {
+        MutexGuard guard(pending_lock);
 
-    ChatSession *chat_session = findChatSession(user);
-    if(!resource.empty()) {
-        if(chat_session) {
-            if(chat_session->resource != resource) {
-                delete chat_session;
-                chat_session = 0;
-            }
+        PendingMessages::iterator it = pending_messages.find(id);
+        if(it == pending_messages.end()) {
+            return false;
         }
-    }
 
-    if(!chat_session) {
-        chat_session = new ChatSession(impl, user, resource);
-        assert(chat_session->session_id == user);
-        chat_sessions[chat_session->session_id] = chat_session;
+        if(!update(it, status, XMPPClock::now(), &completion)) {
+            return false;
+        }
     }
 
-    chat_session->session->send(message, subject);
+    notify(completion);
     return true;
 }
 
-bool XMPPClient::ChatImpl::sendChatMessageComposing(const string& user, const string& resource)
+bool XMPPClient::DeliveryImpl::completeOldest(const string& user, MessageStatus status)
 {
-    MutexGuard guard(chat_sessions_lock);
+    Completion completion;
 
-    ChatSession *chat_session = findChatSession(user);
-    if(resource.empty()) {
-        if(chat_session) {
-            chat_session->message_event_filter->raiseMessageEvent(MessageEventComposing);
-            return true;
+    {
+        MutexGuard guard(pending_lock);
+
+        UserQueues::const_iterator queue = user_queues.find(user);
+        if(queue == user_queues.end()) {
+            return false;
         }
-    }
-    else  {
-        if(chat_session) {
-            if(chat_session->resource != resource) {
-                delete chat_session;
-                chat_session = 0;
+
+        const deque<string>& ids = queue->second;
+        PendingMessages::iterator it = pending_messages.find(ids.front());
+        assert(it != pending_messages.end());
+
+        if(status == MESSAGE_ACKNOWLEDGED) {
+            // NOTE: the oldest one not stored offline yet
+            deque<string>::const_iterator id = ids.begin();
+            for(; id != ids.end(); ++id) {
+                it = pending_messages.find(*id);
+                if(it != pending_messages.end() && !it->second.is_acknowledged) {
+                    break;
+                }
             }
-        }
 
-        if(!chat_session) {
-            chat_session = new ChatSession(impl, user, resource);
-            assert(chat_session->session_id == user);
-            chat_sessions[chat_session->session_id] = chat_session;
+            if(id == ids.end()) {
+                return false;
+            }
         }
 
-        chat_session->message_event_filter->raiseMessageEvent(MessageEventComposing);
-        return true;
+        if(!update(it, status, XMPPClock::now(), &completion)) {
+            return false;
+        }
     }
 
-    return false;
+    notify(completion);
+    return true;
 }
 
-bool XMPPClient::ChatImpl::sendChatMessageDelivered(const string& user, const string& resource)
+int XMPPClient::DeliveryImpl::expire()
 {
-    MutexGuard guard(chat_sessions_lock);
+    vector<Completion> completions;
+    int timeout = -1;
 
-    ChatSession *chat_session = findChatSession(user);
-    if(resource.empty()) {
-        if(chat_session) {
-            chat_session->message_event_filter->raiseMessageEvent(MessageEventDelivered);
-            return true;
-        }
-    }
-    else  {
-        if(chat_session) {
-            if(chat_session->resource != resource) {
-                delete chat_session;
-                chat_session = 0;
+    {
+        MutexGuard guard(pending_lock);
+
+        uint64_t now = XMPPClock::now();
+
+        while(!deadlines.empty()) {
+            PendingMessages::iterator it = pending_messages.find(deadlines.front());
+            if(it != pending_messages.end()) {
+                if(it->second.deadline > now) {
+                    uint64_t wait = (it->second.deadline - now) / 1000 + 1;
+                    timeout = (wait < (uint64_t)INT_MAX) ? (int)wait : INT_MAX;
+                    break;
+                }
+
+                if(it->second.is_acknowledged) {
+                    // no receipt came, already notified
+                    remove(it);
+                }
+                else {
+                    completions.push_back(Completion());
+                    update(it, MESSAGE_TIMEOUT, now, &completions.back());
+                }
             }
-        }
 
-        if(!chat_session) {
-            chat_session = new ChatSession(impl, user, resource);
-            assert(chat_session->session_id == user);
-            chat_sessions[chat_session->session_id] = chat_session;
+            deadlines.pop_front();
         }
+    }
 
-        chat_session->message_event_filter->raiseMessageEvent(MessageEventDelivered);
-        return true;
+    for(vector<Completion>::const_iterator it = completions.begin(); it != completions.end(); ++it) {
+        notify(*it);
     }
 
-    return false;
+    return timeout;
 }
 
-void XMPPClient::ChatImpl::handlePrivateChatMessage(const string& user, const string& room, const Message& message)
+void XMPPClient::DeliveryImpl::fail()
 {
-    const string& body = message.body();
-
-    if(body.empty()) {
-        // do not raise XMPPClient::onChatMessage() on empty messages
-        // NOTE: this behavior was removed from the latest version (1.0.9)
-        // when triggered after MessageEventHandler::handleMessageEvent()
-        return;
-    }
-
-    const DelayedDelivery *dd = message.when();
-    // FIXME: should create sessions for delayed messages?
+    vector<Completion> completions;
 
     {
-        MutexGuard guard(chat_sessions_lock);
+        MutexGuard guard(pending_lock);
 
-        ChatSession *chat_session = findChatSession(user);
-        if(!chat_session) {
-            chat_session = new ChatSession(impl, user);
-            chat_sessions[chat_session->session_id] = chat_session;
+        uint64_t now = XMPPClock::now();
+
+        for(deque<string>::const_iterator id = deadlines.begin(); id != deadlines.end(); ++id) {
+            PendingMessages::const_iterator it = pending_messages.find(*id);
+            if(it != pending_messages.end() && !it->second.is_acknowledged) {
+                Completion completion = {it->second.id, MESSAGE_FAILED, now - it->second.sent};
+                completions.push_back(completion);
+            }
         }
-        assert(chat_session->session_id == user);
+
+        pending_messages.clear();
+        user_queues.clear();
+        deadlines.clear();
+
+        client->metrics.setGauge(XMPPMetrics::GAUGE_PENDING_MESSAGES, 0);
     }
 
-    client->onChatMessage(user, room,
-                          body, message.subject(),
-                          (dd ? dd->stamp().c_str() : 0));
+    for(vector<Completion>::const_iterator it = completions.begin(); it != completions.end(); ++it) {
+        notify(*it);
+    }
 }
 
-void XMPPClient::ChatImpl::handleChatSession(MessageSession *session)
+bool XMPPClient::DeliveryImpl::update(PendingMessages::iterator it, MessageStatus status,
+                                      uint64_t now, Completion *completion)
 {
-    // WARN: can only dispose an old MessageSession with ClientBase::disposeMessageSession()
-    // WARN: cannot dispose the current MessageSession here
+    Pending& pending = it->second;
 
-    MutexGuard guard(chat_sessions_lock);
+    if(pending.is_acknowledged) {
+        // the receipt of a message stored offline is reported too, not its error
+        if(status == MESSAGE_ACKNOWLEDGED) {
+            return false;
+        }
+        if(status != MESSAGE_DELIVERED) {
+            remove(it);
+            return false;
+        }
+    }
 
-    const string& session_id = session->target().username();
-    ChatSession *chat_session = findChatSession(session_id);
-    if(chat_session) {
-        delete chat_session;
+    completion->id = pending.id;
+    completion->status = status;
+    completion->latency = now - pending.sent;
+
+    if(status == MESSAGE_ACKNOWLEDGED && !pending.user.empty()) {
+        // NOTE: keep its place in the user queue for the receipt
+        pending.is_acknowledged = true;
+    }
+    else {
+        remove(it);
     }
 
-    chat_sessions[session_id] = new ChatSession(impl, session);
+    return true;
 }
 
-void XMPPClient::ChatImpl::handleChatMessageEvent(const JID& from, MessageEventType event)
+void XMPPClient::DeliveryImpl::remove(PendingMessages::iterator it)
 {
-    if(MessageEventDelivered & event) {
-        client->onChatMessageDelivered(from.username(), from.resource());
-    }
-    else if(MessageEventComposing & event) {
-        client->onChatMessageComposing(from.username(), from.resource());
+    UserQueues::iterator queue = user_queues.end();
+    if(!it->second.user.empty()) {
+        queue = user_queues.find(it->second.user);
     }
 
-#if 0
-    MutexGuard guard(chat_sessions_lock);
+    pending_messages.erase(it);
 
-    const string& session_id = from.username();
-    ChatSession *chat_session = findChatSession(session_id);
-    if(chat_session) {
-        if(MessageEventDelivered & event) {
-            client->onChatMessageDelivered(session_id, from.resource());
+    if(queue != user_queues.end()) {
+        deque<string>& ids = queue->second;
+        while(!ids.empty() && pending_messages.find(ids.front()) == pending_messages.end()) {
+            ids.pop_front();
         }
-        else if(MessageEventComposing & event) {
-            client->onChatMessageComposing(session_id, from.resource());
+
+        if(ids.empty()) {
+            user_queues.erase(queue);
         }
     }
-#endif
 
-    // MessageEventOffline
-    // MessageEventDisplayed
-    // MessageEventInvalid
-    // MessageEventCancel
+    client->metrics.setGauge(XMPPMetrics::GAUGE_PENDING_MESSAGES, pending_messages.size());
 }
 
-void XMPPClient::ChatImpl::disposeChatSessions()
+void XMPPClient::DeliveryImpl::notify(const Completion& completion)
 {
-    MutexGuard guard(chat_sessions_lock);
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_MESSAGE_COMPLETION,
+               0, 0, (int64_t)completion.id, (int)completion.status);
 
-    ChatSessions::const_iterator it = chat_sessions.begin();
+    // NOTE: same order as MessageStatus
+    client->metrics.increment((XMPPMetrics::Counter)(XMPPMetrics::COUNTER_MESSAGES_ACKNOWLEDGED + (int)completion.status));
 
-    for(; it != chat_sessions.end(); ++it) {
-        delete it->second;
+    if(completion.status == MESSAGE_ACKNOWLEDGED || completion.status == MESSAGE_DELIVERED) {
+        client->metrics.record(XMPPMetrics::HISTOGRAM_MESSAGE_DELIVERY, completion.latency);
     }
-    chat_sessions.clear();
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_MESSAGE_COMPLETION);
+    client->onMessageCompletion(completion.id, completion.status, completion.latency);
 }
 
-XMPPClient::ChatSession* XMPPClient::ChatImpl::findChatSession(const string& id)
+/// XMPPClient::KeepaliveImpl
+XMPPClient::KeepaliveImpl::KeepaliveImpl(XMPPClient *client_)
+    : client(client_), xmpp(0),
+      interval(0), last_received(0), last_ping(0), probe_start(0), unanswered(0)
 {
-    ChatSessions::const_iterator it = chat_sessions.find(id);
+}
 
-    if(it != chat_sessions.end()) {
-        assert(it->second->session_id == id);
-        return it->second;
+void XMPPClient::KeepaliveImpl::start(GlooxClient *xmpp_)
+{
+    const Config& config = client->getConfig();
+
+    if(config.tcp_keepalive) {
+        setSocketOptions(xmpp_->getSocket());
     }
-    return 0;
+
+    if(config.ping_interval <= 0) {
+        return;
+    }
+
+    xmpp = xmpp_;
+    interval = (uint64_t)config.ping_interval * 1000000ULL;
+    last_received = XMPPClock::now();
+    last_ping = 0;
+    probe_start = 0;
+    unanswered = 0;
+
+    client->metrics.setGauge(XMPPMetrics::GAUGE_PING_INTERVAL, config.ping_interval);
 }
 
-// MessageSessionHandler
-void XMPPClient::ChatImpl::handleMessageSession(MessageSession *session)
+void XMPPClient::KeepaliveImpl::stop()
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ChatImpl::handleMessageSession(): "
-              "session=%p from='%s'\n",
-              session, session->target().full().c_str());
-#endif // _DEBUG
-
-    // WARN: can only dispose an old MessageSession with ClientBase::disposeMessageSession()
-    // WARN: cannot dispose the current MessageSession here
+    // NOTE: gloox may still report a ping sent on the stream, it is ignored
+    xmpp = 0;
+}
 
-    handleChatSession(session);
+void XMPPClient::KeepaliveImpl::received(uint64_t now)
+{
+    last_received = now;
+    probe_start = 0;
+    unanswered = 0;
 }
 
-// MessageHandler
-void XMPPClient::ChatImpl::handleMessage(const Message& message, MessageSession *session)
+int XMPPClient::KeepaliveImpl::update(uint64_t now, bool *is_dead)
 {
-    const string& body = message.body();
+    *is_dead = false;
 
-    if(body.empty()) {
-        // do not raise XMPPClient::onChatMessage() on empty messages
-        // NOTE: this behavior was removed from the latest version (1.0.9)
-        // when triggered after MessageEventHandler::handleMessageEvent()
-        return;
+    if(!xmpp) {
+        return -1;
     }
 
-    const JID& target = session->target();
-    const DelayedDelivery *dd = message.when();
+    const Config& config = client->getConfig();
+    uint64_t next;
 
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ChatImpl::handleMessage(): "
-              "session=%p from='%s' timestamp='%s'\n",
-              session, target.full().c_str(),
-              (dd ? dd->stamp().c_str() : "n/a"));
-#endif // _DEBUG
+    if(!probe_start) {
+        // NOTE: fewer wakeups in the background, for a slower detection
+        uint64_t idle = interval;
+        if(client->is_inactive && (uint64_t)config.ping_interval_max * 1000000ULL > idle) {
+            idle = (uint64_t)config.ping_interval_max * 1000000ULL;
+        }
 
-    client->onChatMessage(target.username(), target.resource(),
-                          body, message.subject(),
-                          (dd ? dd->stamp().c_str() : 0));
-}
+        next = last_received + idle;
+        if(now < next) {
+            uint64_t wait = (next - now) / 1000 + 1;
+            return (wait < (uint64_t)INT_MAX) ? (int)wait : INT_MAX;
+        }
 
-// MessageEventHandler
-void XMPPClient::ChatImpl::handleMessageEvent(const JID& from, MessageEventType event)
-{
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> ChatImpl::handleMessageEvent(): "
-              "from='%s' event=%d\n",
-              from.full().c_str(), (int)event);
-#endif // _DEBUG
+        probe_start = now;
+        ping(now);
+    }
+    else {
+        uint64_t dead = probe_start + (uint64_t)config.dead_peer_timeout * 1000000ULL;
+        if(now >= dead) {
+            XMPP_TRACE(XMPPTrace::LEVEL_ERROR, XMPPTrace::EVENT_DEAD_PEER,
+                       0, 0, (int64_t)((now - last_received) / 1000000ULL), unanswered);
+
+            client->metrics.increment(XMPPMetrics::COUNTER_DEAD_PEERS);
+            xmpp = 0;
+            *is_dead = true;
+            return -1;
+        }
 
-    handleChatMessageEvent(from, event);
-}
+        if(now >= last_ping + (uint64_t)config.ping_timeout * 1000000ULL) {
+            // suspected loss, probe again and stop backing off
+            ++unanswered;
+            client->metrics.increment(XMPPMetrics::COUNTER_PING_TIMEOUTS);
 
-/// XMPPClient::GroupChatSession
-XMPPClient::GroupChatSession::GroupChatSession(ClientImpl *impl_, const string& group)
-    : session_id(group),
-      is_joined(false), room(0),
-      creation_state(CREATION_STATE_NONE),
-      impl(impl_)
-{
-    JID nick(group + "@" + impl->getClient()->getConfig().groupchat_server
-             + "/" + impl->getXmpp()->jid().username());
+            interval = (uint64_t)config.ping_interval * 1000000ULL;
+            client->metrics.setGauge(XMPPMetrics::GAUGE_PING_INTERVAL, config.ping_interval);
 
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatSession(): "
-              "room='%s'\n", nick.full().c_str());
-#endif // _DEBUG
+            ping(now);
+        }
+    }
+
+    next = last_ping + (uint64_t)config.ping_timeout * 1000000ULL;
+    uint64_t dead = probe_start + (uint64_t)config.dead_peer_timeout * 1000000ULL;
+    if(dead < next) {
+        next = dead;
+    }
 
-    room = new MUCRoom(impl->getXmpp(), nick,
-                       impl->getGroupChatImpl(), impl->getGroupChatImpl());
+    uint64_t wait = (next > now) ? ((next - now) / 1000 + 1) : 0;
+    return (wait < (uint64_t)INT_MAX) ? (int)wait : INT_MAX;
 }
 
-XMPPClient::GroupChatSession::~GroupChatSession()
+// EventHandler
+void XMPPClient::KeepaliveImpl::handleEvent(const Event& event)
 {
-    if(is_joined) {
-        is_joined = false;
-        room->leave();
+    if(!xmpp || !last_ping) {
+        return;
     }
 
-    delete room;
-}
+    switch(event.eventType()) {
+    case Event::PingPong:
+    case Event::PingError:
+        break;
 
-/// XMPPClient::GroupChatImpl
-XMPPClient::GroupChatImpl::GroupChatImpl(XMPPClient *client_, ClientImpl *impl_)
-    : MUCInvitationHandler(impl_->getXmpp()),
-      client(client_), impl(impl_)
-{
-}
+    default:
+        return;
+    }
 
-XMPPClient::GroupChatImpl::~GroupChatImpl()
-{
-    disposeGroupChatSessions();
+    // NOTE: an error reply still proves the server is there
+    uint64_t now = XMPPClock::now();
+    client->metrics.record(XMPPMetrics::HISTOGRAM_PING, now - last_ping);
+    client->impl->getEndpointImpl().pinged(now - last_ping);
+
+    if(!unanswered) {
+        // answered in time, back off
+        const Config& config = client->getConfig();
+        int interval_max = (config.ping_interval_max > config.ping_interval) ?
+            config.ping_interval_max : config.ping_interval;
+
+        interval *= 2;
+        if(interval > (uint64_t)interval_max * 1000000ULL) {
+            interval = (uint64_t)interval_max * 1000000ULL;
+        }
+        client->metrics.setGauge(XMPPMetrics::GAUGE_PING_INTERVAL, (int64_t)(interval / 1000000ULL));
+    }
+
+    last_ping = 0;
+    received(now);
 }
 
-#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
-bool XMPPClient::GroupChatImpl::declineGroupChatInvitation(const string& group, const string& user, const string& reason)
+void XMPPClient::KeepaliveImpl::ping(uint64_t now)
 {
-    string room = group + "@" + impl->getClient()->getConfig().groupchat_server;
-
-    JID jid(impl->getXmpp()->jid());
-    jid.setUsername(user);
+    XMPP_TRACE(XMPPTrace::LEVEL_DEBUG, XMPPTrace::EVENT_PING,
+               0, 0, (int64_t)(interval / 1000000ULL), unanswered);
 
-    // FIXME: TODO: is something wrong with jid.bareJID()?
-    Message *message = MUCRoom::declineInvitation(room, jid.bareJID(), reason);
-    impl->getXmpp()->send(*message);
-    delete message;
+    client->metrics.increment(XMPPMetrics::COUNTER_PINGS);
 
-    return true;
+    last_ping = now;
+    xmpp->xmppPing(JID(xmpp->jid().server()), this);
 }
-#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
 
-bool XMPPClient::GroupChatImpl::beginGroupChat(const string& group, const string& passwd,
-                                               int history_messages, const string& history_since)
+// setsockopt() failures only cost the TCP level detection, pings still work
+static void g_set_socket_option(int socket, int level, int name, int value)
 {
-    MutexGuard guard(chat_sessions_lock);
+    if(::setsockopt(socket, level, name, &value, sizeof(value)) != 0) {
+#ifdef _DEBUG
+        ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> setsockopt(%d, %d): %s\n",
+                  level, name, ::strerror(errno));
+#endif // _DEBUG
+    }
+}
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session) {
-        return chat_session->is_joined;
+void XMPPClient::KeepaliveImpl::setSocketOptions(int socket)
+{
+    if(socket < 0) {
+        return;
     }
 
-    chat_session = new GroupChatSession(impl, group);
-    assert(chat_session->session_id == group);
-    chat_sessions[chat_session->session_id] = chat_session;
+    const Config& config = client->getConfig();
 
-    if(!passwd.empty()) {
-        chat_session->room->setPassword(passwd);
+    g_set_socket_option(socket, SOL_SOCKET, SO_KEEPALIVE, 1);
+
+#if defined(TCP_KEEPIDLE)
+    if(config.tcp_keepalive_idle > 0) {
+        g_set_socket_option(socket, IPPROTO_TCP, TCP_KEEPIDLE, config.tcp_keepalive_idle);
     }
+#elif defined(TCP_KEEPALIVE)
+    // Darwin name of TCP_KEEPIDLE
+    if(config.tcp_keepalive_idle > 0) {
+        g_set_socket_option(socket, IPPROTO_TCP, TCP_KEEPALIVE, config.tcp_keepalive_idle);
+    }
+#endif
 
-    if(history_messages >= 0) {
-        chat_session->room->setRequestHistory(history_messages, MUCRoom::HistoryMaxStanzas);
+#if defined(TCP_KEEPINTVL)
+    if(config.tcp_keepalive_interval > 0) {
+        g_set_socket_option(socket, IPPROTO_TCP, TCP_KEEPINTVL, config.tcp_keepalive_interval);
     }
-    else if(!history_since.empty()) {
-        chat_session->room->setRequestHistory(history_since);
+#endif
+
+#if defined(TCP_KEEPCNT)
+    if(config.tcp_keepalive_count > 0) {
+        g_set_socket_option(socket, IPPROTO_TCP, TCP_KEEPCNT, config.tcp_keepalive_count);
     }
+#endif
+}
 
-    chat_session->room->join();
-    chat_session->is_joined = true;
+/// XMPPClient::EndpointImpl
+XMPPClient::EndpointImpl::EndpointImpl(XMPPClient *client_, const Config& config)
+    : client(client_), current(-1),
+      standby(-1), standby_socket(-1), is_standby_ready(false), standby_start(0), standby_check(0)
+{
+    for(StringList::const_iterator it = config.endpoints.begin(); it != config.endpoints.end(); ++it) {
+        XMPPEndpoints::Endpoint endpoint;
+        if(!XMPPEndpoints::parse(*it, config.port, &endpoint)) {
+            throw Error("invalid endpoint: " + *it);
+        }
+        endpoints.push_back(endpoint);
+    }
+}
 
-    return true;
+XMPPClient::EndpointImpl::~EndpointImpl()
+{
+    closeStandby();
 }
 
-bool XMPPClient::GroupChatImpl::endGroupChat(const string& group, const string& reason)
+bool XMPPClient::EndpointImpl::connect(GlooxClient *xmpp)
 {
-    MutexGuard guard(chat_sessions_lock);
+    if(endpoints.empty()) {
+        return xmpp->connect(false);
+    }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session) {
-        if(chat_session->is_joined) {
-            chat_session->is_joined = false;
-            chat_session->room->leave(reason);
+    XMPPEndpoints& shared = XMPPEndpoints::getShared();
+
+    vector<size_t> order;
+    shared.rank(endpoints, &order);
+
+    for(vector<size_t>::const_iterator it = order.begin(); it != order.end(); ++it) {
+        const XMPPEndpoints::Endpoint& endpoint = endpoints[*it];
+
+        // NOTE: the calls of gloox expect blocking mode, connect() negotiates the stream on it
+        int socket = -1;
+        bool is_standby = ((int)*it == standby && isStandbyReady());
+        if(is_standby) {
+            ::fcntl(standby_socket, F_SETFL, ::fcntl(standby_socket, F_GETFL) & ~O_NONBLOCK);
+            socket = standby_socket;
+
+            standby_socket = -1;
+            standby = -1;
+            is_standby_ready = false;
+        }
+        else if((int)*it == standby) {
+            closeStandby();
         }
 
-        delete chat_session;
-        chat_sessions.erase(group);
+        ConnectionTCPClient *connection = xmpp->newConnection(endpoint.host, endpoint.port, socket);
 
+        xmpp->setConnectionImpl(connection);
+
+        uint64_t start = XMPPClock::now();
+        if(!xmpp->connect(false)) {
+            shared.recordFailure(endpoint);
+            continue;
+        }
+
+        if(!is_standby) {
+            shared.recordConnect(endpoint, XMPPClock::now() - start);
+        }
+        else {
+            client->metrics.increment(XMPPMetrics::COUNTER_STANDBY_TAKEOVERS);
+        }
+        if(it != order.begin()) {
+            client->metrics.increment(XMPPMetrics::COUNTER_ENDPOINT_FAILOVERS);
+        }
+
+        XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_ENDPOINT,
+                   endpoint.host.c_str(), 0, endpoint.port, is_standby);
+
+        current = (int)*it;
+        standby_check = 0;
         return true;
     }
 
     return false;
 }
 
-bool XMPPClient::GroupChatImpl::destroyGroupChat(const string& group, const string& reason)
+void XMPPClient::EndpointImpl::pinged(uint64_t rtt)
 {
-    MutexGuard guard(chat_sessions_lock);
+    if(current >= 0) {
+        XMPPEndpoints::getShared().recordPing(endpoints[current], rtt);
+    }
+}
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->is_joined = false;
-        chat_session->room->destroy(reason);
+void XMPPClient::EndpointImpl::disconnected(ConnectionError error)
+{
+    if(current < 0) {
+        return;
+    }
 
-        return true;
+    switch(error) {
+    case ConnIoError:
+    case ConnStreamClosed:
+        // NOTE: dead peers are aborted with ConnIoError too
+        XMPPEndpoints::getShared().recordFailure(endpoints[current]);
+        break;
+
+    case ConnUserDisconnected:
+        // NOTE: no reconnection is coming
+        closeStandby();
+        break;
+
+    default:
+        break;
     }
 
-    return false;
+    current = -1;
 }
 
-bool XMPPClient::GroupChatImpl::configureGroupChat(const string& group, const GroupChatConfig *config_)
+int XMPPClient::EndpointImpl::update(uint64_t now)
 {
-    MutexGuard guard(chat_sessions_lock);
+    if(!client->getConfig().endpoint_standby || current < 0 || endpoints.size() < 2) {
+        return -1;
+    }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        if(!config_) {
-            if(chat_session->creation_state == GroupChatSession::CREATION_STATE_PENDING) {
-                chat_session->room->acknowledgeInstantRoom();
+    if(now < standby_check) {
+        uint64_t wait = (standby_check - now) / 1000 + 1;
+        return (wait < (uint64_t)INT_MAX) ? (int)wait : INT_MAX;
+    }
+    standby_check = now + (uint64_t)STANDBY_INTERVAL * 1000ULL;
 
-                return true;
+    // NOTE: a handshake still in progress after an interval failed as well
+    if(standby_socket >= 0) {
+        bool was_ready = is_standby_ready;
+
+        if(!isStandbyReady()) {
+            // NOTE: servers close connections without a stream after a while, that is no failure
+            if(!was_ready) {
+                XMPPEndpoints::getShared().recordFailure(endpoints[standby]);
             }
+            closeStandby();
         }
-        else {
-            config = *config_;
-            chat_session->room->requestRoomConfig();
+    }
 
-            return true;
-        }
+    if(standby_socket < 0) {
+        openStandby();
     }
 
-    return false;
+    return STANDBY_INTERVAL;
 }
 
-bool XMPPClient::GroupChatImpl::cancelGroupChatCreation(const string& group)
+void XMPPClient::EndpointImpl::connected(uint64_t now)
 {
-    MutexGuard guard(chat_sessions_lock);
+    if(standby_socket < 0 || is_standby_ready) {
+        return;
+    }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->cancelRoomCreation();
-        return true;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(::getsockopt(standby_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        XMPPEndpoints::getShared().recordFailure(endpoints[standby]);
+        closeStandby();
+        return;
     }
 
-    return false;
+    XMPPEndpoints::getShared().recordConnect(endpoints[standby], now - standby_start);
+    is_standby_ready = true;
 }
 
-bool XMPPClient::GroupChatImpl::setGroupChatSubject(const string& group, const string& subject)
+void XMPPClient::EndpointImpl::openStandby()
 {
-    MutexGuard guard(chat_sessions_lock);
+    XMPPEndpoints& shared = XMPPEndpoints::getShared();
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->setSubject(subject);
-        return true;
-    }
+    vector<size_t> order;
+    shared.rank(endpoints, &order);
 
-    return false;
-}
+    for(vector<size_t>::const_iterator it = order.begin(); it != order.end(); ++it) {
+        if((int)*it == current || !shared.isHealthy(endpoints[*it])) {
+            continue;
+        }
 
-bool XMPPClient::GroupChatImpl::sendGroupChatMessage(const string& group, const string& message)
-{
-    if(message.empty()) {
-        // do not let sending empty messages
-        return true;
-    }
+        const XMPPEndpoints::Endpoint& endpoint = endpoints[*it];
 
-    MutexGuard guard(chat_sessions_lock);
+        // NOTE: no DNS on the event loop, a miss is resolved by another thread for the next check
+        struct sockaddr_storage address;
+        socklen_t length = 0;
+        if(!shared.findAddress(endpoint, &address, &length)) {
+            continue;
+        }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->send(message);
-        return true;
-    }
+        uint64_t start = XMPPClock::now();
 
-    return false;
-}
+        int socket = ::socket(address.ss_family, SOCK_STREAM, 0);
+        if(socket >= 0) {
+            ::fcntl(socket, F_SETFL, ::fcntl(socket, F_GETFL) | O_NONBLOCK);
 
-bool XMPPClient::GroupChatImpl::inviteToGroupChat(const string& group, const string& user, const string& reason)
-{
-    MutexGuard guard(chat_sessions_lock);
+            if(::connect(socket, reinterpret_cast<struct sockaddr*>(&address), length) != 0 && errno != EINPROGRESS) {
+                ::close(socket);
+                socket = -1;
+            }
+        }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        JID jid(impl->getXmpp()->jid());
-        jid.setUsername(user);
+        if(socket < 0) {
+            shared.recordFailure(endpoint);
+            continue;
+        }
 
-        chat_session->room->invite(jid.bareJID(), reason);
-        return true;
+        standby = (int)*it;
+        standby_socket = socket;
+        is_standby_ready = false;
+        standby_start = start;
+        return;
     }
-
-    return false;
 }
 
-bool XMPPClient::GroupChatImpl::kickFromGroupChat(const string& group, const string& user, const string& reason)
+void XMPPClient::EndpointImpl::closeStandby()
 {
-    MutexGuard guard(chat_sessions_lock);
-
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->kick(user, reason);
-        return true;
+    if(standby_socket >= 0) {
+        ::close(standby_socket);
     }
 
-    return false;
+    standby = -1;
+    standby_socket = -1;
+    is_standby_ready = false;
 }
 
-#ifdef XMPP_CLIENT_BAN_ENABLE
-bool XMPPClient::GroupChatImpl::banFromGroupChat(const string& group, const string& user, const string& reason)
+bool XMPPClient::EndpointImpl::isStandbyReady()
 {
-    MutexGuard guard(chat_sessions_lock);
-
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->ban(user, reason);
-        return true;
+    if(standby_socket < 0) {
+        return false;
     }
 
-    return false;
-}
+    // NOTE: the server sends nothing before our stream header, readable means closed
+    struct pollfd fds;
+    fds.fd = standby_socket;
+    fds.events = POLLIN | POLLOUT;
+    fds.revents = 0;
 
-bool XMPPClient::GroupChatImpl::unbanFromGroupChat(const string& group, const string& user)
-{
-    MutexGuard guard(chat_sessions_lock);
+    if(::poll(&fds, 1, 0) < 0) {
+        return false;
+    }
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->setAffiliation(user, AffiliationNone, "");
-        return true;
+    if(fds.revents != POLLOUT) {
+        return false;
     }
 
-    return false;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(::getsockopt(standby_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        return false;
+    }
+
+    // NOTE: established unseen by the wait (external event loop), its connect time is not known
+    is_standby_ready = true;
+    return true;
 }
-#endif // XMPP_CLIENT_BAN_ENABLE
 
-bool XMPPClient::GroupChatImpl::listGroupChatUsers(const string& group)
+/// XMPPClient::RosterImpl
+XMPPClient::RosterImpl::RosterImpl(XMPPClient *client_)
+    : client(client_), xmpp(0), is_dirty(false)
 {
-    MutexGuard guard(chat_sessions_lock);
+}
 
-    GroupChatSession *chat_session = findGroupChatSession(group);
-    if(chat_session && chat_session->is_joined) {
-        chat_session->room->getRoomItems();
-        return true;
+void XMPPClient::RosterImpl::enable(GlooxClient *xmpp_)
+{
+    const Config& config = client->getConfig();
+
+    xmpp = xmpp_;
+    xmpp->registerStanzaExtension(new RosterQuery());
+    xmpp->registerIqHandler(this, ExtRoster);
+
+    // NOTE: a missing or damaged cache only costs a full roster
+    if(!config.roster_cache.empty()) {
+        MutexGuard guard(roster_lock);
+        roster.load(config.roster_cache);
     }
 
-    return false;
+    client->metrics.setGauge(XMPPMetrics::GAUGE_ROSTER_ITEMS, roster.size());
 }
 
-XMPPClient::GroupChatSession* XMPPClient::GroupChatImpl::findGroupChatSession(const string& id)
+void XMPPClient::RosterImpl::request()
 {
-    GroupChatSessions::const_iterator it = chat_sessions.find(id);
+    if(!xmpp) {
+        return;
+    }
 
-    if(it != chat_sessions.end()) {
-        assert(it->second->session_id == id);
-        return it->second;
+    string version;
+    {
+        MutexGuard guard(roster_lock);
+
+        // NOTE: the cache is only worth its version when it is not empty
+        if(roster.size() != 0) {
+            version = roster.getVersion();
+        }
     }
-    return 0;
+
+    IQ iq(IQ::Get, JID());
+    iq.addExtension(new RosterQuery(version, xmpp->hasRosterVersioning()));
+    xmpp->send(iq, this, 0);
 }
 
-void XMPPClient::GroupChatImpl::disposeGroupChatSessions()
+void XMPPClient::RosterImpl::save()
 {
-    MutexGuard guard(chat_sessions_lock);
+    const Config& config = client->getConfig();
 
-    GroupChatSessions::const_iterator it = chat_sessions.begin();
+    MutexGuard guard(roster_lock);
 
-    for(; it != chat_sessions.end(); ++it) {
-        delete it->second;
+    if(!is_dirty) {
+        return;
+    }
+    is_dirty = false;
+
+    if(!config.roster_cache.empty()) {
+        roster.save(config.roster_cache);
     }
-    chat_sessions.clear();
 }
 
-// MUCRoomHandler
-void XMPPClient::GroupChatImpl::handleMUCParticipantPresence(MUCRoom *room, const MUCRoomParticipant participant, const Presence& presence)
+bool XMPPClient::RosterImpl::find(const string& jid, RosterItem *item)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCParticipantPresence(): "
-              "group='%s' presence=%d nick='%s' JID='%s' reason='%s' status='%s'\n",
-              room->name().c_str(), (int)presence.presence(),
-              (participant.nick ? participant.nick->full().c_str() : "n/a"),
-              (participant.jid ? participant.jid->full().c_str() : "n/a"),
-              participant.reason.c_str(), participant.status.c_str());
-#endif // _DEBUG
-
-    const string& reason =
-        participant.reason.empty() ?
-        participant.status : participant.reason;
-
-    switch(presence.presence()) {
-    case Presence::Available:
-    case Presence::Chat:
-        client->onGroupChatUserPresence(room->name(), participant.nick->resource(),
-                                        true, reason.c_str(), participant.flags);
-        break;
+    MutexGuard guard(roster_lock);
 
-    case Presence::Away:
-    case Presence::DND:
-    case Presence::XA:
-    case Presence::Unavailable:
-        client->onGroupChatUserPresence(room->name(), participant.nick->resource(),
-                                        false, reason.c_str(), participant.flags);
-        break;
+    const RosterItem *found = roster.find(jid);
+    if(!found) {
+        return false;
+    }
 
-    case Presence::Probe:
-    case Presence::Error:
-    case Presence::Invalid:
-    default:
-        break;
+    if(item) {
+        *item = *found;
     }
+    return true;
 }
 
-void XMPPClient::GroupChatImpl::handleMUCMessage(MUCRoom *room, const Message& message, bool priv)
+size_t XMPPClient::RosterImpl::size()
 {
-    const string& user = message.from().resource();
-    const DelayedDelivery *dd = message.when();
+    MutexGuard guard(roster_lock);
+    return roster.size();
+}
 
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCMessage(): "
-              "group='%s' from='%s' nick='%s' private=%s timestamp='%s'\n",
-              room->name().c_str(), message.from().full().c_str(),
-              user.c_str(), (priv ? "yes" : "no"),
-              (dd ? dd->stamp().c_str() : "n/a"));
-#endif // _DEBUG
+// IqHandler
+bool XMPPClient::RosterImpl::handleIq(const IQ& iq)
+{
+    const RosterQuery *query = iq.findExtension<RosterQuery>(ExtRoster);
+    if(!query || iq.subtype() != IQ::Set) {
+        return false;
+    }
 
-    if(priv) {
-        impl->getChatImpl()->handlePrivateChatMessage(user, room->name(), message);
+    // NOTE: pushes come from our own account only, anything else is spoofed
+    if(iq.from() && iq.from().bare() != xmpp->jid().bare()) {
+        return false;
     }
-    else {
-        client->onGroupChatMessage(room->name(), user, message.body(),
-                                   (dd ? dd->stamp().c_str() : 0));
+
+    client->metrics.increment(XMPPMetrics::COUNTER_ROSTER_PUSHES);
+
+    {
+        MutexGuard guard(roster_lock);
+
+        for(vector<RosterItem>::const_iterator it = query->items.begin(); it != query->items.end(); ++it) {
+            if(it->subscription == "remove") {
+                remove(it->jid);
+            }
+            else {
+                update(*it);
+            }
+        }
+
+        if(query->has_version && query->version != roster.getVersion()) {
+            roster.setVersion(query->version);
+            is_dirty = true;
+        }
     }
+
+    IQ result(IQ::Result, iq.from(), iq.id());
+    xmpp->send(result);
+
+    notify();
+    return true;
 }
 
-bool XMPPClient::GroupChatImpl::handleMUCRoomCreation(MUCRoom *room)
+void XMPPClient::RosterImpl::handleIqID(const IQ& iq, int context)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCRoomCreation(): "
-              "group='%s'\n", room->name().c_str());
-#endif // _DEBUG
+    (void)context;
 
-    MutexGuard guard(chat_sessions_lock);
+    if(iq.subtype() != IQ::Result) {
+        // NOTE: the cached roster stays as it is
+        return;
+    }
 
-    GroupChatSession *chat_session = findGroupChatSession(room->name());
-    if(chat_session) {
-        assert(chat_session->room == room);
+    const RosterQuery *query = iq.findExtension<RosterQuery>(ExtRoster);
 
-        if(client->onGroupChatCreation(room->name()) == true) {
-            chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
-            return true;
+    // an empty result: the cached roster is current, the changes come as pushes
+    if(query) {
+        client->metrics.increment(XMPPMetrics::COUNTER_ROSTER_FULL);
+
+        MutexGuard guard(roster_lock);
+
+        // NOTE: reported as changes to the cached roster, often few of them
+        set<string> jids;
+        for(vector<RosterItem>::const_iterator it = query->items.begin(); it != query->items.end(); ++it) {
+            jids.insert(it->jid);
+            update(*it);
         }
-        else {
-            chat_session->creation_state = GroupChatSession::CREATION_STATE_PENDING;
+
+        vector<string> removed;
+        const XMPPRoster::Items& items = roster.getItems();
+        for(XMPPRoster::Items::const_iterator it = items.begin(); it != items.end(); ++it) {
+            if(!jids.count(it->first)) {
+                removed.push_back(it->first);
+            }
+        }
+        for(vector<string>::const_iterator it = removed.begin(); it != removed.end(); ++it) {
+            remove(*it);
         }
+
+        roster.setVersion(query->has_version ? query->version : EmptyString);
+        is_dirty = true;
     }
 
-    return false;
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_ROSTER,
+               query ? query->version.c_str() : 0, 0, query != 0, size());
+
+    notify();
+
+    XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_ROSTER_READY);
+    client->onRosterReady();
 }
 
-void XMPPClient::GroupChatImpl::handleMUCSubject(MUCRoom *room, const string& nick, const string& subject)
+void XMPPClient::RosterImpl::update(const RosterItem& item)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCSubject(): "
-              "group='%s' nick='%s' subject='%s'\n",
-              room->name().c_str(), nick.c_str(), subject.c_str());
-#endif // _DEBUG
-
-    if(!nick.empty()) {
-        client->onGroupChatSubject(room->name(), nick, subject);
+    if(item.jid.empty() || !roster.update(item)) {
+        return;
     }
+    is_dirty = true;
+
+    changes.push_back(Change());
+    changes.back().item = item;
+    changes.back().removed = false;
 }
 
-void XMPPClient::GroupChatImpl::handleMUCInviteDecline(MUCRoom *room, const JID& invitee, const string& reason)
+void XMPPClient::RosterImpl::remove(const string& jid)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCInviteDecline(): "
-              "group='%s' invitee='%s' reason='%s'\n",
-              room->name().c_str(), invitee.full().c_str(), reason.c_str());
-#endif // _DEBUG
+    const RosterItem *item = roster.find(jid);
+    if(!item) {
+        return;
+    }
 
-    client->onGroupChatInviteDecline(room->name(), invitee.username(), reason);
+    changes.push_back(Change());
+    changes.back().item = *item;
+    changes.back().removed = true;
+
+    roster.remove(jid);
+    is_dirty = true;
 }
 
-void XMPPClient::GroupChatImpl::handleMUCError(MUCRoom *room, StanzaError error)
+void XMPPClient::RosterImpl::notify()
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCError(): "
-              "group='%s' error=%d\n",
-              room->name().c_str(), (int)error);
-#endif // _DEBUG
+    client->metrics.setGauge(XMPPMetrics::GAUGE_ROSTER_ITEMS, size());
 
-    client->onGroupChatError(room->name(), error);
+    for(Changes::const_iterator it = changes.begin(); it != changes.end(); ++it) {
+        XMPPMetrics::ScopedTimer timer(client->metrics, XMPPMetrics::HISTOGRAM_ON_ROSTER_ITEM);
+        client->onRosterItem(it->item, it->removed);
+    }
+    changes.clear();
 }
 
-#ifdef _DEBUG
-static void g_show_room_data_form_fields(const DataFormFieldContainer::FieldList& fields)
+/// XMPPClient::SchedulerImpl
+const uint64_t XMPPClient::SchedulerImpl::WEIGHTS[PRIORITY_MAX] = {8, 4, 2, 1};
+
+const XMPPMetrics::Histogram XMPPClient::SchedulerImpl::HISTOGRAMS[PRIORITY_MAX] = {
+    XMPPMetrics::HISTOGRAM_OUTBOUND_QUEUE_CONTENT,
+    XMPPMetrics::HISTOGRAM_OUTBOUND_QUEUE_RECEIPT,
+    XMPPMetrics::HISTOGRAM_OUTBOUND_QUEUE_CHAT_STATE,
+    XMPPMetrics::HISTOGRAM_OUTBOUND_QUEUE_PRESENCE
+};
+
+XMPPClient::SchedulerImpl::SchedulerImpl(XMPPClient *client_, ClientImpl *impl_)
+    : virtual_time(0), queued(0), queued_bytes(0),
+      byte_tokens(0.0), stanza_tokens(0.0), refill_time(0),
+      is_congested(false),
+      client(client_), impl(impl_)
 {
-    DataFormFieldContainer::FieldList::const_iterator it;
-    const DataFormField *field;
+    for(int i = 0; i < PRIORITY_MAX; ++i) {
+        last_finish[i] = 0;
+    }
+}
 
-    for(it = fields.begin(); it != fields.end(); ++it) {
-        field = *it;
-        ::fprintf(stderr, "[name='%s' required=%s label='%s' description='%s' type=%d ",
-                  field->name().c_str(), (field->required() ? "yes" : "no"),
-                  field->label().c_str(), field->description().c_str(), (int)field->type());
+void XMPPClient::SchedulerImpl::send(Priority priority, const string& key, const string& xml)
+{
+    submit(priority, key, xml, xml.size(), 0, 0, false);
+}
 
-        if(field->type() == DataFormField::TypeTextMulti) {
-            ::fprintf(stderr, "values=[");
+void XMPPClient::SchedulerImpl::sendInOrder(Priority priority, const string& xml)
+{
+    submit(priority, EmptyString, xml, xml.size(), 0, 0, true);
+}
 
-            const StringList& values = field->values();
-            StringList::const_iterator it;
+void XMPPClient::SchedulerImpl::callInOrder(Priority priority, size_t size, PostedFunction function, void *data)
+{
+    submit(priority, EmptyString, EmptyString, size, function, data, true);
+}
 
-            for(it = values.begin(); it != values.end(); ++it) {
-                ::fprintf(stderr, "'%s' ", it->c_str());
-            }
+void XMPPClient::SchedulerImpl::submit(Priority priority, const string& key, const string& xml, size_t size,
+                                       PostedFunction function, void *data, bool is_ordered)
+{
+    bool is_direct = false;
 
-            ::fprintf(stderr, "]] ");
+    {
+        MutexGuard guard(queue_lock);
+        refill(XMPPClock::now());
+
+        // NOTE: nothing to overtake, written without a copy; the socket is
+        // NOTE: only polled while congested, not once per stanza
+        if(queued == 0 && (!is_congested || isWritable()) && drain_lock.trylock()) {
+            if(take(size)) {
+                is_direct = true;
+            }
+            else {
+                drain_lock.unlock();
+            }
         }
-        else {
-            ::fprintf(stderr, "value='%s'] ", field->value().c_str());
+
+        if(!is_direct) {
+            Item& item = push(priority, key, xml, size, is_ordered);
+            item.function = function;
+            item.data = data;
         }
     }
+
+    if(is_direct) {
+        client->metrics.record(HISTOGRAMS[priority], 0);
+        write(xml, function, data);
+        drain_lock.unlock();
+    }
+
+    flush();
 }
 
-static void g_show_room_data_form(const DataForm& form)
+int XMPPClient::SchedulerImpl::flush()
 {
-    ::fprintf(stderr, "title='%s' type=%d instructions=[",
-              form.title().c_str(), (int)form.type());
-
-    StringList::const_iterator it;
-    for(it = form.instructions().begin(); it != form.instructions().end(); ++it) {
-        ::fprintf(stderr, "'%s' ", it->c_str());
-    }
+    while(hasQueued()) {
+        if(!drain_lock.trylock()) {
+            // the thread writing drains it
+            return SCHEDULER_INTERVAL;
+        }
 
-    ::fprintf(stderr, "] items=[");
+        drain();
+        drain_lock.unlock();
 
-    const DataForm::ItemList& items = form.items();
-    DataForm::ItemList::const_iterator it_item;
+        // NOTE: stanzas may have been queued after drain() and before the unlock
+        {
+            MutexGuard guard(queue_lock);
 
-    for(it_item = items.begin(); it_item != items.end(); ++it_item) {
-        g_show_room_data_form_fields((*it_item)->fields());
-    }
+            int priority = next();
+            if(priority < 0) {
+                return -1;
+            }
 
-    ::fprintf(stderr, "] fields=[");
+            refill(XMPPClock::now());
+            int wait = getTokenWait(queues[priority].front().size);
+            if(wait > 0) {
+                return wait;
+            }
+        }
 
-    g_show_room_data_form_fields(form.fields());
+        if(!isWritable()) {
+            return SCHEDULER_INTERVAL;
+        }
+    }
 
-    ::fprintf(stderr, "]");
+    return -1;
 }
-#endif // _DEBUG
 
-void XMPPClient::GroupChatImpl::handleMUCInfo(MUCRoom *room, int features, const string& name, const DataForm *form)
+void XMPPClient::SchedulerImpl::discard()
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCInfo(): "
-              "group='%s' features=%d name='%s' form=[",
-              room->name().c_str(), features, name.c_str());
+    vector<pair<PostedFunction, void*> > calls;
 
-    if(form) {
-        g_show_room_data_form(*form);
-    }
-    else {
-        ::fprintf(stderr, "n/a");
-    }
+    {
+        MutexGuard guard(queue_lock);
 
-    ::fprintf(stderr, "]\n");
-#endif // _DEBUG
-}
+        for(int i = 0; i < PRIORITY_MAX; ++i) {
+            for(Queue::const_iterator it = queues[i].begin(); it != queues[i].end(); ++it) {
+                if(it->function) {
+                    calls.push_back(make_pair(it->function, it->data));
+                }
+            }
 
-#ifdef _DEBUG
-static void g_show_room_items(const Disco::ItemList& items)
-{
-    Disco::ItemList::const_iterator it;
-    gloox::Disco::Item *item;
+            queues[i].clear();
+            last_finish[i] = 0;
+        }
+        virtual_time = 0;
+        queued = 0;
+        queued_bytes = 0;
 
-    for(it = items.begin(); it != items.end(); ++it) {
-        item = *it;
-        ::fprintf(stderr, "[JID='%s' name='%s' node='%s'] ",
-                  item->jid().full().c_str(), item->name().c_str(), item->node().c_str());
+        client->metrics.setGauge(XMPPMetrics::GAUGE_OUTBOUND_QUEUE, 0);
+    }
+
+    // NOTE: they free their data, gloox writes nothing without a stream
+    for(size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
     }
 }
-#endif // _DEBUG
 
-void XMPPClient::GroupChatImpl::handleMUCItems(MUCRoom *room, const Disco::ItemList& items)
+uint64_t XMPPClient::SchedulerImpl::getQueueDelay()
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCItems(): "
-              "group='%s' items=[", room->name().c_str());
+    const Config& config = client->getConfig();
+    uint64_t now = XMPPClock::now();
+    uint64_t delay = 0;
 
-    g_show_room_items(items);
-
-    ::fprintf(stderr, "]\n");
-#endif // _DEBUG
+    MutexGuard guard(queue_lock);
+    refill(now);
 
-    StringList users;
-    Disco::ItemList::const_iterator it;
+    // what the rates allow of the backlog
+    if(config.send_rate_bytes > 0 && queued_bytes > byte_tokens) {
+        delay = (uint64_t)((queued_bytes - byte_tokens) * 1e9 / config.send_rate_bytes);
+    }
+    if(config.send_rate_stanzas > 0 && queued > stanza_tokens) {
+        uint64_t stanzas_delay = (uint64_t)((queued - stanza_tokens) * 1e9 / config.send_rate_stanzas);
+        if(stanzas_delay > delay) {
+            delay = stanzas_delay;
+        }
+    }
 
-    for(it = items.begin(); it != items.end(); ++it) {
-        users.push_back((*it)->name());
+    // NOTE: a full socket holds everything back, whatever the rates
+    for(int i = 0; i < PRIORITY_MAX; ++i) {
+        if(!queues[i].empty() && now - queues[i].front().queued > delay) {
+            delay = now - queues[i].front().queued;
+        }
     }
 
-    client->onGroupChatUsersList(room->name(), users);
+    return delay;
 }
 
-// MUCInvitationHandler
-void XMPPClient::GroupChatImpl::handleMUCInvitation(const JID& room, const JID& from, const string& reason,
-                                                    const string& body, const string& password, bool cont, const string& thread)
+XMPPClient::SchedulerImpl::Item& XMPPClient::SchedulerImpl::push(Priority priority, const string& key, const string& xml,
+                                                                 size_t size, bool is_ordered)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCInvitation(): "
-              "group='%s' from='%s' reason='%s' body='%s' passwd='%s' cont=%s thread='%s'\n",
-              room.full().c_str(), from.full().c_str(), reason.c_str(),
-              body.c_str(), password.c_str(), cont ? "yes" : "no", thread.c_str());
-#endif // _DEBUG
+    if(!key.empty()) {
+        supersede(priority, key);
+    }
 
-    if(!client->onGroupChatInvite(room.username(), from.username(), reason, password)) {
-#ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
-        // decline invitation
-        Message *message = MUCRoom::declineInvitation(room, from);
-        impl->getXmpp()->send(*message);
-        delete message;
-#endif // XMPP_CLIENT_INVITE_DECLINE_ENABLE
+    Queue& queue = queues[priority];
+    queue.push_back(Item());
+
+    Item& item = queue.back();
+    item.key = key;
+    item.xml = xml;
+    item.size = size;
+    item.function = 0;
+    item.data = 0;
+    item.queued = XMPPClock::now();
+
+    // NOTE: self-clocked, a class idle for a while does not get credit for it
+    uint64_t start = (last_finish[priority] > virtual_time) ? last_finish[priority] : virtual_time;
+    if(is_ordered) {
+        for(int i = 0; i < PRIORITY_MAX; ++i) {
+            if(last_finish[i] > start) {
+                start = last_finish[i];
+            }
+        }
     }
+    item.finish = start + size * WEIGHTS[PRIORITY_CONTENT] / WEIGHTS[priority];
+    last_finish[priority] = item.finish;
+
+    ++queued;
+    queued_bytes += size;
+    client->metrics.setGauge(XMPPMetrics::GAUGE_OUTBOUND_QUEUE, queued);
+
+    return item;
 }
 
-#ifdef _DEBUG
-static void g_show_config_room_items(const MUCListItemList& items)
+int XMPPClient::SchedulerImpl::next() const
 {
-    MUCListItemList::const_iterator it;
-    for(it = items.begin(); it != items.end(); ++it) {
-        ::fprintf(stderr, "[JID='%s' nick='%s' affiliation=%d role=%d reason='%s'] ",
-                  it->jid().full().c_str(), it->nick().c_str(),
-                  (int)it->affiliation(), (int)it->role(), it->reason().c_str());
+    int priority = -1;
+
+    for(int i = 0; i < PRIORITY_MAX; ++i) {
+        if(!queues[i].empty() && (priority < 0 || queues[i].front().finish < queues[priority].front().finish)) {
+            priority = i;
+        }
     }
+
+    return priority;
 }
-#endif // _DEBUG
 
-// MUCRoomConfigHandler
-void XMPPClient::GroupChatImpl::handleMUCConfigList(MUCRoom* room, const MUCListItemList& items, MUCOperation operation)
+void XMPPClient::SchedulerImpl::pop(int priority, Item *item)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCConfigList(): "
-              "group='%s' operation=%d items=[\n",
-              room->name().c_str(), (int)operation);
+    Item& front = queues[priority].front();
+    item->xml.swap(front.xml);
+    item->size = front.size;
+    item->function = front.function;
+    item->data = front.data;
+    item->queued = front.queued;
+    virtual_time = front.finish;
+    queues[priority].pop_front();
+
+    --queued;
+    queued_bytes -= item->size;
+    client->metrics.setGauge(XMPPMetrics::GAUGE_OUTBOUND_QUEUE, queued);
+}
 
-    g_show_config_room_items(items);
+void XMPPClient::SchedulerImpl::supersede(Priority priority, const string& key)
+{
+    Priority stale;
 
-    ::fprintf(stderr, "]\n");
-#endif // _DEBUG
+    switch(priority) {
+    case PRIORITY_CONTENT:
+    case PRIORITY_CHAT_STATE:
+        // a message or a newer chat state to the user
+        stale = PRIORITY_CHAT_STATE;
+        break;
+
+    case PRIORITY_PRESENCE:
+        stale = PRIORITY_PRESENCE;
+        break;
+
+    case PRIORITY_RECEIPT:
+    default:
+        return;
+    }
+
+    Queue& queue = queues[stale];
+    for(Queue::iterator it = queue.begin(); it != queue.end();) {
+        if(it->key == key) {
+            --queued;
+            queued_bytes -= it->size;
+            it = queue.erase(it);
+            client->metrics.increment(XMPPMetrics::COUNTER_OUTBOUND_SUPERSEDED);
+        }
+        else {
+            ++it;
+        }
+    }
 }
 
-static DataForm* g_configure_room_dataform(const XMPPClient::GroupChatConfig& config, const DataForm& form)
+// buckets hold Config::send_burst milliseconds worth of tokens, at least one stanza
+void XMPPClient::SchedulerImpl::refill(uint64_t now)
 {
-    DataForm *new_form = new DataForm(TypeSubmit, form.instructions(), form.title());
-    bool status = false;
+    const Config& config = client->getConfig();
 
-    do {
-        if(!form.hasField("muc#roomconfig_roomname")) break;
-        new_form->addField(DataFormField::TypeTextSingle, "muc#roomconfig_roomname",
-                           config.title);
+    // NOTE: full at first
+    double elapsed = refill_time ? ((now > refill_time) ? ((now - refill_time) / 1e9) : 0.0) : 1e9;
+    refill_time = now;
 
-        if(!form.hasField("muc#roomconfig_roomdesc")) break;
-        new_form->addField(DataFormField::TypeTextSingle, "muc#roomconfig_roomdesc",
-                           config.description);
+    if(config.send_rate_bytes > 0) {
+        double size = config.send_rate_bytes * (config.send_burst / 1000.0);
 
-        if(!form.hasField("muc#roomconfig_persistentroom")) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_persistentroom",
-                           config.is_persistent ? "1" : "0");
+        byte_tokens += elapsed * config.send_rate_bytes;
+        if(byte_tokens > size) {
+            byte_tokens = size;
+        }
+    }
 
-        if(!(form.hasField("muc#roomconfig_passwordprotectedroom")
-             && form.hasField("muc#roomconfig_roomsecret"))) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_passwordprotectedroom",
-                           config.passwd.empty() ? "0" : "1");
-        new_form->addField(DataFormField::TypeTextPrivate, "muc#roomconfig_roomsecret",
-                           config.passwd);
+    if(config.send_rate_stanzas > 0) {
+        double size = config.send_rate_stanzas * (config.send_burst / 1000.0);
+        if(size < 1.0) {
+            size = 1.0;
+        }
 
-        if(!form.hasField("muc#roomconfig_maxusers")) break;
-        new_form->addField(DataFormField::TypeListSingle, "muc#roomconfig_maxusers",
-                           config.max_number_users);
+        stanza_tokens += elapsed * config.send_rate_stanzas;
+        if(stanza_tokens > size) {
+            stanza_tokens = size;
+        }
+    }
+}
 
-        if(!form.hasField("muc#roomconfig_membersonly")) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_membersonly",
-                           config.is_members_only ? "1" : "0");
+bool XMPPClient::SchedulerImpl::take(size_t size)
+{
+    if(getTokenWait(size) > 0) {
+        return false;
+    }
 
-        if(!form.hasField("muc#roomconfig_changesubject")) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_changesubject",
-                           config.is_user_subject_change_allowed ? "1" : "0");
+    const Config& config = client->getConfig();
 
-        if(!form.hasField("muc#roomconfig_allowinvites")) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_allowinvites",
-                           config.is_user_invite_send_allowed ? "1" : "0");
+    if(config.send_rate_bytes > 0) {
+        byte_tokens -= size;
+    }
+    if(config.send_rate_stanzas > 0) {
+        stanza_tokens -= 1.0;
+    }
 
-        if(!form.hasField("muc#roomconfig_allowvoicerequests")) break;
-        new_form->addField(DataFormField::TypeBoolean, "muc#roomconfig_allowvoicerequests",
-                           config.is_user_send_voice_request_allowed ? "1" : "0");
+    return true;
+}
+
+int XMPPClient::SchedulerImpl::getTokenWait(size_t size) const
+{
+    const Config& config = client->getConfig();
+    double wait = 0.0;  // seconds
+
+    if(config.send_rate_bytes > 0) {
+        // NOTE: a stanza larger than the bucket goes once it is full
+        double needed = config.send_rate_bytes * (config.send_burst / 1000.0);
+        if(needed > size) {
+            needed = size;
+        }
 
-        status = true;
+        if(byte_tokens < needed) {
+            wait = (needed - byte_tokens) / config.send_rate_bytes;
+        }
     }
-    while(0);
 
-    if(!status) {
-        delete new_form;
-        new_form = 0;
+    if(config.send_rate_stanzas > 0 && stanza_tokens < 1.0) {
+        double stanza_wait = (1.0 - stanza_tokens) / config.send_rate_stanzas;
+        if(stanza_wait > wait) {
+            wait = stanza_wait;
+        }
     }
-    return new_form;
-}
 
-void XMPPClient::GroupChatImpl::handleMUCConfigForm(MUCRoom* room, const DataForm& form)
-{
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCConfigForm(): "
-              "group='%s' form=[", room->name().c_str());
+    if(wait <= 0.0) {
+        return 0;
+    }
 
-    g_show_room_data_form(form);
+    wait = wait * 1e6 + 1;
+    return (wait < INT_MAX) ? (int)wait : INT_MAX;
+}
 
-    ::fprintf(stderr, "]\n");
-#endif // _DEBUG
+void XMPPClient::SchedulerImpl::drain()
+{
+    Item item;
 
-    MutexGuard guard(chat_sessions_lock);
+    while(hasQueued() && isWritable()) {
+        int priority;
 
-    GroupChatSession *chat_session = findGroupChatSession(room->name());
-    if(chat_session) {
-        assert(chat_session->room == room);
+        {
+            MutexGuard guard(queue_lock);
+            refill(XMPPClock::now());
 
-        DataForm *new_form = g_configure_room_dataform(config, form);
-        if(new_form) {
-            room->setRoomConfig(new_form);
+            priority = next();
+            if(priority < 0 || !take(queues[priority].front().size)) {
+                break;
+            }
+            pop(priority, &item);
         }
 
-        // FIXME: should be called in XMPPClientGroupChatImpl::handleMUCConfigResult() callback
-        if(chat_session->creation_state == GroupChatSession::CREATION_STATE_PENDING) {
-            chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
-            client->onGroupChatCreate(room->name(), (new_form != 0));
-        }
+        client->metrics.record(HISTOGRAMS[priority], XMPPClock::now() - item.queued);
+        write(item.xml, item.function, item.data);
     }
 }
 
-void XMPPClient::GroupChatImpl::handleMUCConfigResult(MUCRoom* room, bool success, MUCOperation operation)
+void XMPPClient::SchedulerImpl::write(const string& xml, PostedFunction function, void *data)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCConfigResult(): "
-              "group='%s' success=%s operation=%d\n",
-              room->name().c_str(), success ? "yes" : "no", (int)operation);
-#endif // _DEBUG
+    uint64_t start = XMPPClock::now();
 
-    switch(operation) {
-    case SetRNone:
-        client->onGroupChatKickResult(room->name(), success);
-        break;
-#ifdef XMPP_CLIENT_BAN_ENABLE
-    case SetOutcast:
-        client->onGroupChatBanResult(room->name(), success);
-        break;
-    case SetANone:
-        client->onGroupChatUnbanResult(room->name(), success);
-        break;
-#endif // XMPP_CLIENT_BAN_ENABLE
-    case CreateInstantRoom:
-    {
-        MutexGuard guard(chat_sessions_lock);
+    if(function) {
+        function(data);
+    }
+    else {
+        impl->getXmpp()->sendXml(xml);
+    }
 
-        GroupChatSession *chat_session = findGroupChatSession(room->name());
-        if(chat_session) {
-            assert(chat_session->room == room);
+    // NOTE: the socket buffer was full, gloox's blocking write waited for it,
+    // NOTE: or io_uring holds it back, its writes never wait
+    if(XMPPClock::now() - start > SCHEDULER_WRITE_STALL * 1000ULL
+       || impl->getXmpp()->getQueuedBytes() > SCHEDULER_URING_BACKLOG) {
+        is_congested = true;
+    }
+}
 
-            chat_session->creation_state = GroupChatSession::CREATION_STATE_COMPLETE;
-            client->onGroupChatCreate(room->name(), success);
-        }
+bool XMPPClient::SchedulerImpl::hasQueued()
+{
+    MutexGuard guard(queue_lock);
+    return queued != 0;
+}
+
+bool XMPPClient::SchedulerImpl::isWritable()
+{
+    int socket = impl->getXmpp()->getSocket();
+    if(socket < 0) {
+        return true;
     }
-    break;
-    case DestroyRoom:
-        client->onGroupChatDestroy(room->name(), success);
-        break;
 
-    case CancelRoomCreation:
-    case RequestRoomConfig:
-    case SendRoomConfig:
-        // FIXME: do we need signal error cases? (sometimes it doesn't event happen)
-        //if(!success) {
-        //    client->onGroupChatOperationError(room->name(), operation);
-        //}
-#ifndef XMPP_CLIENT_BAN_ENABLE
-    case SetOutcast:
-    case SetANone:
-#endif // XMPP_CLIENT_BAN_ENABLE
-    default:
-        break;
+    // NOTE: errors are reported too, the write then fails as it would have
+    struct pollfd fds;
+    fds.fd = socket;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+
+    bool is_writable = (::poll(&fds, 1, 0) > 0 && impl->getXmpp()->getQueuedBytes() <= SCHEDULER_URING_BACKLOG);
+    if(is_writable) {
+        is_congested = false;
     }
+
+    return is_writable;
 }
 
-void XMPPClient::GroupChatImpl::handleMUCRequest(MUCRoom* room, const DataForm& form)
+/// XMPPClient
+static bool g_is_readable(int socket)
 {
-#ifdef _DEBUG
-    ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> GroupChatImpl::handleMUCRequest(): "
-              "group='%s' form=[", room->name().c_str());
+    if(socket < 0) {
+        return false;
+    }
 
-    g_show_room_data_form(form);
+    struct pollfd fds;
+    fds.fd = socket;
+    fds.events = POLLIN;
+    fds.revents = 0;
 
-    ::fprintf(stderr, "]\n");
-#endif // _DEBUG
+    return ::poll(&fds, 1, 0) > 0;
 }
 
-/// XMPPClient
 XMPPClient::Error::Error(const string& error)
     : runtime_error(error)
 {
@@ -1463,29 +5040,77 @@ static string g_extract_server_domain(const string& jid)
 
 XMPPClient::Config::Config(const string& jid_, const string& passwd_)
     : jid(jid_), passwd(passwd_),
-      server(""), port(5222),
+      server(""), port(5222), server_address(""),
+      endpoint_standby(false), io_uring(false),
       tls_policy(TLSOptional),
       groupchat_server("conference." + g_extract_server_domain(jid)),
-      recv_timeout(-1)
+      recv_timeout(-1),
+      metrics_export(""), metrics_export_interval(10000),
+      capture_file(""),
+      event_bridge(""), event_bridge_size(1048576),
+      fanout_rate(1000),
+      multicast(true), multicast_limit(50),
+      disco_cache_ttl(86400), disco_cache(""),
+      send_rate_bytes(0), send_rate_stanzas(0), send_burst(500),
+      fast_parser(false),
+      message_timeout(60000),
+      ping_interval(30000), ping_interval_max(120000),
+      ping_timeout(5000), dead_peer_timeout(15000),
+      tcp_keepalive(true), tcp_keepalive_idle(60),
+      tcp_keepalive_interval(10), tcp_keepalive_count(3),
+      roster(false), roster_cache("")
 {
 }
 
 XMPPClient::Config::Config()
     : jid("user@host.domain"), passwd("password"),
-      server(""), port(5222),
+      server(""), port(5222), server_address(""),
+      endpoint_standby(false), io_uring(false),
       tls_policy(TLSOptional),
       groupchat_server("conference." + g_extract_server_domain(jid)),
-      recv_timeout(-1)
+      recv_timeout(-1),
+      metrics_export(""), metrics_export_interval(10000),
+      capture_file(""),
+      event_bridge(""), event_bridge_size(1048576),
+      fanout_rate(1000),
+      multicast(true), multicast_limit(50),
+      disco_cache_ttl(86400), disco_cache(""),
+      send_rate_bytes(0), send_rate_stanzas(0), send_burst(500),
+      fast_parser(false),
+      message_timeout(60000),
+      ping_interval(30000), ping_interval_max(120000),
+      ping_timeout(5000), dead_peer_timeout(15000),
+      tcp_keepalive(true), tcp_keepalive_idle(60),
+      tcp_keepalive_interval(10), tcp_keepalive_count(3),
+      roster(false), roster_cache("")
 {
 }
 
 XMPPClient::Config::Config(const Config& config)
     : jid(config.jid), passwd(config.passwd),
-      server(config.server), port(config.port),
+      server(config.server), port(config.port), server_address(config.server_address),
+      endpoints(config.endpoints), endpoint_standby(config.endpoint_standby),
+      io_uring(config.io_uring),
       tls_policy(config.tls_policy),
       ca_certs(config.ca_certs),
       groupchat_server(config.groupchat_server),
-      recv_timeout(config.recv_timeout)
+      recv_timeout(config.recv_timeout),
+      metrics_export(config.metrics_export),
+      metrics_export_interval(config.metrics_export_interval),
+      capture_file(config.capture_file),
+      event_bridge(config.event_bridge), event_bridge_size(config.event_bridge_size),
+      fanout_rate(config.fanout_rate),
+      multicast(config.multicast), multicast_limit(config.multicast_limit),
+      disco_cache_ttl(config.disco_cache_ttl), disco_cache(config.disco_cache),
+      send_rate_bytes(config.send_rate_bytes), send_rate_stanzas(config.send_rate_stanzas),
+      send_burst(config.send_burst),
+      fast_parser(config.fast_parser),
+      message_timeout(config.message_timeout),
+      ping_interval(config.ping_interval), ping_interval_max(config.ping_interval_max),
+      ping_timeout(config.ping_timeout), dead_peer_timeout(config.dead_peer_timeout),
+      tcp_keepalive(config.tcp_keepalive), tcp_keepalive_idle(config.tcp_keepalive_idle),
+      tcp_keepalive_interval(config.tcp_keepalive_interval), tcp_keepalive_count(config.tcp_keepalive_count),
+      roster(config.roster), roster_cache(config.roster_cache)
 {
 }
 
@@ -1496,10 +5121,39 @@ const XMPPClient::Config& XMPPClient::Config::operator=(const Config& config)
         passwd = config.passwd;
         server = config.server;
         port = config.port;
+        server_address = config.server_address;
+        endpoints = config.endpoints;
+        endpoint_standby = config.endpoint_standby;
+        io_uring = config.io_uring;
         tls_policy = config.tls_policy;
         ca_certs = config.ca_certs;
         groupchat_server = config.groupchat_server;
         recv_timeout = config.recv_timeout;
+        metrics_export = config.metrics_export;
+        metrics_export_interval = config.metrics_export_interval;
+        capture_file = config.capture_file;
+        event_bridge = config.event_bridge;
+        event_bridge_size = config.event_bridge_size;
+        fanout_rate = config.fanout_rate;
+        multicast = config.multicast;
+        multicast_limit = config.multicast_limit;
+        disco_cache_ttl = config.disco_cache_ttl;
+        disco_cache = config.disco_cache;
+        send_rate_bytes = config.send_rate_bytes;
+        send_rate_stanzas = config.send_rate_stanzas;
+        send_burst = config.send_burst;
+        fast_parser = config.fast_parser;
+        message_timeout = config.message_timeout;
+        ping_interval = config.ping_interval;
+        ping_interval_max = config.ping_interval_max;
+        ping_timeout = config.ping_timeout;
+        dead_peer_timeout = config.dead_peer_timeout;
+        tcp_keepalive = config.tcp_keepalive;
+        tcp_keepalive_idle = config.tcp_keepalive_idle;
+        tcp_keepalive_interval = config.tcp_keepalive_interval;
+        tcp_keepalive_count = config.tcp_keepalive_count;
+        roster = config.roster;
+        roster_cache = config.roster_cache;
     }
 
     return *this;
@@ -1512,9 +5166,38 @@ static ostream& operator<<(ostream& ost, const XMPPClient::Config& config)
         << " passwd='" <<  config.passwd << "'"
         << " server='" <<  config.server << "'"
         << " port=" << config.port
+        << " server_address='" << config.server_address << "'"
+        << " endpoints=" << config.endpoints.size()
+        << " endpoint_standby=" << config.endpoint_standby
+        << " io_uring=" << config.io_uring
         << " tls_policy=" <<  config.tls_policy
         << " groupchat_server='" <<  config.groupchat_server << "'"
-        << " recv_timeout=" << config.recv_timeout;
+        << " recv_timeout=" << config.recv_timeout
+        << " metrics_export='" << config.metrics_export << "'"
+        << " metrics_export_interval=" << config.metrics_export_interval
+        << " capture_file='" << config.capture_file << "'"
+        << " event_bridge='" << config.event_bridge << "'"
+        << " event_bridge_size=" << config.event_bridge_size
+        << " fanout_rate=" << config.fanout_rate
+        << " multicast=" << config.multicast
+        << " multicast_limit=" << config.multicast_limit
+        << " disco_cache_ttl=" << config.disco_cache_ttl
+        << " disco_cache='" << config.disco_cache << "'"
+        << " send_rate_bytes=" << config.send_rate_bytes
+        << " send_rate_stanzas=" << config.send_rate_stanzas
+        << " send_burst=" << config.send_burst
+        << " fast_parser=" << config.fast_parser
+        << " message_timeout=" << config.message_timeout
+        << " ping_interval=" << config.ping_interval
+        << " ping_interval_max=" << config.ping_interval_max
+        << " ping_timeout=" << config.ping_timeout
+        << " dead_peer_timeout=" << config.dead_peer_timeout
+        << " tcp_keepalive=" << config.tcp_keepalive
+        << " tcp_keepalive_idle=" << config.tcp_keepalive_idle
+        << " tcp_keepalive_interval=" << config.tcp_keepalive_interval
+        << " tcp_keepalive_count=" << config.tcp_keepalive_count
+        << " roster=" << config.roster
+        << " roster_cache='" << config.roster_cache << "'";
 
     return ost;
 }
@@ -1522,7 +5205,8 @@ static ostream& operator<<(ostream& ost, const XMPPClient::Config& config)
 
 XMPPClient::XMPPClient(const Config& config_)
     : config(config_), impl(0),
-      is_connected(false), is_running(false),
+      is_connected(false), has_connected(false), is_inactive(false),
+      has_event_loop_thread(false), is_running(false),
       recv_timeout(-1)
 {
 #ifdef _DEBUG
@@ -1534,10 +5218,19 @@ XMPPClient::XMPPClient(const Config& config_)
     }
 
     impl = new ClientImpl(this, config);
+
+    if(!config.metrics_export.empty()) {
+        metrics.attachExport(config.metrics_export, config.metrics_export_interval,
+                             XMPPMetrics::formatLabel("jid", config.jid));
+    }
 }
 
 XMPPClient::~XMPPClient()
 {
+    if(!config.metrics_export.empty()) {
+        metrics.detachExport(config.metrics_export);
+    }
+
     delete impl;
 }
 
@@ -1548,8 +5241,9 @@ bool XMPPClient::connect(bool start_thread)
         return true;
     }
 
-    is_connected = impl->getXmpp()->connect(false);
+    is_connected = impl->getEndpointImpl().connect(impl->getXmpp());
     if(!is_connected) {
+        metrics.increment(XMPPMetrics::COUNTER_CONNECT_FAILURES);
         return false;
     }
 
@@ -1561,6 +5255,9 @@ bool XMPPClient::connect(bool start_thread)
             is_connected = false;
             is_running = false;
         }
+        else {
+            has_event_loop_thread = true;
+        }
     }
 
     return is_connected;
@@ -1572,10 +5269,17 @@ void XMPPClient::disconnect()
 
     // always wait for event_loop_thread() to finish
     is_running = false;
-    ::pthread_join(event_loop_thread, 0);
+    if(has_event_loop_thread) {
+        has_event_loop_thread = false;
+        ::pthread_join(event_loop_thread, 0);
+    }
 
     impl->getGroupChatImpl()->disposeGroupChatSessions();
     impl->getChatImpl()->disposeChatSessions();
+    impl->getChatImpl()->disposeFanout();
+
+    // NOTE: the event loop is gone, what onDisconnect() posted runs here
+    impl->runPosted();
 }
 
 void* XMPPClient::event_loop(void *data)
@@ -1611,18 +5315,157 @@ bool XMPPClient::update(int timeout /* milliseconds */)
     return internalUpdate((timeout == -1) ? timeout : (timeout * 1000));
 }
 
+bool XMPPClient::processReady(int max_stanzas, int max_time /* milliseconds */)
+{
+    if(is_running) {
+        return true;
+    }
+
+    uint64_t deadline = XMPPClock::now() + (uint64_t)max_time * 1000000ULL;
+    uint64_t stanzas = getStanzasIn();
+
+    // NOTE: a dead peer is aborted here and reported by the first receive()
+    updateTimers(0);
+
+    do {
+        if(!receive(0)) {
+            return false;
+        }
+
+        if(max_stanzas > 0 && getStanzasIn() - stanzas >= (uint64_t)max_stanzas) {
+            break;
+        }
+        if(max_time > 0 && XMPPClock::now() >= deadline) {
+            break;
+        }
+    } while(g_is_readable(impl->getXmpp()->getPollSocket()));
+
+    return true;
+}
+
+int XMPPClient::getNextTimeout()
+{
+    if(is_running) {
+        return -1;
+    }
+
+    int timeout = updateTimers(-1);
+    return (timeout < 0) ? -1 : ((timeout + 999) / 1000);
+}
+
+int XMPPClient::getSocket() const
+{
+    return impl->getXmpp()->getPollSocket();
+}
+
+uint64_t XMPPClient::getStanzasIn() const
+{
+    return metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_MESSAGE)
+        + metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_PRESENCE)
+        + metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_IQ)
+        + metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_SUBSCRIPTION);
+}
+
 bool XMPPClient::internalUpdate(int timeout /* microseconds */)
 {
+    return receive(updateTimers(timeout));
+}
+
+int XMPPClient::updateTimers(int timeout /* microseconds */)
+{
+    // NOTE: do not wait in recv() past the next fan-out slot
+    if(impl->getChatImpl()->flushFanout() && (timeout < 0 || timeout > FANOUT_INTERVAL)) {
+        timeout = FANOUT_INTERVAL;
+    }
+
+    // NOTE: nor past the next check of a busy socket or of the send rates
+    int pacing = impl->getSchedulerImpl().flush();
+    if(pacing >= 0 && (timeout < 0 || timeout > pacing)) {
+        timeout = pacing;
+    }
+
+    // NOTE: nor past the next tracked message deadline
+    int deadline = impl->getDeliveryImpl().expire();
+    if(deadline >= 0 && (timeout < 0 || timeout > deadline)) {
+        timeout = deadline;
+    }
+
+    // NOTE: nor past the next check of the standby connection
+    int standby = impl->getEndpointImpl().update(XMPPClock::now());
+    if(standby >= 0 && (timeout < 0 || timeout > standby)) {
+        timeout = standby;
+    }
+
+    // NOTE: nor past the next ping or dead peer check
+    bool is_dead = false;
+    int keepalive = impl->getKeepaliveImpl().update(XMPPClock::now(), &is_dead);
+    if(is_dead) {
+        // NOTE: the next recv() then fails with ConnNotConnected, the socket is closed already
+        impl->getXmpp()->abortConnection(ConnIoError);
+        timeout = 0;
+    }
+    else if(keepalive >= 0 && (timeout < 0 || timeout > keepalive)) {
+        timeout = keepalive;
+    }
+
+    // NOTE: nor at all when something was posted
+    if(impl->hasPosted()) {
+        timeout = 0;
+    }
+
+    return timeout;
+}
+
+bool XMPPClient::receive(int timeout /* microseconds */)
+{
+    uint64_t bytes_in = metrics.get(XMPPMetrics::COUNTER_BYTES_IN);
+    uint64_t start = XMPPClock::now();
+
+    // NOTE: gloox waits on the stream only, the standby handshake completing ends the wait too
+    int connecting = impl->getEndpointImpl().getConnectingSocket();
+    if(connecting >= 0 && timeout != 0) {
+        struct pollfd fds[2];
+        fds[0].fd = impl->getXmpp()->getPollSocket();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = connecting;
+        fds[1].events = POLLOUT;
+        fds[1].revents = 0;
+
+        if(::poll(fds, 2, (timeout < 0) ? -1 : (timeout + 999) / 1000) > 0 && fds[1].revents) {
+            impl->getEndpointImpl().connected(XMPPClock::now());
+        }
+        timeout = 0;
+    }
+
     ConnectionError error = impl->getXmpp()->recv(timeout);
     ConnectionState state = impl->getXmpp()->state();
     bool retcode = true;
 
+    // NOTE: nothing from the batch outlives its callbacks
+    impl->getArena().reset();
+
+    uint64_t end = XMPPClock::now();
+    if(metrics.get(XMPPMetrics::COUNTER_BYTES_IN) != bytes_in) {
+        metrics.record(XMPPMetrics::HISTOGRAM_RECV, end - start);
+        impl->getKeepaliveImpl().received(end);
+    }
+    else {
+        metrics.increment(XMPPMetrics::COUNTER_RECV_IDLE);
+    }
+
+    // NOTE: once per batch, a login may bring many roster pushes and discovery results
+    impl->getRosterImpl().save();
+    impl->getChatImpl()->saveDiscoCache();
+
+    impl->runPosted();
+
     if(error == ConnNoError) {
         if(StateDisconnected == state) {
             is_connected = false;
             retcode = false;
         }
-        else if(is_running == false) {
+        else if(has_event_loop_thread && is_running == false) {
             // NOTE: it appears there is a broken connection that timeouts
             is_connected = false;
             retcode = false;
@@ -1643,10 +5486,8 @@ bool XMPPClient::internalUpdate(int timeout /* microseconds */)
                 break;
             }
 
-#ifdef _DEBUG
-            ::fprintf(stderr, ">>> DEBUG >>> XMPP_CLIENT >>> XMPPClient::handleUpdateError(): "
-                      "state=%d error=%d\n", (int)state, (int)error);
-#endif // _DEBUG
+            XMPP_TRACE(XMPPTrace::LEVEL_ERROR, XMPPTrace::EVENT_UPDATE_ERROR,
+                       0, 0, (int)state, (int)error);
             retcode = handleUpdateError(state, error);
             break;
         }
@@ -1655,11 +5496,58 @@ bool XMPPClient::internalUpdate(int timeout /* microseconds */)
     return retcode;
 }
 
+void XMPPClient::post(PostedFunction function, void *data)
+{
+    impl->post(function, data);
+}
+
+void XMPPClient::setPostHook(PostedFunction function, void *data)
+{
+    impl->setPostHook(function, data);
+}
+
+uint64_t XMPPClient::getSendQueueDelay() const
+{
+    return impl->getSchedulerImpl().getQueueDelay();
+}
+
+bool XMPPClient::getRosterItem(const string& jid, RosterItem *item) const
+{
+    return impl->getRosterImpl().find(jid, item);
+}
+
+size_t XMPPClient::getRosterSize() const
+{
+    return impl->getRosterImpl().size();
+}
+
+bool XMPPClient::setInactive(bool inactive)
+{
+    if(is_inactive == inactive) {
+        return false;
+    }
+    is_inactive = inactive;
+
+    XMPP_TRACE(XMPPTrace::LEVEL_INFO, XMPPTrace::EVENT_CLIENT_STATE, 0, 0, (int)inactive);
+    metrics.setGauge(XMPPMetrics::GAUGE_INACTIVE, inactive ? 1 : 0);
+
+    if(!inactive) {
+        impl->post(GroupChatImpl::releasePresences, impl->getGroupChatImpl());
+    }
+
+    return is_connected && impl->sendClientState(inactive);
+}
+
 gloox::Client* XMPPClient::getXmpp() const
 {
     return impl->getXmpp();
 }
 
+bool XMPPClient::exportMetrics(const string& target) const
+{
+    return metrics.exportPrometheus(target, XMPPMetrics::formatLabel("jid", config.jid));
+}
+
 bool XMPPClient::handleUpdateError(ConnectionState state, ConnectionError error)
 {
     (void)state, void(error);
@@ -1715,6 +5603,12 @@ bool XMPPClient::sendChatMessageComposing(const string& user, const string& reso
         return false;
     }
 
+    // NOTE: nobody types in the background, not an error
+    if(is_inactive) {
+        metrics.increment(XMPPMetrics::COUNTER_INACTIVE_COMPOSING);
+        return true;
+    }
+
     return impl->getChatImpl()->sendChatMessageComposing(user, resource);
 }
 
@@ -1727,6 +5621,27 @@ bool XMPPClient::sendChatMessageDelivered(const string& user, const string& reso
     return impl->getChatImpl()->sendChatMessageDelivered(user, resource);
 }
 
+XMPPClient::MessageId XMPPClient::sendTrackedChatMessage(const string& user, const string& message,
+                                                        const string& subject, const string& resource)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    MessageId id = 0;
+    impl->getChatImpl()->sendChatMessage(user, message, subject, resource, &id);
+    return id;
+}
+
+bool XMPPClient::sendChatMessageToMany(const vector<string>& users, const string& message, const string& subject)
+{
+    if(!is_connected) {
+        return false;
+    }
+
+    return impl->getChatImpl()->sendChatMessageToMany(users, message, subject);
+}
+
 /// simple chat callbacks
 void XMPPClient::onChatMessage(const string& user, const string& resource,
                                const string& message, const string& subject, const char *timestamp)
@@ -1750,6 +5665,13 @@ void XMPPClient::onChatMessageDelivered(const string& user, const string& resour
     // do nothing
 }
 
+void XMPPClient::onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency)
+{
+    (void)id, (void)status, (void)latency;
+
+    // do nothing
+}
+
 /// group chat methods
 #ifdef XMPP_CLIENT_INVITE_DECLINE_ENABLE
 bool XMPPClient::declineGroupChatInvitation(const string& group, const string& user, const string& reason)
@@ -1907,6 +5829,17 @@ bool XMPPClient::sendGroupChatMessage(const string& group, const string& message
     return impl->getGroupChatImpl()->sendGroupChatMessage(group, message);
 }
 
+XMPPClient::MessageId XMPPClient::sendTrackedGroupChatMessage(const string& group, const string& message)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    MessageId id = 0;
+    impl->getGroupChatImpl()->sendGroupChatMessage(group, message, &id);
+    return id;
+}
+
 bool XMPPClient::inviteToGroupChat(const string& group, const string& user, const string& reason)
 {
     if(!is_connected) {
@@ -1954,6 +5887,63 @@ bool XMPPClient::listGroupChatUsers(const string& group)
     return impl->getGroupChatImpl()->listGroupChatUsers(group);
 }
 
+XMPPClient::RequestId XMPPClient::requestGroupChatKick(const string& group, const string& user, const string& reason)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    RequestId id = 0;
+    impl->getGroupChatImpl()->kickFromGroupChat(group, user, reason, &id);
+    return id;
+}
+
+#ifdef XMPP_CLIENT_BAN_ENABLE
+XMPPClient::RequestId XMPPClient::requestGroupChatBan(const string& group, const string& user, const string& reason)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    RequestId id = 0;
+    impl->getGroupChatImpl()->banFromGroupChat(group, user, reason, &id);
+    return id;
+}
+
+XMPPClient::RequestId XMPPClient::requestGroupChatUnban(const string& group, const string& user)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    RequestId id = 0;
+    impl->getGroupChatImpl()->unbanFromGroupChat(group, user, &id);
+    return id;
+}
+#endif // XMPP_CLIENT_BAN_ENABLE
+
+XMPPClient::RequestId XMPPClient::requestGroupChatConfiguration(const string& group, const GroupChatConfig *config)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    RequestId id = 0;
+    impl->getGroupChatImpl()->configureGroupChat(group, config, &id);
+    return id;
+}
+
+XMPPClient::RequestId XMPPClient::requestGroupChatDestroy(const string& group, const string& reason)
+{
+    if(!is_connected) {
+        return 0;
+    }
+
+    RequestId id = 0;
+    impl->getGroupChatImpl()->destroyGroupChat(group, reason, &id);
+    return id;
+}
+
 /// group chat callbacks
 bool XMPPClient::onGroupChatCreation(const string& group)
 {
@@ -2058,3 +6048,24 @@ void XMPPClient::onGroupChatUsersList(const string& group, const StringList& use
 
     // do nothing
 }
+
+void XMPPClient::onGroupChatRequestResult(RequestId id, const string& group,
+                                          GroupChatOperation operation, bool success)
+{
+    (void)id, (void)group, (void)operation, (void)success;
+
+    // do nothing
+}
+
+/// roster callbacks
+void XMPPClient::onRosterItem(const RosterItem& item, bool removed)
+{
+    (void)item, (void)removed;
+
+    // do nothing
+}
+
+void XMPPClient::onRosterReady()
+{
+    // do nothing
+}
@@ -3,8 +3,12 @@
 #ifndef XMPP_CLIENT_INCLUDED
 #define XMPP_CLIENT_INCLUDED
 
+#include "XMPPMetrics.hpp"
+#include "XMPPRoster.hpp"
+
 #include <gloox/gloox.h>
 #include <stdexcept>
+#include <vector>
 
 #include <pthread.h>
 
@@ -43,6 +47,15 @@ public:
 
         string server;            // generated from jid
         int port;                 // 5222
+        string server_address;    // empty string (resolved by gloox), numeric address connected to instead of server,
+                                  // which TLS still verifies (see XMPPClientRegistry)
+        StringList endpoints;     // empty list (server and port), "host[:port]" connected to fastest healthy first
+                                  // instead, TLS still verifies server (see XMPPEndpoints)
+        bool endpoint_standby;    // false, keeps a TCP connection to the next best endpoint for a faster failover, a
+                                  // second connection kept open (radio, battery); its connect time ranks the endpoints
+                                  // with update() only, processReady() does not wait on it
+        bool io_uring;            // false, the stream goes through io_uring when built with XMPP_CLIENT_IO_URING_ENABLE
+                                  // on Linux 6.0 and later, plain TCP calls otherwise (see XMPPUringConnection)
 
         TLSPolicy tls_policy;     // TLSOptional
         StringList ca_certs;      // empty list
@@ -50,6 +63,44 @@ public:
         string groupchat_server;  // generated from jid
 
         int recv_timeout;         // no timeout (-1), otherwise in milliseconds
+
+        string metrics_export;    // empty string (disabled), file path or "unix:<socket path>", shared with the clients of the process exporting there
+        int metrics_export_interval;  // 10000 milliseconds, exported by a process-wide thread
+
+        string capture_file;      // empty string (disabled), records the inbound stream (see XMPPCapture)
+
+        string event_bridge;      // empty string (disabled), shared memory name ("/name") the events are published
+                                  // to for another process, besides the callbacks (see XMPPEventBridge)
+        int event_bridge_size;    // 1048576 bytes of events held for a slow consumer, the next ones are dropped
+
+        int fanout_rate;          // 1000 recipients per second for sendChatMessageToMany(), multicast or not,
+                                  // 0 for no limit
+        bool multicast;           // true, sendChatMessageToMany() uses XEP-0033 when the server offers it
+        int multicast_limit;      // 50 addresses per stanza, or less if the service advertises it
+
+        int disco_cache_ttl;      // 86400 seconds a discovery result is reused by later connections, 0 to always query
+        string disco_cache;       // empty string (memory only), file sharing discovery results between runs (see XMPPDiscoCache)
+
+        int send_rate_bytes;      // 0 (no limit), outbound bytes per second of the stanzas the library writes
+        int send_rate_stanzas;    // 0 (no limit), outbound stanzas per second, e.g. under the server's karma
+        int send_burst;           // 500 milliseconds worth of bytes and stanzas sent at once after an idle time
+
+        bool fast_parser;         // false, reads plain messages without gloox Tag trees (see XMPPStanzaReader)
+
+        int message_timeout;      // 60000 milliseconds before a tracked message completes with MESSAGE_TIMEOUT
+
+        int ping_interval;        // 30000 milliseconds without inbound data before a XEP-0199 ping, 0 to disable
+        int ping_interval_max;    // 120000 milliseconds, the interval doubles up to it after each ping answered in time
+        int ping_timeout;         // 5000 milliseconds before an unanswered ping is sent again and the interval reset
+        int dead_peer_timeout;    // 15000 milliseconds of unanswered pings before disconnecting with ConnIoError
+
+        bool tcp_keepalive;       // true, SO_KEEPALIVE on the stream socket
+        int tcp_keepalive_idle;   // 60 seconds before the first probe, 0 for the system default
+        int tcp_keepalive_interval;  // 10 seconds between probes, 0 for the system default
+        int tcp_keepalive_count;  // 3 probes, 0 for the system default
+
+        bool roster;              // false, gloox never requests the roster, otherwise see getRosterItem()
+        string roster_cache;      // empty string (memory only), file keeping the roster and its version between runs
     };
 
     explicit XMPPClient(const Config& config);
@@ -58,10 +109,84 @@ public:
 
     bool update(int timeout = -1);
 
+    /// for an external event loop (epoll, libuv...) instead of update(), after connect(false):
+    /// poll getSocket() for reading, level-triggered, and call processReady() when it is
+    /// readable or getNextTimeout() milliseconds have passed, from the thread owning the client
+
+    /// descriptor of the stream, -1 when not connected, another one after a reconnection;
+    /// the io_uring instance with Config::io_uring, readable when it has completions
+    int getSocket() const;
+
+    /// reads what the socket holds without waiting, up to about max_stanzas stanzas or
+    /// max_time milliseconds (checked between reads, 0 for no limit), the rest is left
+    /// for the next call; false when disconnected, as update()
+    bool processReady(int max_stanzas, int max_time);
+
+    /// milliseconds before processReady() is due even if the socket stays idle, -1 if
+    /// no timer is pending; runs the timers already due (pings, pacing, fan-out, timeouts)
+    int getNextTimeout();
+
     const Config& getConfig() const {
         return config;
     }
 
+    const XMPPMetrics& getMetrics() const {
+        return metrics;
+    }
+
+    bool isConnected() const {
+        return is_connected;
+    }
+
+    /// nanoseconds a stanza sent now would wait for the socket or Config::send_rate_*,
+    /// estimated from what is queued, e.g. to slow down a producer
+    uint64_t getSendQueueDelay() const;
+
+    /// runs function(data) from update() or the event loop, after the recv() in progress
+    /// NOTE: thread safe, a recv() without timeout is not interrupted
+    typedef void (*PostedFunction)(void *data);
+    void post(PostedFunction function, void *data);
+
+    /// function(data) runs on the thread calling post() once queued, e.g. to wake an
+    /// external event loop waiting on getSocket(); 0 for none, set before sharing the client
+    void setPostHook(PostedFunction function, void *data);
+
+    /// XEP-0352 client state for a backgrounded application: the server may hold back
+    /// non urgent traffic, composing events are neither sent nor reported, and group
+    /// chat presence is reported once per user when active again;
+    /// true if the server was told, the state is kept across reconnections
+    bool setInactive(bool inactive);
+
+    bool isInactive() const {
+        return is_inactive;
+    }
+
+    /// writes metrics in Prometheus text format to a file or "unix:<socket path>"
+    bool exportMetrics(const string& target) const;
+
+    /// roster entry (Config::roster)
+    typedef XMPPRoster::Item RosterItem;
+
+    /// looks a bare JID up in the roster kept in memory, false if it is not there;
+    /// the cached roster is served before the first connection too
+    bool getRosterItem(const string& jid, RosterItem *item) const;
+    size_t getRosterSize() const;
+
+    /// handle of a tracked message, 0 is never used
+    typedef uint64_t MessageId;
+
+    /// how a tracked message completed, reported once by onMessageCompletion(), except
+    /// for a chat message stored offline: MESSAGE_ACKNOWLEDGED, then MESSAGE_DELIVERED
+    /// when the peer comes back within Config::message_timeout, nothing otherwise
+    enum MessageStatus {
+        MESSAGE_ACKNOWLEDGED,  // group chat: the room reflected it; chat: the server stored it offline and said
+                               // so with a jabber:x:event offline event (servers with XEP-0160 offline storage)
+        MESSAGE_DELIVERED,     // chat only: jabber:x:event delivered event from the client of the peer (those
+                               // implementing XEP-0022, as this library and gloox's MessageEventFilter do)
+        MESSAGE_FAILED,        // error reply from the server or the room, or the connection was lost
+        MESSAGE_TIMEOUT        // nothing within Config::message_timeout
+    };
+
 public:
     /// connection methods
     bool connect(bool start_thread = true);
@@ -72,6 +197,13 @@ public:
     bool sendChatMessageComposing(const string& user, const string& resource = "");
     bool sendChatMessageDelivered(const string& user, const string& resource = "");
 
+    /// sendChatMessage() completed later by onMessageCompletion(), 0 if nothing was sent
+    MessageId sendTrackedChatMessage(const string& user, const string& message, const string& subject = "", const string& resource = "");
+
+    /// queues the same message to many users (no chat session is created),
+    /// sent from update() or the event loop at Config::fanout_rate
+    bool sendChatMessageToMany(const vector<string>& users, const string& message, const string& subject = "");
+
     /// group chat methods
     struct GroupChatConfig
     {
@@ -112,6 +244,7 @@ public:
     bool cancelGroupChatCreation(const string& group);
     bool setGroupChatSubject(const string& group, const string& subject);
     bool sendGroupChatMessage(const string& group, const string& message);
+    MessageId sendTrackedGroupChatMessage(const string& group, const string& message);
     bool inviteToGroupChat(const string& group, const string& user, const string& reason = "");
     bool kickFromGroupChat(const string& group, const string& user, const string& reason = "");
 
@@ -122,6 +255,27 @@ public:
 
     bool listGroupChatUsers(const string& group);
 
+    /// handle of a group chat administration request, 0 is never used
+    typedef uint64_t RequestId;
+
+    enum GroupChatOperation {
+        GROUP_CHAT_KICK,
+        GROUP_CHAT_BAN,
+        GROUP_CHAT_UNBAN,
+        GROUP_CHAT_CONFIGURE,
+        GROUP_CHAT_DESTROY
+    };
+
+    /// same as the methods above, each completed once by onGroupChatRequestResult(),
+    /// 0 if nothing was sent; many requests may be in flight for one group
+    RequestId requestGroupChatKick(const string& group, const string& user, const string& reason = "");
+#ifdef XMPP_CLIENT_BAN_ENABLE
+    RequestId requestGroupChatBan(const string& group, const string& user, const string& reason = "");
+    RequestId requestGroupChatUnban(const string& group, const string& user);
+#endif // XMPP_CLIENT_BAN_ENABLE
+    RequestId requestGroupChatConfiguration(const string& group, const GroupChatConfig *config = 0);
+    RequestId requestGroupChatDestroy(const string& group, const string& reason = "");
+
 protected:
     /// connection callbacks
     virtual void onConnect();
@@ -134,6 +288,9 @@ protected:
     virtual void onChatMessageComposing(const string& user, const string& resource);
     virtual void onChatMessageDelivered(const string& user, const string& resource);
 
+    /// tracked message callback, latency is the time since it was sent in nanoseconds
+    virtual void onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency);
+
     /// group chat callbacks
     virtual bool onGroupChatCreation(const string& group);
     virtual void onGroupChatCreate(const string& group, bool success);
@@ -154,6 +311,16 @@ protected:
     virtual void onGroupChatInviteDecline(const string& group, const string& user, const string& reason);
     virtual void onGroupChatUsersList(const string& group, const StringList& users);
 
+    /// group chat request callback, also failed when the group is left or the connection is lost
+    virtual void onGroupChatRequestResult(RequestId id, const string& group,
+                                          GroupChatOperation operation, bool success);
+
+    /// roster callbacks (Config::roster), from the event loop: each change to the
+    /// cached roster, then onRosterReady() once the server answered the request of
+    /// a new stream; the changes since the cached version follow as pushes
+    virtual void onRosterItem(const RosterItem& item, bool removed);
+    virtual void onRosterReady();
+
 protected:
     gloox::Client* getXmpp() const;
 
@@ -165,6 +332,10 @@ protected:
 
 private:
     bool internalUpdate(int timeout);
+    int updateTimers(int timeout);
+    bool receive(int timeout);
+
+    uint64_t getStanzasIn() const;
 
 private:
     class ClientImpl;
@@ -175,13 +346,24 @@ private:
     class GroupChatImpl;
     struct GroupChatSession;
 
+    class DeliveryImpl;
+    class KeepaliveImpl;
+    class SchedulerImpl;
+    class RosterImpl;
+    class EndpointImpl;
+
     Config config;
     ClientImpl *impl;
 
     volatile bool is_connected;
+    bool has_connected;
+    volatile bool is_inactive;
+
+    XMPPMetrics metrics;
 
     static void* event_loop(void *data);
     pthread_t event_loop_thread;
+    bool has_event_loop_thread;  // not started by connect(false)
     volatile bool is_running;
 
     int recv_timeout;
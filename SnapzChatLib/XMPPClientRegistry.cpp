@@ -0,0 +1,822 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPClientRegistry.hpp"
+#include "XMPPClock.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif // __linux__
+
+// work done for a readable client before the others of its event loop get their turn
+static const int STANZAS_PER_UPDATE = 64;
+static const int TIME_PER_UPDATE = 5;  // milliseconds
+
+// epoll events taken per wait, the others are reported by the next one
+static const int EVENTS_PER_WAIT = 256;
+
+// Entry::timer of an entry out of the heap
+static const size_t NO_TIMER = (size_t)-1;
+
+// domain part of a JID, as gloox connects to it when Config::server is empty
+static string g_extract_domain(const string& jid)
+{
+    size_t begin = jid.find('@');
+    begin = (begin != string::npos) ? begin + 1 : 0;
+
+    size_t end = jid.find('/', begin);
+    return jid.substr(begin, (end != string::npos) ? end - begin : string::npos);
+}
+
+// first address of host, empty string if it cannot be resolved
+static string g_resolve_host(const string& host)
+{
+    struct addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = 0;
+    if(::getaddrinfo(host.c_str(), 0, &hints, &result) != 0 || !result) {
+        return "";
+    }
+
+    char address[INET6_ADDRSTRLEN] = "";
+    const void *addr = 0;
+    if(result->ai_family == AF_INET) {
+        addr = &reinterpret_cast<struct sockaddr_in*>(result->ai_addr)->sin_addr;
+    }
+    else if(result->ai_family == AF_INET6) {
+        addr = &reinterpret_cast<struct sockaddr_in6*>(result->ai_addr)->sin6_addr;
+    }
+
+    if(addr && !::inet_ntop(result->ai_family, addr, address, sizeof(address))) {
+        address[0] = '\0';
+    }
+
+    ::freeaddrinfo(result);
+
+    return address;
+}
+
+// NOTE: the flags of an entry are plain ints for the __sync builtins
+static bool g_test_flag(volatile int *flag)
+{
+    return __sync_fetch_and_or(flag, 0) != 0;
+}
+
+static bool g_clear_flag(volatile int *flag)
+{
+    return __sync_fetch_and_and(flag, 0) != 0;
+}
+
+static void g_set_flag(volatile int *flag)
+{
+    __sync_fetch_and_or(flag, 1);
+}
+
+static void g_set_nonblocking(int fd)
+{
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// interrupts the wait of an event loop, a full pipe does as well
+static void g_wake(int fd)
+{
+    char wake = 0;
+    while(::write(fd, &wake, 1) < 0 && errno == EINTR) {
+    }
+}
+
+// empties the wake pipe, the requests it signalled are taken under their lock
+static void g_drain(int fd)
+{
+    char buffer[64];
+    for(;;) {
+        ssize_t size = ::read(fd, buffer, sizeof(buffer));
+        if(size < 0 && errno == EINTR) {
+            continue;
+        }
+        if(size <= 0) {
+            return;
+        }
+    }
+}
+
+/// XMPPClientRegistry::Config
+XMPPClientRegistry::Config::Config()
+    : event_loops(4), connect_threads(2), dns_ttl(300)
+{
+}
+
+/// XMPPClientRegistry
+XMPPClientRegistry::XMPPClientRegistry(const Config& config_)
+    : config(config_), removed(0), last_handle(0), is_running(false)
+{
+    ::pthread_mutex_init(&entries_lock, 0);
+    ::pthread_mutex_init(&addresses_lock, 0);
+    ::pthread_mutex_init(&connects_lock, 0);
+    ::pthread_cond_init(&connects_cond, 0);
+
+    int count = (config.event_loops > 0) ? config.event_loops : 1;
+    for(int i = 0; i < count; ++i) {
+        EventLoop *loop = new EventLoop;
+        loop->registry = this;
+        loop->has_thread = false;
+        loop->is_woken = false;
+        ::pthread_mutex_init(&loop->added_lock, 0);
+
+        // NOTE: start() fails on descriptors not created
+        if(::pipe(loop->wake) == 0) {
+            g_set_nonblocking(loop->wake[0]);
+            g_set_nonblocking(loop->wake[1]);
+        }
+        else {
+            loop->wake[0] = loop->wake[1] = -1;
+        }
+
+#ifdef __linux__
+        loop->poller = ::epoll_create(1);
+        if(loop->poller >= 0 && loop->wake[0] >= 0) {
+            struct epoll_event event;
+            ::memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = 0;
+            ::epoll_ctl(loop->poller, EPOLL_CTL_ADD, loop->wake[0], &event);
+        }
+#else
+        struct pollfd fd;
+        fd.fd = loop->wake[0];
+        fd.events = POLLIN;
+        fd.revents = 0;
+        loop->fds.push_back(fd);
+#endif // __linux__
+
+        loops.push_back(loop);
+    }
+}
+
+XMPPClientRegistry::~XMPPClientRegistry()
+{
+    stop();
+
+    // NOTE: every entry, removed or not, is owned by its event loop
+    for(vector<EventLoop*>::iterator it = loops.begin(); it != loops.end(); ++it) {
+        EventLoop *loop = *it;
+        loop->entries.insert(loop->entries.end(), loop->added.begin(), loop->added.end());
+
+        for(vector<Entry*>::iterator entry = loop->connected.begin(); entry != loop->connected.end(); ++entry) {
+            (*entry)->is_connected = (*entry)->is_connect_succeeded;
+        }
+
+        for(vector<Entry*>::iterator entry = loop->entries.begin(); entry != loop->entries.end(); ++entry) {
+            if((*entry)->is_connected) {
+                (*entry)->client->disconnect();
+            }
+            delete (*entry)->client;
+            delete *entry;
+        }
+
+#ifdef __linux__
+        if(loop->poller >= 0) {
+            ::close(loop->poller);
+        }
+#endif // __linux__
+        if(loop->wake[0] >= 0) {
+            ::close(loop->wake[0]);
+            ::close(loop->wake[1]);
+        }
+
+        ::pthread_mutex_destroy(&loop->added_lock);
+        delete loop;
+    }
+
+    ::pthread_cond_destroy(&connects_cond);
+    ::pthread_mutex_destroy(&connects_lock);
+    ::pthread_mutex_destroy(&addresses_lock);
+    ::pthread_mutex_destroy(&entries_lock);
+}
+
+bool XMPPClientRegistry::start()
+{
+    if(is_running) {
+        return true;
+    }
+
+    for(vector<EventLoop*>::iterator it = loops.begin(); it != loops.end(); ++it) {
+#ifdef __linux__
+        if((*it)->poller < 0) {
+            return false;
+        }
+#endif // __linux__
+        if((*it)->wake[0] < 0) {
+            return false;
+        }
+    }
+
+    is_running = true;
+
+    for(vector<EventLoop*>::iterator it = loops.begin(); it != loops.end(); ++it) {
+        if(::pthread_create(&(*it)->thread, 0, XMPPClientRegistry::event_loop, *it) != 0) {
+            stop();
+            return false;
+        }
+        (*it)->has_thread = true;
+    }
+
+    int count = (config.connect_threads > 0) ? config.connect_threads : 1;
+    for(int i = 0; i < count; ++i) {
+        pthread_t thread;
+        if(::pthread_create(&thread, 0, XMPPClientRegistry::connect_thread, this) != 0) {
+            stop();
+            return false;
+        }
+        connect_threads.push_back(thread);
+    }
+
+    return true;
+}
+
+void XMPPClientRegistry::stop()
+{
+    is_running = false;
+
+    for(vector<EventLoop*>::iterator it = loops.begin(); it != loops.end(); ++it) {
+        if((*it)->has_thread) {
+            // NOTE: out of its wait without a request, is_running is checked next
+            g_wake((*it)->wake[1]);
+
+            (*it)->has_thread = false;
+            ::pthread_join((*it)->thread, 0);
+        }
+    }
+
+    // NOTE: is_running is read under connects_lock by the connect threads waiting
+    ::pthread_mutex_lock(&connects_lock);
+    ::pthread_cond_broadcast(&connects_cond);
+    ::pthread_mutex_unlock(&connects_lock);
+
+    for(vector<pthread_t>::iterator it = connect_threads.begin(); it != connect_threads.end(); ++it) {
+        ::pthread_join(*it, 0);
+    }
+    connect_threads.clear();
+
+    // NOTE: every thread is gone, the connects not started are requested again for the next start()
+    for(deque<Entry*>::iterator it = connects.begin(); it != connects.end(); ++it) {
+        (*it)->is_connecting = false;
+        g_set_flag(&(*it)->is_connect_requested);
+        request(*it);
+    }
+    connects.clear();
+}
+
+XMPPClientRegistry::Handle XMPPClientRegistry::create(Factory factory, const XMPPClient::Config& client_config, void *data)
+{
+    XMPPClient *client = 0;
+
+    if(client_config.server_address.empty() && config.dns_ttl > 0) {
+        XMPPClient::Config resolved_config(client_config);
+        resolved_config.server_address = resolve(client_config.server.empty() ?
+                                                 g_extract_domain(client_config.jid) : client_config.server);
+        client = factory(resolved_config, data);
+    }
+    else {
+        client = factory(client_config, data);
+    }
+
+    if(!client) {
+        return 0;
+    }
+
+    Entry *entry = new Entry;
+    entry->client = client;
+    entry->is_connect_requested = 0;
+    entry->is_removed = 0;
+    entry->references = 0;
+    entry->is_connected = false;
+    entry->is_connecting = false;
+    entry->deadline = 0;
+    entry->timer = NO_TIMER;
+    entry->position = 0;
+    entry->socket = -1;
+    entry->is_requested = false;
+    entry->is_connect_succeeded = false;
+
+    client->setPostHook(XMPPClientRegistry::posted, entry);
+
+    ::pthread_mutex_lock(&entries_lock);
+
+    entry->handle = ++last_handle;
+    EventLoop *loop = loops[entry->handle % loops.size()];
+    entry->loop = loop;
+
+    // NOTE: added before the handle is known, its event loop sees it before any request
+    ::pthread_mutex_lock(&loop->added_lock);
+    loop->added.push_back(entry);
+    bool is_waking = !loop->is_woken;
+    loop->is_woken = true;
+    ::pthread_mutex_unlock(&loop->added_lock);
+
+    entries[entry->handle] = entry;
+
+    ::pthread_mutex_unlock(&entries_lock);
+
+    if(is_waking) {
+        g_wake(loop->wake[1]);
+    }
+
+    return entry->handle;
+}
+
+bool XMPPClientRegistry::connect(Handle handle)
+{
+    ::pthread_mutex_lock(&entries_lock);
+
+    Entries::iterator it = entries.find(handle);
+    bool status = (it != entries.end() && !it->second->is_removed);
+    if(status) {
+        g_set_flag(&it->second->is_connect_requested);
+        request(it->second);
+    }
+
+    ::pthread_mutex_unlock(&entries_lock);
+
+    return status;
+}
+
+XMPPClient* XMPPClientRegistry::acquire(Handle handle)
+{
+    XMPPClient *client = 0;
+
+    ::pthread_mutex_lock(&entries_lock);
+
+    Entries::iterator it = entries.find(handle);
+    if(it != entries.end() && !it->second->is_removed) {
+        ++it->second->references;
+        client = it->second->client;
+    }
+
+    ::pthread_mutex_unlock(&entries_lock);
+
+    return client;
+}
+
+void XMPPClientRegistry::release(Handle handle)
+{
+    ::pthread_mutex_lock(&entries_lock);
+
+    // NOTE: a removed entry is still there until its last release, then deleted
+    Entries::iterator it = entries.find(handle);
+    if(it != entries.end() && it->second->references > 0) {
+        if(--it->second->references == 0 && it->second->is_removed) {
+            request(it->second);
+        }
+    }
+
+    ::pthread_mutex_unlock(&entries_lock);
+}
+
+bool XMPPClientRegistry::remove(Handle handle)
+{
+    ::pthread_mutex_lock(&entries_lock);
+
+    Entries::iterator it = entries.find(handle);
+    bool status = (it != entries.end() && !it->second->is_removed);
+    if(status) {
+        g_set_flag(&it->second->is_removed);
+        ++removed;
+        request(it->second);
+    }
+
+    ::pthread_mutex_unlock(&entries_lock);
+
+    return status;
+}
+
+size_t XMPPClientRegistry::size()
+{
+    ::pthread_mutex_lock(&entries_lock);
+    size_t count = entries.size() - removed;
+    ::pthread_mutex_unlock(&entries_lock);
+
+    return count;
+}
+
+string XMPPClientRegistry::resolve(const string& host)
+{
+    uint64_t now = XMPPClock::now();
+
+    ::pthread_mutex_lock(&addresses_lock);
+
+    Addresses::const_iterator it = addresses.find(host);
+    if(it != addresses.end() && it->second.expiry > now) {
+        string address = it->second.address;
+        ::pthread_mutex_unlock(&addresses_lock);
+        return address;
+    }
+
+    ::pthread_mutex_unlock(&addresses_lock);
+
+    // NOTE: resolved without the lock, concurrent misses on the same host only cost a query each
+    const string& address = g_resolve_host(host);
+
+    // NOTE: failures are not cached, the next client retries (and gloox resolves by itself meanwhile)
+    if(!address.empty()) {
+        ::pthread_mutex_lock(&addresses_lock);
+
+        Address& cached = addresses[host];
+        cached.address = address;
+        cached.expiry = now + (uint64_t)config.dns_ttl * 1000000000ULL;
+
+        ::pthread_mutex_unlock(&addresses_lock);
+    }
+
+    return address;
+}
+
+void* XMPPClientRegistry::event_loop(void *data)
+{
+    EventLoop *loop = static_cast<EventLoop*>(data);
+    loop->registry->run(loop);
+    return 0;
+}
+
+void XMPPClientRegistry::run(EventLoop *loop)
+{
+    vector<Entry*> added;
+    vector<Entry*> connected;
+    vector<Entry*> requests;
+    vector<Entry*> ready;
+
+    while(is_running) {
+        // NOTE: drained before the lists are taken, a wake written after them stays for the next wait
+        g_drain(loop->wake[0]);
+
+        ::pthread_mutex_lock(&loop->added_lock);
+        added.swap(loop->added);
+        connected.swap(loop->connected);
+        requests.swap(loop->requests);
+        for(vector<Entry*>::iterator it = requests.begin(); it != requests.end(); ++it) {
+            (*it)->is_requested = false;
+        }
+        loop->is_woken = false;
+        ::pthread_mutex_unlock(&loop->added_lock);
+
+        for(vector<Entry*>::iterator it = added.begin(); it != added.end(); ++it) {
+            (*it)->position = loop->entries.size();
+            loop->entries.push_back(*it);
+#ifndef __linux__
+            struct pollfd fd;
+            fd.fd = -1;
+            fd.events = POLLIN;
+            fd.revents = 0;
+            loop->fds.push_back(fd);
+#endif // __linux__
+        }
+        added.clear();
+
+        // NOTE: before the connects done, an entry in both is deleted by the second update() only
+        uint64_t now = XMPPClock::now();
+        for(vector<Entry*>::iterator it = requests.begin(); it != requests.end(); ++it) {
+            // NOTE: due now for what may have been posted, at worst an idle processReady()
+            if(update(*it) && (*it)->is_connected) {
+                schedule(*it, now);
+            }
+        }
+        requests.clear();
+
+        for(vector<Entry*>::iterator it = connected.begin(); it != connected.end(); ++it) {
+            Entry *entry = *it;
+            entry->is_connecting = false;
+            entry->is_connected = entry->is_connect_succeeded;
+
+            // NOTE: a removal or another connect may have been requested meanwhile
+            if(update(entry) && entry->is_connected) {
+                refresh(entry);
+            }
+        }
+        connected.clear();
+
+        int timeout = -1;
+        if(!loop->timers.empty()) {
+            uint64_t deadline = loop->timers[0]->deadline;
+            now = XMPPClock::now();
+            timeout = (deadline > now) ? (int)((deadline - now + 999999ULL) / 1000000ULL) : 0;
+        }
+
+        wait(loop, timeout, &ready);
+        now = XMPPClock::now();
+
+        for(vector<Entry*>::iterator it = ready.begin(); it != ready.end(); ++it) {
+            process(*it);
+        }
+        ready.clear();
+
+        // NOTE: taken out of the heap before any is processed, so each runs once per round
+        while(!loop->timers.empty() && loop->timers[0]->deadline <= now) {
+            Entry *entry = loop->timers[0];
+            schedule(entry, 0);
+            ready.push_back(entry);
+        }
+
+        for(vector<Entry*>::iterator it = ready.begin(); it != ready.end(); ++it) {
+            process(*it);
+        }
+        ready.clear();
+    }
+}
+
+bool XMPPClientRegistry::update(Entry *entry)
+{
+    XMPPClient *client = entry->client;
+
+    // NOTE: a connect thread owns the client, a removal waits until it is back
+    if(entry->is_connecting) {
+        return true;
+    }
+
+    // NOTE: never from the callbacks of the client, which may call remove() on itself
+    if(g_test_flag(&entry->is_removed)) {
+        if(entry->is_connected) {
+            watch(entry, -1);
+            schedule(entry, 0);
+            client->disconnect();
+            entry->is_connected = false;
+        }
+
+        ::pthread_mutex_lock(&entries_lock);
+
+        bool is_released = (entry->references == 0);
+        if(is_released) {
+            entries.erase(entry->handle);
+            --removed;
+        }
+
+        ::pthread_mutex_unlock(&entries_lock);
+
+        // NOTE: acquired by another thread, the last release() requests the entry again
+        if(!is_released) {
+            return true;
+        }
+
+        // NOTE: the last entry of the event loop takes the place of this one
+        EventLoop *loop = entry->loop;
+        Entry *last = loop->entries.back();
+        loop->entries[entry->position] = last;
+        last->position = entry->position;
+        loop->entries.pop_back();
+#ifndef __linux__
+        loop->fds[entry->position + 1] = loop->fds.back();
+        loop->fds.pop_back();
+#endif // __linux__
+
+        delete client;
+        delete entry;
+        return false;
+    }
+
+    if(g_clear_flag(&entry->is_connect_requested)) {
+        if(!entry->is_connected) {
+            entry->is_connecting = true;
+
+            ::pthread_mutex_lock(&connects_lock);
+            connects.push_back(entry);
+            ::pthread_cond_signal(&connects_cond);
+            ::pthread_mutex_unlock(&connects_lock);
+        }
+    }
+
+    return true;
+}
+
+void XMPPClientRegistry::process(Entry *entry)
+{
+    if(!entry->is_connected) {
+        return;
+    }
+
+    if(!entry->client->processReady(STANZAS_PER_UPDATE, TIME_PER_UPDATE)) {
+        // NOTE: unregistered before disconnect() closes it, its number may be reused then
+        watch(entry, -1);
+        schedule(entry, 0);
+        entry->client->disconnect();
+        entry->is_connected = false;
+        return;
+    }
+
+    refresh(entry);
+}
+
+void XMPPClientRegistry::refresh(Entry *entry)
+{
+    // NOTE: another descriptor after a reconnect or a standby takeover, the io_uring
+    // NOTE: instance with Config::io_uring
+    watch(entry, entry->client->getSocket());
+
+    int timeout = entry->client->getNextTimeout();
+    schedule(entry, (timeout >= 0) ? (XMPPClock::now() + (uint64_t)timeout * 1000000ULL) : 0);
+}
+
+void XMPPClientRegistry::request(Entry *entry)
+{
+    EventLoop *loop = entry->loop;
+
+    ::pthread_mutex_lock(&loop->added_lock);
+
+    if(!entry->is_requested) {
+        entry->is_requested = true;
+        loop->requests.push_back(entry);
+    }
+
+    bool is_waking = !loop->is_woken;
+    loop->is_woken = true;
+
+    ::pthread_mutex_unlock(&loop->added_lock);
+
+    if(is_waking) {
+        g_wake(loop->wake[1]);
+    }
+}
+
+void XMPPClientRegistry::posted(void *data)
+{
+    Entry *entry = static_cast<Entry*>(data);
+    entry->loop->registry->request(entry);
+}
+
+void XMPPClientRegistry::watch(Entry *entry, int socket)
+{
+    if(socket == entry->socket) {
+        return;
+    }
+
+#ifdef __linux__
+    int poller = entry->loop->poller;
+
+    struct epoll_event event;
+    ::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = entry;
+
+    // NOTE: fails if the socket is closed already, which unregistered it
+    if(entry->socket >= 0) {
+        ::epoll_ctl(poller, EPOLL_CTL_DEL, entry->socket, &event);
+    }
+
+    // NOTE: still registered if a descriptor closed had a duplicate, pointed to this entry then
+    if(socket >= 0 && ::epoll_ctl(poller, EPOLL_CTL_ADD, socket, &event) != 0 && errno == EEXIST) {
+        ::epoll_ctl(poller, EPOLL_CTL_MOD, socket, &event);
+    }
+#else
+    // NOTE: poll() skips a negative descriptor
+    entry->loop->fds[entry->position + 1].fd = socket;
+#endif // __linux__
+
+    entry->socket = socket;
+}
+
+void XMPPClientRegistry::wait(EventLoop *loop, int timeout, vector<Entry*> *ready)
+{
+#ifdef __linux__
+    struct epoll_event events[EVENTS_PER_WAIT];
+
+    int count = ::epoll_wait(loop->poller, events, EVENTS_PER_WAIT, timeout);
+    for(int i = 0; i < count; ++i) {
+        // NOTE: the wake pipe has no entry
+        if(events[i].data.ptr) {
+            ready->push_back(static_cast<Entry*>(events[i].data.ptr));
+        }
+    }
+#else
+    // NOTE: the kernel still scans every descriptor here, without epoll
+    if(::poll(&loop->fds[0], loop->fds.size(), timeout) <= 0) {
+        return;
+    }
+
+    for(size_t i = 1; i < loop->fds.size(); ++i) {
+        if(loop->fds[i].revents != 0) {
+            ready->push_back(loop->entries[i - 1]);
+        }
+    }
+#endif // __linux__
+}
+
+void XMPPClientRegistry::schedule(Entry *entry, uint64_t deadline)
+{
+    vector<Entry*>& timers = entry->loop->timers;
+
+    if(deadline == 0) {
+        if(entry->timer == NO_TIMER) {
+            return;
+        }
+
+        // NOTE: the last timer takes the place of this one, then moves up or down
+        size_t index = entry->timer;
+        Entry *last = timers.back();
+        timers.pop_back();
+
+        entry->timer = NO_TIMER;
+        entry->deadline = 0;
+
+        if(last != entry) {
+            timers[index] = last;
+            last->timer = index;
+            sift(entry->loop, index);
+        }
+        return;
+    }
+
+    if(entry->timer == NO_TIMER) {
+        entry->timer = timers.size();
+        timers.push_back(entry);
+    }
+
+    entry->deadline = deadline;
+    sift(entry->loop, entry->timer);
+}
+
+void XMPPClientRegistry::sift(EventLoop *loop, size_t index)
+{
+    vector<Entry*>& timers = loop->timers;
+    Entry *entry = timers[index];
+
+    // up while earlier than its parent
+    while(index > 0) {
+        size_t parent = (index - 1) / 2;
+        if(timers[parent]->deadline <= entry->deadline) {
+            break;
+        }
+
+        timers[index] = timers[parent];
+        timers[index]->timer = index;
+        index = parent;
+    }
+
+    // down while later than its earliest child
+    for(;;) {
+        size_t child = 2 * index + 1;
+        if(child >= timers.size()) {
+            break;
+        }
+        if(child + 1 < timers.size() && timers[child + 1]->deadline < timers[child]->deadline) {
+            ++child;
+        }
+        if(entry->deadline <= timers[child]->deadline) {
+            break;
+        }
+
+        timers[index] = timers[child];
+        timers[index]->timer = index;
+        index = child;
+    }
+
+    timers[index] = entry;
+    entry->timer = index;
+}
+
+void* XMPPClientRegistry::connect_thread(void *data)
+{
+    static_cast<XMPPClientRegistry*>(data)->runConnects();
+    return 0;
+}
+
+void XMPPClientRegistry::runConnects()
+{
+    for(;;) {
+        ::pthread_mutex_lock(&connects_lock);
+        while(is_running && connects.empty()) {
+            ::pthread_cond_wait(&connects_cond, &connects_lock);
+        }
+
+        if(!is_running) {
+            ::pthread_mutex_unlock(&connects_lock);
+            return;
+        }
+
+        Entry *entry = connects.front();
+        connects.pop_front();
+        ::pthread_mutex_unlock(&connects_lock);
+
+        // NOTE: DNS, TCP and the stream header, the event loop of the client leaves it alone meanwhile
+        entry->is_connect_succeeded = entry->client->connect(false);
+
+        EventLoop *loop = entry->loop;
+        ::pthread_mutex_lock(&loop->added_lock);
+        loop->connected.push_back(entry);
+        bool is_waking = !loop->is_woken;
+        loop->is_woken = true;
+        ::pthread_mutex_unlock(&loop->added_lock);
+
+        if(is_waking) {
+            g_wake(loop->wake[1]);
+        }
+    }
+}
@@ -0,0 +1,197 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_CLIENT_REGISTRY_INCLUDED
+#define XMPP_CLIENT_REGISTRY_INCLUDED
+
+#include "XMPPClient.hpp"
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+#ifndef __linux__
+#include <poll.h>
+#endif // __linux__
+
+// Many independent clients in one process, e.g. a gateway serving thousands of
+// accounts: each client has its own Config and callbacks (its XMPPClient
+// subclass) and is known by a handle, clients share a few event loop threads
+// polling their sockets (see XMPPClient::processReady()) instead of one each,
+// and the addresses of their servers are resolved once. An event loop keeps its
+// sockets registered with epoll (poll() elsewhere than Linux) and its clients
+// in a heap by next timeout, a wakeup costs what is ready or due only.
+//   XMPPClient* create_client(const XMPPClient::Config& config, void *data) {
+//       return new MyClient(config, static_cast<Account*>(data));
+//   }
+//   Handle handle = registry.create(create_client, config, account);
+//   registry.connect(handle);
+// Callbacks run on the event loop thread of the client, as with connect(true),
+// connect() itself on a connect thread so that a slow server holds up no event loop.
+// TLS contexts are not shared between the clients, gloox creates one per stream.
+// NOTE: thread safe, a client used by another thread is held with acquire()
+class XMPPClientRegistry
+{
+public:
+    /// handle of a registered client, 0 is never used
+    typedef uint64_t Handle;
+
+    /// creates the client of a handle, with the Config given to create()
+    typedef XMPPClient* (*Factory)(const XMPPClient::Config& config, void *data);
+
+    struct Config
+    {
+        explicit Config();
+
+        int event_loops;      // 4 threads, each updating the clients of every event_loops-th handle
+        int connect_threads;  // 2 threads running the connects requested, one at a time each
+        int dns_ttl;          // 300 seconds a resolved server address is reused, 0 to let each client resolve it
+    };
+
+public:
+    explicit XMPPClientRegistry(const Config& config);
+
+    /// stops the event loops, disconnects and deletes the clients left
+    ~XMPPClientRegistry();
+
+    /// starts the event loop threads, false if one of them or their descriptors could not be created
+    bool start();
+    void stop();
+
+    /// creates a client, not connected yet, 0 if the factory failed;
+    /// Config::server_address is filled from the DNS cache when empty
+    Handle create(Factory factory, const XMPPClient::Config& config, void *data = 0);
+
+    /// connects the client from its event loop, again after a disconnection too
+    bool connect(Handle handle);
+
+    /// the client of the handle, 0 if unknown or removed; it is not deleted before
+    /// release(), but only its thread safe members (post()...) may be used meanwhile
+    XMPPClient* acquire(Handle handle);
+    void release(Handle handle);
+
+    /// disconnects and deletes the client from its event loop, once released,
+    /// so a client may remove itself from its callbacks
+    bool remove(Handle handle);
+
+    /// registered clients, removed ones excluded
+    size_t size();
+
+    /// address of host from the DNS cache, resolved on a miss, empty string if it cannot be
+    string resolve(const string& host);
+
+private:
+    struct EventLoop;
+
+    struct Entry
+    {
+        Handle handle;
+        XMPPClient *client;
+        EventLoop *loop;
+
+        // set by any thread under entries_lock, read and cleared by the event loop with __sync builtins
+        volatile int is_connect_requested;
+        volatile int is_removed;
+
+        int references;  // acquire() not released yet, guarded by entries_lock
+
+        // event loop thread only
+        bool is_connected;
+        bool is_connecting;  // queued for or run by a connect thread, which owns the client meanwhile
+        uint64_t deadline;   // XMPPClock::now() when the client is due without input, 0 for none
+        size_t timer;        // index in EventLoop::timers, NO_TIMER when there is no deadline
+        size_t position;     // index in EventLoop::entries
+        int socket;          // registered with the event loop, -1 for none
+
+        bool is_requested;   // in EventLoop::requests, guarded by added_lock
+
+        // connect thread, read by the event loop once the entry is back in EventLoop::connected
+        bool is_connect_succeeded;
+    };
+
+    struct EventLoop
+    {
+        XMPPClientRegistry *registry;
+
+        vector<Entry*> entries;    // event loop thread only
+        vector<Entry*> timers;     // event loop thread only, binary heap by Entry::deadline
+
+        vector<Entry*> added;      // guarded by added_lock
+        vector<Entry*> connected;  // back from a connect thread, guarded by added_lock
+        vector<Entry*> requests;   // connect(), remove(), release() or post() to see to, guarded by added_lock
+        bool is_woken;             // wake written since the last wait, guarded by added_lock
+        pthread_mutex_t added_lock;
+
+        int wake[2];               // pipe, written to interrupt the wait
+#ifdef __linux__
+        int poller;                // epoll instance
+#else
+        vector<struct pollfd> fds; // wake[0], then the socket of each entry by position
+#endif // __linux__
+
+        pthread_t thread;
+        bool has_thread;
+    };
+
+    static void* event_loop(void *data);
+    void run(EventLoop *loop);
+
+    /// false when the entry is done with and deleted
+    bool update(Entry *entry);
+
+    /// processReady() then its socket and timeout again
+    void process(Entry *entry);
+    void refresh(Entry *entry);
+
+    /// has the event loop see to the entry, from any thread
+    void request(Entry *entry);
+    static void posted(void *data);
+
+    /// registers socket for the entry instead of the previous one, -1 for none
+    void watch(Entry *entry, int socket);
+
+    /// waits up to timeout milliseconds (-1 without limit), then adds the entries readable to ready
+    void wait(EventLoop *loop, int timeout, vector<Entry*> *ready);
+
+    /// moves the entry in the heap of its event loop, a deadline of 0 takes it out
+    void schedule(Entry *entry, uint64_t deadline);
+    void sift(EventLoop *loop, size_t index);
+
+    static void* connect_thread(void *data);
+    void runConnects();
+
+private:
+    Config config;
+
+    // NOTE: removed entries stay until their event loop deletes them
+    typedef map<Handle, Entry*> Entries;
+    Entries entries;
+    size_t removed;
+    Handle last_handle;
+    pthread_mutex_t entries_lock;
+
+    vector<EventLoop*> loops;
+    volatile bool is_running;
+
+    deque<Entry*> connects;  // guarded by connects_lock
+    pthread_mutex_t connects_lock;
+    pthread_cond_t connects_cond;
+    vector<pthread_t> connect_threads;
+
+    struct Address
+    {
+        string address;
+        uint64_t expiry;  // XMPPClock::now()
+    };
+
+    typedef map<string, Address> Addresses;
+    Addresses addresses;
+    pthread_mutex_t addresses_lock;
+
+private:
+    XMPPClientRegistry();
+    XMPPClientRegistry(const XMPPClientRegistry&);
+    const XMPPClientRegistry& operator=(const XMPPClientRegistry&);
+};
+
+#endif // XMPP_CLIENT_REGISTRY_INCLUDED
@@ -0,0 +1,40 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_CLOCK_INCLUDED
+#define XMPP_CLOCK_INCLUDED
+
+#include <stdint.h>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif // __APPLE__
+
+class XMPPClock
+{
+public:
+    /// monotonic time in nanoseconds (arbitrary origin)
+    static uint64_t now() {
+#ifdef __APPLE__
+        static mach_timebase_info_data_t timebase;
+        if(timebase.denom == 0) {
+            ::mach_timebase_info(&timebase);
+        }
+        return ::mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif // __APPLE__
+    }
+
+    static uint64_t nowMilliseconds() {
+        return now() / 1000000ULL;
+    }
+
+private:
+    XMPPClock();
+};
+
+#endif // XMPP_CLOCK_INCLUDED
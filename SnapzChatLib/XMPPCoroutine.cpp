@@ -0,0 +1,247 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPCoroutine.hpp"
+
+#if defined(__cpp_impl_coroutine)
+
+/// XMPPAsyncClient operations
+// NOTE: await_suspend() returns false to resume at once, without a result to wait for
+
+bool XMPPAsyncClient::ConnectOperation::await_suspend(std::coroutine_handle<> handle)
+{
+    if(client.isConnected()) {
+        waiter.success = true;
+        return false;
+    }
+
+    waiter.handle = handle;
+
+    // NOTE: not held by connect(), a failure may call onDisconnect() from this
+    // thread, where no event loop would run a posted resume; the result is
+    // only filled in until connect() returns, the coroutine resumes at once then
+    ::pthread_mutex_lock(&client.waiters_lock);
+    client.connect_waiter = &waiter;
+    client.is_connecting = true;
+    ::pthread_mutex_unlock(&client.waiters_lock);
+
+    bool is_connected = client.connect(true);
+
+    ::pthread_mutex_lock(&client.waiters_lock);
+    client.is_connecting = false;
+
+    bool is_waiting = (client.connect_waiter == &waiter);
+    if(is_waiting && !is_connected) {
+        client.connect_waiter = 0;
+        is_waiting = false;
+    }
+    ::pthread_mutex_unlock(&client.waiters_lock);
+
+    return is_waiting;
+}
+
+bool XMPPAsyncClient::JoinOperation::await_suspend(std::coroutine_handle<> handle)
+{
+    waiter.handle = handle;
+
+    ::pthread_mutex_lock(&client.waiters_lock);
+
+    if(client.joined_groups.count(group)) {
+        ::pthread_mutex_unlock(&client.waiters_lock);
+        waiter.success = true;
+        return false;
+    }
+
+    // NOTE: a join in progress completes with the same presence
+    if(!client.beginGroupChat(group, passwd)) {
+        ::pthread_mutex_unlock(&client.waiters_lock);
+        return false;
+    }
+
+    client.join_waiters.insert(make_pair(group, &waiter));
+
+    ::pthread_mutex_unlock(&client.waiters_lock);
+    return true;
+}
+
+bool XMPPAsyncClient::MessageOperation::await_suspend(std::coroutine_handle<> handle)
+{
+    waiter.handle = handle;
+
+    ::pthread_mutex_lock(&client.waiters_lock);
+
+    MessageId id = is_group ?
+        client.sendTrackedGroupChatMessage(to, message) :
+        client.sendTrackedChatMessage(to, message, subject, resource);
+
+    if(!id) {
+        ::pthread_mutex_unlock(&client.waiters_lock);
+        return false;
+    }
+
+    client.message_waiters[id] = &waiter;
+
+    ::pthread_mutex_unlock(&client.waiters_lock);
+    return true;
+}
+
+bool XMPPAsyncClient::ConfigureOperation::await_suspend(std::coroutine_handle<> handle)
+{
+    waiter.handle = handle;
+
+    ::pthread_mutex_lock(&client.waiters_lock);
+
+    RequestId id = client.requestGroupChatConfiguration(group, config);
+    if(!id) {
+        ::pthread_mutex_unlock(&client.waiters_lock);
+        return false;
+    }
+
+    client.request_waiters[id] = &waiter;
+
+    ::pthread_mutex_unlock(&client.waiters_lock);
+    return true;
+}
+
+/// XMPPAsyncClient
+XMPPAsyncClient::XMPPAsyncClient(const Config& config)
+    : XMPPClient(config),
+      connect_waiter(0), is_connecting(false)
+{
+    ::pthread_mutex_init(&waiters_lock, 0);
+}
+
+XMPPAsyncClient::~XMPPAsyncClient()
+{
+    // NOTE: the coroutines still waiting are never resumed
+    ::pthread_mutex_destroy(&waiters_lock);
+}
+
+void XMPPAsyncClient::resumeCoroutine(void *data)
+{
+    std::coroutine_handle<>::from_address(data).resume();
+}
+
+void XMPPAsyncClient::resume(Waiter *waiter, bool success)
+{
+    waiter->success = success;
+    post(resumeCoroutine, waiter->handle.address());
+}
+
+void XMPPAsyncClient::resumeConnect(bool success)
+{
+    if(!connect_waiter) {
+        return;
+    }
+
+    if(is_connecting) {
+        connect_waiter->success = success;
+    }
+    else {
+        resume(connect_waiter, success);
+    }
+    connect_waiter = 0;
+}
+
+void XMPPAsyncClient::resumeJoins(const string& group, bool success)
+{
+    pair<JoinWaiters::iterator, JoinWaiters::iterator> range = join_waiters.equal_range(group);
+
+    for(JoinWaiters::iterator it = range.first; it != range.second; ++it) {
+        resume(it->second, success);
+    }
+    join_waiters.erase(range.first, range.second);
+}
+
+/// connection callbacks
+void XMPPAsyncClient::onConnect()
+{
+    ::pthread_mutex_lock(&waiters_lock);
+    resumeConnect(true);
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+void XMPPAsyncClient::onDisconnect(ConnectionError error)
+{
+    (void)error;
+
+    // NOTE: messages and requests are failed by XMPPClient
+    ::pthread_mutex_lock(&waiters_lock);
+
+    resumeConnect(false);
+
+    for(JoinWaiters::const_iterator it = join_waiters.begin(); it != join_waiters.end(); ++it) {
+        resume(it->second, false);
+    }
+    join_waiters.clear();
+    joined_groups.clear();
+
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+/// simple chat callbacks
+void XMPPAsyncClient::onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency)
+{
+    (void)latency;
+
+    ::pthread_mutex_lock(&waiters_lock);
+
+    MessageWaiters::iterator it = message_waiters.find(id);
+    if(it != message_waiters.end()) {
+        it->second->status = status;
+        resume(it->second, (status == MESSAGE_ACKNOWLEDGED || status == MESSAGE_DELIVERED));
+        message_waiters.erase(it);
+    }
+
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+/// group chat callbacks
+void XMPPAsyncClient::onGroupChatUserPresence(const string& group, const string& user,
+                                              bool online, const string& reason, int flags)
+{
+    (void)user, (void)reason;
+
+    if(!(flags & UserSelf)) {
+        return;
+    }
+
+    ::pthread_mutex_lock(&waiters_lock);
+
+    if(online) {
+        joined_groups.insert(group);
+    }
+    else {
+        joined_groups.erase(group);
+    }
+    resumeJoins(group, online);
+
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+void XMPPAsyncClient::onGroupChatError(const string& group, StanzaError error)
+{
+    (void)error;
+
+    // NOTE: only the joins fail, other errors come back with their own results
+    ::pthread_mutex_lock(&waiters_lock);
+    resumeJoins(group, false);
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+void XMPPAsyncClient::onGroupChatRequestResult(RequestId id, const string& group,
+                                               GroupChatOperation operation, bool success)
+{
+    (void)group, (void)operation;
+
+    ::pthread_mutex_lock(&waiters_lock);
+
+    RequestWaiters::iterator it = request_waiters.find(id);
+    if(it != request_waiters.end()) {
+        resume(it->second, success);
+        request_waiters.erase(it);
+    }
+
+    ::pthread_mutex_unlock(&waiters_lock);
+}
+
+#endif // __cpp_impl_coroutine
@@ -0,0 +1,240 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_COROUTINE_INCLUDED
+#define XMPP_COROUTINE_INCLUDED
+
+#include "XMPPClient.hpp"
+
+// NOTE: C++20 only, the rest of the library does not depend on it
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <map>
+#include <set>
+
+// Detached coroutine: runs on the calling thread up to its first co_await,
+// then is resumed by the event loop thread, its frame is freed at the end.
+//   XMPPTask flow(XMPPAsyncClient& client) {
+//       if(co_await client.connectAsync() && co_await client.joinRoom("lobby")) {
+//           co_await client.sendToRoom("lobby", "hello");
+//       }
+//   }
+struct XMPPTask
+{
+    struct promise_type
+    {
+        XMPPTask get_return_object() {
+            return XMPPTask();
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+// XMPPClient with awaitable operations, completed by its callbacks.
+// Coroutines are resumed through XMPPClient::post(), i.e. from update() or
+// the event loop after the callbacks of one recv(), never from inside them.
+// NOTE: subclasses overriding the callbacks below must call them
+class XMPPAsyncClient : public XMPPClient
+{
+public:
+    // result of one operation, filled before the coroutine is resumed
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        bool success;
+        MessageStatus status;  // messages only
+    };
+
+    // await_ready()/await_resume() shared by all operations
+    class Operation
+    {
+    public:
+        explicit Operation(XMPPAsyncClient& client_)
+            : client(client_) {
+            waiter.success = false;
+            waiter.status = MESSAGE_FAILED;
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+    protected:
+        XMPPAsyncClient& client;
+        Waiter waiter;
+    };
+
+    class ConnectOperation : public Operation
+    {
+    public:
+        explicit ConnectOperation(XMPPAsyncClient& client_)
+            : Operation(client_) {
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle);
+
+        /// true once connected
+        bool await_resume() const noexcept {
+            return waiter.success;
+        }
+    };
+
+    class JoinOperation : public Operation
+    {
+    public:
+        explicit JoinOperation(XMPPAsyncClient& client_, const string& group_, const string& passwd_)
+            : Operation(client_), group(group_), passwd(passwd_) {
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle);
+
+        /// true once our own presence is in the room
+        bool await_resume() const noexcept {
+            return waiter.success;
+        }
+
+    private:
+        string group;
+        string passwd;
+    };
+
+    class MessageOperation : public Operation
+    {
+    public:
+        explicit MessageOperation(XMPPAsyncClient& client_, const string& to_, const string& message_,
+                                  const string& subject_, const string& resource_, bool is_group_)
+            : Operation(client_), to(to_), message(message_), subject(subject_), resource(resource_),
+              is_group(is_group_) {
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle);
+
+        /// see XMPPClient::onMessageCompletion()
+        MessageStatus await_resume() const noexcept {
+            return waiter.status;
+        }
+
+    private:
+        string to;
+        string message;
+        string subject;
+        string resource;
+        bool is_group;
+    };
+
+    class ConfigureOperation : public Operation
+    {
+    public:
+        explicit ConfigureOperation(XMPPAsyncClient& client_, const string& group_, const GroupChatConfig *config_)
+            : Operation(client_), group(group_), config(config_) {
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle);
+
+        /// see XMPPClient::onGroupChatRequestResult()
+        bool await_resume() const noexcept {
+            return waiter.success;
+        }
+
+    private:
+        string group;
+        const GroupChatConfig *config;  // kept by the caller until resumed
+    };
+
+public:
+    explicit XMPPAsyncClient(const Config& config);
+
+    virtual ~XMPPAsyncClient();
+
+    /// connect() with the event loop thread
+    ConnectOperation connectAsync() {
+        return ConnectOperation(*this);
+    }
+
+    /// beginGroupChat()
+    JoinOperation joinRoom(const string& group, const string& passwd = "") {
+        return JoinOperation(*this, group, passwd);
+    }
+
+    /// sendTrackedChatMessage()
+    MessageOperation send(const string& user, const string& message,
+                          const string& subject = "", const string& resource = "") {
+        return MessageOperation(*this, user, message, subject, resource, false);
+    }
+
+    /// sendTrackedGroupChatMessage()
+    MessageOperation sendToRoom(const string& group, const string& message) {
+        return MessageOperation(*this, group, message, "", "", true);
+    }
+
+    /// requestGroupChatConfiguration()
+    ConfigureOperation configureRoom(const string& group, const GroupChatConfig *config = 0) {
+        return ConfigureOperation(*this, group, config);
+    }
+
+protected:
+    /// connection callbacks
+    virtual void onConnect();
+    virtual void onDisconnect(ConnectionError error);
+
+    /// simple chat callbacks
+    virtual void onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency);
+
+    /// group chat callbacks
+    virtual void onGroupChatUserPresence(const string& group, const string& user,
+                                         bool online, const string& reason, int flags);
+    virtual void onGroupChatError(const string& group, StanzaError error);
+    virtual void onGroupChatRequestResult(RequestId id, const string& group,
+                                          GroupChatOperation operation, bool success);
+
+private:
+    // called with waiters_lock held, the coroutine runs later
+    void resume(Waiter *waiter, bool success);
+    void resumeJoins(const string& group, bool success);
+
+    // called with waiters_lock held, completes the connect waiter
+    void resumeConnect(bool success);
+
+    static void resumeCoroutine(void *data);
+
+private:
+    Waiter *connect_waiter;
+    bool is_connecting;  // ConnectOperation::await_suspend() is still in connect()
+
+    typedef std::multimap<string, Waiter*> JoinWaiters;
+    JoinWaiters join_waiters;
+    std::set<string> joined_groups;  // joinRoom() completes at once for these
+
+    typedef std::map<MessageId, Waiter*> MessageWaiters;
+    MessageWaiters message_waiters;
+
+    typedef std::map<RequestId, Waiter*> RequestWaiters;
+    RequestWaiters request_waiters;
+
+    // NOTE: held while an operation starts, so its result cannot come first
+    pthread_mutex_t waiters_lock;
+
+private:
+    XMPPAsyncClient();
+    XMPPAsyncClient(const XMPPAsyncClient&);
+    const XMPPAsyncClient& operator=(const XMPPAsyncClient&);
+};
+
+#endif // __cpp_impl_coroutine
+
+#endif // XMPP_COROUTINE_INCLUDED
@@ -0,0 +1,255 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPDiscoCache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+static const char MAGIC[] = "XMPPDSC1";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+// NOTE: a longer string or list means a corrupt file
+static const uint32_t MAX_STRING_SIZE = 64 * 1024;
+static const uint32_t MAX_COUNT = 1024 * 1024;
+
+static const string EMPTY_STRING;
+
+typedef map<string, XMPPDiscoCache*> SharedCaches;
+static SharedCaches g_shared_caches;
+static pthread_mutex_t g_shared_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool g_write_uint32(FILE *file, uint32_t value)
+{
+    return ::fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool g_write_string(FILE *file, const string& value)
+{
+    return g_write_uint32(file, (uint32_t)value.size())
+        && ::fwrite(value.data(), 1, value.size(), file) == value.size();
+}
+
+static bool g_write_strings(FILE *file, const vector<string>& values)
+{
+    bool status = g_write_uint32(file, (uint32_t)values.size());
+    for(vector<string>::const_iterator it = values.begin(); status && it != values.end(); ++it) {
+        status = g_write_string(file, *it);
+    }
+    return status;
+}
+
+static bool g_read_uint32(FILE *file, uint32_t *value)
+{
+    return ::fread(value, sizeof(*value), 1, file) == 1;
+}
+
+static bool g_read_string(FILE *file, string *value)
+{
+    uint32_t size;
+    if(!g_read_uint32(file, &size) || size > MAX_STRING_SIZE) {
+        return false;
+    }
+
+    value->resize(size);
+    return size == 0 || ::fread(&(*value)[0], 1, size, file) == size;
+}
+
+static bool g_read_strings(FILE *file, vector<string> *values)
+{
+    uint32_t count;
+    if(!g_read_uint32(file, &count) || count > MAX_COUNT) {
+        return false;
+    }
+
+    values->resize(count);
+    for(uint32_t i = 0; i < count; ++i) {
+        if(!g_read_string(file, &(*values)[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// XMPPDiscoCache::Info
+bool XMPPDiscoCache::Info::hasFeature(const string& feature) const
+{
+    for(vector<string>::const_iterator it = features.begin(); it != features.end(); ++it) {
+        if(*it == feature) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const string& XMPPDiscoCache::Info::getField(const string& name) const
+{
+    for(vector<pair<string, string> >::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+        if(it->first == name) {
+            return it->second;
+        }
+    }
+    return EMPTY_STRING;
+}
+
+/// XMPPDiscoCache
+XMPPDiscoCache& XMPPDiscoCache::getShared(const string& path)
+{
+    ::pthread_mutex_lock(&g_shared_caches_lock);
+
+    XMPPDiscoCache*& cache = g_shared_caches[path];
+    if(!cache) {
+        cache = new XMPPDiscoCache(path);
+    }
+
+    ::pthread_mutex_unlock(&g_shared_caches_lock);
+
+    return *cache;
+}
+
+XMPPDiscoCache::XMPPDiscoCache(const string& path_)
+    : path(path_), is_dirty(false)
+{
+    ::pthread_mutex_init(&lock, 0);
+
+    // NOTE: a missing or damaged file only costs the queries
+    if(!path.empty()) {
+        load();
+    }
+}
+
+bool XMPPDiscoCache::find(const string& key, Info *info)
+{
+    ::pthread_mutex_lock(&lock);
+
+    Entries::const_iterator it = entries.find(key);
+    bool status = (it != entries.end() && it->second.expiry > (int64_t)::time(0));
+    if(status && info) {
+        *info = it->second.info;
+    }
+
+    ::pthread_mutex_unlock(&lock);
+
+    return status;
+}
+
+void XMPPDiscoCache::store(const string& key, const Info& info, int ttl)
+{
+    ::pthread_mutex_lock(&lock);
+
+    Entry& entry = entries[key];
+    entry.info = info;
+    entry.expiry = (int64_t)::time(0) + ttl;
+    is_dirty = true;
+
+    ::pthread_mutex_unlock(&lock);
+}
+
+bool XMPPDiscoCache::save()
+{
+    ::pthread_mutex_lock(&lock);
+
+    if(!is_dirty || path.empty()) {
+        ::pthread_mutex_unlock(&lock);
+        return true;
+    }
+    is_dirty = false;
+
+    int64_t now = (int64_t)::time(0);
+    for(Entries::iterator it = entries.begin(); it != entries.end();) {
+        if(it->second.expiry <= now) {
+            entries.erase(it++);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // write into a temporary file first, so that other processes never see partial data
+    const string& tmp_path = path + ".tmp";
+
+    FILE *file = ::fopen(tmp_path.c_str(), "wb");
+    if(!file) {
+        ::pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    bool status = ::fwrite(MAGIC, 1, MAGIC_SIZE, file) == MAGIC_SIZE
+        && g_write_uint32(file, (uint32_t)entries.size());
+
+    for(Entries::const_iterator it = entries.begin(); status && it != entries.end(); ++it) {
+        const Info& info = it->second.info;
+
+        status = g_write_string(file, it->first)
+            && ::fwrite(&it->second.expiry, sizeof(it->second.expiry), 1, file) == 1
+            && g_write_strings(file, info.features)
+            && g_write_uint32(file, (uint32_t)info.fields.size());
+
+        for(vector<pair<string, string> >::const_iterator field = info.fields.begin();
+            status && field != info.fields.end(); ++field) {
+            status = g_write_string(file, field->first) && g_write_string(file, field->second);
+        }
+
+        status = status && g_write_strings(file, info.items);
+    }
+
+    status = (::fclose(file) == 0) && status;
+
+    if(status) {
+        status = (::rename(tmp_path.c_str(), path.c_str()) == 0);
+    }
+    if(!status) {
+        ::unlink(tmp_path.c_str());
+    }
+
+    ::pthread_mutex_unlock(&lock);
+
+    return status;
+}
+
+// called from the constructor only
+bool XMPPDiscoCache::load()
+{
+    FILE *file = ::fopen(path.c_str(), "rb");
+    if(!file) {
+        return false;
+    }
+
+    char magic[MAGIC_SIZE];
+    uint32_t count = 0;
+
+    bool status = ::fread(magic, 1, MAGIC_SIZE, file) == MAGIC_SIZE
+        && ::memcmp(magic, MAGIC, MAGIC_SIZE) == 0
+        && g_read_uint32(file, &count)
+        && count <= MAX_COUNT;
+
+    string key;
+    Entry entry;
+    for(uint32_t i = 0; status && i < count; ++i) {
+        uint32_t fields = 0;
+
+        status = g_read_string(file, &key)
+            && ::fread(&entry.expiry, sizeof(entry.expiry), 1, file) == 1
+            && g_read_strings(file, &entry.info.features)
+            && g_read_uint32(file, &fields)
+            && fields <= MAX_COUNT;
+
+        entry.info.fields.resize(status ? fields : 0);
+        for(uint32_t j = 0; status && j < fields; ++j) {
+            status = g_read_string(file, &entry.info.fields[j].first)
+                && g_read_string(file, &entry.info.fields[j].second);
+        }
+
+        status = status && g_read_strings(file, &entry.info.items);
+
+        // NOTE: the entries read before a truncation are still valid
+        if(status) {
+            entries[key] = entry;
+        }
+    }
+
+    ::fclose(file);
+
+    return status;
+}
@@ -0,0 +1,78 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_DISCO_CACHE_INCLUDED
+#define XMPP_DISCO_CACHE_INCLUDED
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include <pthread.h>
+
+using namespace std;
+
+// Service discovery results reused across connections, by all clients of the
+// process using the same file. Keys are "caps <node>#<ver>" for an entity that
+// advertised a XEP-0115 hash, otherwise "info <jid>" or "items <jid>".
+// The file is a sequence of length-prefixed strings:
+//   "XMPPDSC1", uint32 count, then per entry: key, int64 expiry (Unix time),
+//   uint32 features, features, uint32 fields, names and values, uint32 items, items
+// NOTE: thread safe, integers are written in host byte order
+class XMPPDiscoCache
+{
+public:
+    // what the library uses of a disco#info or disco#items result
+    struct Info
+    {
+        vector<string> features;
+        vector<pair<string, string> > fields;  // extended info form, first value of each field
+        vector<string> items;                  // JIDs of a disco#items result
+
+        bool hasFeature(const string& feature) const;
+
+        /// empty string if the form has no such field
+        const string& getField(const string& name) const;
+    };
+
+public:
+    /// cache of the file, loaded on first use, path "" for one kept in memory only;
+    /// NOTE: never deleted, like the session pools
+    static XMPPDiscoCache& getShared(const string& path);
+
+    /// false if key is unknown or expired
+    bool find(const string& key, Info *info);
+
+    /// keeps info for ttl seconds
+    void store(const string& key, const Info& info, int ttl);
+
+    /// writes the file if an entry was stored since the last call, expired entries are dropped
+    bool save();
+
+private:
+    explicit XMPPDiscoCache(const string& path);
+
+    bool load();
+
+private:
+    struct Entry
+    {
+        Info info;
+        int64_t expiry;  // ::time()
+    };
+
+    typedef map<string, Entry> Entries;
+    Entries entries;
+
+    string path;
+    bool is_dirty;
+
+    pthread_mutex_t lock;
+
+private:
+    XMPPDiscoCache();
+    XMPPDiscoCache(const XMPPDiscoCache&);
+    const XMPPDiscoCache& operator=(const XMPPDiscoCache&);
+};
+
+#endif // XMPP_DISCO_CACHE_INCLUDED
@@ -0,0 +1,370 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPEndpoints.hpp"
+#include "XMPPClock.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+
+// penalty of an endpoint after its first consecutive failure, doubled by each next one (nanoseconds)
+static const uint64_t PENALTY_MIN = 1000000000ULL;
+static const uint64_t PENALTY_MAX = 300000000000ULL;
+
+// weight of a new round trip time sample, 1/8 as for the TCP smoothed RTT
+static const int RTT_WEIGHT_SHIFT = 3;
+
+// resolved address of an endpoint is reused this long before it is looked up again (nanoseconds)
+static const uint64_t ADDRESS_TTL = 300000000000ULL;
+
+static XMPPEndpoints *g_shared_endpoints = 0;
+static pthread_mutex_t g_shared_endpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct Rank
+{
+    size_t index;
+    int group;       // 0 never seen, 1 healthy, 2 penalized
+    uint64_t value;  // round trip time, or end of the penalty
+};
+
+static bool g_rank_less(const Rank& rank0, const Rank& rank1)
+{
+    if(rank0.group != rank1.group) {
+        return rank0.group < rank1.group;
+    }
+    return rank0.value < rank1.value;
+}
+
+// first address of the endpoint, flags AI_NUMERICHOST for a lookup that never waits on DNS
+static bool g_resolve(const XMPPEndpoints::Endpoint& endpoint, int flags,
+                      struct sockaddr_storage *address, socklen_t *length)
+{
+    char port[16];
+    ::snprintf(port, sizeof(port), "%d", endpoint.port);
+
+    struct addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    struct addrinfo *result = 0;
+    if(::getaddrinfo(endpoint.host.c_str(), port, &hints, &result) != 0 || !result) {
+        return false;
+    }
+
+    bool status = (result->ai_addrlen <= sizeof(*address));
+    if(status) {
+        ::memcpy(address, result->ai_addr, result->ai_addrlen);
+        *length = result->ai_addrlen;
+    }
+
+    ::freeaddrinfo(result);
+
+    return status;
+}
+
+static void g_smooth(uint64_t *rtt, uint64_t sample)
+{
+    if(*rtt == 0) {
+        *rtt = sample;
+    }
+    else {
+        *rtt = *rtt - (*rtt >> RTT_WEIGHT_SHIFT) + (sample >> RTT_WEIGHT_SHIFT);
+    }
+
+    // NOTE: 0 means never measured
+    if(*rtt == 0) {
+        *rtt = 1;
+    }
+}
+
+/// XMPPEndpoints::Endpoint
+string XMPPEndpoints::Endpoint::toString() const
+{
+    char port_string[16];
+    ::snprintf(port_string, sizeof(port_string), ":%d", port);
+
+    if(host.find(':') != string::npos) {
+        return "[" + host + "]" + port_string;
+    }
+    return host + port_string;
+}
+
+/// XMPPEndpoints
+bool XMPPEndpoints::parse(const string& text, int default_port, Endpoint *endpoint)
+{
+    size_t colon;
+
+    if(!text.empty() && text[0] == '[') {
+        size_t end = text.find(']');
+        if(end == string::npos) {
+            return false;
+        }
+
+        endpoint->host = text.substr(1, end - 1);
+        colon = (end + 1 < text.size()) ? end + 1 : string::npos;
+        if(colon != string::npos && text[colon] != ':') {
+            return false;
+        }
+    }
+    else {
+        colon = text.rfind(':');
+        endpoint->host = text.substr(0, colon);
+    }
+
+    if(endpoint->host.empty()) {
+        return false;
+    }
+
+    endpoint->port = default_port;
+    if(colon != string::npos) {
+        char *end = 0;
+        long port = ::strtol(text.c_str() + colon + 1, &end, 10);
+        if(end == text.c_str() + colon + 1 || *end != '\0' || port <= 0 || port > 65535) {
+            return false;
+        }
+        endpoint->port = (int)port;
+    }
+
+    return true;
+}
+
+XMPPEndpoints& XMPPEndpoints::getShared()
+{
+    ::pthread_mutex_lock(&g_shared_endpoints_lock);
+    if(!g_shared_endpoints) {
+        g_shared_endpoints = new XMPPEndpoints();
+    }
+    ::pthread_mutex_unlock(&g_shared_endpoints_lock);
+
+    return *g_shared_endpoints;
+}
+
+XMPPEndpoints::XMPPEndpoints()
+    : has_resolver(false)
+{
+    ::pthread_mutex_init(&lock, 0);
+    ::pthread_cond_init(&lookups_cond, 0);
+}
+
+void XMPPEndpoints::rank(const vector<Endpoint>& endpoints, vector<size_t> *order)
+{
+    uint64_t now = XMPPClock::now();
+
+    vector<Rank> ranks(endpoints.size());
+
+    ::pthread_mutex_lock(&lock);
+
+    for(size_t i = 0; i < endpoints.size(); ++i) {
+        ranks[i].index = i;
+        ranks[i].group = 0;
+        ranks[i].value = 0;
+
+        Table::const_iterator it = table.find(endpoints[i].toString());
+        if(it == table.end()) {
+            continue;
+        }
+
+        const Health& health = it->second;
+        if(health.retry_time > now) {
+            ranks[i].group = 2;
+            ranks[i].value = health.retry_time;
+        }
+        else if(health.connect_rtt) {
+            ranks[i].group = 1;
+            ranks[i].value = health.connect_rtt;
+        }
+        else {
+            // NOTE: back from a penalty without a connect measured, after the measured ones
+            ranks[i].group = 1;
+            ranks[i].value = UINT64_MAX;
+        }
+    }
+
+    ::pthread_mutex_unlock(&lock);
+
+    // NOTE: ties keep the configured order
+    stable_sort(ranks.begin(), ranks.end(), g_rank_less);
+
+    order->resize(ranks.size());
+    for(size_t i = 0; i < ranks.size(); ++i) {
+        (*order)[i] = ranks[i].index;
+    }
+}
+
+void XMPPEndpoints::recordConnect(const Endpoint& endpoint, uint64_t rtt)
+{
+    const string& key = endpoint.toString();
+
+    ::pthread_mutex_lock(&lock);
+
+    Health& health = table.insert(make_pair(key, Health())).first->second;
+    g_smooth(&health.connect_rtt, rtt);
+    health.failures = 0;
+    health.retry_time = 0;
+
+    ::pthread_mutex_unlock(&lock);
+}
+
+void XMPPEndpoints::recordPing(const Endpoint& endpoint, uint64_t rtt)
+{
+    const string& key = endpoint.toString();
+
+    ::pthread_mutex_lock(&lock);
+
+    Health& health = table.insert(make_pair(key, Health())).first->second;
+    g_smooth(&health.ping_rtt, rtt);
+
+    ::pthread_mutex_unlock(&lock);
+}
+
+void XMPPEndpoints::recordFailure(const Endpoint& endpoint)
+{
+    const string& key = endpoint.toString();
+    uint64_t now = XMPPClock::now();
+
+    ::pthread_mutex_lock(&lock);
+
+    Health& health = table.insert(make_pair(key, Health())).first->second;
+
+    uint64_t penalty = PENALTY_MIN;
+    for(int i = 0; i < health.failures && penalty < PENALTY_MAX; ++i) {
+        penalty *= 2;
+    }
+    if(penalty > PENALTY_MAX) {
+        penalty = PENALTY_MAX;
+    }
+
+    ++health.failures;
+    health.retry_time = now + penalty;
+
+    ::pthread_mutex_unlock(&lock);
+}
+
+uint64_t XMPPEndpoints::getConnectTime(const Endpoint& endpoint)
+{
+    const string& key = endpoint.toString();
+
+    ::pthread_mutex_lock(&lock);
+
+    Table::const_iterator it = table.find(key);
+    uint64_t rtt = (it != table.end()) ? it->second.connect_rtt : 0;
+
+    ::pthread_mutex_unlock(&lock);
+
+    return rtt;
+}
+
+uint64_t XMPPEndpoints::getPingTime(const Endpoint& endpoint)
+{
+    const string& key = endpoint.toString();
+
+    ::pthread_mutex_lock(&lock);
+
+    Table::const_iterator it = table.find(key);
+    uint64_t rtt = (it != table.end()) ? it->second.ping_rtt : 0;
+
+    ::pthread_mutex_unlock(&lock);
+
+    return rtt;
+}
+
+bool XMPPEndpoints::isHealthy(const Endpoint& endpoint)
+{
+    const string& key = endpoint.toString();
+    uint64_t now = XMPPClock::now();
+
+    ::pthread_mutex_lock(&lock);
+
+    Table::const_iterator it = table.find(key);
+    bool status = (it == table.end() || it->second.retry_time <= now);
+
+    ::pthread_mutex_unlock(&lock);
+
+    return status;
+}
+
+bool XMPPEndpoints::findAddress(const Endpoint& endpoint, struct sockaddr_storage *address, socklen_t *length)
+{
+    // NOTE: an IP address is parsed in place
+    if(g_resolve(endpoint, AI_NUMERICHOST, address, length)) {
+        return true;
+    }
+
+    const string& key = endpoint.toString();
+    uint64_t now = XMPPClock::now();
+
+    ::pthread_mutex_lock(&lock);
+
+    // NOTE: a new entry is zeroed, expired
+    Address& cached = addresses[key];
+
+    bool status = (cached.length > 0);
+    if(status) {
+        *address = cached.address;
+        *length = cached.length;
+    }
+
+    if(cached.expiry <= now && !cached.is_resolving) {
+        cached.is_resolving = true;
+        lookups.push_back(endpoint);
+
+        // NOTE: the thread lives as long as the process, like the shared instance
+        if(!has_resolver) {
+            pthread_t thread;
+            if(::pthread_create(&thread, 0, XMPPEndpoints::resolver, this) == 0) {
+                ::pthread_detach(thread);
+                has_resolver = true;
+            }
+        }
+        ::pthread_cond_signal(&lookups_cond);
+    }
+
+    ::pthread_mutex_unlock(&lock);
+
+    return status;
+}
+
+void* XMPPEndpoints::resolver(void *data)
+{
+    static_cast<XMPPEndpoints*>(data)->runResolver();
+    return 0;
+}
+
+void XMPPEndpoints::runResolver()
+{
+    ::pthread_mutex_lock(&lock);
+
+    for(;;) {
+        while(lookups.empty()) {
+            ::pthread_cond_wait(&lookups_cond, &lock);
+        }
+
+        Endpoint endpoint = lookups.back();
+        lookups.pop_back();
+
+        ::pthread_mutex_unlock(&lock);
+
+        struct sockaddr_storage address;
+        socklen_t length = 0;
+        bool status = g_resolve(endpoint, 0, &address, &length);
+        if(!status) {
+            recordFailure(endpoint);
+        }
+
+        ::pthread_mutex_lock(&lock);
+
+        // NOTE: a failure keeps the previous address, if any, until the next expiry;
+        // without one the next call retries, once the penalty of the endpoint is over
+        Address& cached = addresses[endpoint.toString()];
+        cached.is_resolving = false;
+        if(status) {
+            cached.address = address;
+            cached.length = length;
+        }
+        cached.expiry = (cached.length > 0) ? XMPPClock::now() + ADDRESS_TTL : 0;
+    }
+}
@@ -0,0 +1,105 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_ENDPOINTS_INCLUDED
+#define XMPP_ENDPOINTS_INCLUDED
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+// Health of the servers clients connect to, shared by all clients of the
+// process: smoothed round trip times of TCP connects and XEP-0199 pings, and
+// consecutive failures, each keeping an endpoint out of rotation twice as long
+// as the previous one. Endpoints are known by "host:port". Their addresses are
+// cached too, resolved by a thread of the process instead of the callers.
+// NOTE: thread safe, kept in memory only
+class XMPPEndpoints
+{
+public:
+    struct Endpoint
+    {
+        string host;
+        int port;
+
+        /// "host:port", "[address]:port" for an IPv6 address
+        string toString() const;
+    };
+
+    /// "host", "host:port" or "[IPv6 address]:port", false if the port is not a number
+    static bool parse(const string& text, int default_port, Endpoint *endpoint);
+
+    /// NOTE: never deleted, like the session pools
+    static XMPPEndpoints& getShared();
+
+    /// indexes of endpoints, best first: the ones never tried (so that they get
+    /// measured), then the healthy ones by connect round trip time, then the
+    /// others by end of their penalty
+    /// NOTE: pings are left out, only the current stream of a client has them
+    void rank(const vector<Endpoint>& endpoints, vector<size_t> *order);
+
+    /// nanoseconds
+    void recordConnect(const Endpoint& endpoint, uint64_t rtt);
+    void recordPing(const Endpoint& endpoint, uint64_t rtt);
+
+    /// refused or lost connection, dead peer
+    void recordFailure(const Endpoint& endpoint);
+
+    /// smoothed round trip times, nanoseconds, 0 if never measured
+    uint64_t getConnectTime(const Endpoint& endpoint);
+    uint64_t getPingTime(const Endpoint& endpoint);
+
+    /// false while the endpoint is penalized for its last failure
+    bool isHealthy(const Endpoint& endpoint);
+
+    /// address of the endpoint without waiting for DNS, false on a miss: it is then
+    /// resolved for a next call, a lookup failing counts as a failure of the endpoint
+    /// NOTE: an expired address is still returned while it is resolved again
+    bool findAddress(const Endpoint& endpoint, struct sockaddr_storage *address, socklen_t *length);
+
+private:
+    explicit XMPPEndpoints();
+
+    static void* resolver(void *data);
+    void runResolver();
+
+private:
+    struct Health
+    {
+        uint64_t connect_rtt;  // nanoseconds, 0 if never measured
+        uint64_t ping_rtt;
+        int failures;          // consecutive, reset by a connect
+        uint64_t retry_time;   // XMPPClock::now() when the penalty ends
+    };
+
+    typedef map<string, Health> Table;
+    Table table;
+
+    struct Address
+    {
+        struct sockaddr_storage address;
+        socklen_t length;    // 0 until resolved once
+        uint64_t expiry;     // XMPPClock::now()
+        bool is_resolving;   // in lookups or being resolved
+    };
+
+    typedef map<string, Address> Addresses;
+    Addresses addresses;
+
+    vector<Endpoint> lookups;  // for the resolver thread, started on the first one
+    pthread_cond_t lookups_cond;
+    bool has_resolver;
+
+    pthread_mutex_t lock;
+
+private:
+    XMPPEndpoints(const XMPPEndpoints&);
+    const XMPPEndpoints& operator=(const XMPPEndpoints&);
+};
+
+#endif // XMPP_ENDPOINTS_INCLUDED
@@ -0,0 +1,431 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPEventBridge.hpp"
+#include "XMPPClock.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif // __linux__
+
+static const char MAGIC[] = "XMPPEVT1";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+static const size_t CAPACITY_MIN = 4096;
+static const size_t CAPACITY_MAX = 1UL << 30;
+
+// NOTE: the producer and the consumer write to separate cache lines
+struct XMPPEventBridge::Shared
+{
+    char magic[MAGIC_SIZE];        // written last by create()
+    uint32_t capacity;             // bytes of records after the header
+    uint32_t is_closed;
+    char padding0[48];
+
+    uint64_t tail;                 // bytes published, producer
+    uint64_t dropped;
+    char padding1[48];
+
+    uint64_t head;                 // bytes consumed, consumer
+    uint32_t is_waiting;
+    uint32_t doorbell;             // futex word, bumped by the producer when is_waiting
+    char padding2[48];
+};
+
+struct Record
+{
+    uint32_t size;                 // header included, multiple of 8
+    uint16_t type;
+    uint16_t fields;
+    int32_t value;
+    int32_t flags;
+    uint64_t timestamp;
+};
+
+// fields of each XMPPEventBridge::Type
+static const uint16_t FIELDS[XMPPEventBridge::TYPE_MAX] = {
+    0,  // TYPE_PADDING
+    0,  // TYPE_CONNECT
+    0,  // TYPE_DISCONNECT
+    5,  // TYPE_CHAT_MESSAGE
+    2,  // TYPE_CHAT_COMPOSING
+    2,  // TYPE_CHAT_DELIVERED
+    4,  // TYPE_GROUP_CHAT_MESSAGE
+    3,  // TYPE_GROUP_CHAT_SUBJECT
+    3,  // TYPE_GROUP_CHAT_USER_PRESENCE
+    3,  // TYPE_GROUP_CHAT_INVITE
+    3,  // TYPE_GROUP_CHAT_INVITE_DECLINE
+    1,  // TYPE_GROUP_CHAT_CREATE
+    1,  // TYPE_GROUP_CHAT_DESTROY
+    1   // TYPE_GROUP_CHAT_ERROR
+};
+
+static void g_wake(uint32_t *word)
+{
+#ifdef __linux__
+    // NOTE: not FUTEX_PRIVATE_FLAG, the consumer is another process
+    ::syscall(SYS_futex, word, FUTEX_WAKE, 1, 0, 0, 0);
+#else
+    (void)word;
+#endif // __linux__
+}
+
+static void g_sleep(uint32_t *word, uint32_t value, int timeout /* milliseconds */)
+{
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+    ::syscall(SYS_futex, word, FUTEX_WAIT, value, (timeout < 0) ? 0 : &ts, 0, 0);
+#else
+    // NOTE: no futex between processes, the doorbell is polled each millisecond
+    (void)word;
+    (void)value;
+    (void)timeout;
+    ::usleep(1000);
+#endif // __linux__
+}
+
+XMPPEventBridge::XMPPEventBridge()
+    : shared(0), shared_size(0), records(0), mask(0),
+      is_producer(false),
+      position(0), pending(0)
+{
+}
+
+XMPPEventBridge::~XMPPEventBridge()
+{
+    close();
+}
+
+bool XMPPEventBridge::create(const string& name_, size_t capacity)
+{
+    close();
+
+    if(capacity > CAPACITY_MAX) {
+        errno = EINVAL;
+        return false;
+    }
+
+    size_t size = CAPACITY_MIN;
+    while(size < capacity) {
+        size <<= 1;
+    }
+    capacity = size;
+
+    // NOTE: a producer that died left its memory behind
+    ::shm_unlink(name_.c_str());
+
+    int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        return false;
+    }
+
+    size = sizeof(Shared) + capacity;
+    void *address = MAP_FAILED;
+    if(::ftruncate(fd, size) == 0) {
+        address = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    int errnum = errno;
+    ::close(fd);
+
+    if(address == MAP_FAILED) {
+        ::shm_unlink(name_.c_str());
+        errno = errnum;
+        return false;
+    }
+
+    shared = static_cast<Shared*>(address);
+    shared_size = size;
+    records = static_cast<char*>(address) + sizeof(Shared);
+    mask = capacity - 1;
+    is_producer = true;
+    name = name_;
+
+    shared->capacity = (uint32_t)capacity;
+
+    // NOTE: a consumer opening now sees a complete header or none
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ::memcpy(shared->magic, MAGIC, MAGIC_SIZE);
+
+    return true;
+}
+
+bool XMPPEventBridge::open(const string& name_)
+{
+    close();
+
+    int fd = ::shm_open(name_.c_str(), O_RDWR, 0);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *address = MAP_FAILED;
+    if(::fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(Shared)) {
+        address = ::mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    int errnum = errno;
+    ::close(fd);
+
+    if(address == MAP_FAILED) {
+        errno = errnum;
+        return false;
+    }
+
+    Shared *header = static_cast<Shared*>(address);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if(::memcmp(header->magic, MAGIC, MAGIC_SIZE) != 0 ||
+       header->capacity < CAPACITY_MIN || (header->capacity & (header->capacity - 1)) != 0 ||
+       sizeof(Shared) + header->capacity != (size_t)st.st_size) {
+        ::munmap(address, st.st_size);
+        errno = EINVAL;
+        return false;
+    }
+
+    shared = header;
+    shared_size = st.st_size;
+    records = static_cast<char*>(address) + sizeof(Shared);
+    mask = header->capacity - 1;
+    is_producer = false;
+    name = name_;
+
+    position = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    pending = 0;
+
+    return true;
+}
+
+void XMPPEventBridge::close()
+{
+    if(!shared) {
+        return;
+    }
+
+    if(is_producer) {
+        __atomic_store_n(&shared->is_closed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shared->doorbell, 1, __ATOMIC_RELEASE);
+        g_wake(&shared->doorbell);
+
+        ::shm_unlink(name.c_str());
+    }
+    else {
+        __atomic_store_n(&shared->head, position + pending, __ATOMIC_RELEASE);
+    }
+
+    ::munmap(shared, shared_size);
+
+    shared = 0;
+    shared_size = 0;
+    records = 0;
+    mask = 0;
+    is_producer = false;
+    name.clear();
+    position = 0;
+    pending = 0;
+}
+
+bool XMPPEventBridge::publish(Type type, int value, int flags,
+                              const string& field0, const string& field1,
+                              const string& field2, const string& field3,
+                              const string& field4)
+{
+    if(!shared || !is_producer || type <= TYPE_PADDING || type >= TYPE_MAX) {
+        return false;
+    }
+
+    const string *fields[MAX_FIELDS] = {&field0, &field1, &field2, &field3, &field4};
+    uint16_t count = FIELDS[type];
+
+    size_t size = sizeof(Record);
+    for(uint16_t i = 0; i < count; ++i) {
+        size += sizeof(uint32_t) + fields[i]->size();
+    }
+    size = (size + 7) & ~(size_t)7;
+
+    uint64_t capacity = mask + 1;
+    uint64_t tail = shared->tail;
+    uint64_t head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+
+    size_t offset = tail & mask;
+    size_t padding = (offset + size > capacity) ? capacity - offset : 0;
+
+    if(size > capacity / 4 || tail + padding + size - head > capacity) {
+        __atomic_add_fetch(&shared->dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // NOTE: at least 8 bytes are left, enough for the size and the type
+    if(padding) {
+        Record *record = reinterpret_cast<Record*>(records + offset);
+        record->size = (uint32_t)padding;
+        record->type = TYPE_PADDING;
+
+        tail += padding;
+        offset = 0;
+    }
+
+    Record *record = reinterpret_cast<Record*>(records + offset);
+    record->size = (uint32_t)size;
+    record->type = (uint16_t)type;
+    record->fields = count;
+    record->value = value;
+    record->flags = flags;
+    record->timestamp = XMPPClock::now();
+
+    char *data = reinterpret_cast<char*>(record + 1);
+    for(uint16_t i = 0; i < count; ++i) {
+        uint32_t length = (uint32_t)fields[i]->size();
+        ::memcpy(data, &length, sizeof(length));
+        data += sizeof(length);
+
+        ::memcpy(data, fields[i]->data(), length);
+        data += length;
+    }
+
+    __atomic_store_n(&shared->tail, tail + size, __ATOMIC_RELEASE);
+
+    // NOTE: orders the tail before is_waiting, as wait() orders them the other way
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&shared->is_waiting, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&shared->doorbell, 1, __ATOMIC_RELEASE);
+        g_wake(&shared->doorbell);
+    }
+
+    return true;
+}
+
+bool XMPPEventBridge::read(Event& event)
+{
+    if(!shared || is_producer) {
+        return false;
+    }
+
+    position += pending;
+    pending = 0;
+
+    for(;;) {
+        uint64_t tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+        if(position == tail) {
+            __atomic_store_n(&shared->head, position, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        const char *base = records + (position & mask);
+        const Record *record = reinterpret_cast<const Record*>(base);
+
+        // NOTE: a corrupted ring is skipped up to what is published
+        uint32_t size = record->size;
+        if(size < 8 || (size & 7) != 0 || size > tail - position || (position & mask) + size > mask + 1) {
+            position = tail;
+            continue;
+        }
+
+        if(record->type == TYPE_PADDING) {
+            position += size;
+            continue;
+        }
+
+        // NOTE: the head stays at this record while its fields are used
+        __atomic_store_n(&shared->head, position, __ATOMIC_RELEASE);
+
+        if(size < sizeof(Record) || record->type >= TYPE_MAX || record->fields > MAX_FIELDS) {
+            position += size;
+            continue;
+        }
+
+        event.type = (Type)record->type;
+        event.value = record->value;
+        event.flags = record->flags;
+        event.timestamp = record->timestamp;
+        event.fields = 0;
+
+        const char *data = base + sizeof(Record);
+        const char *end = base + size;
+
+        bool is_valid = true;
+        for(uint16_t i = 0; i < record->fields; ++i) {
+            uint32_t length;
+            if(end - data < (ptrdiff_t)sizeof(length)) {
+                is_valid = false;
+                break;
+            }
+            ::memcpy(&length, data, sizeof(length));
+            data += sizeof(length);
+
+            if((size_t)(end - data) < length) {
+                is_valid = false;
+                break;
+            }
+            event.data[i] = data;
+            event.size[i] = length;
+            data += length;
+        }
+
+        if(!is_valid) {
+            position += size;
+            continue;
+        }
+
+        event.fields = record->fields;
+        pending = size;
+        return true;
+    }
+}
+
+bool XMPPEventBridge::wait(int timeout /* milliseconds */)
+{
+    if(!shared || is_producer) {
+        return false;
+    }
+
+    uint64_t deadline = XMPPClock::nowMilliseconds() + (timeout < 0 ? 0 : timeout);
+
+    for(;;) {
+        uint32_t doorbell = __atomic_load_n(&shared->doorbell, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&shared->is_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        bool has_events = (__atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE) != position + pending);
+        if(has_events || isClosed()) {
+            __atomic_store_n(&shared->is_waiting, 0, __ATOMIC_RELAXED);
+            return has_events;
+        }
+
+        int wait_time = -1;
+        if(timeout >= 0) {
+            uint64_t now = XMPPClock::nowMilliseconds();
+            if(now >= deadline) {
+                __atomic_store_n(&shared->is_waiting, 0, __ATOMIC_RELAXED);
+                return false;
+            }
+            wait_time = (int)(deadline - now);
+        }
+
+        g_sleep(&shared->doorbell, doorbell, wait_time);
+    }
+}
+
+bool XMPPEventBridge::isClosed() const
+{
+    return !shared || __atomic_load_n(&shared->is_closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+uint64_t XMPPEventBridge::getDropped() const
+{
+    return shared ? __atomic_load_n(&shared->dropped, __ATOMIC_RELAXED) : 0;
+}
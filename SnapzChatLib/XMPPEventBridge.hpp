@@ -0,0 +1,120 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_EVENT_BRIDGE_INCLUDED
+#define XMPP_EVENT_BRIDGE_INCLUDED
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// Client events published into POSIX shared memory for another process, one
+// producer (a client, see XMPPClient::Config::event_bridge, which serializes
+// its publish() calls) and one consumer. The memory holds a header then a ring
+// of records:
+//   uint32 size (header included, multiple of 8), uint16 type, uint16 fields,
+//   int32 value, int32 flags, uint64 timestamp, then per field: uint32 size, data
+// A record never wraps around the end of the ring, the space left there is
+// skipped with a TYPE_PADDING record. The consumer reads the fields where they
+// are and sleeps on a futex word of the header (Linux, polled elsewhere).
+// NOTE: integers in host byte order, events that do not fit are dropped and counted
+class XMPPEventBridge
+{
+public:
+    enum Type {
+        TYPE_PADDING = 0,
+        TYPE_CONNECT,                     // no field
+        TYPE_DISCONNECT,                  // value ConnectionError
+        TYPE_CHAT_MESSAGE,                // user, resource, message, subject, timestamp (empty if not delayed)
+        TYPE_CHAT_COMPOSING,              // user, resource
+        TYPE_CHAT_DELIVERED,              // user, resource
+        TYPE_GROUP_CHAT_MESSAGE,          // group, user, message, timestamp (empty if not delayed)
+        TYPE_GROUP_CHAT_SUBJECT,          // group, user, subject
+        TYPE_GROUP_CHAT_USER_PRESENCE,    // group, user, reason; value online, flags UserSelf...
+        TYPE_GROUP_CHAT_INVITE,           // group, user, reason
+        TYPE_GROUP_CHAT_INVITE_DECLINE,   // group, user, reason
+        TYPE_GROUP_CHAT_CREATE,           // group; value success
+        TYPE_GROUP_CHAT_DESTROY,          // group; value success
+        TYPE_GROUP_CHAT_ERROR,            // group; value StanzaError
+        TYPE_MAX
+    };
+
+    static const size_t MAX_FIELDS = 5;
+
+    struct Event
+    {
+        Type type;
+        int value;
+        int flags;
+        uint64_t timestamp;               // XMPPClock::now() when published
+
+        size_t fields;
+        const char *data[MAX_FIELDS];     // in the shared memory, not null terminated
+        size_t size[MAX_FIELDS];
+
+        /// copy of a field, empty string past the fields of the type
+        string getField(size_t index) const {
+            return (index < fields) ? string(data[index], size[index]) : string();
+        }
+    };
+
+public:
+    explicit XMPPEventBridge();
+
+    ~XMPPEventBridge();
+
+    /// producer: creates the shared memory name ("/name"), replacing a stale one,
+    /// with a ring of capacity bytes rounded up to a power of two
+    bool create(const string& name, size_t capacity);
+
+    /// consumer: opens what a producer created, reading resumes where the last consumer stopped
+    bool open(const string& name);
+
+    /// the producer also removes the name, consumers read what is left then see isClosed()
+    void close();
+
+    bool isOpen() const {
+        return shared != 0;
+    }
+
+    /// producer: the fields the type has (see Type) are written, false if the
+    /// event does not fit in the ring (a slow consumer, or a quarter of it at least)
+    bool publish(Type type, int value = 0, int flags = 0,
+                 const string& field0 = string(), const string& field1 = string(),
+                 const string& field2 = string(), const string& field3 = string(),
+                 const string& field4 = string());
+
+    /// consumer: next event without waiting, false if there is none; its fields
+    /// stay valid until the next read()
+    bool read(Event& event);
+
+    /// consumer: waits up to timeout milliseconds (-1 without limit) for an event,
+    /// true when read() may return one
+    bool wait(int timeout);
+
+    /// true once the producer closed, the events left can still be read
+    bool isClosed() const;
+
+    /// events the producer could not publish since create()
+    uint64_t getDropped() const;
+
+private:
+    struct Shared;
+
+    Shared *shared;
+    size_t shared_size;
+    char *records;
+    uint64_t mask;         // capacity - 1
+
+    bool is_producer;
+    string name;
+
+    uint64_t position;     // consumer, start of the record read last
+    uint64_t pending;      // consumer, size of the record read last, freed by the next read()
+
+private:
+    XMPPEventBridge(const XMPPEventBridge&);
+    const XMPPEventBridge& operator=(const XMPPEventBridge&);
+};
+
+#endif // XMPP_EVENT_BRIDGE_INCLUDED
@@ -0,0 +1,717 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPMetrics.hpp"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct MetricDescription
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+static const MetricDescription g_counters[XMPPMetrics::COUNTER_MAX] = {
+    {"xmpp_stanzas_total", "direction=\"in\",type=\"message\"", "Number of XMPP stanzas"},
+    {"xmpp_stanzas_total", "direction=\"in\",type=\"presence\"", 0},
+    {"xmpp_stanzas_total", "direction=\"in\",type=\"iq\"", 0},
+    {"xmpp_stanzas_total", "direction=\"in\",type=\"subscription\"", 0},
+    {"xmpp_stanzas_total", "direction=\"out\",type=\"message\"", 0},
+    {"xmpp_stanzas_total", "direction=\"out\",type=\"presence\"", 0},
+    {"xmpp_stanzas_total", "direction=\"out\",type=\"iq\"", 0},
+    {"xmpp_stanzas_total", "direction=\"out\",type=\"subscription\"", 0},
+    {"xmpp_bytes_total", "direction=\"in\"", "Number of bytes on the XMPP stream"},
+    {"xmpp_bytes_total", "direction=\"out\"", 0},
+    {"xmpp_recv_idle_total", "", "Number of recv() calls that returned without data"},
+    {"xmpp_connects_total", "", "Number of established connections"},
+    {"xmpp_reconnects_total", "", "Number of established connections after the first one"},
+    {"xmpp_connect_failures_total", "", "Number of failed connection attempts"},
+    {"xmpp_disconnects_total", "", "Number of lost or closed connections"},
+    {"xmpp_multicast_stanzas_total", "", "Number of XEP-0033 multicast messages sent"},
+    {"xmpp_multicast_bytes_saved_total", "", "Bytes not sent thanks to XEP-0033 multicast"},
+    {"xmpp_message_completions_total", "status=\"acknowledged\"", "Number of tracked messages completed"},
+    {"xmpp_message_completions_total", "status=\"delivered\"", 0},
+    {"xmpp_message_completions_total", "status=\"failed\"", 0},
+    {"xmpp_message_completions_total", "status=\"timeout\"", 0},
+    {"xmpp_pings_total", "", "Number of XEP-0199 pings sent after a silence"},
+    {"xmpp_ping_timeouts_total", "", "Number of pings unanswered within ping_timeout"},
+    {"xmpp_dead_peers_total", "", "Number of connections closed for unanswered pings"},
+    {"xmpp_inactive_suppressed_total", "type=\"composing\"", "Traffic dropped or coalesced while inactive (XEP-0352)"},
+    {"xmpp_inactive_suppressed_total", "type=\"presence\"", 0},
+    {"xmpp_outbound_superseded_total", "", "Number of queued stanzas dropped for a newer one"},
+    {"xmpp_roster_full_total", "", "Number of full rosters received instead of the changes since the cached version"},
+    {"xmpp_roster_pushes_total", "", "Number of roster pushes applied to the cached roster"},
+    {"xmpp_disco_cache_total", "result=\"hit\"", "Number of service discovery results looked up in the cache"},
+    {"xmpp_disco_cache_total", "result=\"miss\"", 0},
+    {"xmpp_endpoint_failovers_total", "", "Number of connections established past the best ranked endpoint"},
+    {"xmpp_standby_takeovers_total", "", "Number of connections established on the standby TCP connection"},
+    {"xmpp_event_bridge_dropped_total", "", "Number of events not published to a full event bridge"},
+};
+
+static const MetricDescription g_gauges[XMPPMetrics::GAUGE_MAX] = {
+    {"xmpp_sessions", "type=\"chat\"", "Number of entries in the session tables"},
+    {"xmpp_sessions", "type=\"group_chat\"", 0},
+    {"xmpp_fanout_queue", "", "Number of recipients waiting in the fan-out queue"},
+    {"xmpp_pool_objects", "state=\"in_use\"", "Number of session objects in the process-wide pools"},
+    {"xmpp_pool_objects", "state=\"capacity\"", 0},
+    {"xmpp_pending_messages", "", "Number of tracked messages waiting for completion"},
+    {"xmpp_ping_interval_milliseconds", "", "Silence before the next keepalive ping"},
+    {"xmpp_inactive", "", "1 while the client state is inactive (XEP-0352)"},
+    {"xmpp_outbound_queue", "", "Number of stanzas waiting in the outbound scheduler"},
+    {"xmpp_roster_items", "", "Number of contacts in the cached roster"},
+};
+
+static const MetricDescription g_histograms[XMPPMetrics::HISTOGRAM_MAX] = {
+    {"xmpp_recv_duration_seconds", "", "Duration of recv() calls that processed data"},
+    {"xmpp_lock_wait_seconds", "lock=\"chat_sessions\"", "Time spent waiting for session table locks"},
+    {"xmpp_lock_wait_seconds", "lock=\"group_chat_sessions\"", 0},
+    {"xmpp_message_delivery_seconds", "", "Time from sending a tracked message to its acknowledgement or receipt"},
+    {"xmpp_ping_rtt_seconds", "", "Round trip time of keepalive pings"},
+    {"xmpp_outbound_queue_seconds", "class=\"content\"", "Time stanzas waited in the outbound scheduler"},
+    {"xmpp_outbound_queue_seconds", "class=\"receipt\"", 0},
+    {"xmpp_outbound_queue_seconds", "class=\"chat_state\"", 0},
+    {"xmpp_outbound_queue_seconds", "class=\"presence\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onConnect\"", "Execution time of XMPPClient callbacks"},
+    {"xmpp_callback_duration_seconds", "callback=\"onTlsConnect\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onDisconnect\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onChatMessage\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onChatMessageComposing\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onChatMessageDelivered\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onMessageCompletion\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatCreation\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatCreate\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatDestroy\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatSubject\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatMessage\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatInvite\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatKickResult\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatBanResult\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatUnbanResult\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatUserPresence\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatError\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatInviteDecline\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatUsersList\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onGroupChatRequestResult\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onRosterItem\"", 0},
+    {"xmpp_callback_duration_seconds", "callback=\"onRosterReady\"", 0},
+};
+
+static inline uint64_t g_atomic_load(const uint64_t *value)
+{
+    return __sync_fetch_and_add(const_cast<uint64_t*>(value), 0);
+}
+
+static inline int64_t g_atomic_load(const int64_t *value)
+{
+    return __sync_fetch_and_add(const_cast<int64_t*>(value), 0);
+}
+
+template<typename T>
+static inline T* g_atomic_load(T *const *value)
+{
+    return __sync_val_compare_and_swap(const_cast<T**>(value), (T*)0, (T*)0);
+}
+
+/// XMPPMetrics::HistogramSnapshot
+uint64_t XMPPMetrics::HistogramSnapshot::percentile(double quantile) const
+{
+    if(count == 0) {
+        return 0;
+    }
+
+    if(quantile < 0.0) quantile = 0.0;
+    if(quantile > 1.0) quantile = 1.0;
+
+    uint64_t target = (uint64_t)(quantile * count + 0.5);
+    if(target == 0) {
+        target = 1;
+    }
+
+    uint64_t total = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        total += buckets[i];
+        if(total >= target) {
+            uint64_t value = bucketUpperBound(i);
+            return (value < max) ? value : max;
+        }
+    }
+
+    return max;
+}
+
+/// XMPPMetrics
+XMPPMetrics::XMPPMetrics()
+{
+    ::memset(counters, 0, sizeof(counters));
+    ::memset(gauges, 0, sizeof(gauges));
+    ::memset(histograms, 0, sizeof(histograms));
+}
+
+XMPPMetrics::~XMPPMetrics()
+{
+    for(int i = 0; i < HISTOGRAM_MAX; ++i) {
+        delete histograms[i];
+    }
+}
+
+void XMPPMetrics::setGauge(Gauge gauge, int64_t value)
+{
+    int64_t old = gauges[gauge];
+    int64_t prev;
+
+    while((prev = __sync_val_compare_and_swap(&gauges[gauge], old, value)) != old) {
+        old = prev;
+    }
+}
+
+XMPPMetrics::HistogramData* XMPPMetrics::getHistogram(Histogram histogram)
+{
+    HistogramData *data = g_atomic_load(&histograms[histogram]);
+    if(data) {
+        return data;
+    }
+
+    // NOTE: a client records into a few histograms only, ~2 KB each
+    data = new HistogramData;
+    ::memset(data, 0, sizeof(*data));
+
+    HistogramData *prev = __sync_val_compare_and_swap(&histograms[histogram], (HistogramData*)0, data);
+    if(prev) {
+        delete data;
+        return prev;
+    }
+
+    return data;
+}
+
+void XMPPMetrics::record(Histogram histogram, uint64_t value)
+{
+    HistogramData& data = *getHistogram(histogram);
+
+    __sync_fetch_and_add(&data.buckets[bucketIndex(value)], 1);
+    __sync_fetch_and_add(&data.sum, value);
+
+    uint64_t old = data.max;
+    while(value > old) {
+        uint64_t prev = __sync_val_compare_and_swap(&data.max, old, value);
+        if(prev == old) {
+            break;
+        }
+        old = prev;
+    }
+}
+
+void XMPPMetrics::snapshot(Histogram histogram, HistogramSnapshot *result) const
+{
+    const HistogramData *data = g_atomic_load(&histograms[histogram]);
+    if(!data) {
+        ::memset(result, 0, sizeof(*result));
+        return;
+    }
+
+    // NOTE: the count is derived from the buckets to stay consistent with them
+    result->count = 0;
+    for(int j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+        result->buckets[j] = g_atomic_load(&data->buckets[j]);
+        result->count += result->buckets[j];
+    }
+
+    result->sum = g_atomic_load(&data->sum);
+    result->max = g_atomic_load(&data->max);
+}
+
+void XMPPMetrics::snapshot(Snapshot *snapshot) const
+{
+    for(int i = 0; i < COUNTER_MAX; ++i) {
+        snapshot->counters[i] = g_atomic_load(&counters[i]);
+    }
+
+    for(int i = 0; i < GAUGE_MAX; ++i) {
+        snapshot->gauges[i] = g_atomic_load(&gauges[i]);
+    }
+
+    for(int i = 0; i < HISTOGRAM_MAX; ++i) {
+        this->snapshot((Histogram)i, &snapshot->histograms[i]);
+    }
+}
+
+void XMPPMetrics::reset()
+{
+    for(int i = 0; i < COUNTER_MAX; ++i) {
+        __sync_fetch_and_and(&counters[i], 0);
+    }
+
+    for(int i = 0; i < HISTOGRAM_MAX; ++i) {
+        HistogramData *data = g_atomic_load(&histograms[i]);
+        if(!data) {
+            continue;
+        }
+
+        for(int j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+            __sync_fetch_and_and(&data->buckets[j], 0);
+        }
+        __sync_fetch_and_and(&data->sum, 0);
+        __sync_fetch_and_and(&data->max, 0);
+    }
+
+    // NOTE: gauges reflect the current state and are never reset
+}
+
+int XMPPMetrics::bucketIndex(uint64_t value)
+{
+    if(value < (uint64_t)HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+
+    if(value >= (1ULL << HISTOGRAM_MAX_VALUE_BITS)) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS
+        + (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t XMPPMetrics::bucketUpperBound(int index)
+{
+    assert(index >= 0 && index < HISTOGRAM_BUCKETS);
+
+    if(index < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS);
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+
+    return lower + (1ULL << shift) - 1;
+}
+
+const char* XMPPMetrics::counterName(Counter counter)
+{
+    return g_counters[counter].name;
+}
+
+const char* XMPPMetrics::gaugeName(Gauge gauge)
+{
+    return g_gauges[gauge].name;
+}
+
+const char* XMPPMetrics::histogramName(Histogram histogram)
+{
+    return g_histograms[histogram].name;
+}
+
+static string g_series_labels(const char *labels, const string& extra_labels, const char *extra = 0)
+{
+    string result;
+
+    if(*labels) {
+        result += labels;
+    }
+    if(!extra_labels.empty()) {
+        if(!result.empty()) result += ",";
+        result += extra_labels;
+    }
+    if(extra && *extra) {
+        if(!result.empty()) result += ",";
+        result += extra;
+    }
+
+    return result.empty() ? result : ("{" + result + "}");
+}
+
+static void g_format_header(string *out, const MetricDescription& metric, const char *type)
+{
+    if(metric.help) {
+        char line[256];
+        ::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+                   metric.name, metric.help, metric.name, type);
+        *out += line;
+    }
+}
+
+string XMPPMetrics::formatLabel(const string& name, const string& value)
+{
+    string result = name + "=\"";
+
+    for(string::const_iterator it = value.begin(); it != value.end(); ++it) {
+        switch(*it) {
+        case '\\':
+            result += "\\\\";
+            break;
+        case '"':
+            result += "\\\"";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        default:
+            result += *it;
+            break;
+        }
+    }
+
+    return result + "\"";
+}
+
+string XMPPMetrics::formatPrometheus(const string& labels) const
+{
+    const XMPPMetrics *metrics = this;
+    return formatPrometheus(&metrics, &labels, 1);
+}
+
+string XMPPMetrics::formatPrometheus(const XMPPMetrics *const *metrics, const string *labels, size_t count)
+{
+    string out;
+    char line[128];
+
+    for(int i = 0; i < COUNTER_MAX; ++i) {
+        const MetricDescription& metric = g_counters[i];
+        g_format_header(&out, metric, "counter");
+
+        for(size_t k = 0; k < count; ++k) {
+            ::snprintf(line, sizeof(line), " %llu\n", (unsigned long long)metrics[k]->get((Counter)i));
+            out += metric.name + g_series_labels(metric.labels, labels[k]) + line;
+        }
+    }
+
+    for(int i = 0; i < GAUGE_MAX; ++i) {
+        const MetricDescription& metric = g_gauges[i];
+        g_format_header(&out, metric, "gauge");
+
+        for(size_t k = 0; k < count; ++k) {
+            ::snprintf(line, sizeof(line), " %lld\n", (long long)g_atomic_load(&metrics[k]->gauges[i]));
+            out += metric.name + g_series_labels(metric.labels, labels[k]) + line;
+        }
+    }
+
+    HistogramSnapshot *histogram = new HistogramSnapshot;
+
+    for(int i = 0; i < HISTOGRAM_MAX; ++i) {
+        const MetricDescription& metric = g_histograms[i];
+        g_format_header(&out, metric, "histogram");
+
+        for(size_t k = 0; k < count; ++k) {
+            metrics[k]->snapshot((Histogram)i, histogram);
+
+            // only export power-of-two bucket boundaries to keep the output small
+            uint64_t cumulative = 0;
+            for(int j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+                cumulative += histogram->buckets[j];
+
+                if((j % HISTOGRAM_SUB_BUCKETS) == (HISTOGRAM_SUB_BUCKETS - 1)
+                   && j != (HISTOGRAM_BUCKETS - 1)) {
+                    char le[64];
+                    ::snprintf(le, sizeof(le), "le=\"%.9g\"", (double)(bucketUpperBound(j) + 1) / 1e9);
+                    ::snprintf(line, sizeof(line), " %llu\n", (unsigned long long)cumulative);
+                    out += string(metric.name) + "_bucket" + g_series_labels(metric.labels, labels[k], le) + line;
+                }
+            }
+
+            ::snprintf(line, sizeof(line), " %llu\n", (unsigned long long)histogram->count);
+            out += string(metric.name) + "_bucket" + g_series_labels(metric.labels, labels[k], "le=\"+Inf\"") + line;
+
+            ::snprintf(line, sizeof(line), " %.9g\n", (double)histogram->sum / 1e9);
+            out += string(metric.name) + "_sum" + g_series_labels(metric.labels, labels[k]) + line;
+
+            ::snprintf(line, sizeof(line), " %llu\n", (unsigned long long)histogram->count);
+            out += string(metric.name) + "_count" + g_series_labels(metric.labels, labels[k]) + line;
+        }
+    }
+
+    delete histogram;
+    return out;
+}
+
+// NOTE: a slow or stuck collector is given up on, exportPrometheus() may run on an event loop
+static const int EXPORT_TIMEOUT = 100;  // milliseconds
+
+#ifdef MSG_NOSIGNAL
+static const int EXPORT_SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int EXPORT_SEND_FLAGS = 0;  // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+static bool g_wait_socket(int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+
+    for(;;) {
+        uint64_t now = XMPPClock::nowMilliseconds();
+        if(now >= deadline) {
+            return false;
+        }
+
+        pfd.revents = 0;
+        int status = ::poll(&pfd, 1, (int)(deadline - now));
+        if(status > 0) {
+            return true;
+        }
+        if(status < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static bool g_connect(int fd, const struct sockaddr_un& address, uint64_t deadline)
+{
+    if(::connect(fd, (const struct sockaddr*)&address, sizeof(address)) == 0) {
+        return true;
+    }
+
+    // NOTE: an interrupted connect goes on asynchronously, like a pending one
+    if(errno != EINPROGRESS && errno != EINTR) {
+        return false;
+    }
+
+    int error = 0;
+    socklen_t size = sizeof(error);
+
+    return g_wait_socket(fd, POLLOUT, deadline)
+        && ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0
+        && error == 0;
+}
+
+static bool g_write_all(int fd, const string& data, uint64_t deadline)
+{
+    const char *ptr = data.data();
+    size_t size = data.size();
+
+    while(size > 0) {
+        ssize_t written = ::send(fd, ptr, size, EXPORT_SEND_FLAGS);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if((errno != EAGAIN && errno != EWOULDBLOCK) || !g_wait_socket(fd, POLLOUT, deadline)) {
+                return false;
+            }
+            continue;
+        }
+        ptr += written;
+        size -= (size_t)written;
+    }
+
+    return true;
+}
+
+static bool g_export(const string& target, const string& data)
+{
+    static const string UNIX_PREFIX = "unix:";
+
+    if(target.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0) {
+        const string& path = target.substr(UNIX_PREFIX.size());
+
+        struct sockaddr_un address;
+        if(path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+
+        ::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        ::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return false;
+        }
+
+        // NOTE: a collector closing early must not raise SIGPIPE
+#ifdef SO_NOSIGPIPE
+        int enable = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        uint64_t deadline = XMPPClock::nowMilliseconds() + EXPORT_TIMEOUT;
+        bool status = g_connect(fd, address, deadline) && g_write_all(fd, data, deadline);
+
+        ::close(fd);
+        return status;
+    }
+
+    // write into a temporary file first, so that readers never see partial data
+    const string& tmp_path = target + ".tmp";
+
+    FILE *file = ::fopen(tmp_path.c_str(), "w");
+    if(!file) {
+        return false;
+    }
+
+    bool status = (::fwrite(data.data(), 1, data.size(), file) == data.size());
+    status = (::fclose(file) == 0) && status;
+
+    if(status) {
+        status = (::rename(tmp_path.c_str(), target.c_str()) == 0);
+    }
+    if(!status) {
+        ::unlink(tmp_path.c_str());
+    }
+
+    return status;
+}
+
+bool XMPPMetrics::exportPrometheus(const string& target, const string& labels) const
+{
+    return g_export(target, formatPrometheus(labels));
+}
+
+/// shared exports
+struct ExportSource
+{
+    const XMPPMetrics *metrics;
+    string labels;
+    int interval;
+};
+
+struct ExportTarget
+{
+    vector<ExportSource> sources;
+    uint64_t time;  // of the next export, milliseconds
+};
+
+typedef map<string, ExportTarget> ExportTargets;
+
+static ExportTargets g_export_targets;
+static pthread_mutex_t g_export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_export_cond = PTHREAD_COND_INITIALIZER;
+static bool g_has_export_thread = false;
+
+static void* g_export_thread(void *data)
+{
+    (void)data;
+
+    vector<const XMPPMetrics*> metrics;
+    vector<string> labels;
+    vector<pair<string, string> > documents;
+
+    ::pthread_mutex_lock(&g_export_lock);
+
+    for(;;) {
+        uint64_t now = XMPPClock::nowMilliseconds();
+        uint64_t next = 0;
+
+        // NOTE: formatted under the lock, detachExport() waits for the metrics to be read
+        for(ExportTargets::iterator it = g_export_targets.begin(); it != g_export_targets.end(); ++it) {
+            ExportTarget& target = it->second;
+
+            if(target.time <= now) {
+                int interval = target.sources.front().interval;
+
+                metrics.clear();
+                labels.clear();
+                for(size_t i = 0; i < target.sources.size(); ++i) {
+                    metrics.push_back(target.sources[i].metrics);
+                    labels.push_back(target.sources[i].labels);
+                    if(target.sources[i].interval < interval) {
+                        interval = target.sources[i].interval;
+                    }
+                }
+
+                documents.push_back(make_pair(it->first, XMPPMetrics::formatPrometheus(&metrics[0], &labels[0], metrics.size())));
+                target.time = now + interval;
+            }
+
+            if(next == 0 || target.time < next) {
+                next = target.time;
+            }
+        }
+
+        if(!documents.empty()) {
+            ::pthread_mutex_unlock(&g_export_lock);
+            for(size_t i = 0; i < documents.size(); ++i) {
+                g_export(documents[i].first, documents[i].second);
+            }
+            documents.clear();
+            ::pthread_mutex_lock(&g_export_lock);
+            continue;
+        }
+
+        if(next == 0) {
+            ::pthread_cond_wait(&g_export_cond, &g_export_lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+
+        uint64_t nanoseconds = deadline.tv_nsec + (next - now) * 1000000ULL;
+        deadline.tv_sec += (time_t)(nanoseconds / 1000000000ULL);
+        deadline.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+
+        ::pthread_cond_timedwait(&g_export_cond, &g_export_lock, &deadline);
+    }
+
+    return 0;
+}
+
+void XMPPMetrics::attachExport(const string& target, int interval, const string& labels)
+{
+    ExportSource source;
+    source.metrics = this;
+    source.labels = labels;
+    source.interval = (interval > 0) ? interval : 1;
+
+    ::pthread_mutex_lock(&g_export_lock);
+
+    ExportTargets::iterator it = g_export_targets.find(target);
+    if(it == g_export_targets.end()) {
+        it = g_export_targets.insert(make_pair(target, ExportTarget())).first;
+        it->second.time = 0;
+    }
+    it->second.sources.push_back(source);
+
+    // NOTE: the thread lives as long as the process, like the other shared objects
+    if(!g_has_export_thread) {
+        pthread_t thread;
+        if(::pthread_create(&thread, 0, g_export_thread, 0) == 0) {
+            ::pthread_detach(thread);
+            g_has_export_thread = true;
+        }
+    }
+
+    ::pthread_cond_signal(&g_export_cond);
+    ::pthread_mutex_unlock(&g_export_lock);
+}
+
+void XMPPMetrics::detachExport(const string& target)
+{
+    ::pthread_mutex_lock(&g_export_lock);
+
+    ExportTargets::iterator it = g_export_targets.find(target);
+    if(it != g_export_targets.end()) {
+        vector<ExportSource>& sources = it->second.sources;
+
+        for(vector<ExportSource>::iterator source = sources.begin(); source != sources.end(); ++source) {
+            if(source->metrics == this) {
+                sources.erase(source);
+                break;
+            }
+        }
+
+        if(sources.empty()) {
+            g_export_targets.erase(it);
+        }
+    }
+
+    ::pthread_mutex_unlock(&g_export_lock);
+}
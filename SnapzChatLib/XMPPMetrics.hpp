@@ -0,0 +1,233 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_METRICS_INCLUDED
+#define XMPP_METRICS_INCLUDED
+
+#include "XMPPClock.hpp"
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// NOTE: all update methods are lock-free and may be called from any thread;
+// NOTE: readers get a consistent-enough view through snapshot()
+class XMPPMetrics
+{
+public:
+    enum Counter {
+        COUNTER_STANZAS_IN_MESSAGE,
+        COUNTER_STANZAS_IN_PRESENCE,
+        COUNTER_STANZAS_IN_IQ,
+        COUNTER_STANZAS_IN_SUBSCRIPTION,
+        COUNTER_STANZAS_OUT_MESSAGE,
+        COUNTER_STANZAS_OUT_PRESENCE,
+        COUNTER_STANZAS_OUT_IQ,
+        COUNTER_STANZAS_OUT_SUBSCRIPTION,
+        COUNTER_BYTES_IN,
+        COUNTER_BYTES_OUT,
+        COUNTER_RECV_IDLE,
+        COUNTER_CONNECTS,
+        COUNTER_RECONNECTS,
+        COUNTER_CONNECT_FAILURES,
+        COUNTER_DISCONNECTS,
+        COUNTER_MULTICAST_STANZAS,
+        COUNTER_MULTICAST_BYTES_SAVED,
+        COUNTER_MESSAGES_ACKNOWLEDGED,
+        COUNTER_MESSAGES_DELIVERED,
+        COUNTER_MESSAGES_FAILED,
+        COUNTER_MESSAGES_TIMEOUT,
+        COUNTER_PINGS,
+        COUNTER_PING_TIMEOUTS,
+        COUNTER_DEAD_PEERS,
+        COUNTER_INACTIVE_COMPOSING,
+        COUNTER_INACTIVE_PRESENCE,
+        COUNTER_OUTBOUND_SUPERSEDED,
+        COUNTER_ROSTER_FULL,
+        COUNTER_ROSTER_PUSHES,
+        COUNTER_DISCO_CACHE_HITS,
+        COUNTER_DISCO_CACHE_MISSES,
+        COUNTER_ENDPOINT_FAILOVERS,
+        COUNTER_STANDBY_TAKEOVERS,
+        COUNTER_EVENTS_DROPPED,
+        COUNTER_MAX
+    };
+
+    enum Gauge {
+        GAUGE_CHAT_SESSIONS,
+        GAUGE_GROUP_CHAT_SESSIONS,
+        GAUGE_FANOUT_QUEUE,
+        GAUGE_POOL_IN_USE,
+        GAUGE_POOL_CAPACITY,
+        GAUGE_PENDING_MESSAGES,
+        GAUGE_PING_INTERVAL,
+        GAUGE_INACTIVE,
+        GAUGE_OUTBOUND_QUEUE,
+        GAUGE_ROSTER_ITEMS,
+        GAUGE_MAX
+    };
+
+    enum Histogram {
+        HISTOGRAM_RECV,
+        HISTOGRAM_CHAT_SESSIONS_LOCK_WAIT,
+        HISTOGRAM_GROUP_CHAT_SESSIONS_LOCK_WAIT,
+        HISTOGRAM_MESSAGE_DELIVERY,  // tracked message sent to acknowledged or delivered
+        HISTOGRAM_PING,              // XEP-0199 ping round trip
+
+        // time spent in the outbound scheduler, by priority class
+        HISTOGRAM_OUTBOUND_QUEUE_CONTENT,
+        HISTOGRAM_OUTBOUND_QUEUE_RECEIPT,
+        HISTOGRAM_OUTBOUND_QUEUE_CHAT_STATE,
+        HISTOGRAM_OUTBOUND_QUEUE_PRESENCE,
+
+        // XMPPClient callbacks execution time
+        HISTOGRAM_ON_CONNECT,
+        HISTOGRAM_ON_TLS_CONNECT,
+        HISTOGRAM_ON_DISCONNECT,
+        HISTOGRAM_ON_CHAT_MESSAGE,
+        HISTOGRAM_ON_CHAT_MESSAGE_COMPOSING,
+        HISTOGRAM_ON_CHAT_MESSAGE_DELIVERED,
+        HISTOGRAM_ON_MESSAGE_COMPLETION,
+        HISTOGRAM_ON_GROUP_CHAT_CREATION,
+        HISTOGRAM_ON_GROUP_CHAT_CREATE,
+        HISTOGRAM_ON_GROUP_CHAT_DESTROY,
+        HISTOGRAM_ON_GROUP_CHAT_SUBJECT,
+        HISTOGRAM_ON_GROUP_CHAT_MESSAGE,
+        HISTOGRAM_ON_GROUP_CHAT_INVITE,
+        HISTOGRAM_ON_GROUP_CHAT_KICK_RESULT,
+        HISTOGRAM_ON_GROUP_CHAT_BAN_RESULT,
+        HISTOGRAM_ON_GROUP_CHAT_UNBAN_RESULT,
+        HISTOGRAM_ON_GROUP_CHAT_USER_PRESENCE,
+        HISTOGRAM_ON_GROUP_CHAT_ERROR,
+        HISTOGRAM_ON_GROUP_CHAT_INVITE_DECLINE,
+        HISTOGRAM_ON_GROUP_CHAT_USERS_LIST,
+        HISTOGRAM_ON_GROUP_CHAT_REQUEST_RESULT,
+        HISTOGRAM_ON_ROSTER_ITEM,
+        HISTOGRAM_ON_ROSTER_READY,
+
+        HISTOGRAM_MAX
+    };
+
+    // log-linear (HDR-style) buckets: 8 sub-buckets per power of two,
+    // i.e. ~12.5% relative error, values are nanoseconds up to ~68 seconds
+    static const int HISTOGRAM_SUB_BUCKET_BITS = 3;
+    static const int HISTOGRAM_SUB_BUCKETS = (1 << HISTOGRAM_SUB_BUCKET_BITS);
+    static const int HISTOGRAM_MAX_VALUE_BITS = 36;
+    static const int HISTOGRAM_BUCKETS =
+        (HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+    struct HistogramSnapshot
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+
+        /// value at the given quantile (0.0 - 1.0) in nanoseconds
+        uint64_t percentile(double quantile) const;
+
+        double mean() const {
+            return count ? ((double)sum / count) : 0.0;
+        }
+    };
+
+    // NOTE: about 83 KB, allocate it on the heap (secondary threads on iOS have 512 KiB of stack)
+    struct Snapshot
+    {
+        uint64_t counters[COUNTER_MAX];
+        int64_t gauges[GAUGE_MAX];
+        HistogramSnapshot histograms[HISTOGRAM_MAX];
+    };
+
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(XMPPMetrics& metrics_, Histogram histogram_)
+            : metrics(metrics_), histogram(histogram_), start(XMPPClock::now()) {
+        }
+
+        ~ScopedTimer() {
+            metrics.record(histogram, XMPPClock::now() - start);
+        }
+
+    private:
+        XMPPMetrics& metrics;
+        Histogram histogram;
+        uint64_t start;
+
+    private:
+        ScopedTimer();
+        ScopedTimer(const ScopedTimer&);
+        const ScopedTimer& operator=(const ScopedTimer&);
+    };
+
+public:
+    explicit XMPPMetrics();
+
+    ~XMPPMetrics();
+
+    void increment(Counter counter, uint64_t value = 1) {
+        __sync_fetch_and_add(&counters[counter], value);
+    }
+
+    uint64_t get(Counter counter) const {
+        return __sync_fetch_and_add(const_cast<uint64_t*>(&counters[counter]), 0);
+    }
+
+    void setGauge(Gauge gauge, int64_t value);
+
+    void record(Histogram histogram, uint64_t nanoseconds);
+
+    void snapshot(Snapshot *snapshot) const;
+
+    void reset();
+
+    /// Prometheus text exposition format (version 0.0.4)
+    string formatPrometheus(const string& labels = "") const;
+
+    /// name="value", value escaped, for the labels of formatPrometheus() and the exports
+    static string formatLabel(const string& name, const string& value);
+
+    /// one document for several metrics, each series with the labels of its metrics
+    static string formatPrometheus(const XMPPMetrics *const *metrics, const string *labels, size_t count);
+
+    /// writes formatPrometheus() to a file (replaced atomically) or, when
+    /// prefixed with "unix:", to a local stream socket given up on after 100 milliseconds
+    bool exportPrometheus(const string& target, const string& labels = "") const;
+
+    /// exports the metrics with the others attached to the same target, as one
+    /// document, every interval milliseconds (the shortest one of the target)
+    /// from a process-wide thread until detached; labels tell them apart
+    void attachExport(const string& target, int interval, const string& labels);
+
+    /// waits for an export reading the metrics to finish
+    void detachExport(const string& target);
+
+    static const char* counterName(Counter counter);
+    static const char* gaugeName(Gauge gauge);
+    static const char* histogramName(Histogram histogram);
+
+    static int bucketIndex(uint64_t value);
+    static uint64_t bucketUpperBound(int index);
+
+private:
+    struct HistogramData
+    {
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+    };
+
+    uint64_t counters[COUNTER_MAX];
+    int64_t gauges[GAUGE_MAX];
+    HistogramData *histograms[HISTOGRAM_MAX];  // allocated on the first record()
+
+    HistogramData* getHistogram(Histogram histogram);
+    void snapshot(Histogram histogram, HistogramSnapshot *snapshot) const;
+
+private:
+    XMPPMetrics(const XMPPMetrics&);
+    const XMPPMetrics& operator=(const XMPPMetrics&);
+};
+
+#endif // XMPP_METRICS_INCLUDED
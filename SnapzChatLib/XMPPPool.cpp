@@ -0,0 +1,108 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPPool.hpp"
+
+#include <new>
+#include <cstdlib>
+
+static volatile size_t g_total_in_use = 0;
+static volatile size_t g_total_capacity = 0;
+
+XMPPPool::XMPPPool(size_t object_size_)
+    : object_size(object_size_), free_list(0),
+      in_use(0), capacity(0)
+{
+    // NOTE: room for the free list link, and keep every object aligned
+    if(object_size < sizeof(FreeObject)) {
+        object_size = sizeof(FreeObject);
+    }
+    object_size = (object_size + 15) & ~(size_t)15;
+
+    ::pthread_mutex_init(&lock, 0);
+}
+
+void* XMPPPool::allocate(size_t size)
+{
+    if(size > object_size) {
+        return ::operator new(size);
+    }
+
+    ::pthread_mutex_lock(&lock);
+
+    if(!free_list) {
+        char *slab = static_cast<char*>(::malloc(object_size * SLAB_OBJECTS));
+        if(!slab) {
+            ::pthread_mutex_unlock(&lock);
+            throw std::bad_alloc();
+        }
+
+        for(size_t i = SLAB_OBJECTS; i-- > 0;) {
+            FreeObject *object = reinterpret_cast<FreeObject*>(slab + i * object_size);
+            object->next = free_list;
+            free_list = object;
+        }
+
+        capacity += SLAB_OBJECTS;
+        __sync_fetch_and_add(&g_total_capacity, SLAB_OBJECTS);
+    }
+
+    FreeObject *object = free_list;
+    free_list = object->next;
+    ++in_use;
+
+    ::pthread_mutex_unlock(&lock);
+
+    __sync_fetch_and_add(&g_total_in_use, 1);
+    return object;
+}
+
+void XMPPPool::release(void *data, size_t size)
+{
+    if(!data) {
+        return;
+    }
+
+    if(size > object_size) {
+        ::operator delete(data);
+        return;
+    }
+
+    ::pthread_mutex_lock(&lock);
+
+    FreeObject *object = static_cast<FreeObject*>(data);
+    object->next = free_list;
+    free_list = object;
+    --in_use;
+
+    ::pthread_mutex_unlock(&lock);
+
+    __sync_fetch_and_sub(&g_total_in_use, 1);
+}
+
+size_t XMPPPool::getInUse() const
+{
+    ::pthread_mutex_lock(&lock);
+    size_t result = in_use;
+    ::pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+size_t XMPPPool::getCapacity() const
+{
+    ::pthread_mutex_lock(&lock);
+    size_t result = capacity;
+    ::pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+size_t XMPPPool::getTotalInUse()
+{
+    return __sync_fetch_and_add(&g_total_in_use, 0);
+}
+
+size_t XMPPPool::getTotalCapacity()
+{
+    return __sync_fetch_and_add(&g_total_capacity, 0);
+}
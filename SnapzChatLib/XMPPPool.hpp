@@ -0,0 +1,75 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_POOL_INCLUDED
+#define XMPP_POOL_INCLUDED
+
+#include <cstddef>
+#include <pthread.h>
+
+// Fixed-size object pool: objects are carved from slabs of SLAB_OBJECTS and
+// recycled through a free list, slabs are kept for the life of the process.
+// Requests of another size (a derived class) go to the global operator new.
+// NOTE: thread safe, sessions are created from the owner and event loop threads
+class XMPPPool
+{
+public:
+    static const size_t SLAB_OBJECTS = 64;
+
+public:
+    explicit XMPPPool(size_t object_size);
+
+    void* allocate(size_t size);
+    void release(void *data, size_t size);
+
+    /// objects handed out
+    size_t getInUse() const;
+
+    /// objects in the slabs, used or not
+    size_t getCapacity() const;
+
+    /// sums over all pools of the process
+    static size_t getTotalInUse();
+    static size_t getTotalCapacity();
+
+private:
+    struct FreeObject
+    {
+        FreeObject *next;
+    };
+
+    size_t object_size;
+    FreeObject *free_list;
+
+    size_t in_use;
+    size_t capacity;
+
+    mutable pthread_mutex_t lock;
+
+private:
+    XMPPPool();
+    XMPPPool(const XMPPPool&);
+    const XMPPPool& operator=(const XMPPPool&);
+};
+
+// Base class routing new/delete of T through a process-wide XMPPPool, e.g.
+//   class ChatSession : public XMPPPooled<ChatSession> { ... };
+// NOTE: works for objects deleted through a base class with a virtual destructor
+template <class T>
+class XMPPPooled
+{
+public:
+    static void* operator new(size_t size) {
+        return getPool().allocate(size);
+    }
+
+    static void operator delete(void *data, size_t size) {
+        getPool().release(data, size);
+    }
+
+    static XMPPPool& getPool() {
+        static XMPPPool pool(sizeof(T));
+        return pool;
+    }
+};
+
+#endif // XMPP_POOL_INCLUDED
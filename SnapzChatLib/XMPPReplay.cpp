@@ -0,0 +1,233 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPReplay.hpp"
+#include "XMPPClock.hpp"
+
+#include <unistd.h>
+
+// recorded results are handed over unchanged if the client does not send
+// the matching request within this time (e.g. roster or disco answers)
+static const uint64_t RESULT_WAIT_TIMEOUT = 100000000ULL;  // nanoseconds
+
+/// attribute of the tag starting at pos, empty string if missing
+static string g_tag_attribute(const string& data, size_t pos, const string& name, size_t *value_pos = 0)
+{
+    size_t end = data.find('>', pos);
+    if(end == string::npos) {
+        return "";
+    }
+
+    string key = " " + name + "=";
+    size_t found = data.find(key, pos);
+    if(found == string::npos || found > end) {
+        return "";
+    }
+
+    size_t begin = found + key.size();
+    char quote = data[begin];
+    size_t close = data.find(quote, begin + 1);
+    if(close == string::npos || close > end) {
+        return "";
+    }
+
+    if(value_pos) {
+        *value_pos = begin + 1;
+    }
+    return data.substr(begin + 1, close - begin - 1);
+}
+
+XMPPReplayConnection::XMPPReplayConnection(ConnectionDataHandler *handler, const string& path,
+                                           bool realtime_, int connection)
+    : ConnectionBase(handler),
+      position(0), realtime(realtime_),
+      start(0), wait_start(0),
+      total_in(0), total_out(0)
+{
+    XMPPCapture capture;
+    if(!capture.open(path)) {
+        return;
+    }
+
+    int current = -1;
+    bool is_encrypted = false;
+
+    XMPPCapture::Chunk chunk;
+    while(capture.read(chunk)) {
+        if(chunk.flags & XMPPCapture::FLAG_CONNECT) {
+            ++current;
+            continue;
+        }
+
+        if(current != connection) {
+            continue;
+        }
+
+        // NOTE: the plain-text part before STARTTLS cannot be replayed without TLS
+        if((chunk.flags & XMPPCapture::FLAG_ENCRYPTED) && !is_encrypted) {
+            is_encrypted = true;
+            chunks.clear();
+        }
+
+        chunks.push_back(chunk);
+    }
+}
+
+XMPPReplayConnection::XMPPReplayConnection(const XMPPReplayConnection& connection, ConnectionDataHandler *handler)
+    : ConnectionBase(handler),
+      chunks(connection.chunks),
+      position(0), realtime(connection.realtime),
+      start(0), wait_start(0),
+      total_in(0), total_out(0)
+{
+}
+
+XMPPReplayConnection::~XMPPReplayConnection()
+{
+}
+
+ConnectionError XMPPReplayConnection::connect()
+{
+    if(chunks.empty()) {
+        return ConnConnectionRefused;
+    }
+
+    position = 0;
+    start = XMPPClock::now();
+    wait_start = 0;
+    iq_ids.clear();
+
+    m_state = StateConnected;
+    m_handler->handleConnect(this);
+
+    return ConnNoError;
+}
+
+ConnectionError XMPPReplayConnection::recv(int timeout /* microseconds */)
+{
+    if(m_state != StateConnected) {
+        return ConnNotConnected;
+    }
+
+    if(isFinished()) {
+        // nothing more will ever arrive
+        if(timeout > 0) {
+            ::usleep(timeout);
+        }
+        return ConnNoError;
+    }
+
+    XMPPCapture::Chunk& chunk = chunks[position];
+
+    if(realtime) {
+        uint64_t offset = chunk.timestamp - chunks[0].timestamp;
+        uint64_t now = XMPPClock::now() - start;
+
+        if(now < offset) {
+            uint64_t wait = (offset - now) / 1000;
+            if(timeout >= 0 && wait > (uint64_t)timeout) {
+                wait = timeout;
+            }
+            ::usleep((useconds_t)wait);
+            return ConnNoError;
+        }
+    }
+
+    string data = chunk.data;
+    if(!rewriteResultIds(data)) {
+        // give the client a chance to send its request first
+        return ConnNoError;
+    }
+
+    ++position;
+    total_in += data.size();
+    m_handler->handleReceivedData(this, data);
+
+    return ConnNoError;
+}
+
+bool XMPPReplayConnection::rewriteResultIds(string& data)
+{
+    vector<size_t> results;
+
+    for(size_t pos = data.find("<iq"); pos != string::npos; pos = data.find("<iq", pos + 3)) {
+        const string type = g_tag_attribute(data, pos, "type");
+        if(type == "result" || type == "error") {
+            results.push_back(pos);
+        }
+    }
+
+    if(results.empty()) {
+        return true;
+    }
+
+    if(iq_ids.size() < results.size()) {
+        uint64_t now = XMPPClock::now();
+        if(wait_start == 0) {
+            wait_start = now;
+        }
+        if(now - wait_start < RESULT_WAIT_TIMEOUT) {
+            return false;
+        }
+    }
+    wait_start = 0;
+
+    // from the end, so that earlier positions stay valid
+    size_t count = (iq_ids.size() < results.size()) ? iq_ids.size() : results.size();
+    for(size_t i = count; i-- > 0;) {
+        size_t value_pos = string::npos;
+        const string id = g_tag_attribute(data, results[i], "id", &value_pos);
+
+        if(value_pos != string::npos) {
+            data.replace(value_pos, id.size(), iq_ids[i]);
+        }
+    }
+    iq_ids.erase(iq_ids.begin(), iq_ids.begin() + count);
+
+    return true;
+}
+
+bool XMPPReplayConnection::send(const std::string& data)
+{
+    if(m_state != StateConnected) {
+        return false;
+    }
+
+    total_out += data.size();
+
+    // remember the ids of the requests, the recorded results answer them
+    for(size_t pos = data.find("<iq"); pos != string::npos; pos = data.find("<iq", pos + 3)) {
+        const string type = g_tag_attribute(data, pos, "type");
+        if(type == "get" || type == "set") {
+            iq_ids.push_back(g_tag_attribute(data, pos, "id"));
+        }
+    }
+
+    return true;
+}
+
+ConnectionError XMPPReplayConnection::receive()
+{
+    ConnectionError error = ConnNoError;
+
+    while(error == ConnNoError && !isFinished()) {
+        error = recv(-1);
+    }
+
+    return error;
+}
+
+void XMPPReplayConnection::disconnect()
+{
+    m_state = StateDisconnected;
+}
+
+void XMPPReplayConnection::getStatistics(long int& total_in_, long int& total_out_)
+{
+    total_in_ = total_in;
+    total_out_ = total_out;
+}
+
+ConnectionBase* XMPPReplayConnection::newInstance() const
+{
+    return new XMPPReplayConnection(*this, m_handler);
+}
@@ -0,0 +1,79 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_REPLAY_INCLUDED
+#define XMPP_REPLAY_INCLUDED
+
+#include "XMPPCapture.hpp"
+
+#include <gloox/connectionbase.h>
+
+#include <vector>
+#include <deque>
+
+using namespace std;
+using namespace gloox;
+
+// Fake connection feeding an XMPPCapture recording to a gloox::Client, installed
+// with setConnectionImpl() before connecting (TLS must be disabled on the client).
+//
+// Only the chunks received over TLS are replayed when the recording has any, and
+// the ids of inbound iq results are rewritten to the ids of the iq requests the
+// client sent, in order, so that resource binding and session establishment
+// complete against the recorded answers.
+class XMPPReplayConnection : public ConnectionBase
+{
+public:
+    /// loads one connection (0 = first) of the recording into memory
+    explicit XMPPReplayConnection(ConnectionDataHandler *handler, const string& path,
+                                  bool realtime = false, int connection = 0);
+
+    virtual ~XMPPReplayConnection();
+
+    /// true if the recording could be read and has data for the connection
+    bool isValid() const {
+        return !chunks.empty();
+    }
+
+    /// true when all chunks were handed to the client
+    bool isFinished() const {
+        return position >= chunks.size();
+    }
+
+    size_t getChunks() const {
+        return chunks.size();
+    }
+
+public:
+    // ConnectionBase
+    virtual ConnectionError connect();
+    virtual ConnectionError recv(int timeout = -1);
+    virtual bool send(const std::string& data);
+    virtual ConnectionError receive();
+    virtual void disconnect();
+    virtual void getStatistics(long int& total_in, long int& total_out);
+    virtual ConnectionBase* newInstance() const;
+
+private:
+    explicit XMPPReplayConnection(const XMPPReplayConnection& connection, ConnectionDataHandler *handler);
+
+    bool rewriteResultIds(string& data);
+
+private:
+    vector<XMPPCapture::Chunk> chunks;
+    size_t position;
+    bool realtime;
+
+    uint64_t start;          // XMPPClock::now() at connect()
+    uint64_t wait_start;     // XMPPClock::now() since waiting for iq requests, 0 if not waiting
+
+    deque<string> iq_ids;    // sent iq requests waiting for a recorded result
+
+    long int total_in;
+    long int total_out;
+
+private:
+    XMPPReplayConnection();
+    const XMPPReplayConnection& operator=(const XMPPReplayConnection&);
+};
+
+#endif // XMPP_REPLAY_INCLUDED
@@ -0,0 +1,186 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPRoster.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+static const char MAGIC[] = "XMPPROS1";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+// NOTE: a longer string or list means a corrupt file
+static const uint32_t MAX_STRING_SIZE = 1024 * 1024;
+static const uint32_t MAX_COUNT = 16 * 1024 * 1024;
+
+static bool g_write_uint32(FILE *file, uint32_t value)
+{
+    return ::fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool g_write_string(FILE *file, const string& value)
+{
+    return g_write_uint32(file, (uint32_t)value.size())
+        && ::fwrite(value.data(), 1, value.size(), file) == value.size();
+}
+
+static bool g_read_uint32(FILE *file, uint32_t *value)
+{
+    return ::fread(value, sizeof(*value), 1, file) == 1;
+}
+
+static bool g_read_string(FILE *file, string *value)
+{
+    uint32_t size;
+    if(!g_read_uint32(file, &size) || size > MAX_STRING_SIZE) {
+        return false;
+    }
+
+    value->resize(size);
+    return size == 0 || ::fread(&(*value)[0], 1, size, file) == size;
+}
+
+/// XMPPRoster::Item
+XMPPRoster::Item::Item()
+    : is_pending(false)
+{
+}
+
+bool XMPPRoster::Item::operator==(const Item& item) const
+{
+    return jid == item.jid && name == item.name && subscription == item.subscription
+        && is_pending == item.is_pending && groups == item.groups;
+}
+
+/// XMPPRoster
+XMPPRoster::XMPPRoster()
+{
+}
+
+bool XMPPRoster::load(const string& path)
+{
+    clear();
+
+    FILE *file = ::fopen(path.c_str(), "rb");
+    if(!file) {
+        return false;
+    }
+
+    char magic[MAGIC_SIZE];
+    uint32_t count = 0;
+
+    bool status = ::fread(magic, 1, MAGIC_SIZE, file) == MAGIC_SIZE
+        && ::memcmp(magic, MAGIC, MAGIC_SIZE) == 0
+        && g_read_string(file, &version)
+        && g_read_uint32(file, &count)
+        && count <= MAX_COUNT;
+
+    if(status) {
+        items.reserve(count);
+    }
+
+    Item item;
+    for(uint32_t i = 0; status && i < count; ++i) {
+        uint8_t is_pending = 0;
+        uint32_t groups = 0;
+
+        status = g_read_string(file, &item.jid)
+            && g_read_string(file, &item.name)
+            && g_read_string(file, &item.subscription)
+            && ::fread(&is_pending, sizeof(is_pending), 1, file) == 1
+            && g_read_uint32(file, &groups)
+            && groups <= MAX_COUNT;
+
+        item.is_pending = (is_pending != 0);
+        item.groups.resize(status ? groups : 0);
+
+        for(uint32_t j = 0; status && j < groups; ++j) {
+            status = g_read_string(file, &item.groups[j]);
+        }
+
+        if(status) {
+            items[item.jid] = item;
+        }
+    }
+
+    ::fclose(file);
+
+    // NOTE: a partial roster with its version would never be completed by the server
+    if(!status) {
+        clear();
+    }
+
+    return status;
+}
+
+bool XMPPRoster::save(const string& path) const
+{
+    const string& tmp_path = path + ".tmp";
+
+    FILE *file = ::fopen(tmp_path.c_str(), "wb");
+    if(!file) {
+        return false;
+    }
+
+    bool status = ::fwrite(MAGIC, 1, MAGIC_SIZE, file) == MAGIC_SIZE
+        && g_write_string(file, version)
+        && g_write_uint32(file, (uint32_t)items.size());
+
+    for(Items::const_iterator it = items.begin(); status && it != items.end(); ++it) {
+        const Item& item = it->second;
+        uint8_t is_pending = item.is_pending ? 1 : 0;
+
+        status = g_write_string(file, item.jid)
+            && g_write_string(file, item.name)
+            && g_write_string(file, item.subscription)
+            && ::fwrite(&is_pending, sizeof(is_pending), 1, file) == 1
+            && g_write_uint32(file, (uint32_t)item.groups.size());
+
+        for(vector<string>::const_iterator group = item.groups.begin(); status && group != item.groups.end(); ++group) {
+            status = g_write_string(file, *group);
+        }
+    }
+
+    status = (::fclose(file) == 0) && status;
+
+    if(status) {
+        status = (::rename(tmp_path.c_str(), path.c_str()) == 0);
+    }
+    if(!status) {
+        ::unlink(tmp_path.c_str());
+    }
+
+    return status;
+}
+
+void XMPPRoster::clear()
+{
+    version.clear();
+    items.clear();
+}
+
+const XMPPRoster::Item* XMPPRoster::find(const string& jid) const
+{
+    Items::const_iterator it = items.find(jid);
+    return (it != items.end()) ? &it->second : 0;
+}
+
+bool XMPPRoster::update(const Item& item)
+{
+    pair<Items::iterator, bool> result = items.insert(make_pair(item.jid, item));
+    if(result.second) {
+        return true;
+    }
+
+    if(result.first->second == item) {
+        return false;
+    }
+
+    result.first->second = item;
+    return true;
+}
+
+bool XMPPRoster::remove(const string& jid)
+{
+    return items.erase(jid) != 0;
+}
@@ -0,0 +1,85 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_ROSTER_INCLUDED
+#define XMPP_ROSTER_INCLUDED
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+// Local copy of the roster with its XEP-0237 version, indexed by bare JID.
+// The file is a sequence of length-prefixed strings:
+//   "XMPPROS1", version, uint32 count, then per item:
+//   jid, name, subscription, uint8 pending, uint32 groups, groups
+// NOTE: not thread safe, integers are written in host byte order
+class XMPPRoster
+{
+public:
+    struct Item
+    {
+        explicit Item();
+
+        string jid;           // bare JID
+        string name;          // empty string if none
+        string subscription;  // "none", "to", "from" or "both"
+        bool is_pending;      // ask='subscribe', our subscription request is not answered yet
+        vector<string> groups;
+
+        bool operator==(const Item& item) const;
+        bool operator!=(const Item& item) const {
+            return !(*this == item);
+        }
+    };
+
+    typedef unordered_map<string, Item> Items;
+
+public:
+    explicit XMPPRoster();
+
+    /// replaces the roster with the file's, false (and an empty roster) if it is missing or truncated
+    bool load(const string& path);
+
+    /// writes a temporary file renamed over path, so a crash never leaves a partial roster
+    bool save(const string& path) const;
+
+    void clear();
+
+    /// version of the roster as last received, empty string if the server gave none
+    const string& getVersion() const {
+        return version;
+    }
+
+    void setVersion(const string& version_) {
+        version = version_;
+    }
+
+    /// 0 if the JID is not in the roster
+    const Item* find(const string& jid) const;
+
+    /// adds or replaces the item, false if it is unchanged
+    bool update(const Item& item);
+
+    /// false if the JID is not in the roster
+    bool remove(const string& jid);
+
+    size_t size() const {
+        return items.size();
+    }
+
+    const Items& getItems() const {
+        return items;
+    }
+
+private:
+    string version;
+    Items items;
+
+private:
+    XMPPRoster(const XMPPRoster&);
+    const XMPPRoster& operator=(const XMPPRoster&);
+};
+
+#endif // XMPP_ROSTER_INCLUDED
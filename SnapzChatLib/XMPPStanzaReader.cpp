@@ -0,0 +1,754 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPStanzaReader.hpp"
+
+#include <gloox/gloox.h>
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace gloox;
+
+/// first of the characters a, b or c, 0 if none
+static const char* g_find_any(const char *data, const char *end, char a, char b, char c)
+{
+    // NOTE: tags are mostly long runs of attribute text, check 16 bytes at once
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+
+    for(; data + 16 <= end; data += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, vb), _mm_cmpeq_epi8(chunk, vc)));
+
+        int mask = _mm_movemask_epi8(match);
+        if(mask) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t va = vdupq_n_u8(a);
+    const uint8x16_t vb = vdupq_n_u8(b);
+    const uint8x16_t vc = vdupq_n_u8(c);
+
+    for(; data + 16 <= end; data += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data));
+        uint8x16_t match = vorrq_u8(vceqq_u8(chunk, va), vorrq_u8(vceqq_u8(chunk, vb), vceqq_u8(chunk, vc)));
+
+        if(vmaxvq_u8(match)) {
+            break;
+        }
+    }
+#endif
+
+    for(; data < end; ++data) {
+        if(*data == a || *data == b || *data == c) {
+            return data;
+        }
+    }
+    return 0;
+}
+
+/// first occurrence of sequence, 0 if none
+static const char* g_find_sequence(const char *data, const char *end, const char *sequence)
+{
+    size_t size = ::strlen(sequence);
+
+    while(data + size <= end) {
+        data = static_cast<const char*>(::memchr(data, sequence[0], end - data));
+        if(!data || data + size > end) {
+            return 0;
+        }
+        if(::memcmp(data, sequence, size) == 0) {
+            return data;
+        }
+        ++data;
+    }
+    return 0;
+}
+
+/// end of the markup starting with '<' at data, 0 if incomplete
+static const char* g_markup_end(const char *data, const char *end)
+{
+    size_t size = end - data;
+    if(size < 2) {
+        return 0;
+    }
+
+    if(data[1] == '!') {
+        if(size < 9) {
+            return 0;
+        }
+
+        const char *close;
+        if(::memcmp(data, "<!--", 4) == 0) {
+            close = g_find_sequence(data + 4, end, "-->");
+            return close ? (close + 3) : 0;
+        }
+        if(::memcmp(data, "<![CDATA[", 9) == 0) {
+            close = g_find_sequence(data + 9, end, "]]>");
+            return close ? (close + 3) : 0;
+        }
+    }
+    else if(data[1] == '?') {
+        const char *close = g_find_sequence(data + 2, end, "?>");
+        return close ? (close + 2) : 0;
+    }
+
+    // '>' outside of quoted attribute values
+    for(const char *p = data + 1; p < end;) {
+        p = g_find_any(p, end, '>', '\'', '"');
+        if(!p) {
+            return 0;
+        }
+        if(*p == '>') {
+            return p + 1;
+        }
+
+        const char *quote = static_cast<const char*>(::memchr(p + 1, *p, end - p - 1));
+        if(!quote) {
+            return 0;
+        }
+        p = quote + 1;
+    }
+    return 0;
+}
+
+static inline bool g_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static size_t g_name_size(const char *name, const char *end)
+{
+    const char *p = name;
+    while(p < end && !g_is_space(*p) && *p != '/' && *p != '>') {
+        ++p;
+    }
+    return p - name;
+}
+
+static inline bool g_equals(const char *data, size_t size, const char *literal)
+{
+    return ::strlen(literal) == size && ::memcmp(data, literal, size) == 0;
+}
+
+static char* g_write_utf8(char *out, unsigned long code)
+{
+    if(code < 0x80) {
+        *out++ = (char)code;
+    }
+    else if(code < 0x800) {
+        *out++ = (char)(0xc0 | (code >> 6));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    }
+    else if(code < 0x10000) {
+        *out++ = (char)(0xe0 | (code >> 12));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    }
+    else {
+        *out++ = (char)(0xf0 | (code >> 18));
+        *out++ = (char)(0x80 | ((code >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    }
+    return out;
+}
+
+// the code point of "123" or "x7b" after "&#", 0 unless only digits follow
+// and the code point is a character (no NUL, no surrogate, at most 0x10ffff)
+static unsigned long g_character_reference(const char *digits, size_t size)
+{
+    unsigned long base = 10;
+    if(digits[0] == 'x') {
+        base = 16;
+        ++digits;
+        --size;
+    }
+    if(size == 0) {
+        return 0;
+    }
+
+    // at most 8 digits fit the entity, no overflow
+    unsigned long code = 0;
+    for(size_t i = 0; i < size; ++i) {
+        char c = digits[i];
+        unsigned long digit;
+        if(c >= '0' && c <= '9') {
+            digit = c - '0';
+        }
+        else if(base == 16 && c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        }
+        else if(base == 16 && c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        }
+        else {
+            return 0;
+        }
+        code = code * base + digit;
+    }
+
+    if(code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) {
+        return 0;
+    }
+    return code;
+}
+
+/// writes data with entities replaced to out (never longer than data),
+/// returns the end of the output, 0 on an unknown entity
+static char* g_unescape(char *out, const char *data, size_t size)
+{
+    const char *end = data + size;
+
+    for(;;) {
+        const char *amp = static_cast<const char*>(::memchr(data, '&', end - data));
+        if(!amp) {
+            ::memcpy(out, data, end - data);
+            return out + (end - data);
+        }
+        ::memcpy(out, data, amp - data);
+        out += amp - data;
+
+        const char *semicolon = static_cast<const char*>(::memchr(amp, ';', end - amp));
+        if(!semicolon || semicolon - amp > 10) {
+            return 0;
+        }
+
+        const char *entity = amp + 1;
+        size_t entity_size = semicolon - entity;
+
+        if(g_equals(entity, entity_size, "amp")) {
+            *out++ = '&';
+        }
+        else if(g_equals(entity, entity_size, "lt")) {
+            *out++ = '<';
+        }
+        else if(g_equals(entity, entity_size, "gt")) {
+            *out++ = '>';
+        }
+        else if(g_equals(entity, entity_size, "apos")) {
+            *out++ = '\'';
+        }
+        else if(g_equals(entity, entity_size, "quot")) {
+            *out++ = '"';
+        }
+        else if(entity_size > 1 && entity[0] == '#') {
+            unsigned long code = g_character_reference(entity + 1, entity_size - 1);
+            if(code == 0) {
+                return 0;
+            }
+            out = g_write_utf8(out, code);
+        }
+        else {
+            return 0;
+        }
+
+        data = semicolon + 1;
+    }
+}
+
+// one attribute of a start tag: 1 if read, 0 at the end of the tag, -1 on error
+static int g_next_attribute(const char*& p, const char *end,
+                            const char*& name, size_t& name_size, const char*& value, size_t& value_size)
+{
+    while(p < end && g_is_space(*p)) {
+        ++p;
+    }
+    if(p >= end) {
+        return -1;
+    }
+    if(*p == '/' || *p == '>') {
+        return 0;
+    }
+
+    name = p;
+    while(p < end && *p != '=' && !g_is_space(*p)) {
+        ++p;
+    }
+    name_size = p - name;
+
+    while(p < end && g_is_space(*p)) {
+        ++p;
+    }
+    if(p >= end || *p != '=') {
+        return -1;
+    }
+    ++p;
+    while(p < end && g_is_space(*p)) {
+        ++p;
+    }
+    if(p >= end || (*p != '\'' && *p != '"')) {
+        return -1;
+    }
+
+    const char *quote = static_cast<const char*>(::memchr(p + 1, *p, end - p - 1));
+    if(!quote) {
+        return -1;
+    }
+
+    value = p + 1;
+    value_size = quote - value;
+    p = quote + 1;
+    return 1;
+}
+
+/// reads the end of a start tag: 1 for '>', 0 for '/>', -1 on error
+static int g_start_tag_end(const char*& p, const char *end)
+{
+    if(p < end && *p == '>') {
+        ++p;
+        return 1;
+    }
+    if(p + 1 < end && p[0] == '/' && p[1] == '>') {
+        p += 2;
+        return 0;
+    }
+    return -1;
+}
+
+/// reads an end tag for name
+static bool g_end_tag(const char*& p, const char *end, const char *name, size_t name_size)
+{
+    if(end - p < (ptrdiff_t)(name_size + 3) || p[0] != '<' || p[1] != '/' ||
+       ::memcmp(p + 2, name, name_size) != 0) {
+        return false;
+    }
+
+    p += 2 + name_size;
+    while(p < end && g_is_space(*p)) {
+        ++p;
+    }
+    if(p >= end || *p != '>') {
+        return false;
+    }
+    ++p;
+    return true;
+}
+
+static const XMPPStanzaReader::Text EMPTY_TEXT = {"", 0};
+
+/// XMPPStanzaReader
+XMPPStanzaReader::XMPPStanzaReader(DataHandler *data_handler_, MessageHandler *message_handler_,
+                                   XMPPArena *arena_)
+    : data_handler(data_handler_), message_handler(message_handler_), arena(arena_),
+      forwarded(0), position(0), depth(0),
+      element_begin(string::npos), is_candidate(false),
+      handled_messages(0)
+{
+}
+
+XMPPStanzaReader::~XMPPStanzaReader()
+{
+    freeTexts();
+}
+
+void XMPPStanzaReader::reset()
+{
+    buffer.clear();
+    forwarded = 0;
+    position = 0;
+    depth = 0;
+    element_begin = string::npos;
+    is_candidate = false;
+    handled_messages = 0;
+
+    freeTexts();
+}
+
+void XMPPStanzaReader::feed(const string& data)
+{
+    buffer.append(data);
+    forwarded = 0;
+
+    // NOTE: buffer is not modified until the end of feed()
+    const char *base = buffer.data();
+    const char *end = base + buffer.size();
+
+    while(position < buffer.size()) {
+        const char *p = base + position;
+
+        if(*p != '<') {
+            // text, only whitespace between stanzas
+            const char *lt = static_cast<const char*>(::memchr(p, '<', end - p));
+            position = lt ? (lt - base) : buffer.size();
+            continue;
+        }
+
+        const char *markup_end = g_markup_end(p, end);
+        if(!markup_end) {
+            break;
+        }
+
+        size_t markup_begin = position;
+        position = markup_end - base;
+
+        if(p[1] == '!' || p[1] == '?') {
+            // comments, CDATA sections, processing instructions
+            continue;
+        }
+
+        if(p[1] == '/') {
+            if(--depth == 1 && element_begin != string::npos) {
+                handleElement(element_begin, position);
+                element_begin = string::npos;
+            }
+            else if(depth < 0) {
+                depth = 0;
+            }
+            continue;
+        }
+
+        const char *name = p + 1;
+        size_t name_size = g_name_size(name, end);
+        bool is_empty = (markup_end[-2] == '/');
+
+        if(g_equals(name, name_size, "stream:stream")) {
+            // stream (re)start, after STARTTLS, SASL or compression
+            depth = 1;
+            element_begin = string::npos;
+            continue;
+        }
+
+        if(depth <= 1) {
+            element_begin = markup_begin;
+            is_candidate = g_equals(name, name_size, "message");
+
+            if(is_empty) {
+                handleElement(element_begin, position);
+                element_begin = string::npos;
+            }
+            else {
+                depth = 2;
+            }
+        }
+        else if(!is_empty) {
+            ++depth;
+        }
+    }
+
+    // keep a partial message, everything else can go to the parser already
+    size_t keep = position;
+    if(element_begin != string::npos && is_candidate) {
+        keep = element_begin;
+    }
+    forward(keep);
+
+    buffer.erase(0, keep);
+    position -= keep;
+    if(element_begin != string::npos) {
+        element_begin = (element_begin >= keep) ? (element_begin - keep) : 0;
+    }
+    forwarded = 0;
+}
+
+void XMPPStanzaReader::forward(size_t end)
+{
+    if(end <= forwarded) {
+        return;
+    }
+
+    if(forwarded == 0 && end == buffer.size()) {
+        data_handler->handleStreamData(buffer);
+    }
+    else {
+        scratch.assign(buffer, forwarded, end - forwarded);
+        data_handler->handleStreamData(scratch);
+    }
+    forwarded = end;
+}
+
+void XMPPStanzaReader::freeTexts()
+{
+    for(size_t i = 0; i < texts.size(); ++i) {
+        delete[] texts[i];
+    }
+    texts.clear();
+}
+
+void XMPPStanzaReader::handleElement(size_t begin, size_t end)
+{
+    if(!is_candidate || !message_handler) {
+        return;
+    }
+
+    if(!parseMessage(buffer.data() + begin, end - begin)) {
+        freeTexts();
+        return;
+    }
+
+    // keep the stream order: what came before goes to the parser first
+    forward(begin);
+
+    if(message_handler->handleMessage(message)) {
+        forwarded = end;
+        ++handled_messages;
+    }
+    freeTexts();
+}
+
+bool XMPPStanzaReader::readText(const char *data, size_t size, Text& text)
+{
+    if(!::memchr(data, '&', size)) {
+        text.data = data;
+        text.size = size;
+        return true;
+    }
+
+    char *out;
+    if(arena) {
+        out = static_cast<char*>(arena->allocate(size));
+    }
+    else {
+        out = new char[size];
+        texts.push_back(out);
+    }
+
+    char *out_end = g_unescape(out, data, size);
+    if(!out_end) {
+        return false;
+    }
+
+    text.data = out;
+    text.size = out_end - out;
+    return true;
+}
+
+/// reads text content up to the end tag for name, text can be 0 to skip it
+bool XMPPStanzaReader::readTextContent(const char*& p, const char *end, const char *name, size_t name_size, Text *text)
+{
+    const char *lt = static_cast<const char*>(::memchr(p, '<', end - p));
+    if(!lt) {
+        return false;
+    }
+
+    if(text && !readText(p, lt - p, *text)) {
+        return false;
+    }
+
+    p = lt;
+    return g_end_tag(p, end, name, name_size);
+}
+
+bool XMPPStanzaReader::parseMessage(const char *data, size_t size)
+{
+    message.from = EMPTY_TEXT;
+    message.to = EMPTY_TEXT;
+    message.type = EMPTY_TEXT;
+    message.id = EMPTY_TEXT;
+    message.body = EMPTY_TEXT;
+    message.subject = EMPTY_TEXT;
+    message.thread = EMPTY_TEXT;
+    message.stamp = EMPTY_TEXT;
+    message.has_event = false;
+    message.events = 0;
+    message.event_id = EMPTY_TEXT;
+
+    const char *p = data + 8;  // "<message"
+    const char *end = data + size;
+
+    const char *name;
+    const char *value;
+    size_t name_size;
+    size_t value_size;
+    int retcode;
+
+    while((retcode = g_next_attribute(p, end, name, name_size, value, value_size)) > 0) {
+        Text *field = 0;
+
+        if(g_equals(name, name_size, "from")) {
+            field = &message.from;
+        }
+        else if(g_equals(name, name_size, "to")) {
+            field = &message.to;
+        }
+        else if(g_equals(name, name_size, "type")) {
+            field = &message.type;
+        }
+        else if(g_equals(name, name_size, "id")) {
+            field = &message.id;
+        }
+        else if(g_equals(name, name_size, "xmlns")) {
+            if(!g_equals(value, value_size, "jabber:client")) {
+                return false;
+            }
+            continue;
+        }
+        else if(!g_equals(name, name_size, "xml:lang")) {
+            return false;
+        }
+
+        if(field && !readText(value, value_size, *field)) {
+            return false;
+        }
+    }
+
+    if(retcode < 0 || (retcode = g_start_tag_end(p, end)) < 0) {
+        return false;
+    }
+    if(retcode == 0) {
+        // <message/>
+        return true;
+    }
+
+    enum {HAS_BODY = 1, HAS_SUBJECT = 2, HAS_THREAD = 4, HAS_DELAY = 8};
+    int children = 0;
+
+    for(;;) {
+        while(p < end && g_is_space(*p)) {
+            ++p;
+        }
+        if(p + 1 >= end || *p != '<' || p[1] == '!' || p[1] == '?') {
+            // text, comments and CDATA are left to the full parser
+            return false;
+        }
+
+        if(p[1] == '/') {
+            return g_end_tag(p, end, "message", 7);
+        }
+
+        const char *child = p + 1;
+        size_t child_size = g_name_size(child, end);
+        p = child + child_size;
+
+        Text xmlns = EMPTY_TEXT;
+        Text stamp = EMPTY_TEXT;
+        while((retcode = g_next_attribute(p, end, name, name_size, value, value_size)) > 0) {
+            if(g_equals(name, name_size, "xmlns")) {
+                xmlns.data = value;
+                xmlns.size = value_size;
+            }
+            else if(g_equals(name, name_size, "stamp")) {
+                stamp.data = value;
+                stamp.size = value_size;
+            }
+            else if(!g_equals(name, name_size, "from")) {
+                // xml:lang and anything else
+                return false;
+            }
+        }
+        if(retcode < 0 || (retcode = g_start_tag_end(p, end)) < 0) {
+            return false;
+        }
+        bool has_content = (retcode == 1);
+
+        int flag = 0;
+        Text *field = 0;
+
+        if(g_equals(child, child_size, "body")) {
+            flag = HAS_BODY;
+            field = &message.body;
+        }
+        else if(g_equals(child, child_size, "subject")) {
+            flag = HAS_SUBJECT;
+            field = &message.subject;
+        }
+        else if(g_equals(child, child_size, "thread")) {
+            flag = HAS_THREAD;
+            field = &message.thread;
+        }
+
+        if(field) {
+            if((children & flag) || !(xmlns.empty() || xmlns.equals("jabber:client")) || !stamp.empty()) {
+                return false;
+            }
+            children |= flag;
+
+            if(has_content && !readTextContent(p, end, child, child_size, field)) {
+                return false;
+            }
+            continue;
+        }
+
+        bool is_delay = g_equals(child, child_size, "delay") && xmlns.equals("urn:xmpp:delay");
+        bool is_x = g_equals(child, child_size, "x");
+
+        if(is_delay || (is_x && xmlns.equals("jabber:x:delay"))) {
+            if(children & HAS_DELAY) {
+                // gloox keeps the first one only
+                if(has_content && !readTextContent(p, end, child, child_size, 0)) {
+                    return false;
+                }
+                continue;
+            }
+            children |= HAS_DELAY;
+
+            if(!readText(stamp.data, stamp.size, message.stamp)) {
+                return false;
+            }
+            if(has_content && !readTextContent(p, end, child, child_size, 0)) {
+                return false;
+            }
+            continue;
+        }
+
+        if(!is_x || !xmlns.equals("jabber:x:event") || message.has_event) {
+            return false;
+        }
+
+        message.has_event = true;
+        if(!has_content) {
+            continue;
+        }
+
+        // <offline/> <delivered/> <displayed/> <composing/> <id/>
+        for(;;) {
+            while(p < end && g_is_space(*p)) {
+                ++p;
+            }
+            if(p + 1 >= end || *p != '<') {
+                return false;
+            }
+            if(p[1] == '/') {
+                if(!g_end_tag(p, end, "x", 1)) {
+                    return false;
+                }
+                break;
+            }
+
+            const char *event = p + 1;
+            size_t event_size = g_name_size(event, end);
+            p = event + event_size;
+
+            if(g_next_attribute(p, end, name, name_size, value, value_size) != 0 ||
+               (retcode = g_start_tag_end(p, end)) < 0) {
+                return false;
+            }
+
+            if(g_equals(event, event_size, "id")) {
+                if(retcode == 1 && !readTextContent(p, end, event, event_size, &message.event_id)) {
+                    return false;
+                }
+                continue;
+            }
+
+            if(g_equals(event, event_size, "offline")) {
+                message.events |= MessageEventOffline;
+            }
+            else if(g_equals(event, event_size, "delivered")) {
+                message.events |= MessageEventDelivered;
+            }
+            else if(g_equals(event, event_size, "displayed")) {
+                message.events |= MessageEventDisplayed;
+            }
+            else if(g_equals(event, event_size, "composing")) {
+                message.events |= MessageEventComposing;
+            }
+            else {
+                return false;
+            }
+
+            if(retcode == 1 && !g_end_tag(p, end, event, event_size)) {
+                return false;
+            }
+        }
+    }
+}
@@ -0,0 +1,137 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_STANZA_READER_INCLUDED
+#define XMPP_STANZA_READER_INCLUDED
+
+#include "XMPPArena.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+// Pre-parser sitting in front of the gloox XML parser: it splits the inbound
+// stream into top-level elements and hands plain chat/groupchat messages and
+// jabber:x:event notifications to a MessageHandler, without building a Tag
+// tree. Everything else (stream headers, other stanzas, messages with unknown
+// children) is passed on unchanged and in stream order to a DataHandler.
+//
+// Message fields point into the read buffer, or into the XMPPArena when
+// entities had to be replaced, so reading a message does not allocate.
+// Without an arena replaced text is allocated from the heap per message.
+class XMPPStanzaReader
+{
+public:
+    // not NUL-terminated
+    struct Text
+    {
+        const char *data;
+        size_t size;
+
+        bool empty() const {
+            return size == 0;
+        }
+
+        bool equals(const char *data_, size_t size_) const {
+            return size == size_ && ::memcmp(data, data_, size) == 0;
+        }
+
+        bool equals(const string& text) const {
+            return equals(text.data(), text.size());
+        }
+
+        bool equals(const char *text) const {
+            return equals(text, ::strlen(text));
+        }
+
+        void copyTo(string& out) const {
+            out.assign(data, size);
+        }
+    };
+
+    // fields of a recognized message, entities already replaced;
+    // NOTE: only valid during MessageHandler::handleMessage()
+    struct Message
+    {
+        Text from;
+        Text to;
+        Text type;        // empty for 'normal'
+        Text id;
+        Text body;
+        Text subject;
+        Text thread;
+        Text stamp;       // urn:xmpp:delay or jabber:x:delay stamp, empty if none
+
+        bool has_event;   // jabber:x:event present
+        int events;       // MessageEventType bits
+        Text event_id;
+    };
+
+    class DataHandler
+    {
+    public:
+        virtual ~DataHandler() {}
+
+        /// stream data for the full parser
+        virtual void handleStreamData(const string& data) = 0;
+    };
+
+    class MessageHandler
+    {
+    public:
+        virtual ~MessageHandler() {}
+
+        /// false to pass the message to the full parser instead
+        virtual bool handleMessage(const Message& message) = 0;
+    };
+
+public:
+    /// arena holds unescaped text, the owner resets it between batches, 0 for the heap
+    explicit XMPPStanzaReader(DataHandler *data_handler, MessageHandler *message_handler, XMPPArena *arena);
+
+    ~XMPPStanzaReader();
+
+    /// forgets any partial data, for a new connection
+    void reset();
+
+    void feed(const string& data);
+
+    /// messages handled without the full parser since the last reset()
+    unsigned long getHandledMessages() const {
+        return handled_messages;
+    }
+
+private:
+    void forward(size_t end);
+    void freeTexts();
+    void handleElement(size_t begin, size_t end);
+    bool parseMessage(const char *data, size_t size);
+    bool readText(const char *data, size_t size, Text& text);
+    bool readTextContent(const char*& p, const char *end, const char *name, size_t name_size, Text *text);
+
+private:
+    DataHandler *data_handler;
+    MessageHandler *message_handler;
+    XMPPArena *arena;
+
+    string buffer;          // data not passed on yet
+    size_t forwarded;       // buffer[0, forwarded) already passed on during feed()
+    size_t position;        // scanned up to here
+    int depth;              // 1 inside the stream
+    size_t element_begin;   // top-level element being read, string::npos if none
+    bool is_candidate;      // the element may be a message for the fast path
+
+    Message message;
+    string scratch;
+    vector<char*> texts;    // unescaped text of message without an arena
+
+    unsigned long handled_messages;
+
+private:
+    XMPPStanzaReader();
+    XMPPStanzaReader(const XMPPStanzaReader&);
+    const XMPPStanzaReader& operator=(const XMPPStanzaReader&);
+};
+
+#endif // XMPP_STANZA_READER_INCLUDED
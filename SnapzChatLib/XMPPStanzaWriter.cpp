@@ -0,0 +1,208 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPStanzaWriter.hpp"
+
+#include <gloox/gloox.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace gloox;
+
+static inline bool g_is_special(char c)
+{
+    return c == '&' || c == '<' || c == '>' || c == '\'' || c == '"';
+}
+
+static inline const char* g_entity(char c)
+{
+    switch(c) {
+    case '&':
+        return "&amp;";
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '\'':
+        return "&apos;";
+    default:
+        return "&quot;";
+    }
+}
+
+/// index of the first character to escape, size if none
+static size_t g_find_special(const char *data, size_t size)
+{
+    size_t i = 0;
+
+    // NOTE: bodies are mostly plain text, check 16 bytes at once
+#if defined(__SSE2__)
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i apos = _mm_set1_epi8('\'');
+    const __m128i quot = _mm_set1_epi8('"');
+
+    for(; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, lt)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, gt),
+                                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, apos), _mm_cmpeq_epi8(chunk, quot))));
+
+        int mask = _mm_movemask_epi8(match);
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t amp = vdupq_n_u8('&');
+    const uint8x16_t lt = vdupq_n_u8('<');
+    const uint8x16_t gt = vdupq_n_u8('>');
+    const uint8x16_t apos = vdupq_n_u8('\'');
+    const uint8x16_t quot = vdupq_n_u8('"');
+
+    for(; i + 16 <= size; i += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint8x16_t match = vorrq_u8(vorrq_u8(vceqq_u8(chunk, amp), vceqq_u8(chunk, lt)),
+                                    vorrq_u8(vceqq_u8(chunk, gt),
+                                             vorrq_u8(vceqq_u8(chunk, apos), vceqq_u8(chunk, quot))));
+
+        if(vmaxvq_u8(match)) {
+            break;
+        }
+    }
+#endif
+
+    for(; i < size; ++i) {
+        if(g_is_special(data[i])) {
+            return i;
+        }
+    }
+    return size;
+}
+
+void XMPPStanzaWriter::appendEscaped(string& out, const char *data, size_t size)
+{
+    out.reserve(out.size() + size);
+
+    for(;;) {
+        size_t run = g_find_special(data, size);
+        out.append(data, run);
+
+        if(run == size) {
+            break;
+        }
+
+        out += g_entity(data[run]);
+        data += run + 1;
+        size -= run + 1;
+    }
+}
+
+static void g_append_events(string& out, int events, const string& event_id)
+{
+    out += "<x xmlns='jabber:x:event'>";
+
+    if(events & MessageEventOffline) {
+        out += "<offline/>";
+    }
+    if(events & MessageEventDelivered) {
+        out += "<delivered/>";
+    }
+    if(events & MessageEventDisplayed) {
+        out += "<displayed/>";
+    }
+    if(events & MessageEventComposing) {
+        out += "<composing/>";
+    }
+
+    if(!event_id.empty()) {
+        out += "<id>";
+        XMPPStanzaWriter::appendEscaped(out, event_id);
+        out += "</id>";
+    }
+
+    out += "</x>";
+}
+
+void XMPPStanzaWriter::appendChatMessage(string& out, const string& to, const string& id,
+                                         const string& body, const string& subject, const string& thread, int events)
+{
+    out += "<message type='chat' to='";
+    appendEscaped(out, to);
+    out += "' id='";
+    appendEscaped(out, id);
+    out += "'>";
+
+    if(!subject.empty()) {
+        out += "<subject>";
+        appendEscaped(out, subject);
+        out += "</subject>";
+    }
+
+    out += "<body>";
+    appendEscaped(out, body);
+    out += "</body>";
+
+    if(!thread.empty()) {
+        out += "<thread>";
+        appendEscaped(out, thread);
+        out += "</thread>";
+    }
+
+    if(events) {
+        g_append_events(out, events, "");
+    }
+
+    out += "</message>";
+}
+
+void XMPPStanzaWriter::appendGroupChatMessage(string& out, const string& to, const string& id, const string& body)
+{
+    out += "<message type='groupchat' to='";
+    appendEscaped(out, to);
+    out += "' id='";
+    appendEscaped(out, id);
+    out += "'><body>";
+    appendEscaped(out, body);
+    out += "</body></message>";
+}
+
+void XMPPStanzaWriter::appendGroupChatInvitation(string& out, const string& to, const string& id,
+                                                 const string& invitee, const string& reason)
+{
+    out += "<message to='";
+    appendEscaped(out, to);
+    out += "' id='";
+    appendEscaped(out, id);
+    out += "'><x xmlns='";
+    out += XMLNS_MUC_USER;
+    out += "'><invite to='";
+    appendEscaped(out, invitee);
+    out += "'>";
+
+    if(!reason.empty()) {
+        out += "<reason>";
+        appendEscaped(out, reason);
+        out += "</reason>";
+    }
+
+    out += "</invite></x></message>";
+}
+
+void XMPPStanzaWriter::appendMessageEvent(string& out, const string& to, const string& id,
+                                          int event, const string& event_id)
+{
+    out += "<message to='";
+    appendEscaped(out, to);
+    out += "' id='";
+    appendEscaped(out, id);
+    out += "'>";
+
+    g_append_events(out, event, event_id);
+
+    out += "</message>";
+}
@@ -0,0 +1,45 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_STANZA_WRITER_INCLUDED
+#define XMPP_STANZA_WRITER_INCLUDED
+
+#include <string>
+
+using namespace std;
+
+// Serializes the hot outbound stanzas (chat messages and jabber:x:event
+// notifications) from fixed templates straight into a caller-owned buffer,
+// without building a gloox Tag tree. The output matches what gloox sends for
+// the same stanza, apart from attribute order.
+class XMPPStanzaWriter
+{
+public:
+    /// appends data with XML special characters (& < > ' ") escaped
+    static void appendEscaped(string& out, const char *data, size_t size);
+
+    static void appendEscaped(string& out, const string& data) {
+        appendEscaped(out, data.data(), data.size());
+    }
+
+    /// appends <message type='chat'/>, requesting the MessageEventType bits in events (0 for none)
+    static void appendChatMessage(string& out, const string& to, const string& id,
+                                  const string& body, const string& subject, const string& thread, int events);
+
+    /// appends <message type='groupchat'/>, unlike MUCRoom::send() with an id the room reflects back
+    static void appendGroupChatMessage(string& out, const string& to, const string& id, const string& body);
+
+    /// appends a mediated muc#user invitation of invitee to the room, as MUCRoom::invite() does
+    static void appendGroupChatInvitation(string& out, const string& to, const string& id,
+                                          const string& invitee, const string& reason);
+
+    /// appends a jabber:x:event notification about the message event_id
+    static void appendMessageEvent(string& out, const string& to, const string& id,
+                                   int event, const string& event_id);
+
+private:
+    XMPPStanzaWriter();
+    XMPPStanzaWriter(const XMPPStanzaWriter&);
+    const XMPPStanzaWriter& operator=(const XMPPStanzaWriter&);
+};
+
+#endif // XMPP_STANZA_WRITER_INCLUDED
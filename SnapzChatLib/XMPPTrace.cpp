@@ -0,0 +1,285 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "XMPPTrace.hpp"
+#include "XMPPClock.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+
+#include <pthread.h>
+
+using namespace std;
+
+struct EventDescription
+{
+    const char *name;
+    const char *strings[2];  // names of string arguments, 0 if unused
+    const char *args[2];     // names of integer arguments, 0 if unused
+};
+
+static const EventDescription g_events[XMPPTrace::EVENT_MAX] = {
+    {"ClientImpl::onConnect",                      {0, 0},                  {0, 0}},
+    {"ClientImpl::onDisconnect",                   {0, 0},                  {"error", 0}},
+    {"ClientImpl::onTLSConnect",                   {"cipher", 0},           {0, 0}},
+    {"XMPPClient::handleUpdateError",              {0, 0},                  {"state", "error"}},
+    {"ChatImpl::handleMessageSession",             {"user", "resource"},    {0, 0}},
+    {"ChatImpl::handleMessage",                    {"user", "resource"},    {"length", "delayed"}},
+    {"ChatImpl::handleMessageEvent",               {"user", "resource"},    {"event", 0}},
+    {"ChatImpl::handlePrivateChatMessage",         {"user", "group"},       {"length", "delayed"}},
+    {"GroupChatSession",                           {"group", 0},            {0, 0}},
+    {"GroupChatImpl::handleMUCParticipantPresence", {"group", "nick"},      {"presence", "flags"}},
+    {"GroupChatImpl::handleMUCMessage",            {"group", "nick"},       {"private", "delayed"}},
+    {"GroupChatImpl::handleMUCRoomCreation",       {"group", 0},            {0, 0}},
+    {"GroupChatImpl::handleMUCSubject",            {"group", "nick"},       {"length", 0}},
+    {"GroupChatImpl::handleMUCInviteDecline",      {"group", "invitee"},    {0, 0}},
+    {"GroupChatImpl::handleMUCError",              {"group", 0},            {"error", 0}},
+    {"GroupChatImpl::handleMUCInfo",               {"group", "name"},       {"features", 0}},
+    {"GroupChatImpl::handleMUCItems",              {"group", 0},            {"items", 0}},
+    {"GroupChatImpl::handleMUCInvitation",         {"group", "from"},       {"continue", 0}},
+    {"GroupChatImpl::handleMUCConfigList",         {"group", 0},            {"operation", "items"}},
+    {"GroupChatImpl::handleMUCConfigForm",         {"group", 0},            {0, 0}},
+    {"GroupChatImpl::handleMUCConfigResult",       {"group", 0},            {"success", "operation"}},
+    {"GroupChatImpl::handleMUCRequest",            {"group", 0},            {0, 0}},
+    {"GroupChatImpl::handleIqID",                  {"group", 0},            {"success", "operation"}},
+    {"DeliveryImpl::notify",                       {0, 0},                  {"id", "status"}},
+    {"KeepaliveImpl::ping",                        {0, 0},                  {"interval", "unanswered"}},
+    {"KeepaliveImpl::update",                      {0, 0},                  {"silence", "unanswered"}},
+    {"XMPPClient::setInactive",                    {0, 0},                  {"inactive", 0}},
+    {"RosterImpl::handleIqID",                     {"version", 0},          {"full", "items"}},
+    {"EndpointImpl::connect",                      {"host", 0},             {"port", "standby"}},
+    {"AppClient::onChatMessage",                   {"user", "resource"},    {"length", "delayed"}},
+    {"AppClient::sendChatMessageDelivered",        {"user", 0},             {"success", 0}},
+};
+
+static const char* g_level_string(int level)
+{
+    switch(level) {
+    case XMPPTrace::LEVEL_ERROR:
+        return "ERROR";
+    case XMPPTrace::LEVEL_INFO:
+        return "INFO";
+    case XMPPTrace::LEVEL_DEBUG:
+        return "DEBUG";
+    default:
+        break;
+    }
+    return "NONE";
+}
+
+// single-producer ring owned by one thread, read by dump()
+struct TraceRing
+{
+    uint32_t thread;
+    volatile bool is_orphaned;
+    volatile uint64_t head;
+    volatile uint64_t cleared;  // records before this index were dropped by clear()
+    XMPPTrace::Record records[XMPPTrace::RING_CAPACITY];
+};
+
+static pthread_once_t g_ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ring_key;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceRing*> g_rings;
+static FILE * volatile g_echo = 0;
+
+volatile int XMPPTrace::runtime_level = XMPPTrace::LEVEL_INFO;
+
+static void g_release_ring(void *data)
+{
+    // keep the records for dump(), the ring gets reused by the next new thread
+    static_cast<TraceRing*>(data)->is_orphaned = true;
+}
+
+static void g_create_ring_key()
+{
+    ::pthread_key_create(&g_ring_key, g_release_ring);
+}
+
+static TraceRing* g_thread_ring()
+{
+    ::pthread_once(&g_ring_once, g_create_ring_key);
+
+    TraceRing *ring = static_cast<TraceRing*>(::pthread_getspecific(g_ring_key));
+    if(ring) {
+        return ring;
+    }
+
+    ::pthread_mutex_lock(&g_rings_lock);
+
+    vector<TraceRing*>::const_iterator it;
+    for(it = g_rings.begin(); it != g_rings.end(); ++it) {
+        if((*it)->is_orphaned) {
+            ring = *it;
+            ring->is_orphaned = false;
+            break;
+        }
+    }
+
+    if(!ring) {
+        ring = new TraceRing;
+        ring->thread = (uint32_t)g_rings.size();
+        ring->is_orphaned = false;
+        ring->head = 0;
+        ring->cleared = 0;
+        g_rings.push_back(ring);
+    }
+
+    ::pthread_mutex_unlock(&g_rings_lock);
+
+    ::pthread_setspecific(g_ring_key, ring);
+    return ring;
+}
+
+static void g_copy_string(char *dst, const char *src)
+{
+    if(!src) {
+        dst[0] = 0;
+        return;
+    }
+
+    size_t size = ::strlen(src);
+    if(size >= (size_t)XMPPTrace::RECORD_STRING_SIZE) {
+        size = XMPPTrace::RECORD_STRING_SIZE - 1;
+    }
+
+    ::memcpy(dst, src, size);
+    dst[size] = 0;
+}
+
+void XMPPTrace::setLevel(Level level)
+{
+    runtime_level = level;
+}
+
+XMPPTrace::Level XMPPTrace::getLevel()
+{
+    return (Level)runtime_level;
+}
+
+void XMPPTrace::setEcho(FILE *stream)
+{
+    g_echo = stream;
+}
+
+void XMPPTrace::write(int level, Event event,
+                      const char *s0, const char *s1,
+                      int64_t a0, int64_t a1)
+{
+    TraceRing *ring = g_thread_ring();
+
+    uint64_t head = ring->head;
+    Record& record = ring->records[head & (RING_CAPACITY - 1)];
+
+    record.timestamp = XMPPClock::now();
+    record.event = (uint16_t)event;
+    record.level = (uint8_t)level;
+    record.reserved = 0;
+    record.thread = ring->thread;
+    record.args[0] = a0;
+    record.args[1] = a1;
+    g_copy_string(record.strings[0], s0);
+    g_copy_string(record.strings[1], s1);
+
+    // publish the record before moving the head
+    __sync_synchronize();
+    ring->head = head + 1;
+
+    FILE *echo = g_echo;
+    if(echo) {
+        char buffer[256];
+        format(record, buffer, sizeof(buffer));
+        ::fprintf(echo, "%s\n", buffer);
+    }
+}
+
+void XMPPTrace::format(const Record& record, char *buffer, size_t size)
+{
+    static const EventDescription UNKNOWN = {"UNKNOWN", {0, 0}, {0, 0}};
+
+    const EventDescription& event =
+        (record.event < EVENT_MAX) ? g_events[record.event] : UNKNOWN;
+
+    int length = ::snprintf(buffer, size, "%llu.%09llu [%u] %s %s:",
+                            (unsigned long long)(record.timestamp / 1000000000ULL),
+                            (unsigned long long)(record.timestamp % 1000000000ULL),
+                            (unsigned)record.thread, g_level_string(record.level), event.name);
+
+    for(int i = 0; i < 2 && length > 0 && (size_t)length < size; ++i) {
+        if(event.strings[i]) {
+            length += ::snprintf(buffer + length, size - length, " %s='%s'",
+                                 event.strings[i], record.strings[i]);
+        }
+    }
+
+    for(int i = 0; i < 2 && length > 0 && (size_t)length < size; ++i) {
+        if(event.args[i]) {
+            length += ::snprintf(buffer + length, size - length, " %s=%lld",
+                                 event.args[i], (long long)record.args[i]);
+        }
+    }
+}
+
+static bool g_record_less(const XMPPTrace::Record& a, const XMPPTrace::Record& b)
+{
+    return a.timestamp < b.timestamp;
+}
+
+void XMPPTrace::dump(FILE *stream)
+{
+    vector<Record> records;
+
+    ::pthread_mutex_lock(&g_rings_lock);
+
+    vector<TraceRing*>::const_iterator it;
+    for(it = g_rings.begin(); it != g_rings.end(); ++it) {
+        TraceRing *ring = *it;
+
+        uint64_t head = ring->head;
+        __sync_synchronize();
+
+        uint64_t tail = (head > (uint64_t)RING_CAPACITY) ? (head - RING_CAPACITY) : 0;
+        if(tail < ring->cleared) {
+            tail = min((uint64_t)ring->cleared, head);
+        }
+        size_t offset = records.size();
+
+        for(uint64_t i = tail; i < head; ++i) {
+            records.push_back(ring->records[i & (RING_CAPACITY - 1)]);
+        }
+
+        // drop whatever the writer overwrote while copying
+        __sync_synchronize();
+        uint64_t new_head = ring->head;
+        uint64_t new_tail = (new_head > (uint64_t)RING_CAPACITY) ? (new_head - RING_CAPACITY) : 0;
+
+        if(new_tail > tail) {
+            size_t overwritten = (size_t)min(new_tail - tail, head - tail);
+            records.erase(records.begin() + offset, records.begin() + offset + overwritten);
+        }
+    }
+
+    ::pthread_mutex_unlock(&g_rings_lock);
+
+    stable_sort(records.begin(), records.end(), g_record_less);
+
+    char buffer[256];
+    vector<Record>::const_iterator it_record;
+    for(it_record = records.begin(); it_record != records.end(); ++it_record) {
+        format(*it_record, buffer, sizeof(buffer));
+        ::fprintf(stream, "%s\n", buffer);
+    }
+}
+
+void XMPPTrace::clear()
+{
+    ::pthread_mutex_lock(&g_rings_lock);
+
+    // NOTE: owners may be writing concurrently, so only the readable window moves
+    vector<TraceRing*>::const_iterator it;
+    for(it = g_rings.begin(); it != g_rings.end(); ++it) {
+        (*it)->cleared = (*it)->head;
+    }
+
+    ::pthread_mutex_unlock(&g_rings_lock);
+}
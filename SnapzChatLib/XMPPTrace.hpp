@@ -0,0 +1,113 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_TRACE_INCLUDED
+#define XMPP_TRACE_INCLUDED
+
+#include <cstdio>
+#include <stdint.h>
+
+// highest level compiled in, the others cost nothing
+#ifndef XMPP_TRACE_COMPILE_LEVEL
+#define XMPP_TRACE_COMPILE_LEVEL XMPPTrace::LEVEL_DEBUG
+#endif // XMPP_TRACE_COMPILE_LEVEL
+
+#define XMPP_TRACE(level, event, ...)                                   \
+    do {                                                                \
+        if((level) <= XMPP_TRACE_COMPILE_LEVEL && XMPPTrace::isEnabled(level)) { \
+            XMPPTrace::write((level), (event), ##__VA_ARGS__);          \
+        }                                                               \
+    } while(0)
+
+// Binary trace records are written into per-thread lock-free rings and
+// formatted only by dump(), so a trace point costs a clock read and a copy.
+// NOTE: level and echo are process-wide, set by the application, not by a client
+class XMPPTrace
+{
+public:
+    enum Level {
+        LEVEL_NONE,
+        LEVEL_ERROR,
+        LEVEL_INFO,
+        LEVEL_DEBUG
+    };
+
+    enum Event {
+        EVENT_CONNECT,
+        EVENT_DISCONNECT,
+        EVENT_TLS_CONNECT,
+        EVENT_UPDATE_ERROR,
+        EVENT_MESSAGE_SESSION,
+        EVENT_CHAT_MESSAGE,
+        EVENT_CHAT_MESSAGE_EVENT,
+        EVENT_PRIVATE_CHAT_MESSAGE,
+        EVENT_GROUP_CHAT_SESSION,
+        EVENT_GROUP_CHAT_PRESENCE,
+        EVENT_GROUP_CHAT_MESSAGE,
+        EVENT_GROUP_CHAT_CREATION,
+        EVENT_GROUP_CHAT_SUBJECT,
+        EVENT_GROUP_CHAT_INVITE_DECLINE,
+        EVENT_GROUP_CHAT_ERROR,
+        EVENT_GROUP_CHAT_INFO,
+        EVENT_GROUP_CHAT_ITEMS,
+        EVENT_GROUP_CHAT_INVITATION,
+        EVENT_GROUP_CHAT_CONFIG_LIST,
+        EVENT_GROUP_CHAT_CONFIG_FORM,
+        EVENT_GROUP_CHAT_CONFIG_RESULT,
+        EVENT_GROUP_CHAT_REQUEST,
+        EVENT_GROUP_CHAT_REQUEST_RESULT,
+        EVENT_MESSAGE_COMPLETION,
+        EVENT_PING,
+        EVENT_DEAD_PEER,
+        EVENT_CLIENT_STATE,
+        EVENT_ROSTER,
+        EVENT_ENDPOINT,
+        EVENT_APP_CHAT_MESSAGE,
+        EVENT_APP_DELIVERED,
+        EVENT_MAX
+    };
+
+    static const int RECORD_STRING_SIZE = 16;  // longer strings are truncated
+    static const int RING_CAPACITY = 1024;     // records per thread, power of two
+
+    struct Record
+    {
+        uint64_t timestamp;  // XMPPClock::now()
+        uint16_t event;
+        uint8_t level;
+        uint8_t reserved;
+        uint32_t thread;     // index of the writing thread
+        int64_t args[2];
+        char strings[2][RECORD_STRING_SIZE];
+    };
+
+public:
+    static bool isEnabled(int level) {
+        return level <= runtime_level;
+    }
+
+    static void setLevel(Level level);
+    static Level getLevel();
+
+    /// also format each record to the given stream as it is written (debugging only)
+    static void setEcho(FILE *stream);
+
+    static void write(int level, Event event,
+                      const char *s0 = 0, const char *s1 = 0,
+                      int64_t a0 = 0, int64_t a1 = 0);
+
+    /// formats the records of all threads ordered by time
+    static void dump(FILE *stream);
+
+    /// drops all recorded data
+    static void clear();
+
+    static void format(const Record& record, char *buffer, size_t size);
+
+private:
+    static volatile int runtime_level;
+
+private:
+    XMPPTrace();
+};
+
+#endif // XMPP_TRACE_INCLUDED
@@ -0,0 +1,635 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+
+#include "XMPPUringConnection.hpp"
+#include "XMPPClock.hpp"
+
+#include <gloox/mutexguard.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+using namespace gloox;
+using namespace gloox::util;
+
+static const unsigned RING_ENTRIES = 64;
+
+// receive buffers registered with the kernel, BUFFER_COUNT a power of two
+static const unsigned BUFFER_COUNT = 16;
+static const unsigned BUFFER_SIZE = 4096;
+static const unsigned BUFFER_GROUP = 0;
+
+// cleanup() waits this long for the last send, e.g. </stream:stream>, and the receive cancellation (microseconds)
+static const int DRAIN_TIMEOUT = 100000;
+
+// data written behind the send in flight, a peer not reading past it breaks the stream (bytes)
+static const size_t PENDING_LIMIT = 4 * 1024 * 1024;
+
+// user_data of the requests
+static const uint64_t TAG_RECEIVE = 1;
+static const uint64_t TAG_SEND = 2;
+static const uint64_t TAG_WAKE = 3;
+static const uint64_t TAG_CANCEL = 4;
+
+// NOTE: multishot receive came with Linux 6.0, no feature flag tells
+static bool g_has_multishot_receive()
+{
+    struct utsname name;
+    if(::uname(&name) != 0) {
+        return false;
+    }
+
+    char *end = 0;
+    long major = ::strtol(name.release, &end, 10);
+    return major >= 6;
+}
+
+/// XMPPUringConnection
+XMPPUringConnection::XMPPUringConnection(ConnectionDataHandler *handler, const LogSink& log_instance_,
+                                         const string& server, int port)
+    : ConnectionTCPClient(handler, log_instance_, server, port),
+      log_instance(log_instance_),
+      ring_fd(-1), ring(0), ring_size(0), sqes(0), sqes_size(0),
+      sq_head(0), sq_tail(0), sq_mask(0), sq_array(0), sq_entries(0),
+      cq_head(0), cq_tail(0), cq_mask(0), cqes(0),
+      buffer_ring(0), buffer_ring_size(0), buffers(0), buffer_tail(0),
+      is_receiving(false), is_cancelled(false),
+      is_sending(false), is_corked(false), is_broken(false), is_cleanup_deferred(false),
+      total_in(0), total_out(0)
+{
+}
+
+XMPPUringConnection::~XMPPUringConnection()
+{
+    // NOTE: the event loop is gone, nothing else uses the ring
+    teardown();
+}
+
+int XMPPUringConnection::getPollDescriptor() const
+{
+    return (ring_fd >= 0) ? ring_fd : socket();
+}
+
+size_t XMPPUringConnection::getQueuedBytes()
+{
+    MutexGuard guard(submit_lock);
+    return pending.size() + sending.size();
+}
+
+ConnectionError XMPPUringConnection::connect()
+{
+    teardown();
+
+    is_cancelled = false;
+    is_broken = false;
+    is_cleanup_deferred = false;
+    total_in = 0;
+    total_out = 0;
+
+    // NOTE: the stream header is written by handleConnect(), before the ring exists
+    ConnectionError error = ConnectionTCPClient::connect();
+    if(error == ConnNoError && !setup(socket())) {
+        log_instance.warn(LogAreaClassConnectionTCPClient, "io_uring not available, plain TCP calls used");
+        teardown();
+    }
+
+    return error;
+}
+
+ConnectionError XMPPUringConnection::recv(int timeout /* microseconds */)
+{
+    recv_lock.lock();
+
+    if(ring_fd < 0) {
+        recv_lock.unlock();
+        return ConnectionTCPClient::recv(timeout);
+    }
+
+    if(is_cancelled) {
+        recv_lock.unlock();
+        if(is_cleanup_deferred) {
+            cleanup();
+        }
+        return ConnNotConnected;
+    }
+
+    {
+        MutexGuard guard(submit_lock);
+        if(!is_receiving) {
+            armReceive();
+        }
+    }
+
+    // NOTE: what was queued goes with the wait, which returns at once if a completion is there
+    if(*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        enter(timeout != 0, timeout);
+    }
+
+    ConnectionError error = ConnNoError;
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head) {
+        const io_uring_cqe *cqe = &cqes[head & *cq_mask];
+
+        if(cqe->user_data == TAG_RECEIVE) {
+            if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                is_receiving = false;
+            }
+
+            if(cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short id = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if(cqe->res > 0) {
+                    received.append(buffers + id * BUFFER_SIZE, cqe->res);
+                }
+                recycleBuffer(id);
+            }
+
+            // NOTE: -ENOBUFS only stops the receive, armed again below with the buffers given back
+            if(cqe->res == 0) {
+                error = ConnStreamClosed;
+            }
+            else if(cqe->res < 0 && cqe->res != -ENOBUFS) {
+                error = ConnIoError;
+            }
+        }
+        else if(cqe->user_data == TAG_SEND) {
+            MutexGuard guard(submit_lock);
+            if(cqe->res < 0 || (size_t)cqe->res != sending.size()) {
+                is_broken = true;
+            }
+            sending.clear();
+            is_sending = false;
+        }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if(!received.empty()) {
+        total_in += received.size();
+
+        // NOTE: the replies written by the handler go out together, after it
+        {
+            MutexGuard guard(submit_lock);
+            is_corked = true;
+        }
+        m_handler->handleReceivedData(this, received);
+        received.clear();
+
+        MutexGuard guard(submit_lock);
+        is_corked = false;
+    }
+
+    {
+        MutexGuard guard(submit_lock);
+        if(!is_receiving && error == ConnNoError && !is_cancelled) {
+            armReceive();
+        }
+        startSend();
+    }
+    enter(false, 0);
+
+    if(is_broken && error == ConnNoError) {
+        error = ConnIoError;
+    }
+
+    recv_lock.unlock();
+
+    if(is_cleanup_deferred) {
+        cleanup();
+    }
+
+    if(error != ConnNoError) {
+        m_handler->handleDisconnect(this, error);
+    }
+
+    return error;
+}
+
+bool XMPPUringConnection::send(const string& data)
+{
+    bool is_started = false;
+
+    {
+        MutexGuard guard(submit_lock);
+
+        if(ring_fd >= 0) {
+            if(is_cancelled || is_broken) {
+                return false;
+            }
+
+            // NOTE: the next recv() reports the stream broken, as a failed send would
+            if(pending.size() + data.size() > PENDING_LIMIT) {
+                log_instance.err(LogAreaClassConnectionTCPClient, "io_uring send backlog over its limit, stream broken");
+                is_broken = true;
+                return false;
+            }
+
+            pending.append(data);
+            total_out += data.size();
+
+            // NOTE: otherwise submitted when the send in flight completes, or after the batch handled
+            if(!is_corked && !is_sending) {
+                startSend();
+                is_started = true;
+            }
+        }
+    }
+
+    if(ring_fd < 0) {
+        return ConnectionTCPClient::send(data);
+    }
+
+    if(is_started) {
+        enter(false, 0);
+    }
+    return true;
+}
+
+void XMPPUringConnection::disconnect()
+{
+    is_cancelled = true;
+
+    // NOTE: wakes recv() up from a wait without timeout
+    bool is_queued = false;
+    {
+        MutexGuard guard(submit_lock);
+
+        io_uring_sqe *sqe = getSqe();
+        if(sqe) {
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = TAG_WAKE;
+            pushSqe();
+            is_queued = true;
+        }
+    }
+    if(is_queued) {
+        enter(false, 0);
+    }
+
+    ConnectionTCPClient::disconnect();
+}
+
+void XMPPUringConnection::cleanup()
+{
+    // NOTE: done by recv() when it returns, as gloox does for a recv() in progress
+    if(!recv_lock.trylock()) {
+        is_cancelled = true;
+        is_cleanup_deferred = true;
+        return;
+    }
+
+    is_cleanup_deferred = false;
+    teardown();
+
+    recv_lock.unlock();
+
+    ConnectionTCPClient::cleanup();
+}
+
+void XMPPUringConnection::getStatistics(long int& total_in_, long int& total_out_)
+{
+    // NOTE: the plain TCP calls count what they did before the ring or without one
+    ConnectionTCPClient::getStatistics(total_in_, total_out_);
+    total_in_ += total_in;
+    total_out_ += total_out;
+}
+
+ConnectionBase* XMPPUringConnection::newInstance() const
+{
+    return new XMPPUringConnection(m_handler, log_instance, server(), port());
+}
+
+bool XMPPUringConnection::setup(int socket)
+{
+    if(socket < 0 || !g_has_multishot_receive()) {
+        return false;
+    }
+
+    struct io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+
+    int fd = (int)::syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(fd < 0) {
+        return false;
+    }
+
+    MutexGuard guard(submit_lock);
+    ring_fd = fd;
+
+    // NOTE: one mapping for both rings (5.4), wait with a timeout (5.11)
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    size_t size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    void *address = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQ_RING);
+    if(address == MAP_FAILED) {
+        return false;
+    }
+    ring = address;
+    ring_size = size;
+
+    size = params.sq_entries * sizeof(io_uring_sqe);
+    address = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQES);
+    if(address == MAP_FAILED) {
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(address);
+    sqes_size = size;
+
+    char *base = static_cast<char*>(ring);
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sq_entries = params.sq_entries;
+
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    if(::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, &socket, 1) < 0) {
+        return false;
+    }
+
+    // NOTE: provided buffer ring (5.19), page aligned
+    size = BUFFER_COUNT * sizeof(io_uring_buf);
+    address = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(address == MAP_FAILED) {
+        return false;
+    }
+    buffer_ring = static_cast<io_uring_buf_ring*>(address);
+    buffer_ring_size = size;
+
+    struct io_uring_buf_reg reg;
+    ::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+
+    if(::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    buffers = new char[BUFFER_COUNT * BUFFER_SIZE];
+    buffer_tail = 0;
+    for(unsigned i = 0; i < BUFFER_COUNT; ++i) {
+        recycleBuffer((unsigned short)i);
+    }
+
+    is_receiving = false;
+    is_sending = false;
+    is_corked = false;
+    pending.clear();
+    sending.clear();
+
+    armReceive();
+    return true;
+}
+
+void XMPPUringConnection::teardown()
+{
+    if(ring_fd < 0) {
+        return;
+    }
+
+    bool is_idle = true;
+
+    if(ring && buffers) {
+        {
+            MutexGuard guard(submit_lock);
+
+            if(is_receiving) {
+                io_uring_sqe *sqe = getSqe();
+                if(sqe) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = TAG_RECEIVE;
+                    sqe->user_data = TAG_CANCEL;
+                    pushSqe();
+                }
+            }
+            startSend();
+        }
+
+        uint64_t deadline = XMPPClock::now() + (uint64_t)DRAIN_TIMEOUT * 1000ULL;
+        uint64_t now = XMPPClock::now();
+
+        while((is_receiving || is_sending) && now < deadline) {
+            enter(true, (int)((deadline - now) / 1000ULL));
+
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for(; head != tail; ++head) {
+                const io_uring_cqe *cqe = &cqes[head & *cq_mask];
+
+                if(cqe->user_data == TAG_RECEIVE) {
+                    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                        is_receiving = false;
+                    }
+                    if(cqe->flags & IORING_CQE_F_BUFFER) {
+                        recycleBuffer((unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                    }
+                }
+                else if(cqe->user_data == TAG_SEND) {
+                    MutexGuard guard(submit_lock);
+                    sending.clear();
+                    is_sending = false;
+                    startSend();
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            now = XMPPClock::now();
+        }
+
+        is_idle = !is_receiving && !is_sending;
+    }
+
+    MutexGuard guard(submit_lock);
+
+    ::close(ring_fd);
+    ring_fd = -1;
+
+    // NOTE: the kernel may still write into the buffers of a request not completed, leaked then
+    if(is_idle) {
+        delete[] buffers;
+    }
+    else {
+        (new string())->swap(sending);
+    }
+    buffers = 0;
+
+    if(buffer_ring) {
+        ::munmap(buffer_ring, buffer_ring_size);
+    }
+    if(sqes) {
+        ::munmap(sqes, sqes_size);
+    }
+    if(ring) {
+        ::munmap(ring, ring_size);
+    }
+
+    ring = 0;
+    sqes = 0;
+    buffer_ring = 0;
+    sq_head = sq_tail = sq_mask = sq_array = 0;
+    cq_head = cq_tail = cq_mask = 0;
+    cqes = 0;
+
+    is_receiving = false;
+    is_sending = false;
+    is_corked = false;
+    pending.clear();
+    sending.clear();
+}
+
+io_uring_sqe* XMPPUringConnection::getSqe()
+{
+    if(ring_fd < 0 || !sqes) {
+        return 0;
+    }
+
+    unsigned tail = *sq_tail;
+    if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        return 0;
+    }
+
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    ::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+
+    return sqe;
+}
+
+void XMPPUringConnection::pushSqe()
+{
+    // NOTE: published once filled, another thread may submit it right away
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+int XMPPUringConnection::enter(bool wait, int timeout /* microseconds */)
+{
+    int fd;
+    unsigned to_submit;
+    {
+        MutexGuard guard(submit_lock);
+        if(ring_fd < 0) {
+            return -1;
+        }
+
+        fd = ring_fd;
+        to_submit = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    if(!to_submit && !wait) {
+        return 0;
+    }
+
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    void *arg = 0;
+    size_t arg_size = 0;
+
+    struct io_uring_getevents_arg getevents;
+    struct __kernel_timespec ts;
+
+    if(wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+
+        if(timeout >= 0) {
+            ts.tv_sec = timeout / 1000000;
+            ts.tv_nsec = (timeout % 1000000) * 1000LL;
+
+            ::memset(&getevents, 0, sizeof(getevents));
+            getevents.ts = (uint64_t)(uintptr_t)&ts;
+
+            flags |= IORING_ENTER_EXT_ARG;
+            arg = &getevents;
+            arg_size = sizeof(getevents);
+        }
+    }
+
+    int result = (int)::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+
+    // NOTE: a timeout or a signal is no error, nor is a full completion queue handled by the next call
+    if(result < 0 && (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+        return 0;
+    }
+    return result;
+}
+
+void XMPPUringConnection::armReceive()
+{
+    io_uring_sqe *sqe = getSqe();
+    if(!sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = 0;  // registered file
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = TAG_RECEIVE;
+    pushSqe();
+
+    is_receiving = true;
+}
+
+void XMPPUringConnection::recycleBuffer(unsigned short id)
+{
+    // NOTE: not buffer_ring->bufs, the empty struct before it in the kernel header takes a byte in C++
+    io_uring_buf *buffer = reinterpret_cast<io_uring_buf*>(buffer_ring) + (buffer_tail & (BUFFER_COUNT - 1));
+    buffer->addr = (uint64_t)(uintptr_t)(buffers + id * BUFFER_SIZE);
+    buffer->len = BUFFER_SIZE;
+    buffer->bid = id;
+
+    ++buffer_tail;
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+void XMPPUringConnection::startSend()
+{
+    if(is_sending || pending.empty() || is_broken) {
+        return;
+    }
+
+    io_uring_sqe *sqe = getSqe();
+    if(!sqe) {
+        return;
+    }
+
+    sending.swap(pending);
+    pending.clear();
+
+    // NOTE: one send in flight keeps the order, MSG_WAITALL has the kernel finish a short one
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = 0;  // registered file
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)sending.data();
+    sqe->len = (unsigned)sending.size();
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = TAG_SEND;
+    pushSqe();
+
+    is_sending = true;
+}
+
+#endif // XMPP_CLIENT_IO_URING_ENABLE
@@ -0,0 +1,133 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef XMPP_URING_CONNECTION_INCLUDED
+#define XMPP_URING_CONNECTION_INCLUDED
+
+#ifdef XMPP_CLIENT_IO_URING_ENABLE
+
+#include <gloox/connectiontcpclient.h>
+#include <gloox/mutex.h>
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// TCP connection of a gloox stream on io_uring (Linux 6.0 and later, built with
+// XMPP_CLIENT_IO_URING_ENABLE), see XMPPClient::Config::io_uring:
+// - a multishot receive fills buffers registered with the kernel, a busy stream
+//   costs no syscall per read;
+// - writes are coalesced into one send in flight, those made while a batch of
+//   received data is handled (receipts, replies) go with a single submission;
+// - the socket is registered too, the kernel does not look it up per request.
+// The connection is established by ConnectionTCPClient::connect(), the plain
+// TCP calls are kept when the kernel or a seccomp policy refuses io_uring.
+// send() never blocks: a peer not reading shows in getQueuedBytes(), a stream
+// holding 4 MiB unsent is broken.
+// NOTE: recv() from the event loop, send() and disconnect() from any thread, as gloox does
+class XMPPUringConnection : public gloox::ConnectionTCPClient
+{
+public:
+    explicit XMPPUringConnection(gloox::ConnectionDataHandler *handler, const gloox::LogSink& log_instance,
+                                 const string& server, int port);
+
+    virtual ~XMPPUringConnection();
+
+    /// false without a ring, the plain TCP calls are used then
+    bool isActive() const {
+        return ring_fd >= 0;
+    }
+
+    /// descriptor readable when recv() has something to handle: the ring, or the socket without one
+    int getPollDescriptor() const;
+
+    /// bytes given to send() and not sent yet, 0 without a ring
+    size_t getQueuedBytes();
+
+public:
+    // ConnectionBase
+    virtual gloox::ConnectionError connect();
+    virtual gloox::ConnectionError recv(int timeout = -1);
+    virtual bool send(const string& data);
+    virtual void disconnect();
+    virtual void cleanup();
+    virtual void getStatistics(long int& total_in, long int& total_out);
+    virtual gloox::ConnectionBase* newInstance() const;
+
+private:
+    bool setup(int socket);
+    void teardown();
+
+    /// next free submission entry, 0 if the queue is full; NOTE: with submit_lock
+    io_uring_sqe* getSqe();
+
+    /// queues the entry filled since getSqe(); NOTE: with submit_lock
+    void pushSqe();
+
+    /// hands the entries queued so far to the kernel, waits for one completion
+    /// at most timeout microseconds (-1 without limit) if wait is set
+    int enter(bool wait, int timeout);
+
+    void armReceive();
+    void recycleBuffer(unsigned short id);
+
+    /// moves pending into a send in flight unless there is one; NOTE: with submit_lock
+    void startSend();
+
+private:
+    const gloox::LogSink& log_instance;
+
+    int ring_fd;  // -1 without a ring
+
+    void *ring;
+    size_t ring_size;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+    unsigned short buffer_tail;
+
+    bool is_receiving;      // the multishot receive is armed, event loop only
+    string received;        // batch of a recv(), event loop only
+    volatile bool is_cancelled;
+
+    // NOTE: data written while sending waits in pending, sent as one when the send in flight completes
+    gloox::util::Mutex submit_lock;
+    string pending;
+    string sending;
+    bool is_sending;
+    bool is_corked;         // a received batch is being handled
+    volatile bool is_broken;
+
+    gloox::util::Mutex recv_lock;
+    volatile bool is_cleanup_deferred;  // cleanup() during a recv(), done when it returns
+
+    long int total_in;
+    long int total_out;
+
+private:
+    XMPPUringConnection();
+    XMPPUringConnection(const XMPPUringConnection&);
+    const XMPPUringConnection& operator=(const XMPPUringConnection&);
+};
+
+#endif // XMPP_CLIENT_IO_URING_ENABLE
+
+#endif // XMPP_URING_CONNECTION_INCLUDED
@@ -0,0 +1,195 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#include "LoadScenario.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+
+LoadScenario::Error::Error(const string& error)
+    : runtime_error(error)
+{
+}
+
+LoadScenario::LoadScenario()
+    : server("127.0.0.1"), port(5222),
+      domain("localhost"), groupchat_server(""),
+      tls_policy(TLSOptional),
+      user_prefix("load"), password("password"),
+      first_account(0), accounts(100), workers(4),
+      login_rate(10.0), duration(60), report_interval(10),
+      message_rate(0.1), message_size(64), composing_ratio(0.5), reply_delivered(true),
+      rooms(0), room_join_ratio(0.0), room_message_rate(0.0),
+      suspend_interval(0), suspend_duration(10)
+{
+}
+
+static string g_trim(const string& value)
+{
+    size_t begin = value.find_first_not_of(" \t\r");
+    if(begin == string::npos) {
+        return "";
+    }
+
+    size_t end = value.find_last_not_of(" \t\r");
+    return value.substr(begin, end - begin + 1);
+}
+
+static int g_to_int(const string& key, const string& value, int min)
+{
+    char *end = 0;
+    long result = ::strtol(value.c_str(), &end, 10);
+
+    if(value.empty() || *end != 0 || result < min) {
+        throw LoadScenario::Error("invalid value for '" + key + "': '" + value + "'");
+    }
+    return (int)result;
+}
+
+static double g_to_double(const string& key, const string& value, double min, double max)
+{
+    char *end = 0;
+    double result = ::strtod(value.c_str(), &end);
+
+    if(value.empty() || *end != 0 || result < min || result > max) {
+        throw LoadScenario::Error("invalid value for '" + key + "': '" + value + "'");
+    }
+    return result;
+}
+
+static bool g_to_bool(const string& key, const string& value)
+{
+    if(value == "true" || value == "yes" || value == "1") {
+        return true;
+    }
+    if(value == "false" || value == "no" || value == "0") {
+        return false;
+    }
+    throw LoadScenario::Error("invalid value for '" + key + "': '" + value + "'");
+}
+
+void LoadScenario::load(const string& path)
+{
+    ifstream file(path.c_str());
+    if(!file) {
+        throw Error("cannot read scenario '" + path + "'");
+    }
+
+    string line;
+    int line_number = 0;
+
+    while(getline(file, line)) {
+        ++line_number;
+
+        size_t comment = line.find('#');
+        if(comment != string::npos) {
+            line.erase(comment);
+        }
+
+        line = g_trim(line);
+        if(line.empty()) {
+            continue;
+        }
+
+        size_t pos = line.find('=');
+        if(pos == string::npos) {
+            ostringstream error;
+            error << path << ":" << line_number << ": expected 'key = value'";
+            throw Error(error.str());
+        }
+
+        const string key = g_trim(line.substr(0, pos));
+        const string value = g_trim(line.substr(pos + 1));
+
+        if(key == "server") {
+            server = value;
+        }
+        else if(key == "port") {
+            port = g_to_int(key, value, 1);
+        }
+        else if(key == "domain") {
+            domain = value;
+        }
+        else if(key == "groupchat_server") {
+            groupchat_server = value;
+        }
+        else if(key == "tls") {
+            if(value == "disabled") {
+                tls_policy = TLSDisabled;
+            }
+            else if(value == "optional") {
+                tls_policy = TLSOptional;
+            }
+            else if(value == "required") {
+                tls_policy = TLSRequired;
+            }
+            else {
+                throw Error("invalid value for 'tls': '" + value + "'");
+            }
+        }
+        else if(key == "user_prefix") {
+            user_prefix = value;
+        }
+        else if(key == "password") {
+            password = value;
+        }
+        else if(key == "first_account") {
+            first_account = g_to_int(key, value, 0);
+        }
+        else if(key == "accounts") {
+            accounts = g_to_int(key, value, 1);
+        }
+        else if(key == "workers") {
+            workers = g_to_int(key, value, 1);
+        }
+        else if(key == "login_rate") {
+            login_rate = g_to_double(key, value, 0.001, 1e6);
+        }
+        else if(key == "duration") {
+            duration = g_to_int(key, value, 0);
+        }
+        else if(key == "report_interval") {
+            report_interval = g_to_int(key, value, 1);
+        }
+        else if(key == "message_rate") {
+            message_rate = g_to_double(key, value, 0.0, 1e6);
+        }
+        else if(key == "message_size") {
+            message_size = g_to_int(key, value, 1);
+        }
+        else if(key == "composing_ratio") {
+            composing_ratio = g_to_double(key, value, 0.0, 1.0);
+        }
+        else if(key == "reply_delivered") {
+            reply_delivered = g_to_bool(key, value);
+        }
+        else if(key == "rooms") {
+            rooms = g_to_int(key, value, 0);
+        }
+        else if(key == "room_join_ratio") {
+            room_join_ratio = g_to_double(key, value, 0.0, 1.0);
+        }
+        else if(key == "room_message_rate") {
+            room_message_rate = g_to_double(key, value, 0.0, 1e6);
+        }
+        else if(key == "suspend_interval") {
+            suspend_interval = g_to_int(key, value, 0);
+        }
+        else if(key == "suspend_duration") {
+            suspend_duration = g_to_int(key, value, 0);
+        }
+        else {
+            ostringstream error;
+            error << path << ":" << line_number << ": unknown key '" << key << "'";
+            throw Error(error.str());
+        }
+    }
+
+    if(groupchat_server.empty()) {
+        groupchat_server = "conference." + domain;
+    }
+
+    if(workers > accounts) {
+        workers = accounts;
+    }
+}
@@ -0,0 +1,66 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+#ifndef LOAD_SCENARIO_INCLUDED
+#define LOAD_SCENARIO_INCLUDED
+
+#include <gloox/gloox.h>
+
+#include <string>
+#include <stdexcept>
+
+using namespace std;
+using namespace gloox;
+
+// Load scenario, read from "key = value" lines ('#' starts a comment).
+// Accounts are "<user_prefix><index>@<domain>", index in [first_account, first_account + accounts).
+struct LoadScenario
+{
+    class Error : public runtime_error
+    {
+    public:
+        explicit Error(const string& error);
+
+    private:
+        Error();
+        const Error& operator=(const Error&);
+    };
+
+    explicit LoadScenario();
+
+    /// throws LoadScenario::Error on unreadable files, unknown keys or bad values
+    void load(const string& path);
+
+    // server
+    string server;              // "127.0.0.1"
+    int port;                   // 5222
+    string domain;              // "localhost"
+    string groupchat_server;    // "conference." + domain
+    TLSPolicy tls_policy;       // TLSOptional ("disabled", "optional", "required")
+
+    // accounts
+    string user_prefix;         // "load"
+    string password;            // "password"
+    int first_account;          // 0
+    int accounts;               // 100
+    int workers;                // 4 threads, each owning accounts / workers clients
+
+    // schedule, all rates are per second
+    double login_rate;          // 10 logins
+    int duration;               // 60 seconds after the last login
+    int report_interval;        // 10 seconds
+
+    // per online account
+    double message_rate;        // 0.1 messages to random accounts
+    int message_size;           // 64 bytes of body
+    double composing_ratio;     // 0.5 of the messages are preceded by 'composing'
+    bool reply_delivered;       // true, answer each message with 'delivered' (message RTT)
+
+    int rooms;                  // 0 rooms named "<user_prefix>room<index>"
+    double room_join_ratio;     // 0.0 of the logins join a random room
+    double room_message_rate;   // 0.0 messages per joined account
+
+    int suspend_interval;       // 0 (never), mean seconds online before a suspend
+    int suspend_duration;       // 10 seconds offline while suspended
+};
+
+#endif // LOAD_SCENARIO_INCLUDED
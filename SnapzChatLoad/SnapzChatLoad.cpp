@@ -0,0 +1,772 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+// Headless load generator: logs in many XMPPClient accounts following a
+// LoadScenario and reports connect latency, message RTT and error counts as
+// one JSON line per report interval (the last one has "final": true).
+//
+// Linux build (needs the gloox 1.0 headers and library), from the top directory:
+//   make load
+//
+// Usage: snapzchatload <scenario file>    (see SnapzChatLoad/example.scenario)
+
+#include "LoadScenario.hpp"
+#include "XMPPClient.hpp"
+#include "XMPPClock.hpp"
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+/// LoadStats, shared by all workers, lock-free
+class LoadStats
+{
+public:
+    enum Counter {
+        COUNTER_LOGINS,
+        COUNTER_CONNECTS,
+        COUNTER_CONNECT_FAILURES,
+        COUNTER_DISCONNECTS,
+        COUNTER_SUSPENDS,
+        COUNTER_MESSAGES_SENT,
+        COUNTER_MESSAGES_RECEIVED,
+        COUNTER_COMPOSING_SENT,
+        COUNTER_COMPOSING_RECEIVED,
+        COUNTER_DELIVERED_RECEIVED,
+        COUNTER_SEND_FAILURES,
+        COUNTER_MESSAGE_TIMEOUTS,
+        COUNTER_ROOM_JOINS,
+        COUNTER_ROOM_MESSAGES_SENT,
+        COUNTER_ROOM_MESSAGES_RECEIVED,
+        COUNTER_ROOM_ERRORS,
+        COUNTER_MAX
+    };
+
+    enum Histogram {
+        HISTOGRAM_CONNECT,       // connect() to onConnect()
+        HISTOGRAM_MESSAGE_RTT,   // sendTrackedChatMessage() to MESSAGE_DELIVERED
+        HISTOGRAM_MESSAGE_ACK,   // sendTracked*() to MESSAGE_ACKNOWLEDGED (room reflection or offline storage)
+        HISTOGRAM_MESSAGE,       // sendChatMessage() to onChatMessage()
+        HISTOGRAM_ROOM_JOIN,     // beginGroupChat() to own presence
+        HISTOGRAM_MAX
+    };
+
+public:
+    explicit LoadStats() {
+        ::memset(counters, 0, sizeof(counters));
+        ::memset(histograms, 0, sizeof(histograms));
+        online = 0;
+    }
+
+    void increment(Counter counter) {
+        __sync_fetch_and_add(&counters[counter], 1);
+    }
+
+    uint64_t get(Counter counter) const {
+        return __sync_fetch_and_add(const_cast<uint64_t*>(&counters[counter]), 0);
+    }
+
+    void record(Histogram histogram, uint64_t value);
+    void snapshot(Histogram histogram, XMPPMetrics::HistogramSnapshot *snapshot) const;
+
+    static const char* counterName(Counter counter);
+    static const char* histogramName(Histogram histogram);
+
+    volatile int online;
+
+private:
+    uint64_t counters[COUNTER_MAX];
+    XMPPMetrics::HistogramSnapshot histograms[HISTOGRAM_MAX];  // same buckets as XMPPMetrics
+
+private:
+    LoadStats(const LoadStats&);
+    const LoadStats& operator=(const LoadStats&);
+};
+
+void LoadStats::record(Histogram histogram, uint64_t value)
+{
+    XMPPMetrics::HistogramSnapshot& data = histograms[histogram];
+
+    __sync_fetch_and_add(&data.buckets[XMPPMetrics::bucketIndex(value)], 1);
+    __sync_fetch_and_add(&data.count, 1);
+    __sync_fetch_and_add(&data.sum, value);
+
+    uint64_t old = data.max;
+    while(value > old) {
+        uint64_t prev = __sync_val_compare_and_swap(&data.max, old, value);
+        if(prev == old) {
+            break;
+        }
+        old = prev;
+    }
+}
+
+void LoadStats::snapshot(Histogram histogram, XMPPMetrics::HistogramSnapshot *snapshot) const
+{
+    XMPPMetrics::HistogramSnapshot& data = const_cast<XMPPMetrics::HistogramSnapshot&>(histograms[histogram]);
+
+    snapshot->count = 0;
+    for(int i = 0; i < XMPPMetrics::HISTOGRAM_BUCKETS; ++i) {
+        snapshot->buckets[i] = __sync_fetch_and_add(&data.buckets[i], 0);
+        snapshot->count += snapshot->buckets[i];
+    }
+    snapshot->sum = __sync_fetch_and_add(&data.sum, 0);
+    snapshot->max = __sync_fetch_and_add(&data.max, 0);
+}
+
+const char* LoadStats::counterName(Counter counter)
+{
+    static const char *NAMES[COUNTER_MAX] = {
+        "logins",
+        "connects",
+        "connect_failures",
+        "disconnects",
+        "suspends",
+        "messages_sent",
+        "messages_received",
+        "composing_sent",
+        "composing_received",
+        "delivered_received",
+        "send_failures",
+        "message_timeouts",
+        "room_joins",
+        "room_messages_sent",
+        "room_messages_received",
+        "room_errors"
+    };
+    return NAMES[counter];
+}
+
+const char* LoadStats::histogramName(Histogram histogram)
+{
+    static const char *NAMES[HISTOGRAM_MAX] = {
+        "connect",
+        "rtt",
+        "ack",
+        "latency",
+        "room_join"
+    };
+    return NAMES[histogram];
+}
+
+/// LoadAccount, owned by one worker thread
+class LoadClient;
+
+struct LoadAccount
+{
+    enum State {
+        STATE_OFFLINE,      // waiting for next_login
+        STATE_CONNECTING,   // connect() called, waiting for onConnect()
+        STATE_ONLINE,
+        STATE_SUSPENDED     // waiting for next_login
+    };
+
+    int index;
+    string user;
+    LoadClient *client;
+    State state;
+
+    uint64_t login_time;        // nanoseconds, at connect()
+    uint64_t next_login;        // milliseconds
+    uint64_t next_message;      // milliseconds
+    uint64_t next_room_message; // milliseconds
+    uint64_t next_suspend;      // milliseconds, 0 if never
+
+    string room;                // joined room, empty if none
+    uint64_t join_time;         // nanoseconds, at beginGroupChat()
+};
+
+class LoadClient : public XMPPClient
+{
+public:
+    explicit LoadClient(const Config& config, LoadAccount *account,
+                        const LoadScenario& scenario, LoadStats& stats);
+
+    virtual ~LoadClient();
+
+    bool isClosed() const {
+        return is_closed;
+    }
+
+protected:
+    /// connection callbacks
+    virtual void onConnect();
+    virtual bool onTlsConnect(const CertInfo& info);
+    virtual void onDisconnect(ConnectionError error);
+
+    /// simple chat callbacks
+    virtual void onChatMessage(const string& user, const string& resource,
+                               const string& message, const string& subject, const char *timestamp);
+    virtual void onChatMessageComposing(const string& user, const string& resource);
+    virtual void onChatMessageDelivered(const string& user, const string& resource);
+    virtual void onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency);
+
+    /// group chat callbacks
+    virtual void onGroupChatMessage(const string& group, const string& user,
+                                    const string& message, const char *timestamp);
+    virtual void onGroupChatUserPresence(const string& group, const string& user,
+                                         bool online, const string& reason, int flags);
+    virtual void onGroupChatError(const string& group, StanzaError error);
+
+private:
+    LoadAccount *account;
+    const LoadScenario& scenario;
+    LoadStats& stats;
+
+    bool is_closed;  // the connection ended, the worker deletes this client
+
+private:
+    LoadClient();
+    LoadClient(const LoadClient&);
+    const LoadClient& operator=(const LoadClient&);
+};
+
+static const uint64_t RECONNECT_DELAY = 5000;  // milliseconds
+
+static volatile bool g_is_stopping = false;
+
+/// LoadClient
+LoadClient::LoadClient(const Config& config, LoadAccount *account_,
+                       const LoadScenario& scenario_, LoadStats& stats_)
+    : XMPPClient(config),
+      account(account_), scenario(scenario_), stats(stats_),
+      is_closed(false)
+{
+}
+
+LoadClient::~LoadClient()
+{
+    XMPPClient::disconnect();
+}
+
+void LoadClient::onConnect()
+{
+    stats.increment(LoadStats::COUNTER_CONNECTS);
+    stats.record(LoadStats::HISTOGRAM_CONNECT, XMPPClock::now() - account->login_time);
+    __sync_fetch_and_add(&stats.online, 1);
+
+    account->state = LoadAccount::STATE_ONLINE;
+}
+
+bool LoadClient::onTlsConnect(const CertInfo& info)
+{
+    (void)info;
+
+    // load test servers commonly use self-signed certificates
+    return true;
+}
+
+void LoadClient::onDisconnect(ConnectionError error)
+{
+    is_closed = true;
+
+    switch(account->state) {
+    case LoadAccount::STATE_CONNECTING:
+        stats.increment(LoadStats::COUNTER_CONNECT_FAILURES);
+        break;
+
+    case LoadAccount::STATE_ONLINE:
+        __sync_fetch_and_sub(&stats.online, 1);
+        if(error != ConnUserDisconnected) {
+            stats.increment(LoadStats::COUNTER_DISCONNECTS);
+        }
+        break;
+
+    default:
+        // suspended or stopped by the worker
+        return;
+    }
+
+    account->state = LoadAccount::STATE_OFFLINE;
+}
+
+void LoadClient::onChatMessage(const string& user, const string& resource,
+                               const string& message, const string& subject, const char *timestamp)
+{
+    (void)resource, (void)subject;
+
+    stats.increment(LoadStats::COUNTER_MESSAGES_RECEIVED);
+
+    // body: "<XMPPClock::now() at send> <padding>", skip messages stored offline
+    if(!timestamp) {
+        uint64_t sent = ::strtoull(message.c_str(), 0, 10);
+        uint64_t now = XMPPClock::now();
+        if(sent > 0 && sent <= now) {
+            stats.record(LoadStats::HISTOGRAM_MESSAGE, now - sent);
+        }
+    }
+
+    if(scenario.reply_delivered) {
+        sendChatMessageDelivered(user);
+    }
+}
+
+void LoadClient::onChatMessageComposing(const string& user, const string& resource)
+{
+    (void)user, (void)resource;
+
+    stats.increment(LoadStats::COUNTER_COMPOSING_RECEIVED);
+}
+
+void LoadClient::onChatMessageDelivered(const string&, const string&)
+{
+    stats.increment(LoadStats::COUNTER_DELIVERED_RECEIVED);
+}
+
+void LoadClient::onMessageCompletion(MessageId id, MessageStatus status, uint64_t latency)
+{
+    (void)id;
+
+    switch(status) {
+    case MESSAGE_ACKNOWLEDGED:
+        stats.record(LoadStats::HISTOGRAM_MESSAGE_ACK, latency);
+        break;
+
+    case MESSAGE_DELIVERED:
+        stats.record(LoadStats::HISTOGRAM_MESSAGE_RTT, latency);
+        break;
+
+    case MESSAGE_FAILED:
+        stats.increment(LoadStats::COUNTER_SEND_FAILURES);
+        break;
+
+    case MESSAGE_TIMEOUT:
+        stats.increment(LoadStats::COUNTER_MESSAGE_TIMEOUTS);
+        break;
+    }
+}
+
+void LoadClient::onGroupChatMessage(const string& group, const string& user,
+                                    const string& message, const char *timestamp)
+{
+    (void)group, (void)user, (void)message, (void)timestamp;
+
+    stats.increment(LoadStats::COUNTER_ROOM_MESSAGES_RECEIVED);
+}
+
+void LoadClient::onGroupChatUserPresence(const string& group, const string& user,
+                                         bool online, const string& reason, int flags)
+{
+    (void)user, (void)reason;
+
+    if(online && (flags & UserSelf) && group == account->room) {
+        stats.increment(LoadStats::COUNTER_ROOM_JOINS);
+        stats.record(LoadStats::HISTOGRAM_ROOM_JOIN, XMPPClock::now() - account->join_time);
+    }
+}
+
+void LoadClient::onGroupChatError(const string& group, StanzaError error)
+{
+    (void)group, (void)error;
+
+    stats.increment(LoadStats::COUNTER_ROOM_ERRORS);
+}
+
+/// LoadWorker
+class LoadWorker
+{
+public:
+    explicit LoadWorker(const LoadScenario& scenario, LoadStats& stats, unsigned int seed);
+
+    ~LoadWorker();
+
+    void addAccount(int index, uint64_t first_login);
+
+    bool start();
+    void join();
+
+private:
+    void run();
+    void login(LoadAccount *account, uint64_t now);
+    void logout(LoadAccount *account, LoadAccount::State state);
+    void updateOnline(LoadAccount *account, uint64_t now);
+    void sendMessage(LoadAccount *account);
+
+    double random();                     // [0.0, 1.0)
+    uint64_t randomInterval(double rate); // exponential, milliseconds
+
+    static void* worker_loop(void *data);
+
+private:
+    const LoadScenario& scenario;
+    LoadStats& stats;
+
+    vector<LoadAccount*> accounts;
+    unsigned int seed;
+    string padding;
+
+    pthread_t worker_thread;
+
+private:
+    LoadWorker();
+    LoadWorker(const LoadWorker&);
+    const LoadWorker& operator=(const LoadWorker&);
+};
+
+LoadWorker::LoadWorker(const LoadScenario& scenario_, LoadStats& stats_, unsigned int seed_)
+    : scenario(scenario_), stats(stats_), seed(seed_),
+      padding(scenario_.message_size, 'x')
+{
+}
+
+LoadWorker::~LoadWorker()
+{
+    vector<LoadAccount*>::const_iterator it;
+    for(it = accounts.begin(); it != accounts.end(); ++it) {
+        delete (*it)->client;
+        delete *it;
+    }
+}
+
+void LoadWorker::addAccount(int index, uint64_t first_login)
+{
+    char user[256];
+    ::snprintf(user, sizeof(user), "%s%d", scenario.user_prefix.c_str(), index);
+
+    LoadAccount *account = new LoadAccount;
+    account->index = index;
+    account->user = user;
+    account->client = 0;
+    account->state = LoadAccount::STATE_OFFLINE;
+    account->login_time = 0;
+    account->next_login = first_login;
+    account->next_message = 0;
+    account->next_room_message = 0;
+    account->next_suspend = 0;
+    account->join_time = 0;
+
+    accounts.push_back(account);
+}
+
+bool LoadWorker::start()
+{
+    return ::pthread_create(&worker_thread, 0, LoadWorker::worker_loop, this) == 0;
+}
+
+void LoadWorker::join()
+{
+    ::pthread_join(worker_thread, 0);
+}
+
+void* LoadWorker::worker_loop(void *data)
+{
+    static_cast<LoadWorker*>(data)->run();
+    return 0;
+}
+
+double LoadWorker::random()
+{
+    return ::rand_r(&seed) / ((double)RAND_MAX + 1.0);
+}
+
+uint64_t LoadWorker::randomInterval(double rate)
+{
+    return (uint64_t)(-::log(1.0 - random()) / rate * 1000.0) + 1;
+}
+
+void LoadWorker::run()
+{
+    while(!g_is_stopping) {
+        uint64_t now = XMPPClock::nowMilliseconds();
+
+        vector<LoadAccount*>::const_iterator it;
+        for(it = accounts.begin(); it != accounts.end(); ++it) {
+            LoadAccount *account = *it;
+
+            if(!account->client) {
+                if(now >= account->next_login) {
+                    login(account, now);
+                }
+                continue;
+            }
+
+            // NOTE: every client is only used from this thread, as AppClient requires
+            if(!account->client->update(0) || account->client->isClosed()) {
+                if(account->state == LoadAccount::STATE_CONNECTING) {
+                    stats.increment(LoadStats::COUNTER_CONNECT_FAILURES);
+                }
+
+                logout(account, LoadAccount::STATE_OFFLINE);
+                account->next_login = now + RECONNECT_DELAY;
+                continue;
+            }
+
+            if(account->state == LoadAccount::STATE_ONLINE) {
+                updateOnline(account, now);
+            }
+        }
+
+        ::usleep(1000);
+    }
+
+    vector<LoadAccount*>::const_iterator it;
+    for(it = accounts.begin(); it != accounts.end(); ++it) {
+        if((*it)->client) {
+            logout(*it, LoadAccount::STATE_OFFLINE);
+        }
+    }
+}
+
+void LoadWorker::login(LoadAccount *account, uint64_t now)
+{
+    XMPPClient::Config config(account->user + "@" + scenario.domain, scenario.password);
+    config.server = scenario.server;
+    config.port = scenario.port;
+    config.tls_policy = scenario.tls_policy;
+    config.groupchat_server = scenario.groupchat_server;
+
+    stats.increment(LoadStats::COUNTER_LOGINS);
+
+    account->client = new LoadClient(config, account, scenario, stats);
+    account->state = LoadAccount::STATE_CONNECTING;
+    account->login_time = XMPPClock::now();
+    account->room.clear();
+
+    // driven by update() from this thread
+    if(!account->client->connect(false)) {
+        stats.increment(LoadStats::COUNTER_CONNECT_FAILURES);
+
+        logout(account, LoadAccount::STATE_OFFLINE);
+        account->next_login = now + RECONNECT_DELAY;
+        return;
+    }
+
+    account->next_message = (scenario.message_rate > 0.0) ?
+        (now + randomInterval(scenario.message_rate)) : 0;
+    account->next_suspend = (scenario.suspend_interval > 0) ?
+        (now + randomInterval(1.0 / scenario.suspend_interval)) : 0;
+    account->next_room_message = 0;
+}
+
+void LoadWorker::logout(LoadAccount *account, LoadAccount::State state)
+{
+    if(account->state == LoadAccount::STATE_ONLINE) {
+        __sync_fetch_and_sub(&stats.online, 1);
+    }
+
+    // NOTE: set first, onDisconnect() must not count this as a failure
+    account->state = state;
+
+    delete account->client;
+    account->client = 0;
+}
+
+void LoadWorker::updateOnline(LoadAccount *account, uint64_t now)
+{
+    LoadClient *client = account->client;
+
+    // join a room once per login
+    if(scenario.rooms > 0 && account->next_room_message == 0) {
+        account->next_room_message = (uint64_t)-1;
+
+        if(random() < scenario.room_join_ratio) {
+            char room[256];
+            ::snprintf(room, sizeof(room), "%sroom%d",
+                       scenario.user_prefix.c_str(), (int)(random() * scenario.rooms));
+
+            account->room = room;
+            account->join_time = XMPPClock::now();
+            client->beginGroupChat(account->room, "", 0);
+
+            if(scenario.room_message_rate > 0.0) {
+                account->next_room_message = now + randomInterval(scenario.room_message_rate);
+            }
+        }
+    }
+
+    if(account->next_message && now >= account->next_message) {
+        account->next_message = now + randomInterval(scenario.message_rate);
+        sendMessage(account);
+    }
+
+    if(!account->room.empty() && now >= account->next_room_message) {
+        account->next_room_message = now + randomInterval(scenario.room_message_rate);
+
+        char body[32];
+        ::snprintf(body, sizeof(body), "%llu ", (unsigned long long)XMPPClock::now());
+
+        if(client->sendTrackedGroupChatMessage(account->room, body + padding)) {
+            stats.increment(LoadStats::COUNTER_ROOM_MESSAGES_SENT);
+        }
+        else {
+            stats.increment(LoadStats::COUNTER_SEND_FAILURES);
+        }
+    }
+
+    if(account->next_suspend && now >= account->next_suspend) {
+        stats.increment(LoadStats::COUNTER_SUSPENDS);
+
+        // same as AppClient::Suspend(): the client is destroyed and created again on resume
+        logout(account, LoadAccount::STATE_SUSPENDED);
+        account->next_login = now + scenario.suspend_duration * 1000ULL;
+    }
+}
+
+void LoadWorker::sendMessage(LoadAccount *account)
+{
+    if(scenario.accounts < 2) {
+        return;
+    }
+
+    int peer = scenario.first_account + (int)(random() * (scenario.accounts - 1));
+    if(peer >= account->index) {
+        ++peer;
+    }
+
+    char user[256];
+    ::snprintf(user, sizeof(user), "%s%d", scenario.user_prefix.c_str(), peer);
+
+    if(random() < scenario.composing_ratio) {
+        // NOTE: only sent once the peer has requested events on an earlier message
+        if(account->client->sendChatMessageComposing(user)) {
+            stats.increment(LoadStats::COUNTER_COMPOSING_SENT);
+        }
+    }
+
+    char body[32];
+    uint64_t now = XMPPClock::now();
+    ::snprintf(body, sizeof(body), "%llu ", (unsigned long long)now);
+
+    // NOTE: tracked only when the peer answers, or every message would time out
+    bool is_sent = scenario.reply_delivered ?
+        (account->client->sendTrackedChatMessage(user, body + padding) != 0) :
+        account->client->sendChatMessage(user, body + padding);
+
+    if(!is_sent) {
+        stats.increment(LoadStats::COUNTER_SEND_FAILURES);
+        return;
+    }
+
+    stats.increment(LoadStats::COUNTER_MESSAGES_SENT);
+}
+
+/// report
+static void g_report(FILE *stream, const LoadStats& stats, uint64_t start, bool is_final)
+{
+    ::fprintf(stream, "{\"time\": %.3f, \"online\": %d",
+              (XMPPClock::now() - start) / 1e9, (int)stats.online);
+
+    for(int i = 0; i < LoadStats::COUNTER_MAX; ++i) {
+        LoadStats::Counter counter = (LoadStats::Counter)i;
+        ::fprintf(stream, ", \"%s\": %llu",
+                  LoadStats::counterName(counter), (unsigned long long)stats.get(counter));
+    }
+
+    uint64_t errors =
+        stats.get(LoadStats::COUNTER_CONNECT_FAILURES) +
+        stats.get(LoadStats::COUNTER_DISCONNECTS) +
+        stats.get(LoadStats::COUNTER_SEND_FAILURES) +
+        stats.get(LoadStats::COUNTER_ROOM_ERRORS);
+
+    uint64_t operations =
+        stats.get(LoadStats::COUNTER_LOGINS) +
+        stats.get(LoadStats::COUNTER_MESSAGES_SENT) +
+        stats.get(LoadStats::COUNTER_ROOM_MESSAGES_SENT);
+
+    ::fprintf(stream, ", \"error_rate\": %.6f", operations ? ((double)errors / operations) : 0.0);
+
+    XMPPMetrics::HistogramSnapshot *snapshot = new XMPPMetrics::HistogramSnapshot;
+
+    for(int i = 0; i < LoadStats::HISTOGRAM_MAX; ++i) {
+        LoadStats::Histogram histogram = (LoadStats::Histogram)i;
+        stats.snapshot(histogram, snapshot);
+
+        const char *name = LoadStats::histogramName(histogram);
+        ::fprintf(stream, ", \"%s_count\": %llu, \"%s_p50_ms\": %.3f, \"%s_p90_ms\": %.3f"
+                  ", \"%s_p99_ms\": %.3f, \"%s_max_ms\": %.3f",
+                  name, (unsigned long long)snapshot->count,
+                  name, snapshot->percentile(0.50) / 1e6,
+                  name, snapshot->percentile(0.90) / 1e6,
+                  name, snapshot->percentile(0.99) / 1e6,
+                  name, snapshot->max / 1e6);
+    }
+
+    delete snapshot;
+
+    ::fprintf(stream, "%s}\n", is_final ? ", \"final\": true" : "");
+    ::fflush(stream);
+}
+
+static void g_stop(int signum)
+{
+    (void)signum;
+
+    g_is_stopping = true;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        ::fprintf(stderr, "usage: %s <scenario file>\n", argv[0]);
+        return 2;
+    }
+
+    LoadScenario scenario;
+    try {
+        scenario.load(argv[1]);
+    }
+    catch(const LoadScenario::Error& error) {
+        ::fprintf(stderr, "%s\n", error.what());
+        return 2;
+    }
+
+    ::signal(SIGINT, g_stop);
+    ::signal(SIGTERM, g_stop);
+    ::signal(SIGPIPE, SIG_IGN);
+
+    LoadStats stats;
+    uint64_t start = XMPPClock::now();
+    uint64_t start_ms = start / 1000000ULL;
+
+    vector<LoadWorker*> workers;
+    for(int i = 0; i < scenario.workers; ++i) {
+        workers.push_back(new LoadWorker(scenario, stats, (unsigned int)(start ^ (i * 7919))));
+    }
+
+    // logins are spread over time at login_rate, accounts round-robin over the workers
+    for(int i = 0; i < scenario.accounts; ++i) {
+        uint64_t first_login = start_ms + (uint64_t)(i * 1000.0 / scenario.login_rate);
+        workers[i % scenario.workers]->addAccount(scenario.first_account + i, first_login);
+    }
+
+    size_t started = 0;
+    while(started < workers.size() && workers[started]->start()) {
+        ++started;
+    }
+
+    uint64_t end_ms = start_ms + (uint64_t)(scenario.accounts * 1000.0 / scenario.login_rate)
+        + scenario.duration * 1000ULL;
+    uint64_t report_ms = start_ms + scenario.report_interval * 1000ULL;
+
+    if(started < workers.size()) {
+        ::fprintf(stderr, "cannot start worker threads\n");
+        g_is_stopping = true;
+    }
+
+    while(!g_is_stopping && XMPPClock::nowMilliseconds() < end_ms) {
+        ::usleep(100000);
+
+        if(XMPPClock::nowMilliseconds() >= report_ms) {
+            report_ms += scenario.report_interval * 1000ULL;
+            g_report(stdout, stats, start, false);
+        }
+    }
+
+    g_is_stopping = true;
+    for(size_t i = 0; i < started; ++i) {
+        workers[i]->join();
+    }
+
+    g_report(stdout, stats, start, true);
+
+    for(size_t i = 0; i < workers.size(); ++i) {
+        delete workers[i];
+    }
+
+    return 0;
+}
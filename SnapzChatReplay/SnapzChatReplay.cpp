@@ -0,0 +1,264 @@
+//// -*- mode: C++; coding: utf-8; -*-
+
+// Replays an inbound XML stream recorded with XMPPClient::Config::capture_file
+// through XMPPClient, without a server, and prints one JSON document with the
+// parse and dispatch throughput.
+//
+// Linux build (needs the gloox 1.0 headers and library), from the top directory:
+//   make replay
+//
+// Usage: snapzchatreplay [-r] [-f] [-n iterations] [-c connection] [-j jid] <capture file>
+//   -r  realtime, keeps the recorded timing instead of replaying as fast as possible
+//   -f  enables XMPPClient::Config::fast_parser, to compare against the gloox parser alone
+
+#include "XMPPClient.hpp"
+#include "XMPPClock.hpp"
+#include "XMPPReplay.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+class ReplayClient : public XMPPClient
+{
+public:
+    explicit ReplayClient(const Config& config);
+
+    virtual ~ReplayClient();
+
+    /// replays the whole connection, false if the recording cannot be used
+    bool run(const string& path, bool realtime, int connection);
+
+public:
+    uint64_t bytes;
+    uint64_t chat_messages;
+    uint64_t composing_events;
+    uint64_t delivered_events;
+    uint64_t group_chat_messages;
+    uint64_t group_chat_presences;
+    uint64_t group_chat_subjects;
+
+protected:
+    /// simple chat callbacks
+    virtual void onChatMessage(const string& user, const string& resource,
+                               const string& message, const string& subject, const char *timestamp);
+    virtual void onChatMessageComposing(const string& user, const string& resource);
+    virtual void onChatMessageDelivered(const string& user, const string& resource);
+
+    /// group chat callbacks
+    virtual void onGroupChatSubject(const string& group, const string& user, const string& subject);
+    virtual void onGroupChatMessage(const string& group, const string& user,
+                                    const string& message, const char *timestamp);
+    virtual void onGroupChatUserPresence(const string& group, const string& user,
+                                         bool online, const string& reason, int flags);
+
+private:
+    bool is_started;
+
+private:
+    ReplayClient();
+    ReplayClient(const ReplayClient&);
+    const ReplayClient& operator=(const ReplayClient&);
+};
+
+/// ReplayClient
+ReplayClient::ReplayClient(const Config& config)
+    : XMPPClient(config),
+      bytes(0), chat_messages(0), composing_events(0), delivered_events(0),
+      group_chat_messages(0), group_chat_presences(0), group_chat_subjects(0),
+      is_started(false)
+{
+}
+
+ReplayClient::~ReplayClient()
+{
+    if(is_started) {
+        XMPPClient::disconnect();
+    }
+}
+
+bool ReplayClient::run(const string& path, bool realtime, int connection_index)
+{
+    XMPPReplayConnection *connection = new XMPPReplayConnection(getXmpp(), path, realtime, connection_index);
+    if(!connection->isValid()) {
+        delete connection;
+        return false;
+    }
+
+    // NOTE: gloox::Client owns the connection from here
+    getXmpp()->setConnectionImpl(connection);
+
+    is_started = XMPPClient::connect(false);
+    if(!is_started) {
+        return false;
+    }
+
+    while(!connection->isFinished()) {
+        if(!update(0)) {
+            break;
+        }
+    }
+
+    long int total_in = 0;
+    long int total_out = 0;
+    connection->getStatistics(total_in, total_out);
+    bytes = total_in;
+
+    return true;
+}
+
+void ReplayClient::onChatMessage(const string&, const string&, const string&, const string&, const char *)
+{
+    ++chat_messages;
+}
+
+void ReplayClient::onChatMessageComposing(const string&, const string&)
+{
+    ++composing_events;
+}
+
+void ReplayClient::onChatMessageDelivered(const string&, const string&)
+{
+    ++delivered_events;
+}
+
+void ReplayClient::onGroupChatSubject(const string&, const string&, const string&)
+{
+    ++group_chat_subjects;
+}
+
+void ReplayClient::onGroupChatMessage(const string&, const string&, const string&, const char *)
+{
+    ++group_chat_messages;
+}
+
+void ReplayClient::onGroupChatUserPresence(const string&, const string&, bool, const string&, int)
+{
+    ++group_chat_presences;
+}
+
+/// main
+static void g_usage(const char *name)
+{
+    ::fprintf(stderr, "usage: %s [-r] [-f] [-n iterations] [-c connection] [-j jid] <capture file>\n", name);
+}
+
+static uint64_t g_stanzas_in(const XMPPMetrics& metrics)
+{
+    return metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_MESSAGE) +
+           metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_PRESENCE) +
+           metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_IQ) +
+           metrics.get(XMPPMetrics::COUNTER_STANZAS_IN_SUBSCRIPTION);
+}
+
+int main(int argc, char *argv[])
+{
+    bool realtime = false;
+    bool fast_parser = false;
+    int iterations = 1;
+    int connection = 0;
+    const char *jid = "replay@replay.local";
+
+    int option;
+    while((option = ::getopt(argc, argv, "rfn:c:j:h")) != -1) {
+        switch(option) {
+        case 'r':
+            realtime = true;
+            break;
+        case 'f':
+            fast_parser = true;
+            break;
+        case 'n':
+            iterations = ::atoi(optarg);
+            break;
+        case 'c':
+            connection = ::atoi(optarg);
+            break;
+        case 'j':
+            jid = optarg;
+            break;
+        default:
+            g_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if(optind + 1 != argc || iterations < 1) {
+        g_usage(argv[0]);
+        return 2;
+    }
+    const string path = argv[optind];
+
+    XMPPClient::Config config(jid, "replay");
+    config.tls_policy = TLSDisabled;
+    config.fast_parser = fast_parser;
+    config.ping_interval = 0;  // nobody answers a replayed stream
+
+    uint64_t bytes = 0;
+    uint64_t stanzas = 0;
+    uint64_t chat_messages = 0;
+    uint64_t composing_events = 0;
+    uint64_t delivered_events = 0;
+    uint64_t group_chat_messages = 0;
+    uint64_t group_chat_presences = 0;
+    uint64_t group_chat_subjects = 0;
+
+    uint64_t start = XMPPClock::now();
+
+    for(int i = 0; i < iterations; ++i) {
+        // NOTE: a fresh client per iteration, the parser and sessions start from scratch
+        ReplayClient client(config);
+
+        if(!client.run(path, realtime, connection)) {
+            ::fprintf(stderr, "cannot replay connection %d of %s\n", connection, path.c_str());
+            return 1;
+        }
+
+        bytes += client.bytes;
+        stanzas += g_stanzas_in(client.getMetrics());
+        chat_messages += client.chat_messages;
+        composing_events += client.composing_events;
+        delivered_events += client.delivered_events;
+        group_chat_messages += client.group_chat_messages;
+        group_chat_presences += client.group_chat_presences;
+        group_chat_subjects += client.group_chat_subjects;
+    }
+
+    double seconds = (XMPPClock::now() - start) / 1e9;
+    if(seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    ::printf("{\n"
+             "  \"capture\": \"%s\",\n"
+             "  \"connection\": %d,\n"
+             "  \"iterations\": %d,\n"
+             "  \"realtime\": %s,\n"
+             "  \"fast_parser\": %s,\n"
+             "  \"seconds\": %.6f,\n"
+             "  \"bytes\": %llu,\n"
+             "  \"mb_per_second\": %.3f,\n"
+             "  \"stanzas\": %llu,\n"
+             "  \"stanzas_per_second\": %.1f,\n"
+             "  \"chat_messages\": %llu,\n"
+             "  \"composing_events\": %llu,\n"
+             "  \"delivered_events\": %llu,\n"
+             "  \"group_chat_messages\": %llu,\n"
+             "  \"group_chat_presences\": %llu,\n"
+             "  \"group_chat_subjects\": %llu\n"
+             "}\n",
+             path.c_str(), connection, iterations, realtime ? "true" : "false",
+             fast_parser ? "true" : "false",
+             seconds,
+             (unsigned long long)bytes, bytes / seconds / (1024.0 * 1024.0),
+             (unsigned long long)stanzas, stanzas / seconds,
+             (unsigned long long)chat_messages,
+             (unsigned long long)composing_events,
+             (unsigned long long)delivered_events,
+             (unsigned long long)group_chat_messages,
+             (unsigned long long)group_chat_presences,
+             (unsigned long long)group_chat_subjects);
+
+    return 0;
+}